@@ -40,16 +40,22 @@
 #include <fcntl.h>
 #include <mqueue.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "psmq-common.h"
 #include "psmq.h"
 #include "valid.h"
 
+#if PSMQ_HAVE_SHM
+#   include <sys/mman.h>
+#endif
+
 
 /* ==========================================================================
                   _                __           ____
@@ -61,6 +67,105 @@
    ========================================================================== */
 
 
+/* ==========================================================================
+    Stamps publish message 'msg' with send time, when tracing is enabled
+    and stamp fits into message.
+
+    Returns number of bytes of 'msg' to send.
+   ========================================================================== */
+
+
+static size_t psmq_trace_stamp
+(
+	struct psmq      *psmq,  /* psmq object */
+	struct psmq_msg  *msg    /* message to stamp */
+)
+{
+	size_t            len;   /* length of message without stamp */
+	unsigned int      sent;  /* send time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	len = psmq_real_msg_size(*msg);
+	if (psmq->trace == 0 || len + sizeof(sent) > sizeof(*msg))
+		return len;
+
+	/* stamp goes right after payload, it's not counted
+	 * in paylen, broker knows it's there because we
+	 * told him we are tracing */
+	sent = psmq_trace_now();
+	memcpy((char *)msg + len, &sent, sizeof(sent));
+	return len + sizeof(sent);
+}
+
+
+/* ==========================================================================
+    Sends request 'req' of 'len' bytes on behalf of client 'fd' to the
+    broker. How broker learns who sends request depends on protocol
+    agreed during open. With PSMQ_PROTO_V1 fd goes in ctrl.data, and with
+    PSMQ_PROTO_V2 it's put right after request, which is then marked with
+    PSMQ_CTRL_V2, so broker knows it's there.
+
+    Returns 0 on success or -1 on errors, errno is set by mq_send().
+   ========================================================================== */
+
+
+static int psmq_send_req
+(
+	struct psmq      *psmq,  /* psmq object */
+	struct psmq_req  *req,   /* request to send */
+	size_t            len,   /* number of bytes of req to send */
+	unsigned short    fd,    /* file descriptor to send request as */
+	unsigned int      prio   /* request priority */
+)
+{
+	if (psmq->proto != PSMQ_PROTO_V2)
+	{
+		req->msg.ctrl.data = fd;
+		return mq_send(psmq->qpub, (char *)req, len, prio);
+	}
+
+	req->msg.ctrl.cmd |= PSMQ_CTRL_V2;
+	req->msg.ctrl.data = 0;
+	memcpy((char *)req + len, &fd, sizeof(fd));
+	return mq_send(psmq->qpub, (char *)req, len + sizeof(fd), prio);
+}
+
+
+/* ==========================================================================
+    Makes sure that trace of received message 'msg' of 'len' bytes is
+    valid, when broker didn't send it (message was not a publish, or
+    trace did not fit into our queue) it's zeroed.
+   ========================================================================== */
+
+
+static void psmq_trace_fix
+(
+	struct psmq      *psmq,  /* psmq object */
+	struct psmq_msg  *msg,   /* received message */
+	ssize_t           len    /* number of received bytes */
+)
+{
+	size_t            off;   /* offset of trace in msg */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (psmq->trace == 0)
+		return;
+
+	if (msg->ctrl.cmd != PSMQ_CTRL_CMD_PUBLISH &&
+			msg->ctrl.cmd != PSMQ_CTRL_CMD_PUBLISH_SHM)
+		return;
+
+	off = psmq_real_msg_size(*msg);
+	if (off + sizeof(struct psmq_trace) > sizeof(*msg))
+		return;
+
+	if ((size_t)len < off + sizeof(struct psmq_trace))
+		memset((char *)msg + off, 0x00, sizeof(struct psmq_trace));
+}
+
+
 /* ==========================================================================
     Same as psmq_publish, but also accepts psmq_msg.ctrl part of message, to
     be able to send custom commands. Usefull only as internal usage.
@@ -73,14 +178,15 @@ int psmq_publish_msg
 (
 	struct psmq     *psmq,     /* psmq object */
 	char             cmd,      /* message command */
-	unsigned char    data,     /* data for the control part of message */
+	unsigned short   fd,       /* file descriptor to send message as */
 	const char      *topic,    /* topic of message to be sent */
 	const void      *payload,  /* payload of message to be sent */
 	size_t           paylen,   /* length of payload buffer */
 	unsigned int     prio      /* message priority */
 )
 {
-	struct psmq_msg  pub;      /* buffer used to send out data to broker */
+	struct psmq_req  pub;      /* buffer used to send out data to broker */
+	size_t           len;      /* number of bytes of pub to send */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
@@ -89,21 +195,130 @@ int psmq_publish_msg
 	VALID(EBADF, psmq->qsub != psmq->qpub);
 
 	memset(&pub, 0x00, sizeof(pub));
-	pub.ctrl.cmd = cmd;
-	pub.ctrl.data = data;
+	pub.msg.ctrl.cmd = cmd;
 
 	if (topic)
-		strcpy(pub.data, topic);
+		strcpy(pub.msg.data, topic);
 
 	/* payload may be NULL and it's ok, so set
 	 * payload only if it was set */
 	if (payload)
 	{
-		memcpy(pub.data + (topic ? strlen(topic) + 1 : 0), payload, paylen);
-		pub.paylen = paylen;
+		memcpy(pub.msg.data + (topic ? strlen(topic) + 1 : 0),
+				payload, paylen);
+		pub.msg.paylen = paylen;
 	}
 
-	return mq_send(psmq->qpub, (char *)&pub, psmq_real_msg_size(pub), prio);
+	if (cmd == PSMQ_CTRL_CMD_PUBLISH || cmd == PSMQ_CTRL_CMD_PUBLISH_SHM)
+		len = psmq_trace_stamp(psmq, &pub.msg);
+	else
+		len = psmq_real_msg_size(pub.msg);
+
+	return psmq_send_req(psmq, &pub, len, fd, prio);
+}
+
+
+/* ==========================================================================
+    Maps shared memory slab of the broker 'brokername' if broker created
+    one. Slab is optional, so failure here is not an error, psmq->shm
+    simply stays NULL and large payloads won't be available.
+   ========================================================================== */
+
+
+static void psmq_shm_attach
+(
+	struct psmq          *psmq,        /* psmq object */
+	const char           *brokername   /* name of the broker */
+)
+{
+#if PSMQ_HAVE_SHM
+	struct psmq_shm_hdr  *h;           /* mapped slab */
+	struct stat           st;          /* slab file information */
+	char                  name[256];   /* name of the slab */
+	int                   fd;          /* slab file descriptor */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	psmq->shm = NULL;
+	psmq->shmlen = 0;
+
+	if (psmq_shm_name(name, sizeof(name), brokername) != 0)
+		return;
+
+	if ((fd = shm_open(name, O_RDWR, 0)) == -1)
+		return;  /* broker does not provide slab */
+
+	h = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*h))
+		h = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (h == MAP_FAILED)
+		return;
+
+	/* slab may be left over from crashed broker
+	 * or created by something else entirely */
+	if (h->magic != PSMQ_SHM_MAGIC || h->blksize == 0 ||
+			psmq_shm_size(h->nblocks, h->blksize) != (size_t)st.st_size)
+	{
+		munmap(h, st.st_size);
+		return;
+	}
+
+	psmq->shm = h;
+	psmq->shmlen = st.st_size;
+#else
+	(void)brokername;
+	psmq->shm = NULL;
+	psmq->shmlen = 0;
+#endif
+}
+
+
+/* ==========================================================================
+    Unmaps slab mapped by psmq_shm_attach().
+   ========================================================================== */
+
+
+static void psmq_shm_detach
+(
+	struct psmq  *psmq  /* psmq object */
+)
+{
+#if PSMQ_HAVE_SHM
+	if (psmq->shm)
+		munmap(psmq->shm, psmq->shmlen);
+#endif
+
+	psmq->shm = NULL;
+	psmq->shmlen = 0;
+}
+
+
+/* ==========================================================================
+    Returns index of slab block that 'buf' points into, or -1 when 'buf'
+    does not point to start of any block.
+   ========================================================================== */
+
+
+static int psmq_shm_buf_block
+(
+	struct psmq          *psmq,   /* psmq object */
+	const void           *buf     /* buffer in slab */
+)
+{
+	struct psmq_shm_desc  desc;   /* descriptor of buf */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if ((const char *)buf < (const char *)psmq->shm ||
+			(const char *)buf >= (const char *)psmq->shm + psmq->shmlen)
+		return -1;
+
+	desc.slab = 0;
+	desc.offset = (const char *)buf - (const char *)psmq->shm;
+	desc.len = 0;
+	return psmq_shm_block(psmq->shm, &desc);
 }
 
 
@@ -173,6 +388,435 @@ int psmq_publish
 }
 
 
+/* ==========================================================================
+    Same as psmq_publish_prio, but broker also keeps message as retained
+    message of 'topic', and sends it to every client that later
+    subscribes to topic matching it. Only last message is kept for each
+    topic. Publishing empty payload clears retained message of topic.
+    Broker keeps retained messages only when it was started with -a.
+
+    Returns 0 on success or -1 on errors
+
+    errno:
+            EINVAL      psmq is invalid (null)
+            EINVAL      topic is invalid (null)
+            EBADF       psmq was not properly initialized
+            EBADMSG     topic does not start from '/' character
+            ENOBUFS     topic and/or payload are to big to fit into buffers
+   ========================================================================== */
+
+
+int psmq_publish_retain
+(
+	struct psmq     *psmq,     /* psmq object */
+	const char      *topic,    /* topic of message to be sent */
+	const void      *payload,  /* payload of message to be sent */
+	size_t           paylen,   /* length of payload buffer */
+	unsigned int     prio      /* message priority */
+)
+{
+	struct psmq_msg  pub;      /* only for size of data */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, psmq);
+	VALID(EINVAL, topic);
+	VALID(ENOBUFS, strlen(topic) + 1 + paylen <= sizeof(pub.data));
+	VALID(EBADMSG, topic[0] == '/');
+
+	return psmq_publish_msg(psmq, PSMQ_CTRL_CMD_PUBLISH_RETAIN, psmq->fd,
+			topic, payload, paylen, prio);
+}
+
+
+/* ==========================================================================
+    Publishes 'n' messages from 'pubs' array with 'prio' priority. Messages
+    are packed together into as few mqueue messages as possible, and
+    broker unpacks and routes them as if they were published one by one,
+    so for many small messages this saves a lot of syscalls on both ends.
+
+    All messages are validated before anything is sent, so on validation
+    error nothing gets published. Order of messages is kept.
+
+    Returns 0 on success or -1 on errors
+
+    errno:
+            EINVAL      psmq is invalid (null)
+            EINVAL      pubs is invalid (null) or n is less than 1
+            EINVAL      topic of any message is invalid (null)
+            EBADF       psmq was not properly initialized
+            EBADMSG     topic of any message does not start from '/'
+            ENOBUFS     any message alone is too big to fit into buffers
+   ========================================================================== */
+
+
+int psmq_publish_batch
+(
+	struct psmq            *psmq,     /* psmq object */
+	const struct psmq_pub  *pubs,     /* messages to publish */
+	int                     n,        /* number of messages in pubs */
+	unsigned int            prio      /* messages priority */
+)
+{
+	struct psmq_req         req;      /* request with packed messages */
+	struct psmq_msg        *batch;    /* message part of req */
+	unsigned short          paylen;   /* payload length of single record */
+	size_t                  topiclen; /* length of topic with null */
+	size_t                  reclen;   /* length of single record */
+	size_t                  max;      /* max space for records in batch */
+	int                     i;        /* current message */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, psmq);
+	VALID(EINVAL, pubs);
+	VALID(EINVAL, n > 0);
+
+	/* batch has empty topic, so first byte
+	 * of data is taken by its null */
+	batch = &req.msg;
+	max = sizeof(batch->data) - 1;
+
+	for (i = 0; i != n; ++i)
+	{
+		VALID(EINVAL, pubs[i].topic);
+		VALID(EBADMSG, pubs[i].topic[0] == '/');
+		VALID(ENOBUFS, sizeof(paylen) + strlen(pubs[i].topic) + 1 +
+				pubs[i].paylen <= max);
+	}
+
+	VALID(EBADF, psmq->qpub != (mqd_t)-1);
+	VALID(EBADF, psmq->qsub != psmq->qpub);
+
+	memset(&req, 0x00, sizeof(req));
+
+	for (i = 0; i != n; ++i)
+	{
+		topiclen = strlen(pubs[i].topic) + 1;
+		paylen = pubs[i].payload ? pubs[i].paylen : 0;
+		reclen = sizeof(paylen) + topiclen + paylen;
+
+		if (batch->paylen + reclen > max)
+		{
+			/* no more space for this record, send what
+			 * we have so far and start next batch */
+			batch->ctrl.cmd = PSMQ_CTRL_CMD_PUBLISH_BATCH;
+			if (psmq_send_req(psmq, &req, psmq_real_msg_size(*batch),
+						psmq->fd, prio) != 0)
+				return -1;
+
+			batch->paylen = 0;
+		}
+
+		/* record may land at unaligned address,
+		 * so store its length byte by byte */
+		memcpy(batch->data + 1 + batch->paylen, &paylen, sizeof(paylen));
+		batch->paylen += sizeof(paylen);
+		memcpy(batch->data + 1 + batch->paylen, pubs[i].topic, topiclen);
+		batch->paylen += topiclen;
+		if (paylen)
+			memcpy(batch->data + 1 + batch->paylen, pubs[i].payload, paylen);
+		batch->paylen += paylen;
+	}
+
+	batch->ctrl.cmd = PSMQ_CTRL_CMD_PUBLISH_BATCH;
+	return psmq_send_req(psmq, &req, psmq_real_msg_size(*batch),
+			psmq->fd, prio);
+}
+
+
+/* ==========================================================================
+    Registers 'alias' for 'topic', after that messages on 'topic' can be
+    published with psmq_publish_alias(). Broker sends back ACK message
+    with information whether registration was success or not. You can
+    check this by calling psmq_receive() after this function. Registering
+    alias again replaces topic it stands for.
+
+    Returns 0 on success or -1 on error
+
+    errno:
+            EINVAL      psmq is invalid (null)
+            EINVAL      topic is invalid (null)
+            EINVAL      alias is not less than PSMQ_MAX_ALIASES
+            EBADMSG     topic does not start from '/' character
+            EBADF       psmq has not been initialized
+            ENOBUFS     topic is too long for msgclass of psmq
+   ========================================================================== */
+
+
+int psmq_alias
+(
+	struct psmq    *psmq,   /* psmq object */
+	const char     *topic,  /* topic to create alias for */
+	unsigned char   alias   /* alias to register */
+)
+{
+	VALID(EINVAL, psmq);
+	VALID(EINVAL, topic);
+	VALID(EINVAL, alias < PSMQ_MAX_ALIASES);
+	VALID(EBADMSG, topic[0] == '/');
+	VALID(EBADF, psmq->qsub != (mqd_t)-1);
+	VALID(EBADF, psmq->qsub != psmq->qpub);
+	VALID(ENOBUFS, strlen(topic) + 1 <= psmq->msgclass);
+	VALID(ENOBUFS, strlen(topic) + 1 + sizeof(alias) <= PSMQ_MSG_MAX);
+
+	return psmq_publish_msg(psmq, PSMQ_CTRL_CMD_ALIAS, psmq->fd,
+			topic, &alias, sizeof(alias), 0);
+}
+
+
+/* ==========================================================================
+    Publishes message with 'payload' of size 'paylen' on topic registered
+    earlier as 'alias' with psmq_alias(). Only alias is sent to the broker,
+    which already knows who is subscribed to topic behind it, so there is
+    no need to match topic on every publish. Subscribers receive message
+    with full topic, just as it was published with psmq_publish_prio().
+
+    Note that payload must fit into buffer together with topic behind
+    alias, otherwise broker will drop the message.
+
+    Returns 0 on success or -1 on errors
+
+    errno:
+            EINVAL      psmq is invalid (null)
+            EINVAL      alias is not less than PSMQ_MAX_ALIASES
+            EBADF       psmq was not properly initialized
+            ENOBUFS     payload is to big to fit into buffers
+   ========================================================================== */
+
+
+int psmq_publish_alias
+(
+	struct psmq      *psmq,     /* psmq object */
+	unsigned char     alias,    /* alias of topic to publish on */
+	const void       *payload,  /* payload of message to be sent */
+	size_t            paylen,   /* length of payload buffer */
+	unsigned int      prio      /* message priority */
+)
+{
+	struct psmq_req   req;      /* buffer used to send out data to broker */
+	struct psmq_msg  *pub;      /* message part of req */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	pub = &req.msg;
+	VALID(EINVAL, psmq);
+	VALID(EINVAL, alias < PSMQ_MAX_ALIASES);
+	VALID(ENOBUFS, 1 + sizeof(alias) + paylen <= sizeof(pub->data));
+	VALID(EBADF, psmq->qpub != (mqd_t)-1);
+	VALID(EBADF, psmq->qsub != psmq->qpub);
+
+	/* topic is empty, and alias goes as first byte of
+	 * payload, so only what is really needed is copied */
+	pub->ctrl.cmd = PSMQ_CTRL_CMD_PUBLISH_ALIAS;
+	pub->data[0] = '\0';
+	pub->data[1] = alias;
+	pub->paylen = sizeof(alias);
+	if (payload)
+	{
+		memcpy(pub->data + 2, payload, paylen);
+		pub->paylen += paylen;
+	}
+
+	return psmq_send_req(psmq, &req, psmq_trace_stamp(psmq, pub),
+			psmq->fd, prio);
+}
+
+
+/* ==========================================================================
+    Allocates buffer of 'len' bytes in broker's shared memory slab. Caller
+    writes payload directly into returned buffer and then publishes it
+    with psmq_publish_shm(), so payload is never copied. Buffer that
+    won't be published must be given back with psmq_shm_release().
+
+    Returns pointer to buffer on success or NULL on errors.
+
+    errno:
+            EINVAL      psmq is invalid (null)
+            ENOTSUP     broker does not provide shared memory slab
+            EMSGSIZE    len is bigger than slab block size
+            ENOSPC      all blocks are currently in use
+   ========================================================================== */
+
+
+void *psmq_shm_alloc
+(
+	struct psmq          *psmq,   /* psmq object */
+	size_t                len     /* number of bytes to allocate */
+)
+{
+#if PSMQ_HAVE_SHM
+	struct psmq_shm_hdr  *h;      /* mapped slab */
+	unsigned int         *refs;   /* reference counters of blocks */
+	unsigned int          start;  /* block to start search from */
+	unsigned int          i;      /* iterator */
+	unsigned int          b;      /* block being checked */
+	unsigned int          zero;   /* expected value of free block */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALIDR(EINVAL, NULL, psmq);
+	VALIDR(ENOTSUP, NULL, psmq->shm);
+
+	h = psmq->shm;
+	VALIDR(EMSGSIZE, NULL, len <= h->blksize);
+
+	/* blocks are shared by all clients, so claim it with
+	 * compare and swap, whoever swaps 0 to 1 first owns it.
+	 * Start from where last allocation ended, so we don't
+	 * fight over first blocks all the time */
+	refs = psmq_shm_refs(h);
+	start = __atomic_load_n(&h->hint, __ATOMIC_RELAXED);
+	for (i = 0; i != h->nblocks; ++i)
+	{
+		b = (start + i) % h->nblocks;
+		zero = 0;
+		if (__atomic_compare_exchange_n(&refs[b], &zero, 1, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			__atomic_store_n(&h->hint, b + 1, __ATOMIC_RELAXED);
+			return (char *)h + psmq_shm_data_off(h->nblocks) +
+				(size_t)b * h->blksize;
+		}
+	}
+
+	errno = ENOSPC;
+	return NULL;
+#else
+	(void)len;
+	VALIDR(EINVAL, NULL, psmq);
+	errno = ENOTSUP;
+	return NULL;
+#endif
+}
+
+
+/* ==========================================================================
+    Publishes 'len' bytes of 'buf' allocated with psmq_shm_alloc() on
+    'topic'. Only small descriptor of buf goes through broker, subscribers
+    read payload straight from slab. On success, ownership of 'buf' passes
+    to the broker and caller must not touch it anymore. On error, caller
+    still owns 'buf'.
+
+    Returns 0 on success or -1 on errors
+
+    errno:
+            EINVAL      psmq is invalid (null)
+            EINVAL      topic is invalid (null)
+            EINVAL      buf does not come from psmq_shm_alloc()
+            ENOTSUP     broker does not provide shared memory slab
+            EMSGSIZE    len is bigger than slab block size
+            EBADMSG     topic does not start from '/' character
+            ENOBUFS     topic is to big to fit into buffers
+   ========================================================================== */
+
+
+int psmq_publish_shm
+(
+	struct psmq          *psmq,   /* psmq object */
+	const char           *topic,  /* topic of message to be sent */
+	void                 *buf,    /* buffer with payload in slab */
+	size_t                len,    /* length of payload in buf */
+	unsigned int          prio    /* message priority */
+)
+{
+	struct psmq_shm_desc  desc;   /* descriptor of buf to publish */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, psmq);
+	VALID(EINVAL, topic);
+	VALID(ENOTSUP, psmq->shm);
+	VALID(EINVAL, psmq_shm_buf_block(psmq, buf) >= 0);
+	VALID(EMSGSIZE, len <= ((struct psmq_shm_hdr *)psmq->shm)->blksize);
+	VALID(ENOBUFS, strlen(topic) + 1 + sizeof(desc) <= PSMQ_MSG_MAX);
+	VALID(EBADMSG, topic[0] == '/');
+
+	desc.slab = 0;
+	desc.offset = (char *)buf - (char *)psmq->shm;
+	desc.len = len;
+
+	return psmq_publish_msg(psmq, PSMQ_CTRL_CMD_PUBLISH_SHM, psmq->fd,
+			topic, &desc, sizeof(desc), prio);
+}
+
+
+/* ==========================================================================
+    Borrows payload of 'msg' received with PSMQ_CTRL_CMD_PUBLISH_SHM
+    command. Payload stays in broker's slab, it is not copied. Returned
+    pointer is valid until it's given back with psmq_shm_release(), every
+    borrowed payload must be released, or else slab will run out of free
+    blocks. Length of payload is stored in 'len'.
+
+    Returns pointer to payload on success or NULL on errors.
+
+    errno:
+            EINVAL      psmq, msg or len is invalid (null)
+            EINVAL      msg is not PSMQ_CTRL_CMD_PUBLISH_SHM message
+            ENOTSUP     broker does not provide shared memory slab
+            EBADMSG     descriptor in msg is invalid
+   ========================================================================== */
+
+
+const void *psmq_shm_borrow
+(
+	struct psmq             *psmq,   /* psmq object */
+	const struct psmq_msg   *msg,    /* received message */
+	size_t                  *len     /* length of payload will be here */
+)
+{
+	struct psmq_shm_desc     desc;   /* descriptor of payload */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALIDR(EINVAL, NULL, psmq);
+	VALIDR(EINVAL, NULL, msg);
+	VALIDR(EINVAL, NULL, len);
+	VALIDR(EINVAL, NULL, msg->ctrl.cmd == PSMQ_CTRL_CMD_PUBLISH_SHM);
+	VALIDR(ENOTSUP, NULL, psmq->shm);
+	VALIDR(EBADMSG, NULL, msg->paylen == sizeof(desc));
+
+	memcpy(&desc, PSMQ_PAYLOAD(*msg), sizeof(desc));
+	VALIDR(EBADMSG, NULL, psmq_shm_block(psmq->shm, &desc) >= 0);
+
+	*len = desc.len;
+	return (char *)psmq->shm + desc.offset;
+}
+
+
+/* ==========================================================================
+    Gives back 'buf' obtained either from psmq_shm_borrow() or from
+    psmq_shm_alloc() that was not published. Block is reused once all
+    subscribers have released it.
+
+    Returns 0 on success or -1 on errors
+
+    errno:
+            EINVAL      psmq is invalid (null)
+            EINVAL      buf does not point to slab block
+            ENOTSUP     broker does not provide shared memory slab
+   ========================================================================== */
+
+
+int psmq_shm_release
+(
+	struct psmq  *psmq,   /* psmq object */
+	const void   *buf     /* buffer to release */
+)
+{
+	int           block;  /* block buf points to */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, psmq);
+	VALID(ENOTSUP, psmq->shm);
+	VALID(EINVAL, (block = psmq_shm_buf_block(psmq, buf)) >= 0);
+
+	psmq_shm_ref(psmq->shm, block, -1);
+	return 0;
+}
+
+
 /* ==========================================================================
     Waits for message to be received from broker. Message is stored in msg
     buffer provided by caller. Function will receive both subscribed message
@@ -197,13 +841,21 @@ int psmq_receive_prio
 	unsigned int     *prio   /* message priority */
 )
 {
+	ssize_t           len;   /* number of received bytes */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
 	VALID(EINVAL, psmq);
 	VALID(EINVAL, msg);
 	VALID(EBADF, psmq->qpub != (mqd_t)-1);
 	VALID(EBADF, psmq->qsub != psmq->qpub);
 
-	/* return -1 on error otherwise return 0 */
-	return -(mq_receive(psmq->qsub, (char *)msg, sizeof(*msg), prio) == -1);
+	len = mq_receive(psmq->qsub, (char *)msg, sizeof(*msg), prio);
+	if (len == -1)
+		return -1;
+
+	psmq_trace_fix(psmq, msg, len);
+	return 0;
 }
 
 
@@ -258,14 +910,22 @@ int psmq_timedreceive_prio
 	struct timespec  *tp     /* absolute time to wait for timeout */
 )
 {
+	ssize_t           len;   /* number of received bytes */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
 	VALID(EINVAL, psmq);
 	VALID(EINVAL, msg);
 	VALID(EINVAL, tp);
 	VALID(EBADF, psmq->qpub != (mqd_t)-1);
 	VALID(EBADF, psmq->qsub != psmq->qpub);
 
-	return -(mq_timedreceive(psmq->qsub, (char *)msg,
-				sizeof(*msg), prio, tp) == -1);
+	len = mq_timedreceive(psmq->qsub, (char *)msg, sizeof(*msg), prio, tp);
+	if (len == -1)
+		return -1;
+
+	psmq_trace_fix(psmq, msg, len);
+	return 0;
 }
 
 
@@ -341,6 +1001,99 @@ int psmq_timedreceive_ms
 }
 
 
+/* ==========================================================================
+    Receives up to 'n' messages into 'msgs' array. Function blocks only
+    for the first message, for up to 'timeout' milliseconds, or forever
+    when 'timeout' is negative. After that all messages that are already
+    waiting in the queue are taken, without blocking, until there are no
+    more or 'msgs' is full. Priority of each message is stored in 'prios',
+    unless it is NULL.
+
+    Returns number of received messages (at least 1) on success or -1 on
+    errors
+
+    errno:
+            EINVAL      psmq is invalid (null)
+            EINVAL      msgs is invalid (null) or n is less than 1
+            EBADF       psmq was not properly initialized
+            EINTR       The call was interrupted by a signal handler
+            ETIMEDOUT   call timed out before message could be received
+   ========================================================================== */
+
+
+int psmq_receive_many_prio
+(
+	struct psmq      *psmq,    /* psmq object */
+	struct psmq_msg  *msgs,    /* received messages */
+	unsigned int     *prios,   /* messages priorities */
+	int               n,       /* max number of messages to receive */
+	int               timeout  /* ms to wait for first message */
+)
+{
+	struct timespec   tp;      /* absolute time to wait for timeout */
+	ssize_t           len;     /* number of received bytes */
+	int               i;       /* number of received messages */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, psmq);
+	VALID(EINVAL, msgs);
+	VALID(EINVAL, n > 0);
+	VALID(EBADF, psmq->qpub != (mqd_t)-1);
+	VALID(EBADF, psmq->qsub != psmq->qpub);
+
+	if (timeout < 0)
+	{
+		len = mq_receive(psmq->qsub, (char *)&msgs[0], sizeof(msgs[0]),
+				prios ? &prios[0] : NULL);
+	}
+	else
+	{
+		psmq_ms_to_tp(timeout, &tp);
+		len = mq_timedreceive(psmq->qsub, (char *)&msgs[0], sizeof(msgs[0]),
+				prios ? &prios[0] : NULL, &tp);
+	}
+
+	if (len == -1)
+		return -1;
+
+	psmq_trace_fix(psmq, &msgs[0], len);
+
+	/* timeout that already occured makes mq_timedreceive()
+	 * return immediately when queue is empty, so this won't
+	 * block and queue needs not to be switched to O_NONBLOCK */
+	memset(&tp, 0x00, sizeof(tp));
+	for (i = 1; i != n; ++i)
+	{
+		len = mq_timedreceive(psmq->qsub, (char *)&msgs[i], sizeof(msgs[i]),
+				prios ? &prios[i] : NULL, &tp);
+		if (len == -1)
+			break;
+
+		psmq_trace_fix(psmq, &msgs[i], len);
+	}
+
+	return i;
+}
+
+
+/* ==========================================================================
+    Same as psmq_receive_many_prio but ignores priority.
+   ========================================================================== */
+
+
+int psmq_receive_many
+(
+	struct psmq      *psmq,    /* psmq object */
+	struct psmq_msg  *msgs,    /* received messages */
+	int               n,       /* max number of messages to receive */
+	int               timeout  /* ms to wait for first message */
+)
+{
+	return psmq_receive_many_prio(psmq, msgs, NULL, n, timeout);
+}
+
+
 /* ==========================================================================
     Opens connection to broker. Client queue should already be created.
 
@@ -372,6 +1125,7 @@ static int psmq_init_wq
 {
 	int              ack;         /* ACK from the broker after open */
 	int              saveerrno;   /* saved errno value */
+	unsigned char    proto;       /* protocol we ask broker for */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
@@ -395,8 +1149,17 @@ static int psmq_init_wq
 	/* both queues have been created, that means
 	 * we have enough memory to operate, now we
 	 * need to register to broker, so it knows
-	 * where to send messages */
-	if (psmq_publish_msg(psmq, PSMQ_CTRL_CMD_OPEN, 0, mqname, NULL, 0, 0) != 0)
+	 * where to send messages. Open is always
+	 * sent in PSMQ_PROTO_V1 format, with protocol
+	 * we want in payload. Old broker ignores
+	 * payload and answers in V1, so we still
+	 * can talk to him. Longest queue names leave
+	 * no room for protocol, we stay with V1 then */
+	proto = PSMQ_PROTO_V2;
+	psmq->proto = PSMQ_PROTO_V1;
+	if (psmq_publish_msg(psmq, PSMQ_CTRL_CMD_OPEN, 0, mqname, &proto,
+				strlen(mqname) + 1 < PSMQ_MSG_MAX ? sizeof(proto) : 0,
+				0) != 0)
 		goto error;
 
 	/* check response from the broker on subscribe
@@ -427,28 +1190,42 @@ static int psmq_init_wq
 		if (msg.ctrl.cmd != PSMQ_CTRL_CMD_OPEN)
 			continue;
 
-		/* no space left for us on the broker */
+		/* no space left for us on the broker, or
+		 * broker failed to make room for us */
 		ack = msg.ctrl.data;
-		if (msg.paylen == 0 && ack == ENOSPC)
+		if (msg.paylen == 0 && (ack == ENOSPC || ack == ENOMEM))
+			break;
+
+		if (msg.paylen == 1)
+		{
+			/* broker does not know V2, fd
+			 * comes in 1 byte */
+			psmq->fd = (unsigned char)msg.data[0];
 			break;
+		}
 
-		if (msg.paylen != 1)
+		if (msg.paylen != 1 + sizeof(psmq->fd) ||
+				msg.data[0] != PSMQ_PROTO_V2)
 		{
-			/* we expected exactly 1 byte as fd,
+			/* we expected 1 byte as fd, or agreed
+			 * protocol followed by 2 byte fd,
 			 * anything else is wrong */
 			ack = EBADMSG;
 			break;
 		}
 
-		ack = msg.ctrl.data;
-		psmq->fd = msg.data[0];
+		memcpy(&psmq->fd, msg.data + 1, sizeof(psmq->fd));
+		psmq->proto = PSMQ_PROTO_V2;
 		break;
 	}
 
 	/* ack received and fd is valid,
 	 * we are victorious */
 	if (ack == 0)
+	{
+		psmq_shm_attach(psmq, brokername);
 		return 0;
+	}
 
 error:
 	/* broker will return either 0 or errno to
@@ -483,7 +1260,9 @@ error:
     Opens connection to broker. Function allows caller to provide both
     brokername queue as well as it's own queue name. If these are not
     specified (NULL), default broker name is used, and for client, queue
-    name is generated.
+    name is generated. Client's queue is created with messages that can
+    hold up to 'msgclass' bytes of topic and payload. Broker will not
+    send us messages that are bigger than that.
 
     Return 0 when broker sends back connection confirmation or -1 when error
     occured.
@@ -493,6 +1272,8 @@ error:
             EINVAL      brokername does not start with '/'
             EINVAL      mqname does not start with '/'
             EINVAL      maxmsg is 0 or less
+            EINVAL      msgclass is not between PSMQ_MSG_CLASS_MIN and
+                        PSMQ_MSG_MAX
             ENAMETOOLONG  mqname is bigger than PSMQ_MSG_MAX and thus cannot
                         be send to broker
             EACCES      Either brokername or mqname can't be opened due to
@@ -508,12 +1289,13 @@ error:
    ========================================================================== */
 
 
-int psmq_init_named
+int psmq_init_class
 (
 	struct psmq     *psmq,        /* psmq object to initialize */
 	const char      *brokername,  /* name of the broker to connect to */
 	const char      *mqname,      /* name of the reciving queue to create */
-	int              maxmsg       /* max queued messages in mqname */
+	int              maxmsg,      /* max queued messages in mqname */
+	int              msgclass     /* max topic + payload in mqname msg */
 )
 {
 	struct mq_attr mqa;
@@ -524,6 +1306,8 @@ int psmq_init_named
 
 	VALID(EINVAL, psmq);
 	VALID(EINVAL, maxmsg > 0);
+	VALID(EINVAL, msgclass >= PSMQ_MSG_CLASS_MIN);
+	VALID(EINVAL, msgclass <= PSMQ_MSG_MAX);
 
 	if (brokername)
 		VALID(EINVAL, brokername[0] == '/');
@@ -540,8 +1324,9 @@ int psmq_init_named
 
 	memset(psmq, 0x00, sizeof(struct psmq));
 	memset(&mqa, 0x00, sizeof(mqa));
-	mqa.mq_msgsize = sizeof(struct psmq_msg);
+	mqa.mq_msgsize = offsetof(struct psmq_msg, data) + msgclass;
 	mqa.mq_maxmsg = maxmsg;
+	psmq->msgclass = msgclass;
 
 	if (mqname)
 	{
@@ -601,6 +1386,25 @@ int psmq_init_named
 }
 
 
+/* ==========================================================================
+    Same as psmq_init_class(), but client's queue can hold messages of
+    any size.
+   ========================================================================== */
+
+
+int psmq_init_named
+(
+	struct psmq     *psmq,        /* psmq object to initialize */
+	const char      *brokername,  /* name of the broker to connect to */
+	const char      *mqname,      /* name of the reciving queue to create */
+	int              maxmsg       /* max queued messages in mqname */
+)
+{
+	return psmq_init_class(psmq, brokername, mqname, maxmsg,
+			PSMQ_MSG_CLASS_LARGE);
+}
+
+
 /* ==========================================================================
     Opens connection to broker. Function uses default name for broker and
     generates name for client. Name will be in format "/psmqcNNN" where,
@@ -658,6 +1462,31 @@ int psmq_cleanup
 	 * if it succed or not, we close our booth and
 	 * nothing can stop us from doing it */
 	psmq_publish_msg(psmq, PSMQ_CTRL_CMD_CLOSE, psmq->fd, NULL, NULL, 0, 0);
+
+	if (psmq->shm)
+	{
+		struct psmq_msg  msg;  /* message left in our queue */
+		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+		/* large payloads that were sent to us, but we
+		 * never received them, still hold blocks in
+		 * slab, give them back, or they will be lost
+		 * until broker restarts */
+		while (psmq_timedreceive_ms(psmq, &msg, 0) == 0)
+			if (msg.ctrl.cmd == PSMQ_CTRL_CMD_PUBLISH_SHM)
+			{
+				const void  *buf;  /* borrowed payload */
+				size_t       len;  /* length of payload */
+				/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+				if ((buf = psmq_shm_borrow(psmq, &msg, &len)))
+					psmq_shm_release(psmq, buf);
+			}
+	}
+
+	psmq_shm_detach(psmq);
 	mq_close(psmq->qpub);
 	mq_close(psmq->qsub);
 	psmq->qpub = (mqd_t) -1;
@@ -679,7 +1508,7 @@ int psmq_cleanup
             EINVAL      topic is empty ("")
             EBADMSG     topic contains only "/" and nothing else
             EBADF       psmq has not been initialized
-            ENOBUFS     topic is too long
+            ENOBUFS     topic is too long for msgclass of psmq
    ========================================================================== */
 
 
@@ -695,7 +1524,7 @@ int psmq_subscribe
 	VALID(EBADMSG, topic[0] == '/');
 	VALID(EBADF, psmq->qsub != (mqd_t)-1);
 	VALID(EBADF, psmq->qsub != psmq->qpub);
-	VALID(ENOBUFS, strlen(topic) + 1 <= PSMQ_MSG_MAX);
+	VALID(ENOBUFS, strlen(topic) + 1 <= psmq->msgclass);
 
 	/* send subscribe request to the server */
 	return psmq_publish_msg(psmq, PSMQ_CTRL_CMD_SUBSCRIBE,
@@ -703,6 +1532,44 @@ int psmq_subscribe
 }
 
 
+/* ==========================================================================
+    Same as psmq_subscribe() but also passes 'flags' that change how
+    broker delivers messages of that subscription, PSMQ_SUB_CONFLATE
+    is the only one for now. With 'flags' being 0, this is exactly
+    psmq_subscribe().
+
+    Returns 0 on success or -1 on error
+
+    errno:
+            EINVAL      unknown bit is set in flags
+            others      same as psmq_subscribe()
+   ========================================================================== */
+
+
+int psmq_subscribe_flags
+(
+	struct psmq    *psmq,  /* psmq object */
+	const char     *topic, /* topic to register to */
+	unsigned char   flags  /* PSMQ_SUB_* flags */
+)
+{
+	VALID(EINVAL, psmq);
+	VALID(EINVAL, topic);
+	VALID(EINVAL, topic[0] != '\0');
+	VALID(EINVAL, (flags & ~PSMQ_SUB_CONFLATE) == 0);
+	VALID(EBADMSG, topic[0] == '/');
+	VALID(EBADF, psmq->qsub != (mqd_t)-1);
+	VALID(EBADF, psmq->qsub != psmq->qpub);
+	VALID(ENOBUFS, strlen(topic) + 1 <= psmq->msgclass);
+	VALID(ENOBUFS, strlen(topic) + 1 + !!flags <= PSMQ_MSG_MAX);
+
+	/* flags go as 1 byte payload, only when there are any,
+	 * so plain subscription looks the same as it always did */
+	return psmq_publish_msg(psmq, PSMQ_CTRL_CMD_SUBSCRIBE,
+			psmq->fd, topic, &flags, !!flags, 0);
+}
+
+
 /* ==========================================================================
     Unsubscribes from 'topic'. After call to this function, broker will send
     back ACK reply with information whether command was success or not. You
@@ -716,7 +1583,7 @@ int psmq_subscribe
             EINVAL      topic is empty ("")
             EBADMSG     topic contains only "/" and nothing else
             EBADF       psmq has not been initialized
-            ENOBUFS     topic is too long
+            ENOBUFS     topic is too long for msgclass of psmq
    ========================================================================== */
 
 
@@ -732,7 +1599,7 @@ int psmq_unsubscribe
 	VALID(EBADMSG, topic[0] == '/');
 	VALID(EBADF, psmq->qsub != (mqd_t)-1);
 	VALID(EBADF, psmq->qsub != psmq->qpub);
-	VALID(ENOBUFS, strlen(topic) + 1 <= PSMQ_MSG_MAX);
+	VALID(ENOBUFS, strlen(topic) + 1 <= psmq->msgclass);
 
 	/* send subscribe request to the server */
 	return psmq_publish_msg(psmq, PSMQ_CTRL_CMD_UNSUBSCRIBE,
@@ -760,6 +1627,7 @@ int psmq_ioctl
 {
 	int            val_int;     /* ap value treated as integer */
 	unsigned short val_ushort;  /* ap value treated as unsigned short */
+	unsigned int   val_limit[2]; /* ap values treated as rate and burst */
 	va_list        ap;          /* variadic argument */
 	char           buf[32];     /* buffer with ioctl data to send to broker */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
@@ -795,6 +1663,49 @@ int psmq_ioctl
 		return psmq_publish_msg(psmq, PSMQ_CTRL_CMD_IOCTL, psmq->fd, NULL,
 				buf, 1 + sizeof(val_ushort), 0);
 
+	/* ==================================================================
+	       __
+	      / /_ ____ ___ _ ____ ___
+	     / __// __// _ `// __// -_)
+	     \__//_/   \_,_/ \__/ \__/
+	   ================================================================== */
+
+	case PSMQ_IOCTL_TRACE:
+		val_int = va_arg(ap, int);
+		VALID(EINVAL, val_int == 0 || val_int == 1);
+
+		buf[1] = val_int;
+		if (psmq_publish_msg(psmq, PSMQ_CTRL_CMD_IOCTL, psmq->fd, NULL,
+				buf, 2, 0) != 0)
+			return -1;
+
+		/* stamping starts right away, broker ignores
+		 * stamps until he processes this request */
+		psmq->trace = val_int;
+		return 0;
+
+	/* ==================================================================
+	        __ _           _  __
+	       / /(_)__ _  (_)/ /_
+	      / // //  ' \/ // __/
+	     /_//_//_/_/_//_/ \__/
+	   ================================================================== */
+
+	case PSMQ_IOCTL_PUB_LIMIT:
+	case PSMQ_IOCTL_RECV_LIMIT:
+		val_limit[0] = va_arg(ap, unsigned int);
+		val_limit[1] = va_arg(ap, unsigned int);
+		VALID(EINVAL, val_limit[0] <= PSMQ_LIMIT_MAX);
+		VALID(EINVAL, val_limit[1] <= PSMQ_LIMIT_MAX);
+
+		/* broker sends limit back in reply, so
+		 * it must fit into our queue */
+		VALID(ENOBUFS, 1 + sizeof(val_limit) <= psmq->msgclass);
+
+		memcpy(buf + 1, val_limit, sizeof(val_limit));
+		return psmq_publish_msg(psmq, PSMQ_CTRL_CMD_IOCTL, psmq->fd, NULL,
+				buf, 1 + sizeof(val_limit), 0);
+
 	default:
 		errno = EINVAL;
 		return -1;
@@ -821,3 +1732,96 @@ int psmq_ioctl_reply_timeout
 {
 	return psmq_ioctl(psmq, PSMQ_IOCTL_REPLY_TIMEOUT, val);
 }
+
+
+/* ==========================================================================
+    Enables or disables latency tracing for client. When enabled, library
+    stamps every published message with send time, broker adds times it
+    received message and sent it to us, and all three can be read from
+    received message with psmq_msg_trace().
+   ========================================================================== */
+
+
+int psmq_ioctl_trace
+(
+	struct psmq   *psmq,   /* psmq object */
+	int            enable  /* 1 to enable tracing, 0 to disable */
+)
+{
+	return psmq_ioctl(psmq, PSMQ_IOCTL_TRACE, enable);
+}
+
+
+/* ==========================================================================
+    Limits number of messages we can publish to 'rate' per second, with
+    bursts of up to 'burst' messages. Broker drops publishes over the
+    limit. 'rate' 0 removes the limit.
+   ========================================================================== */
+
+
+int psmq_ioctl_pub_limit
+(
+	struct psmq   *psmq,   /* psmq object */
+	unsigned int   rate,   /* messages per second */
+	unsigned int   burst   /* max messages at once, 0 - same as rate */
+)
+{
+	return psmq_ioctl(psmq, PSMQ_IOCTL_PUB_LIMIT, rate, burst);
+}
+
+
+/* ==========================================================================
+    Limits number of messages broker delivers to us to 'rate' per second,
+    with bursts of up to 'burst' messages. Messages over the limit are
+    dropped. 'rate' 0 removes the limit.
+   ========================================================================== */
+
+
+int psmq_ioctl_recv_limit
+(
+	struct psmq   *psmq,   /* psmq object */
+	unsigned int   rate,   /* messages per second */
+	unsigned int   burst   /* max messages at once, 0 - same as rate */
+)
+{
+	return psmq_ioctl(psmq, PSMQ_IOCTL_RECV_LIMIT, rate, burst);
+}
+
+
+/* ==========================================================================
+    Reads timestamps of published message 'msg' into 'trace'. Message
+    must have been received by client with tracing enabled, otherwise
+    result is undefined. Timestamps that were not taken are 0, this
+    happens when publisher is not tracing, or our queue was too small
+    to fit trace along with message.
+
+    Returns 0 on success or -1 on errors
+
+    errno:
+            EINVAL      msg or trace is invalid (null)
+            EINVAL      msg is not a published message
+            ENOBUFS     message is too big to carry trace
+   ========================================================================== */
+
+
+int psmq_msg_trace
+(
+	const struct psmq_msg  *msg,    /* received message */
+	struct psmq_trace      *trace   /* timestamps of message */
+)
+{
+	size_t                  off;    /* offset of trace in msg */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, msg);
+	VALID(EINVAL, trace);
+	VALID(EINVAL, msg->ctrl.cmd == PSMQ_CTRL_CMD_PUBLISH ||
+			msg->ctrl.cmd == PSMQ_CTRL_CMD_PUBLISH_SHM);
+
+	off = psmq_real_msg_size(*msg);
+	VALID(ENOBUFS, off + sizeof(*trace) <= sizeof(*msg));
+
+	memcpy(trace, (const char *)msg + off, sizeof(*trace));
+	return 0;
+}
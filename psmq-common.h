@@ -21,22 +21,37 @@
 #include <sys/time.h>
 #include <time.h>
 
+#include "psmq.h"
+
 
 /* default name for psmq broker to use, when none is specified */
 #define PSMQD_DEFAULT_QNAME "/psmqd"
 
+/* large payloads can be passed via shared memory slab only when
+ * system supports posix shared memory, and compiler can update
+ * reference counters of blocks atomically */
+#if HAVE_SYS_MMAN_H && HAVE_SHM_OPEN && HAVE_ATOMIC_BUILTINS
+#   define PSMQ_HAVE_SHM 1
+#else
+#   define PSMQ_HAVE_SHM 0
+#endif
+
 /* hard limits, these are minimal values that either makes sense or
  * psmq cannot properly work with different values that these or
  * internal types forbids some values to be bigger */
 
-#if PSMQ_MAX_CLIENTS > (UCHAR_MAX - 1)
-	/* psmq uses unsigned char to hold, and transmit client's file
+#if PSMQ_MAX_CLIENTS > (USHRT_MAX - 1)
+	/* psmq uses unsigned short to hold, and transmit client's file
 	 * descriptors, so you cannot set max clients to be bigger than
-	 * what unsigned char can hold. -1 is because UCHAR_MAX is
+	 * what unsigned short can hold. -1 is because USHRT_MAX is
 	 * reserved for errors. */
-#   error PSMQ_MAX_CLIENTS must not be bigger than (UCHAR_MAX - 1)
+#   error PSMQ_MAX_CLIENTS must not be bigger than (USHRT_MAX - 1)
 #endif
 
+/* PSMQ_PROTO_V1 clients send their file descriptor in unsigned char,
+ * so they only ever get one of the first that many */
+#define PSMQ_V1_MAX_CLIENTS (UCHAR_MAX - 1)
+
 #define PSMQ_MAX_CLIENTS_HARD_MIN 2
 #if PSMQ_MAX_CLIENTS < PSMQ_MAX_CLIENTS_HARD_MIN
 	/* psmq is a publish subscriber program, so at least one client
@@ -46,7 +61,41 @@
 #   error PSMQ_MAX_CLIENTS must be bigger than 1
 #endif
 
+#if PSMQ_MAX_SUBS < 1 || PSMQ_MAX_SUBS > USHRT_MAX
+	/* every client has pool of that many topic nodes, number of
+	 * used nodes is kept in unsigned short */
+#   error PSMQ_MAX_SUBS must be between 1 and USHRT_MAX
+#endif
+
 #define size_of_member(type, member) sizeof(((type *)0)->member)
+
+/* bitmaps of clients, bit of client fd is bit (fd % PSMQ_BM_BITS)
+ * of word (fd / PSMQ_BM_BITS). Set bits are found word by word with
+ * psmq_bm_ctz(), so walking bitmap does not cost anything for words
+ * that have no bit set */
+#define PSMQ_BM_BITS (sizeof(unsigned long) * CHAR_BIT)
+#define psmq_bm_words(n) (((n) + PSMQ_BM_BITS - 1) / PSMQ_BM_BITS)
+#define psmq_bm_isset(bm, i) \
+		(((bm)[(i) / PSMQ_BM_BITS] >> ((i) % PSMQ_BM_BITS)) & 1)
+#define psmq_bm_set(bm, i) \
+		((bm)[(i) / PSMQ_BM_BITS] |= 1UL << ((i) % PSMQ_BM_BITS))
+#define psmq_bm_clr(bm, i) \
+		((bm)[(i) / PSMQ_BM_BITS] &= ~(1UL << ((i) % PSMQ_BM_BITS)))
+
+/* index of lowest set bit in w, w must not be 0 */
+#if HAVE_BUILTIN_BITOPS
+#   define psmq_bm_ctz(w) __builtin_ctzl(w)
+#else
+#   define psmq_bm_ctz(w) psmq_ctzl(w)
+#endif
+
+/* number of bits set in w */
+#if HAVE_BUILTIN_BITOPS
+#   define psmq_bm_count(w) __builtin_popcountl(w)
+#else
+#   define psmq_bm_count(w) psmq_popcountl(w)
+#endif
+
 /* calculates real size of msg to send over, real that is, if
  * data[PSMQ_MSG_MAX] is 50, topic is 10 bytes long and payload is 4
  * bytes long, there is no need to send whole struct with 50 bytes,
@@ -64,7 +113,70 @@
 		((m).ctrl.cmd == PSMQ_CTRL_CMD_IOCTL ? 0 : (strlen((m).data) + 1)) + \
 		(m).paylen)
 
+/* request as it goes to broker's control queue. PSMQ_PROTO_V2 client
+ * puts his id right after message (after trace stamp, if there is
+ * one), so request may take that much more than struct psmq_msg. It
+ * is not aligned, so it must be copied byte by byte. */
+struct psmq_req
+{
+    struct psmq_msg  msg;
+    unsigned char    id[sizeof(unsigned short)];
+};
+
+/* client that enabled PSMQ_IOCTL_TRACE puts unsigned int send time
+ * right after payload of every message he publishes, and broker puts
+ * struct psmq_trace there in every message it publishes to him. It is
+ * not counted in paylen, so psmq_real_msg_size() is its offset. Either
+ * is left out when it wouldn't fit into receiver's queue. */
+
+
+/* shared memory slab for large payloads, created by the broker when
+ * it's started with -s option. Name of the slab is broker's name with
+ * PSMQ_SHM_SUFFIX appended. Slab starts with header, right after it
+ * there is reference counter for each block, and then come blocks
+ * themselves, first one aligned to PSMQ_SHM_ALIGN. Block is free when
+ * its reference counter is 0. */
+#define PSMQ_SHM_MAGIC  0x70736d71u  /* "psmq" */
+#define PSMQ_SHM_ALIGN  64
+#define PSMQ_SHM_SUFFIX ".shm"
+
+struct psmq_shm_hdr
+{
+    unsigned int  magic;    /* set by broker once slab is ready to use */
+    unsigned int  nblocks;  /* number of blocks in slab */
+    unsigned int  blksize;  /* size of single block, multiple of ALIGN */
+    unsigned int  hint;     /* where to start looking for free block */
+};
+
+/* descriptor of payload in the slab, this is what is sent over
+ * mqueues as a payload of PSMQ_CTRL_CMD_PUBLISH_SHM message */
+struct psmq_shm_desc
+{
+    unsigned int  slab;     /* slab id, only 0 is valid for now */
+    unsigned int  offset;   /* offset of payload from start of slab */
+    unsigned int  len;      /* length of payload */
+};
+
+#define psmq_shm_refs(h) ((unsigned int *)((struct psmq_shm_hdr *)(h) + 1))
+#define psmq_shm_data_off(nblocks) ((sizeof(struct psmq_shm_hdr) + \
+		(size_t)(nblocks) * sizeof(unsigned int) + PSMQ_SHM_ALIGN - 1) & \
+		~(size_t)(PSMQ_SHM_ALIGN - 1))
+#define psmq_shm_size(nblocks, blksize) (psmq_shm_data_off(nblocks) + \
+		(size_t)(nblocks) * (blksize))
+
 
 void psmq_ms_to_tp(size_t ms, struct timespec *tp);
+unsigned long psmq_mono_us(void);
+unsigned long psmq_mono_ms(void);
+unsigned int psmq_trace_now(void);
+#if PSMQ_HAVE_SHM
+int psmq_shm_name(char *name, size_t len, const char *brokername);
+#endif
+int psmq_shm_block(struct psmq_shm_hdr *h, const struct psmq_shm_desc *desc);
+unsigned int psmq_shm_ref(struct psmq_shm_hdr *h, int block, int n);
+#if !HAVE_BUILTIN_BITOPS
+int psmq_ctzl(unsigned long w);
+int psmq_popcountl(unsigned long w);
+#endif
 
 #endif /* PSMQ_BROKER_H */
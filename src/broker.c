@@ -43,16 +43,35 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <mqueue.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
+#include <unistd.h>
+
+#include "psmq-common.h"
+
+#if PSMQ_HAVE_SHM
+#   include <sys/mman.h>
+#endif
+
+#if HAVE_SYS_EPOLL_H && HAVE_SYS_SIGNALFD_H && PSMQ_NO_SIGNALS == 0
+#   define PSMQD_EPOLL 1
+#   include <sys/epoll.h>
+#   include <sys/signalfd.h>
+#endif
 
 #include "cfg.h"
 #include "globals.h"
-#include "psmq-common.h"
+#include "retained.h"
+#include "sub-tree.h"
 #include "topic-list.h"
+#include "topic-map.h"
 #include "valid.h"
 #include "psmq.h"
 
@@ -67,6 +86,125 @@
    ========================================================================== */
 
 
+/* set of clients message on some topic is routed to */
+struct route
+{
+	/* number of clients stored in fds */
+	int  n;
+
+	/* number of elements fds has room for */
+	int  size;
+
+	/* clients subscribed to topic, in ascending order, this
+	 * is what fan-out walks, so it never looks at clients
+	 * that are not subscribed. Grown when route is resolved
+	 * and more clients match than it can hold */
+	unsigned short  *fds;
+};
+
+
+/* topic alias registered by client */
+struct alias
+{
+	/* topic alias stands for, NULL when alias is not set */
+	char  *topic;
+
+	/* value of routegen when route was resolved, route is
+	 * resolved again when subscriptions have changed */
+	unsigned long  gen;
+
+	/* clients subscribed to topic */
+	struct route  route;
+};
+
+
+/* cached route of recently published topic */
+struct rcache
+{
+	/* topic route is for, NULL when entry is not used */
+	char  *topic;
+
+	/* psmqd_tl_hash() of topic */
+	unsigned long  hash;
+
+	/* value of routegen when route was resolved, route is
+	 * resolved again when subscriptions have changed */
+	unsigned long  gen;
+
+	/* neighbours on the lru list, prev is more recently
+	 * used, -1 at the ends of the list */
+	int  prev;
+	int  next;
+
+	/* next entry in the same hash bucket, or -1 */
+	int  chain;
+
+	/* clients subscribed to topic */
+	struct route  route;
+};
+
+
+/* token bucket limiting rate of messages, every message takes one
+ * token, and bucket is refilled with rate tokens per second, up to
+ * burst tokens */
+struct bucket
+{
+	/* tokens added per second, 0 when there is no limit */
+	unsigned int  rate;
+
+	/* max number of tokens bucket can hold */
+	unsigned int  burst;
+
+	/* tokens in bucket, in thousandths of token, so even
+	 * low rates can be refilled every millisecond */
+	unsigned long  tokens;
+
+	/* psmq_mono_ms() of last refill */
+	unsigned long  last;
+};
+
+
+/* broker statistics, published periodically on PSMQD_SYS_TOPIC */
+#define PSMQD_STATS_CMDS "ocsupilbankr" /* commands counted in stats */
+struct stats
+{
+	/* number of requests received, per command, index
+	 * is position of command in PSMQD_STATS_CMDS */
+	unsigned long  cmds[sizeof(PSMQD_STATS_CMDS) - 1];
+
+	/* all requests received on control queue, those not
+	 * counted in cmds were malformed and dropped */
+	unsigned long  received;
+
+	/* messages that went through routing */
+	unsigned long  published;
+
+	/* published messages noone was subscribed to */
+	unsigned long  nomatch;
+
+	/* messages handed over to subscribers */
+	unsigned long  delivered;
+
+	/* times fan-out was interrupted by higher priority message */
+	unsigned long  preempted;
+
+	/* publishes and deliveries dropped by clients' rate limits */
+	unsigned long  limited;
+
+	/* undelivered messages replaced by newer ones on the same
+	 * topic, for clients with conflated subscriptions */
+	unsigned long  conflated;
+
+	/* value of published during previous report */
+	unsigned long  lastpublished;
+
+	/* histogram of time spent in routing single message,
+	 * bucket i counts messages routed in less than 2^i
+	 * microseconds, last one counts all slower */
+	unsigned long  hist[16];
+};
+
+
 /* structure describing connected client */
 struct client
 {
@@ -78,6 +216,10 @@ struct client
 	 * not subscribed to any topic */
 	struct psmqd_tl  *topics;
 
+	/* nodes of topics list, all are freed at once when
+	 * client closes */
+	struct psmqd_tl_pool  pool;
+
 	/* how many times did client missed pub because it's queue
 	 * was full? */
 	unsigned char  missed_pubs;
@@ -85,6 +227,110 @@ struct client
 	/* how long will broker wait for client to free up space in
 	 * its mqueue after giving up and discarding message */
 	unsigned short  reply_timeout;
+
+	/* topic aliases, array of PSMQ_MAX_ALIASES elements allocated
+	 * when client registers his first alias, NULL until then */
+	struct alias  *aliases;
+
+	/* rate limit of messages client publishes, set with
+	 * ioctl or from config */
+	struct bucket  publim;
+
+	/* number of client's publishes and deliveries to him,
+	 * that were dropped because of rate limits */
+	unsigned long  limited;
+
+	/* client was told his publish was dropped, and won't
+	 * be told again until some publish gets through */
+	unsigned char  overlimit;
+
+	/* messages waiting to be sent by delivery threads, or
+	 * messages parked because client's mqueue was full, when
+	 * non blocking delivery is enabled. This is ring buffer of
+	 * qsize elements allocated when client opens for the first
+	 * time. With delivery threads, all fields below and
+	 * missed_pubs are protected with wlock */
+	struct delivery  *queue;
+	unsigned short    qhead;   /* index of oldest message in queue */
+	unsigned short    qcount;  /* number of messages in queue */
+	unsigned char     busy;    /* thread is sending to client now */
+	unsigned char     ready;   /* client is on wready list */
+};
+
+
+/* part of client's state that is looked at for every message routed
+ * to him. It's kept apart from struct client, in array of its own, so
+ * fan-out to many clients walks few densely packed cache lines, instead
+ * of pulling whole client structures that are mostly cold */
+struct target
+{
+	/* rate limit of messages we deliver to client, set
+	 * with ioctl or from config */
+	struct bucket  recvlim;
+
+	/* number of messages handed over to client since he opened */
+	unsigned long  delivered;
+
+	/* size of messages client's mqueue can hold, client chooses
+	 * it when creating queue, bigger messages are not sent */
+	unsigned short  msgsize;
+
+	/* number of client's subscriptions with PSMQ_SUB_CONFLATE,
+	 * when 0, we don't even look for them during publish */
+	unsigned short  nconflate;
+
+	/* client wants latency tracing, his publishes carry send
+	 * time and we add struct psmq_trace to what we send him */
+	unsigned char  trace;
+};
+
+
+/* message waiting to be sent by delivery thread, when message is
+ * published to more than one client, all of them share single copy */
+struct pending
+{
+	/* number of clients' queues message is on, +1 for
+	 * whoever created it, message is freed when this
+	 * drops to 0 */
+	unsigned int  refs;
+
+	/* priority to send message with */
+	unsigned int  prio;
+
+	/* when set, thread will close client's mqueue
+	 * after sending this message */
+	int  close;
+
+	/* number of bytes to send from msg */
+	size_t  len;
+
+	/* message to send, it must be last as memory is
+	 * allocated only for len bytes of it */
+	struct psmq_msg  msg;
+};
+
+
+/* single entry on client's delivery queue */
+struct delivery
+{
+	struct pending  *msg;      /* message to send */
+	mqd_t            mq;       /* mqueue to send message to */
+	unsigned short   timeout;  /* reply_timeout at the time of queueing */
+};
+
+
+/* message taken from control queue ahead of its turn, while broker
+ * was looking for higher priority messages in the middle of fan-out */
+struct backlog
+{
+	/* priority message was sent with */
+	unsigned int  prio;
+
+	/* number of bytes received into msg */
+	size_t  len;
+
+	/* received message, as it came from control queue */
+	struct psmq_req  msg;
 };
 
 
@@ -100,8 +346,74 @@ struct client
 
 #define EL_OPTIONS_OBJECT &g_psmqd_log
 #define PSMQ_MAX_MISSED_PUBS 10
+#define PSMQD_CTRL_CMD_KILL 'k' /* internal, see psmqd_broker_kill() */
 static mqd_t          qctrl;  /* mqueue handle to broker main control queue */
-static struct client  clients[PSMQ_MAX_CLIENTS]; /* array of clients */
+static mqd_t          qbatch; /* non blocking handle to qctrl for batching */
+#define PSMQD_CLIENTS_MIN 16 /* initial number of slots in clients */
+static struct client *clients; /* array of clients, grows when needed */
+static struct target *targets; /* hot part of clients, same size */
+static int            nslots; /* number of elements in clients and targets */
+#define PSMQD_CUSED_WORDS ((int)psmq_bm_words(nslots))
+static unsigned long *cused;  /* bit set for connected, nslots bits */
+static unsigned long *rmatched; /* clients matched by topic, nslots bits */
+static struct psmqd_st *subtree; /* wildcard subscriptions of all clients */
+static struct psmqd_tm  topicmap; /* exact subscriptions of all clients */
+static unsigned long    routegen; /* bumped whenever routing changes */
+static struct psmqd_rt  retained; /* retained messages, arena NULL if disabled */
+static struct rcache   *rcache;   /* route cache, NULL when disabled */
+static int             *rbuckets; /* first entry of each hash bucket */
+static unsigned long    rmask;    /* number of buckets - 1 */
+static int              rmru;     /* most recently used entry in rcache */
+static int              rlru;     /* least recently used entry in rcache */
+#define PSMQD_SYS_TOPIC "/$sys/" /* reserved for broker's own messages */
+#define PSMQD_SELF_FD USHRT_MAX  /* fd of broker's own messages */
+static struct stats     stats;    /* broker statistics */
+static int              ntraced;  /* number of clients with tracing */
+static unsigned long    stats_next; /* psmq_mono_ms() of next report */
+static unsigned long    stats_last; /* psmq_mono_ms() of last report */
+
+/* delivery threads, used when broker_workers > 0 */
+#define PSMQD_CLIENT_QUEUE 32 /* max messages waiting for single client */
+static pthread_t       *workers;    /* delivery threads */
+static pthread_mutex_t  wlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   wcond = PTHREAD_COND_INITIALIZER; /* work to do */
+static pthread_cond_t   wroom = PTHREAD_COND_INITIALIZER; /* queue has room */
+static unsigned short  *wready;      /* clients with messages, nslots */
+static int              wready_head; /* index of first client in wready */
+static int              wready_n;    /* number of clients in wready */
+static int              wstop;       /* threads should exit when idle */
+static struct pending   closemsg;    /* close reply, shared by all */
+static int              qsize;       /* size of clients' queues, 0 if unused */
+
+/* non blocking delivery, used when broker_overflow > 0 */
+#define PSMQD_FLUSH_MS 10 /* how often to retry sending parked messages */
+static int              nparked;     /* clients with parked messages */
+
+#if PSMQD_EPOLL
+/* epoll main loop, on linux mqd_t is a file descriptor that can be
+ * polled, so broker can sleep until something happens */
+#define PSMQD_EV_QCTRL  (PSMQ_MAX_CLIENTS + 0) /* epoll tag for qctrl */
+#define PSMQD_EV_SIGNAL (PSMQ_MAX_CLIENTS + 1) /* epoll tag for sigfd */
+static int              epfd = -1;   /* epoll instance, -1 when not used */
+static int              sigfd = -1;  /* signalfd for shutdown signals */
+static sigset_t         sigold;      /* signal mask before sigfd was created */
+#endif
+
+/* fan-out preemption, used when broker_preempt > 0 */
+#define PSMQD_BACKLOG 32      /* max messages taken ahead of their turn */
+#define PSMQD_PREEMPT_DEPTH 8 /* max nesting of preempting messages */
+static struct backlog  *backlog;    /* messages taken ahead, by prio */
+static int              nbacklog;   /* number of messages in backlog */
+static int              preempting; /* current nesting of preemptions */
+static struct route     rscratch[PSMQD_PREEMPT_DEPTH + 1]; /* per nesting */
+
+/* preempting message is processed in the middle of fan-out */
+static void psmqd_broker_process(struct psmq_req *req, size_t len,
+		unsigned int prio);
+
+/* shared memory slab for large payloads, used when broker_shm > 0 */
+static struct psmq_shm_hdr *slab;    /* mapped slab, NULL when not used */
+static size_t           slablen;     /* size of mapped slab */
 
 
 /* ==========================================================================
@@ -115,735 +427,3682 @@ static struct client  clients[PSMQ_MAX_CLIENTS]; /* array of clients */
 
 
 /* ==========================================================================
-    Finds first free slot in clients variable
+    Drops reference to slab block held by large payload 'msg', when
+    message won't be delivered to one of its recipients. Does nothing for
+    any other message.
    ========================================================================== */
 
 
-static unsigned char psmqd_broker_get_free_client(void)
+static void psmqd_broker_shm_drop
+(
+	const struct psmq_msg  *msg    /* message that won't be delivered */
+)
 {
-	int  fd;  /* number of free slot in clients */
+	struct psmq_shm_desc    desc;  /* descriptor of payload in slab */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	for (fd = 0; fd != PSMQ_MAX_CLIENTS; ++fd)
-		if (clients[fd].mq == (mqd_t)-1)
-			return fd; /* mq not set, slot available */
+	if (msg->ctrl.cmd != PSMQ_CTRL_CMD_PUBLISH_SHM)
+		return;
 
-	/* all slots are used */
-	return UCHAR_MAX;
+	memcpy(&desc, msg->data + strlen(msg->data) + 1, sizeof(desc));
+	psmq_shm_ref(slab, psmq_shm_block(slab, &desc), -1);
 }
 
 
 /* ==========================================================================
-    Checks if published topic matches subscribed topic
+    Grows clients and targets arrays twice, but no more than up to
+    PSMQ_MAX_CLIENTS elements. New slots are marked as not connected.
+    Arrays may be moved, so no one can hold pointer to client across
+    call to this function, that's why it must be called with wlock held.
+    Bitmaps of clients and wready list are grown to match.
 
-    Return 0 when there is NO match, and 1 when they matches.
+    errno:
+            ENOSPC      arrays already have PSMQ_MAX_CLIENTS elements
+            ENOMEM      not enough memory to grow arrays
    ========================================================================== */
 
 
-static int psmqd_broker_topic_matches
-(
-	const char  *pub_topic,  /* topic message was publish with */
-	const char  *sub_topic   /* client's subscribe topic (may contain * or + */
-)
+static int psmqd_broker_grow_clients(void)
 {
-	char        *pubts;      /* saveptr of pubt for strtok_r */
-	char        *subts;      /* saveptr of subt for strtok_r */
-	char        *pubtok;     /* current token of pub topic */
-	char        *subtok;     /* current token of sub topic */
-	char         pubt[PSMQ_MSG_MAX];  /* copy of pub_topic */
-	char         subt[PSMQ_MSG_MAX];  /* copy of sub_topic */
+	int              n;     /* new number of slots */
+	int              i;     /* iterator */
+	int              head;  /* clients in wready before end of array */
+	struct client   *c;     /* grown clients array */
+	struct target   *t;     /* grown targets array */
+	unsigned long   *bm;    /* grown bitmap */
+	unsigned short  *w;     /* grown wready list */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	/* topics are equal, no need to parse them */
-	if (strcmp(pub_topic, sub_topic) == 0)
-		return 1;
+	VALID(ENOSPC, nslots < PSMQ_MAX_CLIENTS);
 
-	strcpy(pubt, pub_topic);
-	strcpy(subt, sub_topic);
+	n = nslots ? nslots * 2 : PSMQD_CLIENTS_MIN;
+	if (n > PSMQ_MAX_CLIENTS)
+		n = PSMQ_MAX_CLIENTS;
 
-	/* first tokenize will always be valid, since
-	 * all topics must start from '/' and this is
-	 * checked before this function is called */
+	/* when second realloc fails, clients stays bigger than
+	 * nslots, which does no harm, it will be realloced again */
+	if ((c = realloc(clients, n * sizeof(*clients))) == NULL)
+		return -1;
+	clients = c;
 
-	pubtok = strtok_r(pubt, "/", &pubts);
-	subtok = strtok_r(subt, "/", &subts);
+	if ((t = realloc(targets, n * sizeof(*targets))) == NULL)
+		return -1;
+	targets = t;
 
-	/* let's iterate through all parts of the topic */
-	while(pubtok && subtok)
-	{
-		if (strcmp(subtok, "*") == 0)
-		{
-			/* path is equal up until now, and
-			 * current token is '*' so we can stop
-			 * parsing now and treat topics as
-			 * matching.
-			 *
-			 * Note, '*' was replaces with '@' to
-			 * make compilers happy.  A little
-			 * quiz, guess why?
-			 *
-			 * Examples of matching topics:
-			 *
-			 *      pub: /a/b/c/d
-			 *      sub: /a/b/@
-			 *
-			 *      pub: /a/b/c/d
-			 *      sub: /a/@
-			 *
-			 *      pub: /a/b/c/d
-			 *      sub: /@
-			 */
+	bm = realloc(cused, psmq_bm_words(n) * sizeof(*cused));
+	if (bm == NULL)
+		return -1;
+	cused = bm;
 
-			return 1;
-		}
+	/* bits past nslots in last old word are already clear */
+	for (i = PSMQD_CUSED_WORDS; i != (int)psmq_bm_words(n); ++i)
+		cused[i] = 0;
 
-		if (strcmp(subtok, "+") == 0)
-		{
-			/* path is equal up intil now, and
-			 * current token is '+' so we treat
-			 * whole token as valid and continue
-			 * for the next one.
-			 *
-			 * Examples of matching topics:
-			 *
-			 *      pub: /a/b/c/d
-			 *      sub: /+/b/c/d
-			 *
-			 *      pub: /a/b/c/d
-			 *      sub: /a/b/+/d
-			 *
-			 *      pub: /a/b/c/d
-			 *      sub: /a/b/c/+
-			 */
+	/* zeroed by psmqd_broker_route_match() before use */
+	bm = realloc(rmatched, psmq_bm_words(n) * sizeof(*rmatched));
+	if (bm == NULL)
+		return -1;
+	rmatched = bm;
 
-			pubtok = strtok_r(NULL, "/", &pubts);
-			subtok = strtok_r(NULL, "/", &subts);
-			continue;
-		}
+	/* wready is a ring, it cannot be realloced in place as
+	 * it may wrap around its end, so clients are copied
+	 * to new list in order, starting from its beginning */
+	if ((w = malloc(n * sizeof(*wready))) == NULL)
+		return -1;
 
-		if (strcmp(subtok, pubtok) != 0)
-			return 0; /* topics don't match */
+	head = wready_n;
+	if (wready_head + wready_n > nslots)
+		head = nslots - wready_head;
 
-		/* tokens are valid, take another token
-		 * and continue with the checks */
-		pubtok = strtok_r(NULL, "/", &pubts);
-		subtok = strtok_r(NULL, "/", &subts);
+	if (wready_n)
+	{
+		memcpy(w, wready + wready_head, head * sizeof(*wready));
+		memcpy(w + head, wready, (wready_n - head) * sizeof(*wready));
 	}
 
-	/* we get here when we read all tokenes from
-	 * either pub topic or sub topic */
+	free(wready);
+	wready = w;
+	wready_head = 0;
 
-	/* if both sub topic and pub topic were fully
-	 * tokenized and they match, topics are equal */
-	if (subtok == pubtok)
-		return 1;
+	for (i = nslots; i != n; ++i)
+	{
+		memset(&clients[i], 0x00, sizeof(clients[i]));
+		memset(&targets[i], 0x00, sizeof(targets[i]));
+		clients[i].mq = (mqd_t)-1;
+	}
 
-	/* only one of the sub topic or pub topic was
-	 * tokenized fully, so these topics don't match */
+	el_oprint(OELI, "client table grown from %d to %d slots", nslots, n);
+	nslots = n;
 	return 0;
 }
 
 
 /* ==========================================================================
-    Sends message to the client with 'mq' mqueue
+    Finds first free slot in clients variable, that is lower than 'max'.
+    Zero bits in cused are found with ctz, so it costs the same no matter
+    how many clients are connected. When all slots are taken, clients
+    table is grown.
 
-    On error -1 is returned and client session is closed. On success 0 will
-    be returned.
+    Returns free slot, or USHRT_MAX when there is none.
+
+    errno:
+            ENOSPC      all slots below max are taken
+            ENOMEM      clients table is full and cannot be grown
    ========================================================================== */
 
 
-static int psmqd_broker_reply_mq
+static unsigned short psmqd_broker_get_free_client
 (
-	mqd_t            mq,       /* mqueue of client to send message to */
-	char             cmd,      /* command to which reply applies */
-	unsigned char    data,     /* errno reply */
-	const char      *topic,    /* topic to send message with */
-	const void      *payload,  /* data to send to the client */
-	unsigned         paylen,   /* length of payload to send */
-	unsigned int     prio,     /* message priority */
-	unsigned short   timeout   /* timeout in milliseconds */
+	int            max    /* free slot must be lower than that */
 )
 {
-	struct psmq_msg  msg;      /* structure with message to send */
-	struct timespec  tp;       /* absolute time when mq_send() call expire */
-	unsigned         topiclen; /* length of topic */
+	int            fd;    /* number of free slot in clients */
+	int            i;     /* current word of cused */
+	unsigned long  word;  /* not connected slots of current word */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	memset(&msg, 0x00, sizeof(msg));
-	msg.ctrl.cmd = cmd;
-	msg.ctrl.data = data;
-	msg.paylen = paylen;
-	topiclen = 0;
+	if (max > PSMQ_MAX_CLIENTS)
+		max = PSMQ_MAX_CLIENTS;
 
-	if (topic)
+	/* clear bit means slot is available, but with delivery
+	 * threads previous client may still have messages (and
+	 * close reply) waiting for him, slot can be reused only
+	 * after all of them are sent */
+	pthread_mutex_lock(&wlock);
+	for (i = 0; i != PSMQD_CUSED_WORDS; ++i)
 	{
-		topiclen = strlen(topic) + 1;
-		strcpy(msg.data, topic);
+		for (word = ~cused[i]; word; word &= word - 1)
+		{
+			/* slots past end of table are not
+			 * connected, but they don't exist yet */
+			fd = i * PSMQ_BM_BITS + psmq_bm_ctz(word);
+			if (fd >= nslots || fd >= max)
+				break;
+
+			if (clients[fd].qcount == 0 && clients[fd].busy == 0)
+			{
+				pthread_mutex_unlock(&wlock);
+				return fd;
+			}
+		}
 	}
 
-	if (payload && paylen)
-		memcpy(msg.data + topiclen, payload, paylen);
+	/* all slots are used, first of new ones is
+	 * the one we take, if there is any */
+	fd = nslots;
+	if (fd >= max)
+		errno = ENOSPC;
+	else if (psmqd_broker_grow_clients() == 0)
+	{
+		pthread_mutex_unlock(&wlock);
+		return fd;
+	}
+	pthread_mutex_unlock(&wlock);
 
-	/* send data to client, but do not wait if its queue
-	 * is full, if it cannot process messages quick enough
-	 * it does not deserve new message */
-	psmq_ms_to_tp(timeout, &tp);
-	return mq_timedsend(mq, (char *)&msg, psmq_real_msg_size(msg), prio, &tp);
+	return USHRT_MAX;
 }
 
 
 /* ==========================================================================
-    Same as psmqd_broker_reply_mq() but accepts fd instead of mqueue. Will
-    also increment missed_pubs counter when message could not have been
-    delivered to the client.
+    Adds client 'fd' subscription 'sub' to the routing structures. Exact
+    topics go into topic map, where they can be found with single hash
+    lookup, and topics with wildcards go into subscription tree.
    ========================================================================== */
 
 
-static int psmqd_broker_reply
+static int psmqd_broker_route_add
 (
-	int           fd,       /* fd of client to send message to */
-	char          cmd,      /* command to which reply applies */
-	unsigned char data,     /* errno reply */
-	const char   *topic,    /* topic to send message with */
-	const void   *payload,  /* data to send to the client */
-	unsigned      paylen,   /* length of payload to send */
-	unsigned int  prio      /* message priority */
+	const struct psmqd_tl  *sub,  /* compiled subscription topic */
+	unsigned short          fd    /* client subscribing to topic */
 )
 {
-	if (psmqd_broker_reply_mq(clients[fd].mq, cmd,
-			data,topic, payload, paylen, prio, clients[fd].reply_timeout) == 0)
-	{
-		clients[fd].missed_pubs = 0;
-		return 0;
-	}
+	++routegen;
+	if (sub->has_wildcard)
+		return psmqd_st_add(&subtree, sub, fd);
 
-	clients[fd].missed_pubs += 1;
-	return -1;
+	return psmqd_tm_add(&topicmap, sub, fd);
 }
 
 
 /* ==========================================================================
-    Same as psmqd_broker_reply_mq() but used to reply to control requests.
-    These replies holds no data but control bytes.
+    Removes client 'fd' subscription 'sub' from the routing structures
    ========================================================================== */
 
 
-static int psmqd_broker_reply_ctrl
+static int psmqd_broker_route_delete
 (
-	int           fd,       /* fd of client to send message to */
-	char          cmd,      /* command to which reply applies */
-	unsigned char data,     /* errno reply */
-	const char   *extra     /* extra string data to send back to client */
+	const struct psmqd_tl  *sub,  /* compiled subscription topic */
+	unsigned short          fd    /* client unsubscribing from topic */
 )
 {
-	return psmqd_broker_reply(fd, cmd, data, extra, NULL, 0, 0);
-}
+	++routegen;
+	if (sub->has_wildcard)
+		return psmqd_st_delete(&subtree, sub, fd);
 
-
-/* ==========================================================================
-                                                       __
-                _____ ___   ____ _ __  __ ___   _____ / /_ _____
-               / ___// _ \ / __ `// / / // _ \ / ___// __// ___/
-              / /   /  __// /_/ // /_/ //  __/(__  )/ /_ (__  )
-             /_/    \___/ \__, / \__,_/ \___//____/ \__//____/
-                            /_/
-   ========================================================================== */
+	return psmqd_tm_delete(&topicmap, sub, fd);
+}
 
 
 /* ==========================================================================
-    Open connection with the broker
-    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-
-    request:
-            ctrl.cmd    char    PSMQ_CTRL_CMD_OPEN
-            ctrl.data   uchar   ignored
-            data        str     queue name where messages will be sent
-
-    response:
-            ctrl.cmd    char    PSMQ_CTRL_CMD_OPEN
-            ctrl.data   uchar   0 on success, or errno
-            data
-                fd      uchar   file descriptor to use when communicating,
-                                field is valid only when ctrl.data is 0
-
-    note:
-            yes, errno is int, so max value of errno is 32767, but this is
-            designed for embedded with small memory footprint, and mqueue
-            always allocates all memory for all possible messages on the
-            queue, so it is by design, to keep these messages as small as
-            possible, thus errno can be max 255. Sometimes this may bite,
-            when errno is bigger than 255. In such case, any errno bigger
-            than 255 will get truncated to 255.
+    Makes sure 'route' has room for at least 'n' clients.
 
-            This will also limit max clients up to 255. Yeah, like someone
-            is going to have 255 different processes with different psmq
-            clients in their embedded systems. Btw, I know someone will hit
-            this. If you happened to do so, you can freely email me and
-            laugh into my face for such ridiculous limitation.
+    errno:
+            ENOMEM      not enough memory to grow route
    ========================================================================== */
 
 
-static int psmqd_broker_open
+static int psmqd_broker_route_reserve
 (
-	struct psmq_msg  *msg      /* msg with queue name to open */
+	struct route    *route,  /* route to grow */
+	int              n       /* number of clients route must hold */
 )
 {
-	mqd_t             qc;      /* new communication queue */
-	unsigned char     fd;      /* new file descriptor for the client */
-	char             *qname;   /* queue name to open */
+	unsigned short  *fds;    /* grown list of clients */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-	/* qname validated for null
-	 * termination during reception */
-	qname = msg->data;
 
-	/* open communication line with client */
-	qc = mq_open(qname, O_RDWR);
-	if (qc == (mqd_t)-1)
-	{
-		/* couldn't open queue provided by client and thus we have
-		 * no way of informing him about error, so we only log this
-		 * and abort this session */
-		el_operror(OELC, "open failed: mq_open(%s)", qname);
-		return -1;
-	}
+	if (n <= route->size)
+		return 0;
 
-	fd = psmqd_broker_get_free_client();
-	if (fd == UCHAR_MAX)
-	{
-		/* all slots are taken, send error information to the client */
-		el_oprint(OELW, "open failed client %s: no free slots", qname);
-		psmqd_broker_reply_mq(qc, PSMQ_CTRL_CMD_OPEN, ENOSPC,
-				NULL, NULL, 0, 0, 0);
-		mq_close(qc);
+	if ((fds = realloc(route->fds, n * sizeof(*fds))) == NULL)
 		return -1;
-	}
-
-	clients[fd].mq = qc;
-
-	/* we have free slot and all data has been allocated, send
-	 * client file descriptor he can use to control communication */
-	if (psmqd_broker_reply_mq(qc, PSMQ_CTRL_CMD_OPEN,
-				0, NULL, &fd, 1, 0, 0) == 0)
-	{
-		el_oprint(OELN, "[%3d] opened %s", fd, qname);
-		return 0;
-	}
 
-	/* for some reason we couldn't send fd to client, log it
-	 * and cleanup this mess */
-	el_operror(OELW, "couldn't send fd to client %s", qname);
-	mq_close(qc);
-	clients[fd].mq = (mqd_t)-1;
-	return -1;
+	route->fds = fds;
+	route->size = n;
+	return 0;
 }
 
 
 /* ==========================================================================
-    Subscribes to topic in message payload
-    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-
-    request:
-            ctrl.cmd    char    PSMQ_CTRL_CMD_SUBSCRIBE
-            ctrl.data   uchar   file descriptor
-            data        str     topic to subscribe to
+    Finds all clients that are interested in message on 'topic' and marks
+    them in 'route'. Client is marked only once, even when more than one
+    of his subscriptions match, for example when topic is /a/s/d and
+    client subscribed to /a/s/d and /a/s/+, so we don't send him same
+    message twice.
 
-    response
-            ctrl.cmd    char    PSMQ_CTRL_CMD_SUBSCRIBE
-            ctrl.data   uchar   0 on success, otherwise errno
-            data        -       topic used tried to subscribe to
+    When there is no memory for all matched clients, route is left
+    empty, so message goes nowhere.
 
-    errno for response:
-            EBADMSG     payload is not a string or not a valid topic
-            UCHAR_MAX   returned errno from system is bigger than UCHAR_MAX
+    errno:
+            ENOMEM      not enough memory to grow route
    ========================================================================== */
 
 
-static int psmqd_broker_subscribe
+static int psmqd_broker_route_match
 (
-	struct psmq_msg  *msg         /* subscription request */
+	const char     *topic,  /* topic message is published on */
+	unsigned long   hash,   /* psmqd_tl_hash() of topic */
+	struct route   *route   /* matched clients will be stored here */
 )
 {
-	unsigned char     fd;         /* clients file descriptor */
-	unsigned char     err;        /* errno value to send to client */
-	char             *stopic;     /* subscribe topic from client */
-	char             *stopicsave; /* saved pointer of stopic */
-	unsigned          stopiclen;  /* length of stopic */
+	unsigned long   word;   /* bits of matched not yet packed */
+	int             i;      /* current word of matched */
+	int             n;      /* number of matched clients */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-	fd = msg->ctrl.data;
-	stopic = msg->data;
-	stopiclen = strlen(stopic);
-	err = 0;
 
-	if (stopiclen < 2)
-	{
-		el_oprint(OELW, "[%3d] subscribe error, topic '%s' too short %u",
-				fd, stopic, stopiclen);
-		err = EBADMSG;
-	}
-	else if (msg->paylen != 0)
+	/* subscribed clients are connected, so
+	 * they all are below nslots */
+	route->n = 0;
+	if (nslots == 0)
+		return 0;
+
+	memset(rmatched, 0x00, PSMQD_CUSED_WORDS * sizeof(*rmatched));
+	psmqd_tm_match(&topicmap, topic, hash, rmatched);
+	psmqd_st_match(subtree, topic, rmatched);
+
+	for (i = 0, n = 0; i != PSMQD_CUSED_WORDS; ++i)
+		n += psmq_bm_count(rmatched[i]);
+
+	if (psmqd_broker_route_reserve(route, n) != 0)
+		return -1;
+
+	/* pack matched clients into fds, empty words are
+	 * skipped as a whole */
+	for (i = 0; i != PSMQD_CUSED_WORDS; ++i)
+		for (word = rmatched[i]; word; word &= word - 1)
+			route->fds[route->n++] = i * PSMQ_BM_BITS + psmq_bm_ctz(word);
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Creates route cache for 'size' topics. All entries start unused, and
+    are put on lru list, so they are taken from its end as topics come.
+   ========================================================================== */
+
+
+static int psmqd_broker_rcache_create
+(
+	int             size      /* number of topics to cache */
+)
+{
+	int             i;        /* iterator */
+	unsigned long   nbuckets; /* number of hash buckets */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* at least as many buckets as entries, and power
+	 * of 2, so bucket can be found with simple mask */
+	for (nbuckets = 1; nbuckets < (unsigned long)size; nbuckets <<= 1)
+		;
+
+	rcache = malloc(size * sizeof(*rcache));
+	rbuckets = malloc(nbuckets * sizeof(*rbuckets));
+	if (rcache == NULL || rbuckets == NULL)
 	{
-		el_oprint(OELW, "[%3d] subscribe error, message contains extra data", fd);
-		err = EBADMSG;
+		el_operror(OELF, "failed to allocate route cache");
+		free(rcache);
+		free(rbuckets);
+		rcache = NULL;
+		rbuckets = NULL;
+		return -1;
 	}
-	else if (stopic[0] != '/')
+
+	for (i = 0; i != size; ++i)
 	{
-		el_oprint(OELW, "[%3d] subscribe error, topic %s must start with '/'",
-				fd, stopic);
-		err = EBADMSG;
+		rcache[i].topic = NULL;
+		rcache[i].prev = i - 1;
+		rcache[i].next = i + 1 == size ? -1 : i + 1;
+		rcache[i].chain = -1;
+		rcache[i].route.n = 0;
+		rcache[i].route.size = 0;
+		rcache[i].route.fds = NULL;
 	}
-	else if (stopic[stopiclen - 1] == '/')
+
+	for (i = 0; i != (int)nbuckets; ++i)
+		rbuckets[i] = -1;
+
+	rmask = nbuckets - 1;
+	rmru = 0;
+	rlru = size - 1;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Frees route cache and all topics in it
+   ========================================================================== */
+
+
+static void psmqd_broker_rcache_destroy(void)
+{
+	int  i;  /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (rcache == NULL)
+		return;
+
+	for (i = 0; i != g_psmqd_cfg.broker_route_cache; ++i)
 	{
-		el_oprint(OELW, "[%3d] subscribe error, topic %s cannot end with '/'",
-				fd, stopic);
-		err = EBADMSG;
+		free(rcache[i].topic);
+		free(rcache[i].route.fds);
 	}
-	else
+
+	free(rcache);
+	free(rbuckets);
+	rcache = NULL;
+	rbuckets = NULL;
+}
+
+
+/* ==========================================================================
+    Returns route of 'topic' from cache. When topic is not cached, least
+    recently used entry is reused for it. Route is resolved again when
+    routing has changed since it was cached. Returned pointer is valid
+    until next call.
+
+    Returns NULL only when there is no memory for new topic or its route,
+    in which case caller should match topic on its own.
+   ========================================================================== */
+
+
+static const struct route *psmqd_broker_rcache_get
+(
+	const char     *topic,   /* topic to find route for */
+	unsigned long   hash     /* psmqd_tl_hash() of topic */
+)
+{
+	int             i;       /* cache entry with topic */
+	int            *link;    /* link pointing to entry in chain */
+	char           *copy;    /* memory for new topic */
+	struct rcache  *e;       /* cache entry with topic */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = rbuckets[hash & rmask]; i != -1; i = rcache[i].chain)
+		if (rcache[i].hash == hash && strcmp(rcache[i].topic, topic) == 0)
+			break;
+
+	if (i == -1)
 	{
-		for (stopicsave = stopic; *stopic != '\0'; ++stopic)
+		/* not in cache, evict least recently used entry,
+		 * realloc() will reuse memory of old topic when
+		 * new one fits in it */
+		i = rlru;
+		e = &rcache[i];
+		if ((copy = realloc(e->topic, strlen(topic) + 1)) == NULL)
+			return NULL;
+
+		if (e->topic)
 		{
-			if (*stopic == '/' && *(stopic + 1) == '/')
-			{
-				el_oprint(OELW, "[%3d] subscribe error, topic '%s' cannot "
-						"contain two '/' in a row", fd, stopicsave);
-				err = EBADMSG;
-				break;
-			}
+			for (link = &rbuckets[e->hash & rmask]; *link != i;)
+				link = &rcache[*link].chain;
+
+			*link = e->chain;
 		}
 
-		stopic = stopicsave;
+		strcpy(copy, topic);
+		e->topic = copy;
+		e->hash = hash;
+		e->gen = routegen - 1;
+		e->chain = rbuckets[hash & rmask];
+		rbuckets[hash & rmask] = i;
 	}
 
-	if (err)
+	e = &rcache[i];
+
+	/* subscriptions changed since we've last
+	 * looked, subscribers need to be found again */
+	if (e->gen != routegen)
 	{
-		psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_SUBSCRIBE, err, stopic);
-		return -1;
+		if (psmqd_broker_route_match(e->topic, hash, &e->route) != 0)
+			return NULL;
+
+		e->gen = routegen;
+	}
+
+	/* move entry to the front of lru list */
+	if (i != rmru)
+	{
+		rcache[e->prev].next = e->next;
+		if (e->next != -1)
+			rcache[e->next].prev = e->prev;
+		else
+			rlru = e->prev;
+
+		e->prev = -1;
+		e->next = rmru;
+		rcache[rmru].prev = i;
+		rmru = i;
 	}
 
+	return &e->route;
+}
+
+
+/* ==========================================================================
+    Frees all aliases of client 'fd'
+   ========================================================================== */
+
+
+static void psmqd_broker_alias_destroy
+(
+	int  fd   /* client to free aliases for */
+)
+{
+	int  i;   /* current alias */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
 
-	if (psmqd_tl_add(&clients[fd].topics, stopic) != 0)
+	if (clients[fd].aliases == NULL)
+		return;
+
+	for (i = 0; i != PSMQ_MAX_ALIASES; ++i)
 	{
-		/* subscription failed */
-		err = errno < UCHAR_MAX ? errno : UCHAR_MAX;
-		el_operror(OELW, "[%3d] failed to add topic to list", fd);
-		psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_SUBSCRIBE, err, stopic);
-		return -1;
+		free(clients[fd].aliases[i].topic);
+		free(clients[fd].aliases[i].route.fds);
 	}
 
-	psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_SUBSCRIBE, 0, stopic);
-	el_oprint(OELN, "[%3d] subscribed to %s", fd, stopic);
-	return 0;
+	free(clients[fd].aliases);
+	clients[fd].aliases = NULL;
 }
 
 
 /* ==========================================================================
-    Unsubscribes client from specified topic
-    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    Puts time elapsed since 'start' into routing time histogram. Does
+    nothing when stats are disabled.
+   ========================================================================== */
 
-    request:
-            ctrl.cmd    char    PSMQ_CTRL_CMD_UNSUBSCRIBE
-            ctrl.data   uchar   file descriptor of the client
-            data        str     string with topic to unsubscribe
 
-    response
-            ctrl.cmd    char    PSMQ_CTRL_CMD_UNSUBSCRIBE
-            ctrl.data   uchar   0 on success, otherwise errno
-            data        -       none
+static void psmqd_broker_stats_time
+(
+	unsigned long   start   /* psmq_mono_us() when routing started */
+)
+{
+	unsigned long   us;     /* time spent on routing */
+	unsigned int    i;      /* histogram bucket */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-    errno:
-            UCHAR_MAX   returned errno from system is bigger than UCHAR_MAX
+
+	if (g_psmqd_cfg.broker_stats == 0)
+		return;
+
+	us = psmq_mono_us() - start;
+	for (i = 0; i != sizeof(stats.hist) / sizeof(*stats.hist) - 1; ++i)
+		if (us < 1ul << i)
+			break;
+
+	++stats.hist[i];
+}
+
+
+/* ==========================================================================
+    Sets limit of bucket 'b' to 'rate' messages per second, with bursts
+    of up to 'burst' messages. When 'burst' is 0, it's the same as rate.
+    Bucket starts full.
    ========================================================================== */
 
 
-static int psmqd_broker_unsubscribe
+static void psmqd_broker_bucket_set
 (
-	struct psmq_msg  *msg     /* messages request */
+	struct bucket  *b,      /* bucket to set */
+	unsigned int    rate,   /* messages per second, 0 for no limit */
+	unsigned int    burst   /* max messages at once */
 )
 {
-	unsigned char     fd;     /* client's file descriptor */
-	unsigned char     err;    /* error to send to client as reply */
-	char             *utopic; /* topic to unsubscribe */
+	b->rate = rate;
+	b->burst = burst ? burst : rate;
+	b->tokens = b->burst * 1000ul;
+	b->last = psmq_mono_ms();
+}
+
+
+/* ==========================================================================
+    Takes single token from bucket 'b', after refilling it with tokens
+    that accumulated since last time.
+
+    Returns 0 when message may go, or -1 when it's over the limit.
+   ========================================================================== */
+
+
+static int psmqd_broker_bucket_take
+(
+	struct bucket  *b        /* bucket to take token from */
+)
+{
+	unsigned long   now;     /* current time */
+	unsigned long   elapsed; /* ms since last refill */
+	unsigned long   max;     /* full bucket */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	fd = msg->ctrl.data;
-	utopic = msg->data;
+	if (b->rate == 0)
+		return 0;
 
-	if (psmqd_tl_delete(&clients[fd].topics, utopic) != 0)
-	{
-		err = errno < UCHAR_MAX ? errno : UCHAR_MAX;
-		el_operror(OELW, "[%3d] unsubscribe failed, topic: %s", fd, utopic);
-		psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_UNSUBSCRIBE, err, utopic);
+	now = psmq_mono_ms();
+	elapsed = now - b->last;
+	b->last = now;
+	max = b->burst * 1000ul;
+
+	/* rate is in tokens per second, which is thousandths
+	 * of token per ms, check for long idle time first so
+	 * multiplication cannot overflow */
+	if (elapsed > max / b->rate)
+		b->tokens = max;
+	else
+		b->tokens += elapsed * b->rate;
+
+	if (b->tokens > max)
+		b->tokens = max;
+
+	if (b->tokens < 1000)
 		return -1;
-	}
 
-	el_oprint(OELN, "[%3d] unsubscribed %s", fd, utopic);
-	psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_UNSUBSCRIBE, 0, utopic);
+	b->tokens -= 1000;
 	return 0;
 }
 
 
 /* ==========================================================================
-    Closes connection with client and removes all resources alloceted by him
-    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    Fills 'msg' with reply data, returns number of bytes of 'msg' that
+    should be sent to the client.
+   ========================================================================== */
 
-    request:
-            ctrl.cmd    char    PSMQ_CTRL_CMD_CLOSE
-            ctrl.data   uchar   file descriptor of the client
-            data        -       none
 
-    response
-            ctrl.cmd    char    PSMQ_CTRL_CMD_CLOSE
-            ctrl.data   uchar   0 on success, otherwise errno
-            data        -       none
+static size_t psmqd_broker_msg_fill
+(
+	struct psmq_msg  *msg,      /* message to fill */
+	char              cmd,      /* command to which reply applies */
+	unsigned char     data,     /* errno reply */
+	const char       *topic,    /* topic to send message with */
+	const void       *payload,  /* data to send to the client */
+	unsigned          paylen    /* length of payload to send */
+)
+{
+	unsigned          topiclen; /* length of topic */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	memset(msg, 0x00, sizeof(*msg));
+	msg->ctrl.cmd = cmd;
+	msg->ctrl.data = data;
+	msg->paylen = paylen;
+	topiclen = 0;
+
+	if (topic)
+	{
+		topiclen = strlen(topic) + 1;
+		strcpy(msg->data, topic);
+	}
+
+	if (payload && paylen)
+		memcpy(msg->data + topiclen, payload, paylen);
+
+	return psmq_real_msg_size(*msg);
+}
+
+
+/* ==========================================================================
+    Sends message to the client with 'mq' mqueue
+
+    On error -1 is returned and client session is closed. On success 0 will
+    be returned.
    ========================================================================== */
 
 
-static int psmqd_broker_close
+static int psmqd_broker_reply_mq
 (
-	int  fd  /* client's file descriptor */
+	mqd_t            mq,       /* mqueue of client to send message to */
+	char             cmd,      /* command to which reply applies */
+	unsigned char    data,     /* errno reply */
+	const char      *topic,    /* topic to send message with */
+	const void      *payload,  /* data to send to the client */
+	unsigned         paylen,   /* length of payload to send */
+	unsigned int     prio,     /* message priority */
+	unsigned short   timeout   /* timeout in milliseconds */
 )
 {
-	/* first, zero out missed_pubs or else we risk
-	 * infinite recursive loop when sending close
-	 * command to client triggers close function
-	 * over and over again until all that is right
-	 * and good is dead */
-	clients[fd].missed_pubs = 0;
+	struct psmq_msg  msg;      /* structure with message to send */
+	struct timespec  tp;       /* absolute time when mq_send() call expire */
+	size_t           len;      /* number of bytes to send */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-	/* send reply to broker we processed his close
-	 * request, yes we lie to him, but we won't be
-	 * able to ack him after we close communication
-	 * queue */
-	psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_CLOSE, 0, NULL);
 
-	/* first delete all topics client is subscribed to */
-	psmqd_tl_destroy(clients[fd].topics);
+	len = psmqd_broker_msg_fill(&msg, cmd, data, topic, payload, paylen);
 
-	/* then close mq and set it to -1 to indicate
-	 * slot is free for next client */
-	mq_close(clients[fd].mq);
-	clients[fd].mq = (mqd_t)-1;
-	clients[fd].topics = NULL;
-	el_oprint(OELN, "[%3d] closed, bye bye", fd);
+	/* send data to client, but do not wait if its queue
+	 * is full, if it cannot process messages quick enough
+	 * it does not deserve new message */
+	psmq_ms_to_tp(timeout, &tp);
+	return mq_timedsend(mq, (char *)&msg, len, prio, &tp);
+}
 
-	return 0;
+
+/* ==========================================================================
+    Creates pending copy of first 'len' bytes of 'msg'. Returned message
+    has one reference that belongs to the caller, it must be dropped with
+    psmqd_broker_pending_put() after message is queued to all clients.
+
+    Returns NULL when there is no memory.
+   ========================================================================== */
+
+
+static struct pending *psmqd_broker_pending_dup
+(
+	const struct psmq_msg  *msg,   /* message to copy */
+	size_t                  len,   /* number of bytes to send */
+	unsigned int            prio   /* message priority */
+)
+{
+	struct pending         *p;     /* new pending message */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* message can be really small compared to struct
+	 * psmq_msg, so allocate only what will be sent */
+	p = malloc(offsetof(struct pending, msg) + len);
+	if (p == NULL)
+		return NULL;
+
+	memcpy(&p->msg, msg, len);
+	p->refs = 1;
+	p->prio = prio;
+	p->close = 0;
+	p->len = len;
+	return p;
 }
 
 
 /* ==========================================================================
-    Process published message by one of the clients and send it to all
-    interested parties.
-    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    Same as psmqd_broker_pending_dup() but builds message from its parts
+   ========================================================================== */
 
-    request:
-            ctrl.cmd    char    PSMQ_CTRL_CMD_PUBLISH
-            ctrl.data   uchar   file descriptor of requesting client
-            paylen      uint    size of data.payload
-            data
-                topic   str     topic to publish message on
-                payload any     data to publish
 
-    response:
-            none        -       psmq doesn't use any id to identify messages
-                                so OK response to publishing client is quite
-                                pointless, as he wouldn't know which message
-                                has been accepted.
+static struct pending *psmqd_broker_pending_new
+(
+	char             cmd,      /* command to which reply applies */
+	unsigned char    data,     /* errno reply */
+	const char      *topic,    /* topic to send message with */
+	const void      *payload,  /* data to send to the client */
+	unsigned         paylen,   /* length of payload to send */
+	unsigned int     prio      /* message priority */
+)
+{
+	struct psmq_msg  msg;      /* message to send */
+	size_t           len;      /* number of bytes to send */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	len = psmqd_broker_msg_fill(&msg, cmd, data, topic, payload, paylen);
+	return psmqd_broker_pending_dup(&msg, len, prio);
+}
+
+
+/* ==========================================================================
+    Drops one reference of message 'p', and frees it if that was the last
+    one.
+   ========================================================================== */
+
+
+static void psmqd_broker_pending_put
+(
+	struct pending  *p    /* message to drop reference of */
+)
+{
+	unsigned int     refs; /* references left on p */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	pthread_mutex_lock(&wlock);
+	refs = --p->refs;
+	pthread_mutex_unlock(&wlock);
+
+	if (refs == 0)
+		free(p);
+}
+
+
+/* ==========================================================================
+    Looks for undelivered publish on the same topic as 'p' in client's 'c'
+    queue, and when there is one, puts 'p' in its place. Message keeps
+    place in queue of the one it replaced, so client that is not keeping
+    up gets at most one message per topic. Must be called with wlock held
+    when delivery threads are used.
+
+    Returns 1 when message was replaced, 0 when there was nothing to
+    replace and 'p' must be queued as usual.
+   ========================================================================== */
+
+
+static int psmqd_broker_conflate
+(
+	struct client    *c,     /* client to look for messages of */
+	struct pending   *p      /* newer message */
+)
+{
+	struct delivery  *d;     /* message in client's queue */
+	struct pending   *old;   /* message being replaced */
+	int               i;     /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != c->qcount; ++i)
+	{
+		d = &c->queue[(c->qhead + i) % qsize];
+		old = d->msg;
+
+		/* replies to client's requests carry topic
+		 * too, but these must never be lost */
+		if (old->msg.ctrl.cmd != PSMQ_CTRL_CMD_PUBLISH &&
+				old->msg.ctrl.cmd != PSMQ_CTRL_CMD_PUBLISH_SHM)
+			continue;
+
+		if (strcmp(old->msg.data, p->msg.data) != 0)
+			continue;
+
+		/* old message will never reach client */
+		psmqd_broker_shm_drop(&old->msg);
+		if (--old->refs == 0)
+			free(old);
+
+		d->msg = p;
+		p->refs += 1;
+		++stats.conflated;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Puts client 'fd' at the end of wready list and wakes up one of the
+    delivery threads to deal with it. Must be called with wlock held.
+   ========================================================================== */
+
+
+static void psmqd_broker_ready_push
+(
+	int  fd  /* client with messages waiting for delivery */
+)
+{
+	wready[(wready_head + wready_n) % nslots] = fd;
+	wready_n += 1;
+	clients[fd].ready = 1;
+	pthread_cond_signal(&wcond);
+}
+
+
+/* ==========================================================================
+    Puts message 'p' on client's 'fd' delivery queue, from where it will be
+    sent by one of the delivery threads.
+
+    When client's queue is full, we wait up to client's reply_timeout for
+    thread to make room in it, just like we would wait in mq_timedsend()
+    if we were sending message directly. If there is still no room after
+    that, message is dropped and counted as missed pub. Last slot of the
+    queue is reserved for close message, so client can always be closed.
+
+    When 'conflate' is set, message replaces older one on the same topic
+    that is still waiting in the queue, if there is any.
+
+    Returns 0 when message was queued and -1 when it was dropped.
+   ========================================================================== */
+
+
+static int psmqd_broker_queue
+(
+	int               fd,    /* client to send message to */
+	struct pending   *p,     /* message to send */
+	int               conflate /* replace older message on the topic */
+)
+{
+	struct client    *c;     /* client to send message to */
+	struct delivery  *d;     /* free slot in client's queue */
+	struct timespec   tp;    /* absolute time when waiting for room expire */
+	int               max;   /* number of slots we can use */
+	int               ret;   /* return code */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	c = &clients[fd];
+	max = p->close ? qsize : qsize - 1;
+	ret = -1;
+
+	pthread_mutex_lock(&wlock);
+	if (conflate && c->missed_pubs < PSMQ_MAX_MISSED_PUBS &&
+			psmqd_broker_conflate(c, p))
+	{
+		/* older value was still waiting, and now it's
+		 * gone, so there is no need to wait for room */
+		pthread_mutex_unlock(&wlock);
+		return 0;
+	}
+
+	if (c->qcount >= max && p->close == 0)
+	{
+		psmq_ms_to_tp(c->reply_timeout, &tp);
+		while (c->qcount >= max &&
+				c->missed_pubs < PSMQ_MAX_MISSED_PUBS)
+			if (pthread_cond_timedwait(&wroom, &wlock, &tp) == ETIMEDOUT)
+				break;
+	}
+
+	if (p->close == 0 && c->missed_pubs >= PSMQ_MAX_MISSED_PUBS)
+	{
+		/* client is dead, there is no point in queueing
+		 * anything more for him, caller should close him */
+		errno = EPIPE;
+	}
+	else if (c->qcount < max)
+	{
+		d = &c->queue[(c->qhead + c->qcount) % qsize];
+		d->msg = p;
+		d->mq = c->mq;
+		d->timeout = c->reply_timeout;
+		c->qcount += 1;
+		p->refs += 1;
+
+		/* when client is busy, thread that is sending to
+		 * him now will put him back on the list */
+		if (c->busy == 0 && c->ready == 0)
+			psmqd_broker_ready_push(fd);
+
+		ret = 0;
+	}
+	else
+	{
+		c->missed_pubs += 1;
+		errno = EAGAIN;
+	}
+	pthread_mutex_unlock(&wlock);
+
+	return ret;
+}
+
+
+/* ==========================================================================
+    Returns number of missed pubs by client 'fd'
+   ========================================================================== */
+
+
+static unsigned char psmqd_broker_missed_pubs
+(
+	int            fd    /* client to check */
+)
+{
+	unsigned char  n;    /* number of missed pubs */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	pthread_mutex_lock(&wlock);
+	n = clients[fd].missed_pubs;
+	pthread_mutex_unlock(&wlock);
+	return n;
+}
+
+
+/* ==========================================================================
+    Asks main loop to close client 'fd' that is assumed dead, delivery
+    threads cannot do it themselves, as routing belongs to the main loop.
+    Broker won't wait if its queue is full, in such case client will be
+    closed on next publish to him.
+   ========================================================================== */
+
+
+static void psmqd_broker_request_kill
+(
+	int              fd    /* client to close */
+)
+{
+	struct psmq_req  req;  /* kill request */
+	struct timespec  tp;   /* timeout for mq_timedsend(), 0 */
+	size_t           len;  /* number of bytes to send */
+	unsigned short   id;   /* fd of client to close */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* fd may not fit into ctrl.data, so request
+	 * is sent just like V2 client would send it */
+	id = fd;
+	len = psmqd_broker_msg_fill(&req.msg,
+			(char)(PSMQD_CTRL_CMD_KILL | PSMQ_CTRL_V2), 0, NULL, NULL, 0);
+	memcpy((char *)&req + len, &id, sizeof(id));
+	len += sizeof(id);
+	tp.tv_sec = 0;
+	tp.tv_nsec = 0;
+	mq_timedsend(qctrl, (char *)&req, len, 0, &tp);
+}
+
+
+/* ==========================================================================
+    Delivery thread. Takes first client from wready list and sends him his
+    oldest message. Only one thread serves a client at a time (busy flag),
+    so client receives messages in the same order they were queued, and
+    when client is slow, only one thread waits for him, while other
+    threads deliver messages to other clients.
+
+    Thread exits when wstop is set and there is nothing more to send.
+   ========================================================================== */
+
+
+static void *psmqd_broker_worker
+(
+	void             *arg    /* not used */
+)
+{
+	struct client    *c;     /* client we are sending to */
+	struct delivery   d;     /* message to send */
+	struct timespec   tp;    /* absolute time when mq_send() call expire */
+	int               fd;    /* client's file descriptor */
+	int               dead;  /* client is not reading his queue anymore */
+	int               ret;   /* return code from mq_timedsend() */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	(void)arg;
+
+	pthread_mutex_lock(&wlock);
+	for (;;)
+	{
+		while (wready_n == 0 && wstop == 0)
+			pthread_cond_wait(&wcond, &wlock);
+
+		if (wready_n == 0)
+			break;  /* stop requested and all is delivered */
+
+		fd = wready[wready_head];
+		wready_head = (wready_head + 1) % nslots;
+		wready_n -= 1;
+
+		c = &clients[fd];
+		c->ready = 0;
+		c->busy = 1;
+		d = c->queue[c->qhead];
+		c->qhead = (c->qhead + 1) % qsize;
+		if (c->qcount-- >= qsize - 1)
+			pthread_cond_signal(&wroom);  /* main loop may wait for it */
+		dead = c->missed_pubs >= PSMQ_MAX_MISSED_PUBS;
+		pthread_mutex_unlock(&wlock);
+
+		/* client that missed too many pubs is about to be
+		 * closed by the broker, don't waste time on him,
+		 * but still try to send him the close message */
+		ret = -1;
+		if (dead == 0 || d.msg->close)
+		{
+			psmq_ms_to_tp(d.timeout, &tp);
+			ret = mq_timedsend(d.mq, (char *)&d.msg->msg, d.msg->len,
+					d.msg->prio, &tp);
+
+			if (ret != 0)
+				el_operror(OELE, "[%3d] sending failed, cmd: %c",
+						fd, d.msg->msg.ctrl.cmd);
+		}
+
+		if (d.msg->close)
+		{
+			mq_close(d.mq);
+			el_oprint(OELN, "[%3d] closed, bye bye", fd);
+		}
+
+		if (ret != 0)
+			psmqd_broker_shm_drop(&d.msg->msg);
+
+		/* clients may have been moved when table was
+		 * grown while we were sending */
+		pthread_mutex_lock(&wlock);
+		c = &clients[fd];
+		if (ret == 0 || d.msg->close)
+			c->missed_pubs = 0;
+		else if (dead == 0 && ++c->missed_pubs == PSMQ_MAX_MISSED_PUBS)
+			psmqd_broker_request_kill(fd);
+
+		if (--d.msg->refs == 0)
+			free(d.msg);
+
+		c->busy = 0;
+		if (c->qcount)
+			psmqd_broker_ready_push(fd);
+	}
+	pthread_mutex_unlock(&wlock);
+
+	return NULL;
+}
+
+
+/* ==========================================================================
+    Stops and joins first 'n' delivery threads, threads will first send
+    everything that is still queued.
+   ========================================================================== */
+
+
+static void psmqd_broker_workers_stop
+(
+	int  n  /* number of threads to join */
+)
+{
+	int  i;  /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	pthread_mutex_lock(&wlock);
+	wstop = 1;
+	pthread_cond_broadcast(&wcond);
+	pthread_mutex_unlock(&wlock);
+
+	for (i = 0; i != n; ++i)
+		pthread_join(workers[i], NULL);
+
+	free(workers);
+	workers = NULL;
+}
+
+
+/* ==========================================================================
+    Marks client 'fd' as having parked messages, or not, when 'parked' is
+    0. In epoll loop, client's mqueue is watched for room only when he has
+    something parked.
+   ========================================================================== */
+
+
+static void psmqd_broker_parked
+(
+	int                  fd,      /* client that changed state */
+	int                  parked   /* does client have parked messages? */
+)
+{
+#if PSMQD_EPOLL
+	struct epoll_event   ev;      /* event to watch for */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (epfd != -1)
+	{
+		memset(&ev, 0x00, sizeof(ev));
+		ev.events = EPOLLOUT;
+		ev.data.u32 = fd;
+		if (epoll_ctl(epfd, parked ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+					clients[fd].mq, &ev) != 0)
+			el_operror(OELE, "[%3d] epoll_ctl(%d)", fd, parked);
+	}
+#endif
+
+	nparked += parked ? 1 : -1;
+}
+
+
+/* ==========================================================================
+    Sends message to client 'fd' without blocking, used for non blocking
+    delivery. When client's mqueue is full, or he already has parked
+    messages that must go first, message is parked in client's queue, and
+    psmqd_broker_flush() will send it once client makes room.
+
+    '*shared' is parked copy of 'msg', it's created when message is parked
+    for the first time, so when message is published to many clients, all
+    of them can share it. Caller must drop it when it's no longer needed.
+
+    With 'conflate' set, message that would be parked replaces older one
+    on the same topic that is still parked, if there is any. Such message
+    is not dropped even when client's queue is full.
+
+    Returns 0 when message was sent or parked, and -1 when it was dropped
+    because client's queue is full.
+   ========================================================================== */
+
+
+static int psmqd_broker_send_nb
+(
+	int               fd,      /* client to send message to */
+	struct psmq_msg  *msg,     /* message to send */
+	size_t            len,     /* number of bytes of msg to send */
+	unsigned int      prio,    /* message priority */
+	struct pending  **shared,  /* parked copy of msg */
+	int               conflate /* replace older message on the topic */
+)
+{
+	struct client    *c;       /* client to send message to */
+	struct delivery  *d;       /* free slot in client's queue */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	c = &clients[fd];
+
+	if (c->qcount == 0)
+	{
+		if (mq_send(c->mq, (char *)msg, len, prio) == 0)
+		{
+			c->missed_pubs = 0;
+			return 0;
+		}
+
+		if (errno != EAGAIN)
+		{
+			c->missed_pubs += 1;
+			return -1;
+		}
+	}
+
+	if (c->qcount == qsize && conflate == 0)
+	{
+		/* client is not reading his queue for
+		 * quite some time now, that's not a short
+		 * stall anymore, so drop message */
+		c->missed_pubs += 1;
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if (*shared == NULL)
+	{
+		*shared = psmqd_broker_pending_dup(msg, len, prio);
+		if (*shared == NULL)
+		{
+			c->missed_pubs += 1;
+			return -1;
+		}
+	}
+
+	if (conflate && psmqd_broker_conflate(c, *shared))
+		return 0;
+
+	if (c->qcount == qsize)
+	{
+		/* nothing to replace, so it's the same
+		 * as with any other message */
+		c->missed_pubs += 1;
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if (c->qcount == 0)
+		psmqd_broker_parked(fd, 1);
+
+	d = &c->queue[(c->qhead + c->qcount) % qsize];
+	d->msg = *shared;
+	d->mq = c->mq;
+	d->timeout = c->reply_timeout;
+	c->qcount += 1;
+	(*shared)->refs += 1;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Sends as many parked messages of client 'fd' as his mqueue can take
+    now, rest stays parked until next call.
+   ========================================================================== */
+
+
+static void psmqd_broker_flush_client
+(
+	int               fd    /* client to flush messages to */
+)
+{
+	struct client    *c;    /* client to flush messages to */
+	struct delivery  *d;    /* oldest parked message of client */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	c = &clients[fd];
+	if (c->qcount == 0)
+		return;
+
+	while (c->qcount)
+	{
+		d = &c->queue[c->qhead];
+		if (mq_send(d->mq, (char *)&d->msg->msg, d->msg->len,
+					d->msg->prio) == 0)
+			c->missed_pubs = 0;
+		else if (errno == EAGAIN)
+			return;  /* still full, try next time */
+		else
+		{
+			el_operror(OELE, "[%3d] sending parked msg failed", fd);
+			psmqd_broker_shm_drop(&d->msg->msg);
+		}
+
+		/* message sent, or failed in a way retry
+		 * won't help, either way it's done */
+		c->qhead = (c->qhead + 1) % qsize;
+		c->qcount -= 1;
+		psmqd_broker_pending_put(d->msg);
+	}
+
+	psmqd_broker_parked(fd, 0);
+}
+
+
+/* ==========================================================================
+    Flushes parked messages of all clients
+   ========================================================================== */
+
+
+static void psmqd_broker_flush(void)
+{
+	int            i;     /* current word of cused */
+	unsigned long  word;  /* connected clients of current word */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != PSMQD_CUSED_WORDS; ++i)
+		for (word = cused[i]; word; word &= word - 1)
+			psmqd_broker_flush_client(i * PSMQ_BM_BITS +
+					psmq_bm_ctz(word));
+}
+
+
+/* ==========================================================================
+    Drops all messages parked for client 'fd'
+   ========================================================================== */
+
+
+static void psmqd_broker_discard
+(
+	int            fd    /* client to discard messages of */
+)
+{
+	struct client  *c;   /* client to discard messages of */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	c = &clients[fd];
+	if (c->qcount == 0)
+		return;
+
+	for (; c->qcount; --c->qcount)
+	{
+		psmqd_broker_shm_drop(&c->queue[c->qhead].msg->msg);
+		psmqd_broker_pending_put(c->queue[c->qhead].msg);
+		c->qhead = (c->qhead + 1) % qsize;
+	}
+
+	psmqd_broker_parked(fd, 0);
+}
+
+
+/* ==========================================================================
+    Sends first 'len' bytes of already built message 'msg' to client 'fd',
+    in a way that depends on delivery mode. Will also increment missed_pubs
+    counter when message could not have been delivered to the client.
+
+    'conflate' is passed to delivery threads or non blocking delivery, it
+    has no meaning when message is sent directly.
+   ========================================================================== */
+
+
+static int psmqd_broker_send_msg
+(
+	int              fd,       /* fd of client to send message to */
+	struct psmq_msg *msg,      /* message to send */
+	size_t           len,      /* number of bytes of msg to send */
+	unsigned int     prio,     /* message priority */
+	int              conflate  /* replace older message on the topic */
+)
+{
+	struct pending  *p;        /* message for delivery threads */
+	struct timespec  tp;       /* absolute time when mq_send() call expire */
+	int              ret;      /* return code */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_psmqd_cfg.broker_overflow)
+	{
+		p = NULL;
+		ret = psmqd_broker_send_nb(fd, msg, len, prio, &p, conflate);
+		if (p)
+			psmqd_broker_pending_put(p);
+		return ret;
+	}
+
+	if (g_psmqd_cfg.broker_workers)
+	{
+		/* all messages to the client must go through his
+		 * queue, or else they could overtake publishes
+		 * that are still waiting there */
+		p = psmqd_broker_pending_dup(msg, len, prio);
+		if (p == NULL)
+			return -1;
+
+		ret = psmqd_broker_queue(fd, p, conflate);
+		psmqd_broker_pending_put(p);
+		return ret;
+	}
+
+	psmq_ms_to_tp(clients[fd].reply_timeout, &tp);
+	if (mq_timedsend(clients[fd].mq, (char *)msg, len, prio, &tp) == 0)
+	{
+		clients[fd].missed_pubs = 0;
+		return 0;
+	}
+
+	clients[fd].missed_pubs += 1;
+	return -1;
+}
+
+
+/* ==========================================================================
+    Same as psmqd_broker_reply_mq() but accepts fd instead of mqueue. Will
+    also increment missed_pubs counter when message could not have been
+    delivered to the client.
+   ========================================================================== */
+
+
+static int psmqd_broker_reply
+(
+	int              fd,       /* fd of client to send message to */
+	char             cmd,      /* command to which reply applies */
+	unsigned char    data,     /* errno reply */
+	const char      *topic,    /* topic to send message with */
+	const void      *payload,  /* data to send to the client */
+	unsigned         paylen,   /* length of payload to send */
+	unsigned int     prio      /* message priority */
+)
+{
+	struct psmq_msg  msg;      /* message to send */
+	size_t           len;      /* number of bytes to send */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	len = psmqd_broker_msg_fill(&msg, cmd, data, topic, payload, paylen);
+	return psmqd_broker_send_msg(fd, &msg, len, prio, 0);
+}
+
+
+/* ==========================================================================
+    Same as psmqd_broker_reply_mq() but used to reply to control requests.
+    These replies holds no data but control bytes.
+   ========================================================================== */
+
+
+static int psmqd_broker_reply_ctrl
+(
+	int           fd,       /* fd of client to send message to */
+	char          cmd,      /* command to which reply applies */
+	unsigned char data,     /* errno reply */
+	const char   *extra     /* extra string data to send back to client */
+)
+{
+	return psmqd_broker_reply(fd, cmd, data, extra, NULL, 0, 0);
+}
+
+
+/* ==========================================================================
+                                                       __
+                _____ ___   ____ _ __  __ ___   _____ / /_ _____
+               / ___// _ \ / __ `// / / // _ \ / ___// __// ___/
+              / /   /  __// /_/ // /_/ //  __/(__  )/ /_ (__  )
+             /_/    \___/ \__, / \__,_/ \___//____/ \__//____/
+                            /_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Open connection with the broker
+    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+    request:
+            ctrl.cmd    char    PSMQ_CTRL_CMD_OPEN
+            ctrl.data   uchar   ignored
+            paylen      uint    0 or 1
+            data
+                topic   str     queue name where messages will be sent
+                proto   uchar   protocol client wants to use, optional,
+                                PSMQ_PROTO_V1 when not sent
+
+    response (PSMQ_PROTO_V1):
+            ctrl.cmd    char    PSMQ_CTRL_CMD_OPEN
+            ctrl.data   uchar   0 on success, or errno
+            data
+                fd      uchar   file descriptor to use when communicating,
+                                field is valid only when ctrl.data is 0
+
+    response (PSMQ_PROTO_V2):
+            ctrl.cmd    char    PSMQ_CTRL_CMD_OPEN
+            ctrl.data   uchar   0 on success, or errno
+            data
+                proto   uchar   PSMQ_PROTO_V2
+                fd      ushort  file descriptor to use when communicating,
+                                not aligned, both fields are sent only when
+                                ctrl.data is 0
+
+    note:
+            yes, errno is int, so max value of errno is 32767, but this is
+            designed for embedded with small memory footprint, and mqueue
+            always allocates all memory for all possible messages on the
+            queue, so it is by design, to keep these messages as small as
+            possible, thus errno can be max 255. Sometimes this may bite,
+            when errno is bigger than 255. In such case, any errno bigger
+            than 255 will get truncated to 255.
+
+            This also limited max clients up to 255. Yeah, like someone
+            is going to have 255 different processes with different psmq
+            clients in their embedded systems. Well, someone did hit this,
+            so PSMQ_PROTO_V2 client has his fd sent after request in 16
+            bits, and broker won't run out of ids for him before it runs
+            out of memory. PSMQ_PROTO_V1 clients still get only fds that
+            fit in ctrl.data.
+   ========================================================================== */
+
+
+static int psmqd_broker_open
+(
+	struct psmq_msg  *msg      /* msg with queue name to open */
+)
+{
+	mqd_t             qc;      /* new communication queue */
+	unsigned short    fd;      /* new file descriptor for the client */
+	char             *qname;   /* queue name to open */
+	struct mq_attr    mqa;     /* attributes of client's queue */
+	unsigned char     proto;   /* protocol client speaks */
+	unsigned char     reply[1 + sizeof(fd)]; /* payload of reply */
+	int               err;     /* errno to send to client */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	/* qname validated for null
+	 * termination during reception */
+	qname = msg->data;
+
+	/* client that knows nothing about protocols, sends
+	 * nothing, and client that knows more than we do,
+	 * gets the best we can offer */
+	proto = msg->paylen ? msg->data[strlen(qname) + 1] : PSMQ_PROTO_V1;
+	if (proto > PSMQ_PROTO_V2)
+		proto = PSMQ_PROTO_V2;
+
+	/* open communication line with client, with non blocking
+	 * delivery we never wait for client to make room in his
+	 * queue, we park messages instead */
+	qc = mq_open(qname, O_RDWR | (g_psmqd_cfg.broker_overflow ? O_NONBLOCK : 0));
+	if (qc == (mqd_t)-1)
+	{
+		/* couldn't open queue provided by client and thus we have
+		 * no way of informing him about error, so we only log this
+		 * and abort this session */
+		el_operror(OELC, "open failed: mq_open(%s)", qname);
+		return -1;
+	}
+
+	/* client tells us his size class by the size of his
+	 * queue, it must be able to hold at least our replies */
+	if (mq_getattr(qc, &mqa) != 0 || mqa.mq_msgsize <
+			(long)offsetof(struct psmq_msg, data) + PSMQ_MSG_CLASS_MIN)
+	{
+		el_oprint(OELW, "open failed client %s: queue msgsize too small",
+				qname);
+		psmqd_broker_reply_mq(qc, PSMQ_CTRL_CMD_OPEN, EMSGSIZE,
+				NULL, NULL, 0, 0, 0);
+		mq_close(qc);
+		return -1;
+	}
+
+	fd = psmqd_broker_get_free_client(proto == PSMQ_PROTO_V1 ?
+			PSMQ_V1_MAX_CLIENTS : PSMQ_MAX_CLIENTS);
+	if (fd == USHRT_MAX)
+	{
+		/* all slots are taken, send error information to the client */
+		err = errno;
+		el_operror(OELW, "open failed client %s: no free slots", qname);
+		psmqd_broker_reply_mq(qc, PSMQ_CTRL_CMD_OPEN, err,
+				NULL, NULL, 0, 0, 0);
+		mq_close(qc);
+		return -1;
+	}
+
+	if (qsize && clients[fd].queue == NULL)
+	{
+		/* delivery queue is allocated once and kept for
+		 * next clients that will use this slot */
+		clients[fd].queue = malloc(qsize * sizeof(*clients[fd].queue));
+		if (clients[fd].queue == NULL)
+		{
+			el_oprint(OELW, "open failed client %s: no memory", qname);
+			psmqd_broker_reply_mq(qc, PSMQ_CTRL_CMD_OPEN, ENOMEM,
+					NULL, NULL, 0, 0, 0);
+			mq_close(qc);
+			return -1;
+		}
+	}
+
+	clients[fd].mq = qc;
+	psmq_bm_set(cused, fd);
+	targets[fd].delivered = 0;
+	clients[fd].limited = 0;
+	clients[fd].overlimit = 0;
+	psmqd_broker_bucket_set(&clients[fd].publim,
+			g_psmqd_cfg.broker_pub_limit, 0);
+	psmqd_broker_bucket_set(&targets[fd].recvlim,
+			g_psmqd_cfg.broker_recv_limit, 0);
+	targets[fd].msgsize = mqa.mq_msgsize < (long)sizeof(struct psmq_msg) ?
+		(unsigned short)mqa.mq_msgsize :
+		(unsigned short)sizeof(struct psmq_msg);
+	if (targets[fd].msgsize != sizeof(struct psmq_msg))
+		el_oprint(OELI, "[%3d] queue takes messages up to %u bytes",
+				fd, targets[fd].msgsize);
+
+	/* we have free slot and all data has been allocated, send
+	 * client file descriptor he can use to control communication,
+	 * V1 client's fd is always lower than UCHAR_MAX */
+	reply[0] = (unsigned char)fd;
+	if (proto == PSMQ_PROTO_V2)
+	{
+		reply[0] = PSMQ_PROTO_V2;
+		memcpy(reply + 1, &fd, sizeof(fd));
+	}
+
+	if (psmqd_broker_reply_mq(qc, PSMQ_CTRL_CMD_OPEN, 0, NULL, reply,
+				proto == PSMQ_PROTO_V2 ? sizeof(reply) : 1, 0, 0) == 0)
+	{
+		el_oprint(OELN, "[%3d] opened %s, protocol v%d", fd, qname, proto);
+		return 0;
+	}
+
+	/* for some reason we couldn't send fd to client, log it
+	 * and cleanup this mess */
+	el_operror(OELW, "couldn't send fd to client %s", qname);
+	mq_close(qc);
+	clients[fd].mq = (mqd_t)-1;
+	psmq_bm_clr(cused, fd);
+	return -1;
+}
+
+
+/* ==========================================================================
+    Sends client 'fd' all retained messages with topics matching his
+    just added subscription 'node'. Messages go out in the same way as
+    any other publish, so client cannot tell them apart from new ones.
+   ========================================================================== */
+
+
+static void psmqd_broker_send_retained
+(
+	unsigned short          fd,     /* client that just subscribed */
+	const struct psmqd_tl  *node    /* his new subscription */
+)
+{
+	struct psmqd_rt_msg    *m;      /* current retained message */
+	struct psmq_msg         msg;    /* message to send */
+	size_t                  len;    /* number of bytes to send */
+	const char             *topic;  /* topic of retained message */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (m = psmqd_rt_next(&retained, NULL); m != NULL;
+			m = psmqd_rt_next(&retained, m))
+	{
+		topic = PSMQD_RT_TOPIC(m);
+		if (psmqd_tl_matches(node, topic, m->hash) == 0)
+			continue;
+
+		len = psmqd_broker_msg_fill(&msg, PSMQ_CTRL_CMD_PUBLISH, 0,
+				topic, PSMQD_RT_PAYLOAD(m), m->paylen);
+		if (len > targets[fd].msgsize)
+			continue;
+
+		if (psmqd_broker_send_msg(fd, &msg, len, 0, 0) != 0)
+		{
+			/* queue is full, rest would fail too, and
+			 * missed pubs will take care of the client
+			 * if he is really dead */
+			el_operror(OELW, "[%3d] failed to send retained %s",
+					fd, topic);
+			return;
+		}
+
+		++targets[fd].delivered;
+		++stats.delivered;
+		el_oprint(OELD, "[%3d] sent retained %s", fd, topic);
+	}
+}
+
+
+/* ==========================================================================
+    Subscribes to topic in message payload
+    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+    request:
+            ctrl.cmd    char    PSMQ_CTRL_CMD_SUBSCRIBE
+            ctrl.data   uchar   file descriptor
+            paylen      uint    0, or 1 when flags are sent
+            data
+                topic   str     topic to subscribe to
+                flags   uchar   optional PSMQ_SUB_* flags
+
+    response
+            ctrl.cmd    char    PSMQ_CTRL_CMD_SUBSCRIBE
+            ctrl.data   uchar   0 on success, otherwise errno
+            data        -       topic used tried to subscribe to
+
+    errno for response:
+            EBADMSG     payload is not a string or not a valid topic
+            EINVAL      unknown flag was set
+            UCHAR_MAX   returned errno from system is bigger than UCHAR_MAX
+   ========================================================================== */
+
+
+static int psmqd_broker_subscribe
+(
+	struct psmq_msg  *msg,        /* subscription request */
+	unsigned short    fd          /* clients file descriptor */
+)
+{
+	unsigned char     err;        /* errno value to send to client */
+	struct psmqd_tl  *node;       /* node with compiled stopic */
+	char             *stopic;     /* subscribe topic from client */
+	char             *stopicsave; /* saved pointer of stopic */
+	unsigned          stopiclen;  /* length of stopic */
+	unsigned char     flags;      /* PSMQ_SUB_* flags of subscription */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	stopic = msg->data;
+	stopiclen = strlen(stopic);
+	flags = msg->paylen == 1 ? (unsigned char)stopic[stopiclen + 1] : 0;
+	err = 0;
+
+	if (stopiclen < 2)
+	{
+		el_oprint(OELW, "[%3d] subscribe error, topic '%s' too short %u",
+				fd, stopic, stopiclen);
+		err = EBADMSG;
+	}
+	else if (msg->paylen > 1)
+	{
+		el_oprint(OELW, "[%3d] subscribe error, message contains extra data", fd);
+		err = EBADMSG;
+	}
+	else if (flags & ~PSMQ_SUB_CONFLATE)
+	{
+		el_oprint(OELW, "[%3d] subscribe error, unknown flags 0x%02x",
+				fd, flags);
+		err = EINVAL;
+	}
+	else if (stopic[0] != '/')
+	{
+		el_oprint(OELW, "[%3d] subscribe error, topic %s must start with '/'",
+				fd, stopic);
+		err = EBADMSG;
+	}
+	else if (stopic[stopiclen - 1] == '/')
+	{
+		el_oprint(OELW, "[%3d] subscribe error, topic %s cannot end with '/'",
+				fd, stopic);
+		err = EBADMSG;
+	}
+	else
+	{
+		for (stopicsave = stopic; *stopic != '\0'; ++stopic)
+		{
+			if (*stopic == '/' && *(stopic + 1) == '/')
+			{
+				el_oprint(OELW, "[%3d] subscribe error, topic '%s' cannot "
+						"contain two '/' in a row", fd, stopicsave);
+				err = EBADMSG;
+				break;
+			}
+		}
+
+		stopic = stopicsave;
+	}
+
+	if (err)
+	{
+		psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_SUBSCRIBE, err, stopic);
+		return -1;
+	}
+
+
+	/* list holds compiled topic, so routing can
+	 * use it without parsing topic again. Client
+	 * may already be subscribed to the same topic,
+	 * so only returned node is the one we've added */
+	node = psmqd_tl_pool_add(&clients[fd].pool, &clients[fd].topics, stopic);
+	if (node == NULL)
+	{
+		/* subscription failed */
+		err = errno < UCHAR_MAX ? errno : UCHAR_MAX;
+		el_operror(OELW, "[%3d] failed to add topic to list", fd);
+		psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_SUBSCRIBE, err, stopic);
+		return -1;
+	}
+
+	node->flags = flags;
+	if (psmqd_broker_route_add(node, fd) != 0)
+	{
+		/* topic is on client's list, but we failed to put
+		 * it into routing, so he would never get any
+		 * message, revert the whole subscription */
+		err = errno < UCHAR_MAX ? errno : UCHAR_MAX;
+		el_operror(OELW, "[%3d] failed to add topic to routing", fd);
+		psmqd_tl_pool_delete_node(&clients[fd].pool,
+				&clients[fd].topics, node);
+		psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_SUBSCRIBE, err, stopic);
+		return -1;
+	}
+
+	if (flags & PSMQ_SUB_CONFLATE)
+		++targets[fd].nconflate;
+
+	psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_SUBSCRIBE, 0, stopic);
+	el_oprint(OELN, "[%3d] subscribed to %s%s", fd, stopic,
+			flags & PSMQ_SUB_CONFLATE ? " (conflated)" : "");
+
+	/* client learns current state of topics right away,
+	 * instead of waiting for next publish on them */
+	if (retained.n)
+		psmqd_broker_send_retained(fd, node);
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Unsubscribes client from specified topic
+    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+    request:
+            ctrl.cmd    char    PSMQ_CTRL_CMD_UNSUBSCRIBE
+            ctrl.data   uchar   file descriptor of the client
+            data        str     string with topic to unsubscribe
+
+    response
+            ctrl.cmd    char    PSMQ_CTRL_CMD_UNSUBSCRIBE
+            ctrl.data   uchar   0 on success, otherwise errno
+            data        -       none
+
+    errno:
+            UCHAR_MAX   returned errno from system is bigger than UCHAR_MAX
+   ========================================================================== */
+
+
+static int psmqd_broker_unsubscribe
+(
+	struct psmq_msg  *msg,    /* messages request */
+	unsigned short    fd      /* client's file descriptor */
+)
+{
+	unsigned char     err;    /* error to send to client as reply */
+	struct psmqd_tl  *node;   /* node with compiled utopic */
+	char             *utopic; /* topic to unsubscribe */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	utopic = msg->data;
+
+	if ((node = psmqd_tl_find(clients[fd].topics, utopic)) == NULL)
+	{
+		err = errno < UCHAR_MAX ? errno : UCHAR_MAX;
+		el_operror(OELW, "[%3d] unsubscribe failed, topic: %s", fd, utopic);
+		psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_UNSUBSCRIBE, err, utopic);
+		return -1;
+	}
+
+	/* topic is on client's list, so it's also in routing,
+	 * there is no way for this to fail. Routing must be
+	 * updated first, as deleting from list frees compiled
+	 * topic */
+	psmqd_broker_route_delete(node, fd);
+	if (node->flags & PSMQ_SUB_CONFLATE)
+		--targets[fd].nconflate;
+
+	psmqd_tl_pool_delete_node(&clients[fd].pool,
+			&clients[fd].topics, node);
+
+	el_oprint(OELN, "[%3d] unsubscribed %s", fd, utopic);
+	psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_UNSUBSCRIBE, 0, utopic);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Closes connection with client and removes all resources alloceted by him
+    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+    request:
+            ctrl.cmd    char    PSMQ_CTRL_CMD_CLOSE
+            ctrl.data   uchar   file descriptor of the client
+            data        -       none
+
+    response
+            ctrl.cmd    char    PSMQ_CTRL_CMD_CLOSE
+            ctrl.data   uchar   0 on success, otherwise errno
+            data        -       none
+   ========================================================================== */
+
+
+static int psmqd_broker_close
+(
+	int               fd     /* client's file descriptor */
+)
+{
+	struct psmqd_tl  *node;  /* current node of client's topics */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* first delete all topics client is subscribed to, both
+	 * from the routing and his own list */
+	for (node = clients[fd].topics; node != NULL; node = node->next)
+		psmqd_broker_route_delete(node, fd);
+
+	psmqd_tl_pool_destroy(&clients[fd].pool);
+	clients[fd].topics = NULL;
+	targets[fd].nconflate = 0;
+	psmqd_broker_alias_destroy(fd);
+
+	if (targets[fd].trace)
+	{
+		targets[fd].trace = 0;
+		--ntraced;
+	}
+
+	if (g_psmqd_cfg.broker_workers)
+	{
+		/* client may still have messages waiting in his
+		 * queue, so we cannot close mq now. Close reply
+		 * goes after them, and delivery thread will close
+		 * mq once it sends it. Slot is not reused until
+		 * that happens. */
+		psmqd_broker_queue(fd, &closemsg, 0);
+		clients[fd].mq = (mqd_t)-1;
+		psmq_bm_clr(cused, fd);
+		return 0;
+	}
+
+	/* zero out missed_pubs or else we risk
+	 * infinite recursive loop when sending close
+	 * command to client triggers close function
+	 * over and over again until all that is right
+	 * and good is dead */
+	clients[fd].missed_pubs = 0;
+
+	/* messages that are still parked will never
+	 * be delivered, client is leaving */
+	if (g_psmqd_cfg.broker_overflow)
+		psmqd_broker_discard(fd);
+
+	/* send reply to broker we processed his close
+	 * request, yes we lie to him, but we won't be
+	 * able to ack him after we close communication
+	 * queue. Send it directly, so it does not get
+	 * parked in non blocking mode */
+	psmqd_broker_reply_mq(clients[fd].mq, PSMQ_CTRL_CMD_CLOSE, 0,
+			NULL, NULL, 0, 0, clients[fd].reply_timeout);
+
+	/* then close mq and set it to -1 to indicate
+	 * slot is free for next client */
+	mq_close(clients[fd].mq);
+	clients[fd].mq = (mqd_t)-1;
+	psmq_bm_clr(cused, fd);
+	el_oprint(OELN, "[%3d] closed, bye bye", fd);
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Closes client 'fd' if he failed to receive PSMQ_MAX_MISSED_PUBS messages
+    in a row, such client is assumed dead.
+    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+    request:
+            ctrl.cmd    char    PSMQD_CTRL_CMD_KILL
+            ctrl.data   uchar   file descriptor of the client
+            data        -       none
+
+    response:
+            same as for close, when client was closed
+
+    note:
+            this is internal request, delivery threads send it to the
+            broker when client reaches PSMQ_MAX_MISSED_PUBS, as they cannot
+            close client themselves. It's harmless when some client sends
+            it, since client is closed only when he really missed all these
+            pubs.
+   ========================================================================== */
+
+
+static int psmqd_broker_kill
+(
+	int              fd      /* client's file descriptor */
+)
+{
+	struct psmq_msg  dummy;  /* oldest message removed from client's queue */
+	struct timespec  tp;     /* timeout for mq_timedreceive() */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (psmqd_broker_missed_pubs(fd) < PSMQ_MAX_MISSED_PUBS)
+		return 0;
+
+	el_oprint(OELE, "[%3d] failed to send msg to client "
+			"for %d consecutive calls, delete client",
+			fd, PSMQ_MAX_MISSED_PUBS);
+
+	/* client assumed dead, it's queue now is
+	 * most probably full, but there still is
+	 * a chance that client is alive but just
+	 * hanged for a long time and will eventualy
+	 * read something from queue, but since
+	 * queue is full we cannot send him close
+	 * message. So to make sure there is close
+	 * message on the queue, we remove oldest
+	 * message from it and then call close().
+	 * We do not check for return code here,
+	 * if it does not work there is nothing
+	 * we can do. */
+	tp.tv_sec = 0;
+	tp.tv_nsec = 0;
+	mq_timedreceive(clients[fd].mq, (char *)&dummy, sizeof(dummy), NULL, &tp);
+	return psmqd_broker_close(fd);
+}
+
+
+/* ==========================================================================
+    Sends first 'size' bytes of message 'msg' published by another client
+    to client 'fd', with 'trace' appended after payload. Time of sending
+    is put into trace here, so it includes time spent on sending to
+    clients that got message before 'fd'. With delivery threads or non
+    blocking delivery, it's the time message was handed over to them, and
+    'conflate' is honored the same way as for message without trace.
+   ========================================================================== */
+
+
+static int psmqd_broker_send_trace
+(
+	int                      fd,     /* client to send message to */
+	const struct psmq_msg   *msg,    /* published message */
+	size_t                   size,   /* number of bytes of msg to send */
+	const struct psmq_trace *trace,  /* timestamps of message */
+	unsigned int             prio,   /* message priority */
+	int                      conflate /* replace older message on topic */
+)
+{
+	struct psmq_msg          out;    /* message with trace */
+	struct psmq_trace        t;      /* trace to send */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	memcpy(&out, msg, size);
+	out.ctrl.data = 0;
+
+	t = *trace;
+	t.bsend = psmq_trace_now();
+	memcpy((char *)&out + size, &t, sizeof(t));
+	return psmqd_broker_send_msg(fd, &out, size + sizeof(t), prio,
+			conflate);
+}
+
+
+/* ==========================================================================
+    Drops publish of client 'fd' on 'topic', that went over his publish
+    rate limit. With broker_limit_errno, client is told about it with
+    PSMQ_CTRL_CMD_PUBLISH reply carrying EAGAIN, but only about first
+    dropped message, so flooding client doesn't get his queue flooded
+    too.
+   ========================================================================== */
+
+
+static void psmqd_broker_limited
+(
+	int          fd,    /* client that went over the limit */
+	const char  *topic  /* topic of dropped message */
+)
+{
+	++stats.limited;
+	++clients[fd].limited;
+	el_oprint(OELD, "[%3d] publish on %s over the limit, dropped",
+			fd, topic);
+
+	if (g_psmqd_cfg.broker_limit_errno == 0 || clients[fd].overlimit)
+		return;
+
+	clients[fd].overlimit = 1;
+	psmqd_broker_reply(fd, PSMQ_CTRL_CMD_PUBLISH, EAGAIN, topic, NULL, 0, 0);
+}
+
+
+/* ==========================================================================
+    Puts message 'msg' of 'len' bytes, received from control queue, into
+    backlog. Backlog is sorted by priority, highest is at the end, and
+    among messages with the same priority, oldest is closer to the end,
+    so they are taken out in the same order control queue would give
+    them to us. There is always room for one more message above
+    PSMQD_BACKLOG.
+   ========================================================================== */
+
+
+static void psmqd_broker_backlog_add
+(
+	const struct psmq_req  *msg,   /* received message */
+	size_t                  len,   /* number of bytes received */
+	unsigned int            prio   /* priority of msg */
+)
+{
+	int                     i;     /* position of new message */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != nbacklog; ++i)
+		if (backlog[i].prio >= prio)
+			break;
+
+	memmove(backlog + i + 1, backlog + i, (nbacklog - i) * sizeof(*backlog));
+	backlog[i].prio = prio;
+	backlog[i].len = len;
+	memcpy(&backlog[i].msg, msg, len);
+	++nbacklog;
+}
+
+
+/* ==========================================================================
+    Takes message with highest priority out of backlog into 'msg', and
+    stores its priority in 'prio'. Backlog must not be empty.
+
+    Returns number of bytes in 'msg'.
+   ========================================================================== */
+
+
+static size_t psmqd_broker_backlog_take
+(
+	struct psmq_req  *msg,   /* message is taken here */
+	unsigned int     *prio   /* priority of msg */
+)
+{
+	--nbacklog;
+	*prio = backlog[nbacklog].prio;
+	memcpy(msg, &backlog[nbacklog].msg, backlog[nbacklog].len);
+	return backlog[nbacklog].len;
+}
+
+
+/* ==========================================================================
+    Called during fan-out of message with priority 'prio', every
+    broker_preempt deliveries. Takes messages that are waiting on control
+    queue into backlog, without blocking, and if there are any with
+    higher priority than 'prio', processes them right away. Caller then
+    continues his fan-out where he left off.
+
+    Messages are taken only while there is room in backlog, so when it's
+    full, high priority message waiting on control queue is not seen
+    until one from backlog is processed.
+
+    Returns 1 when some message was processed, and state of the broker
+    could have changed, 0 otherwise.
+   ========================================================================== */
+
+
+static int psmqd_broker_preempt
+(
+	unsigned int      prio      /* priority of interrupted fan-out */
+)
+{
+	struct psmq_req   msg;      /* message taken from control queue */
+	unsigned int      mprio;    /* priority of msg */
+	ssize_t           len;      /* length of msg */
+	int               ret;      /* return code */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* every preemption costs us a stack frame, and
+	 * each nested one has higher priority, so this
+	 * limit is rarely, if ever, reached */
+	if (preempting == PSMQD_PREEMPT_DEPTH)
+		return 0;
+
+	while (nbacklog < PSMQD_BACKLOG)
+	{
+		len = mq_receive(qbatch, (char *)&msg, sizeof(msg), &mprio);
+		if (len < 0)
+			break;
+
+		psmqd_broker_backlog_add(&msg, len, mprio);
+	}
+
+	ret = 0;
+	++preempting;
+	while (nbacklog && backlog[nbacklog - 1].prio > prio)
+	{
+		len = psmqd_broker_backlog_take(&msg, &mprio);
+		el_oprint(OELD, "prio %u fan-out preempted by prio %u",
+				prio, mprio);
+		++stats.preempted;
+		psmqd_broker_process(&msg, len, mprio);
+		ret = 1;
+	}
+
+	--preempting;
+	return ret;
+}
+
+
+/* ==========================================================================
+    Checks if message on 'topic' should be conflated for client 'fd', that
+    is if any of his subscriptions that match topic was made with
+    PSMQ_SUB_CONFLATE flag.
+   ========================================================================== */
+
+
+static int psmqd_broker_conflated
+(
+	int                     fd,     /* client to check */
+	const char             *topic,  /* topic message is published on */
+	unsigned long           hash    /* psmqd_tl_hash() of topic */
+)
+{
+	const struct psmqd_tl  *node;   /* client's subscription */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (targets[fd].nconflate == 0)
+		return 0;
+
+	for (node = clients[fd].topics; node != NULL; node = node->next)
+		if (node->flags & PSMQ_SUB_CONFLATE &&
+				psmqd_tl_matches(node, topic, hash))
+			return 1;
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Process published message by one of the clients and send it to all
+    interested parties.
+    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+    request:
+            ctrl.cmd    char    PSMQ_CTRL_CMD_PUBLISH
+            ctrl.data   uchar   file descriptor of requesting client
+            paylen      uint    size of data.payload
+            data
+                topic   str     topic to publish message on
+                payload any     data to publish
+
+    response:
+            none        -       psmq doesn't use any id to identify messages
+                                so OK response to publishing client is quite
+                                pointless, as he wouldn't know which message
+                                has been accepted.
+
+    note:
+            PSMQ_CTRL_CMD_PUBLISH_SHM is handled here too, then payload is
+            struct psmq_shm_desc, descriptor of large payload in the slab.
+            Publisher hands us his reference to the block, we take one
+            more for every subscriber message is delivered to, and drop
+            publisher's once we are done.
+
+            When 'route' is set, subscribers were already found by the
+            caller and topic is not matched again.
+
+            When 'trace' is set, clients with tracing enabled get it
+            right after payload, with bsend filled in.
+
+            Clients that subscribed to topic with PSMQ_SUB_CONFLATE get
+            message in place of older one on the same topic, that broker
+            still holds for them, if there is any. Only messages that
+            wait in broker can be replaced, that is with delivery threads
+            or non blocking delivery, once message is in client's mqueue
+            it's his.
+   ========================================================================== */
+
+
+static int psmqd_broker_publish
+(
+	struct psmq_msg          *msg,    /* published message by client */
+	unsigned short            from,   /* publisher, or PSMQD_SELF_FD */
+	unsigned int              prio,   /* message priority */
+	const struct route       *route,  /* subscribers of topic or NULL */
+	const struct psmq_trace  *trace   /* timestamps of message or NULL */
+)
+{
+	int               fd;        /* client's file descriptor */
+	int               ret;       /* return code from sending */
+	void             *payload;   /* payload to publish */
+	char             *topic;     /* topic to publish message on */
+	struct pending   *shared;    /* message for delivery threads */
+	struct psmq_msg   reply;     /* message to send without blocking */
+	size_t            len;       /* number of bytes of reply to send */
+	int               block;     /* slab block of large payload, or -1 */
+	size_t            size;      /* size of message on the wire */
+	struct psmq_shm_desc desc;   /* descriptor of large payload */
+	struct route     *match;     /* our own list of subscribed clients */
+	unsigned long     start;     /* time routing started, for stats */
+	unsigned long     gen;       /* routegen when route was resolved */
+	unsigned long     hash;      /* psmqd_tl_hash() of topic */
+	int               conflate;  /* replace older message on topic */
+	int               aliased;   /* route is alias of publisher */
+	int               i;         /* index of current client in route */
+	int               n;         /* number of matched clients so far */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* topic is verified for null termination
+	 * during data reception */
+	topic = msg->data;
+	payload = msg->data + strlen(topic) + 1;
+	hash = psmqd_tl_hash(topic);
+	start = g_psmqd_cfg.broker_stats ? psmq_mono_us() : 0;
+
+	el_oprint(OELD, "received publish from topic %s, payload (len: %u):",
+			topic, msg->paylen);
+	el_opmemory(OELD, payload, msg->paylen);
+
+	block = -1;
+	if (msg->ctrl.cmd == PSMQ_CTRL_CMD_PUBLISH_SHM)
+	{
+		/* descriptor comes from client, make sure it
+		 * really points into our slab, before we touch
+		 * anything there */
+		if (msg->paylen == sizeof(desc))
+		{
+			memcpy(&desc, payload, sizeof(desc));
+			block = psmq_shm_block(slab, &desc);
+		}
+
+		if (block == -1)
+		{
+			el_oprint(OELW, "invalid large payload descriptor "
+					"from %d, hexdump is:", from);
+			el_opmemory(OELW, msg, sizeof(*msg));
+			return -1;
+		}
+	}
+
+	if (from != PSMQD_SELF_FD &&
+			strncmp(topic, PSMQD_SYS_TOPIC, sizeof(PSMQD_SYS_TOPIC) - 1) == 0)
+	{
+		/* subscribers must be able to trust that
+		 * these come from broker */
+		el_oprint(OELW, "[%3d] publish on reserved topic %s dropped",
+				from, topic);
+		psmq_shm_ref(slab, block, -1);
+		return -1;
+	}
+
+	if (from != PSMQD_SELF_FD)
+	{
+		if (psmqd_broker_bucket_take(&clients[from].publim) != 0)
+		{
+			psmqd_broker_limited(from, topic);
+			psmq_shm_ref(slab, block, -1);
+			return -1;
+		}
+
+		clients[from].overlimit = 0;
+	}
+
+	++stats.published;
+
+	if (msg->ctrl.cmd == PSMQ_CTRL_CMD_PUBLISH_RETAIN)
+	{
+		/* for subscribers it's ordinary publish, that
+		 * broker happens to remember for later ones */
+		msg->ctrl.cmd = PSMQ_CTRL_CMD_PUBLISH;
+		if (retained.arena && psmqd_rt_set(&retained, topic, hash,
+					payload, msg->paylen) != 0)
+			el_operror(OELW, "[%3d] failed to retain message on %s",
+					from, topic);
+	}
+
+	/* find all clients that are interested in that message,
+	 * recently published topics are served from cache. When
+	 * we need list of our own, it's taken from scratch routes,
+	 * each nesting of preemption has its own */
+	aliased = route != NULL;
+	match = &rscratch[preempting];
+	if (route == NULL && rcache)
+		route = psmqd_broker_rcache_get(topic, hash);
+
+	if (route == NULL)
+	{
+		if (psmqd_broker_route_match(topic, hash, match) != 0)
+		{
+			el_operror(OELE, "[%3d] no memory to route msg on %s",
+					from, topic);
+			psmq_shm_ref(slab, block, -1);
+			return -1;
+		}
+
+		route = match;
+	}
+
+	if (route->n == 0)
+	{
+		/* noone is interested */
+		psmq_shm_ref(slab, block, -1);
+		++stats.nomatch;
+		psmqd_broker_stats_time(start);
+		return 0;
+	}
+
+	/* forwarded message is as big as the one we got, clients
+	 * with queues too small for it won't get it */
+	size = psmq_real_msg_size(*msg);
+
+	/* with delivery threads, message is built once and
+	 * all subscribed clients get reference to it, same
+	 * goes for non blocking delivery, but there copy is
+	 * made only when message needs to be parked */
+	shared = NULL;
+	len = 0;
+	if (g_psmqd_cfg.broker_workers)
+		shared = psmqd_broker_pending_new(msg->ctrl.cmd, 0,
+				topic, payload, msg->paylen, prio);
+	else if (g_psmqd_cfg.broker_overflow)
+		len = psmqd_broker_msg_fill(&reply, msg->ctrl.cmd, 0,
+				topic, payload, msg->paylen);
+
+	/* fan-out may be interrupted by higher priority message,
+	 * that can change subscriptions or reuse cache entry
+	 * route points to, so work on our own copy then. Route
+	 * given by caller is alias of publisher, which is freed
+	 * when he gets killed during fan-out, because his own
+	 * queue is full, so that one is copied always */
+	gen = routegen;
+	if ((g_psmqd_cfg.broker_preempt || aliased) && route != match)
+	{
+		if (psmqd_broker_route_reserve(match, route->n) != 0)
+		{
+			el_operror(OELE, "[%3d] no memory to route msg on %s",
+					from, topic);
+			if (shared)
+				psmqd_broker_pending_put(shared);
+			psmq_shm_ref(slab, block, -1);
+			return -1;
+		}
+
+		memcpy(match->fds, route->fds, route->n * sizeof(*route->fds));
+		match->n = route->n;
+		route = match;
+	}
+
+	for (i = 0, n = 0; i != route->n; ++i)
+	{
+		fd = route->fds[i];
+		if (g_psmqd_cfg.broker_preempt &&
+				++n % g_psmqd_cfg.broker_preempt == 0 &&
+				psmqd_broker_preempt(prio) && gen != routegen)
+		{
+			/* subscriptions changed in the meantime, rest
+			 * of clients get message only if they are
+			 * still subscribed to it. route is our own
+			 * copy, so its fds have just changed, find
+			 * where we were in the new list */
+			psmqd_broker_route_match(topic, hash, match);
+			gen = routegen;
+			for (i = 0; i != route->n && route->fds[i] < fd; ++i)
+				;
+
+			if (i == route->n || route->fds[i] != fd)
+			{
+				/* not subscribed anymore, next
+				 * iteration takes fds[i] */
+				--i;
+				continue;
+			}
+		}
+
+		if (size > targets[fd].msgsize)
+		{
+			/* client chose queue for smaller messages,
+			 * that's not his fault, he's not missing
+			 * anything he could receive */
+			el_oprint(OELD, "[%3d] msg on %s too big for client (%lu)",
+					fd, topic, (unsigned long)size);
+			continue;
+		}
+
+		if (psmqd_broker_bucket_take(&targets[fd].recvlim) != 0)
+		{
+			/* client doesn't want messages faster than that */
+			el_oprint(OELD, "[%3d] msg on %s over receive limit, dropped",
+					fd, topic);
+			++clients[fd].limited;
+			++stats.limited;
+			continue;
+		}
+
+		/* yes, we have a match, send message to the client,
+		 * reference must be taken before sending, as client
+		 * may release payload before we even return here */
+		psmq_shm_ref(slab, block, 1);
+		conflate = psmqd_broker_conflated(fd, topic, hash);
+		if (trace && targets[fd].trace &&
+				size + sizeof(*trace) <= targets[fd].msgsize)
+			ret = psmqd_broker_send_trace(fd, msg, size, trace, prio,
+					conflate);
+		else if (len)
+			ret = psmqd_broker_send_nb(fd, &reply, len, prio, &shared,
+					conflate);
+		else if (shared)
+			ret = psmqd_broker_queue(fd, shared, conflate);
+		else
+			ret = psmqd_broker_reply(fd, msg->ctrl.cmd, 0,
+					topic, payload, msg->paylen, prio);
+
+		if (ret != 0)
+		{
+			psmq_shm_ref(slab, block, -1);
+			el_operror(OELE, "[%3d] sending failed. topic %s, prio %u,"
+					" payload (len: %u):", fd, topic, prio, msg->paylen);
+			el_opmemory(OELE, payload, msg->paylen);
+
+			psmqd_broker_kill(fd);
+			continue;
+		}
+
+		++targets[fd].delivered;
+		++stats.delivered;
+		el_oprint(OELD, "published %s to %d", topic, fd);
+	}
+
+	if (shared)
+		psmqd_broker_pending_put(shared);
+
+	psmq_shm_ref(slab, block, -1);
+	psmqd_broker_stats_time(start);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Unpacks batch of publishes and routes each of them, as if they were
+    sent in separate messages.
+    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+    request:
+            ctrl.cmd    char    PSMQ_CTRL_CMD_PUBLISH_BATCH
+            ctrl.data   uchar   file descriptor of requesting client
+            paylen      uint    size of all records
+            data
+                topic   str     empty string
+                records any     records, one after another, each is:
+                    paylen  ushort  size of payload, not aligned
+                    topic   str     topic to publish message on
+                    payload any     data to publish
+
+    response:
+            none        -       same as with PSMQ_CTRL_CMD_PUBLISH
+   ========================================================================== */
+
+
+static int psmqd_broker_publish_batch
+(
+	struct psmq_msg          *msg,    /* batch published by client */
+	unsigned short            fd,     /* client's file descriptor */
+	unsigned int              prio,   /* message priority */
+	const struct psmq_trace  *trace   /* timestamps of batch or NULL */
+)
+{
+	struct psmq_msg   pub;       /* single unpacked publish */
+	const char       *rec;       /* current record */
+	const char       *end;       /* end of records */
+	unsigned short    paylen;    /* payload length of current record */
+	size_t            topiclen;  /* length of topic, with null */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* batch topic is verified for null termination during
+	 * reception, and paylen checked against received data */
+	rec = msg->data + strlen(msg->data) + 1;
+	end = rec + msg->paylen;
+
+	while (rec != end)
+	{
+		/* records come from client, so each one must be
+		 * checked if it really fits into what's left */
+		if ((size_t)(end - rec) < sizeof(paylen) + 1)
+			break;
+
+		memcpy(&paylen, rec, sizeof(paylen));
+		rec += sizeof(paylen);
+
+		if (memchr(rec, '\0', end - rec) == NULL)
+			break;
+
+		topiclen = strlen(rec) + 1;
+		if ((size_t)(end - rec) < topiclen + paylen)
+			break;
+
+		pub.ctrl.cmd = PSMQ_CTRL_CMD_PUBLISH;
+		pub.ctrl.data = 0;
+		pub.paylen = paylen;
+		memcpy(pub.data, rec, topiclen + paylen);
+		psmqd_broker_publish(&pub, fd, prio, NULL, trace);
+
+		rec += topiclen + paylen;
+	}
+
+	if (rec == end)
+		return 0;
+
+	el_oprint(OELW, "[%3d] malformed batch, dropping %lu bytes of it, "
+			"hexdump of msg is:", fd, (unsigned long)(end - rec));
+	el_opmemory(OELW, msg, sizeof(*msg));
+	return -1;
+}
+
+
+/* ==========================================================================
+    Registers topic alias for the client. Client can later publish on that
+    topic by sending only alias instead of full topic. Subscribers of the
+    topic are resolved once and reused until subscriptions change, so
+    publishing by alias does not need to match topic at all. Registering
+    alias that is already set replaces it.
+    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+    request:
+            ctrl.cmd    char    PSMQ_CTRL_CMD_ALIAS
+            ctrl.data   uchar   file descriptor of the client
+            paylen      uint    1
+            data
+                topic   str     topic to create alias for
+                alias   uchar   alias to register, less than PSMQ_MAX_ALIASES
+
+    response
+            ctrl.cmd    char    PSMQ_CTRL_CMD_ALIAS
+            ctrl.data   uchar   0 on success, otherwise errno
+            data        str     topic from request
+
+    errno for response:
+            EBADMSG     topic is invalid or payload is not a single byte
+            EINVAL      alias is not less than PSMQ_MAX_ALIASES
+            ENOMEM      not enough memory to register alias
+   ========================================================================== */
+
+
+static int psmqd_broker_alias
+(
+	struct psmq_msg  *msg,    /* alias registration request */
+	unsigned short    fd      /* client's file descriptor */
+)
+{
+	unsigned char     id;     /* alias to register */
+	char             *topic;  /* topic to register alias for */
+	char             *copy;   /* copy of topic, kept by alias */
+	struct alias     *alias;  /* registered alias */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	topic = msg->data;
+
+	if (msg->paylen != 1 || topic[0] != '/')
+	{
+		el_oprint(OELW, "[%3d] alias error, invalid request for %s",
+				fd, topic);
+		psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_ALIAS, EBADMSG, topic);
+		return -1;
+	}
+
+	id = (unsigned char)topic[strlen(topic) + 1];
+	if (id >= PSMQ_MAX_ALIASES)
+	{
+		el_oprint(OELW, "[%3d] alias error, alias %d out of range",
+				fd, id);
+		psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_ALIAS, EINVAL, topic);
+		return -1;
+	}
+
+	if (clients[fd].aliases == NULL)
+	{
+		clients[fd].aliases = calloc(PSMQ_MAX_ALIASES,
+				sizeof(*clients[fd].aliases));
+		if (clients[fd].aliases == NULL)
+		{
+			el_operror(OELW, "[%3d] alias error, no memory", fd);
+			psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_ALIAS, ENOMEM, topic);
+			return -1;
+		}
+	}
+
+	if ((copy = malloc(strlen(topic) + 1)) == NULL)
+	{
+		el_operror(OELW, "[%3d] alias error, no memory", fd);
+		psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_ALIAS, ENOMEM, topic);
+		return -1;
+	}
+
+	strcpy(copy, topic);
+	alias = &clients[fd].aliases[id];
+	free(alias->topic);
+	alias->topic = copy;
+	/* when route cannot be resolved now, it
+	 * will be tried again on first publish */
+	alias->gen = routegen - 1;
+	if (psmqd_broker_route_match(copy, psmqd_tl_hash(copy),
+				&alias->route) == 0)
+		alias->gen = routegen;
+
+	el_oprint(OELN, "[%3d] alias %d set to %s", fd, id, topic);
+	psmqd_broker_reply_ctrl(fd, PSMQ_CTRL_CMD_ALIAS, 0, topic);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Publishes message on topic previously registered as alias by the
+    client. Message is forwarded to subscribers as ordinary publish, with
+    full topic, so they don't need to know anything about aliases.
+    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+    request:
+            ctrl.cmd    char    PSMQ_CTRL_CMD_PUBLISH_ALIAS
+            ctrl.data   uchar   file descriptor of requesting client
+            paylen      uint    size of payload + 1
+            data
+                topic   str     empty string
+                alias   uchar   alias registered by the client
+                payload any     data to publish
+
+    response:
+            none        -       same as with PSMQ_CTRL_CMD_PUBLISH
+   ========================================================================== */
+
+
+static int psmqd_broker_publish_alias
+(
+	struct psmq_msg          *msg,    /* published message by client */
+	unsigned short            fd,     /* client's file descriptor */
+	unsigned int              prio,   /* message priority */
+	const struct psmq_trace  *trace   /* timestamps of message or NULL */
+)
+{
+	unsigned char     id;        /* alias message is published on */
+	const char       *payload;   /* payload to publish */
+	struct alias     *alias;     /* alias message is published on */
+	struct psmq_msg   pub;       /* message with full topic */
+	size_t            topiclen;  /* length of topic, with null */
+	unsigned long     hash;      /* psmqd_tl_hash() of alias topic */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	payload = msg->data + strlen(msg->data) + 1;
+	id = msg->paylen ? (unsigned char)payload[0] : UCHAR_MAX;
+
+	if (id >= PSMQ_MAX_ALIASES || clients[fd].aliases == NULL ||
+			clients[fd].aliases[id].topic == NULL)
+	{
+		el_oprint(OELW, "[%3d] publish on unknown alias %d", fd, id);
+		return -1;
+	}
+
+	alias = &clients[fd].aliases[id];
+	topiclen = strlen(alias->topic) + 1;
+	if (topiclen + msg->paylen - 1 > sizeof(pub.data))
+	{
+		el_oprint(OELW, "[%3d] publish on alias %d, payload too big "
+				"for topic %s", fd, id, alias->topic);
+		return -1;
+	}
+
+	/* subscriptions changed since we've last
+	 * looked, subscribers need to be found again */
+	if (alias->gen != routegen)
+	{
+		hash = psmqd_tl_hash(alias->topic);
+		if (psmqd_broker_route_match(alias->topic, hash,
+					&alias->route) != 0)
+		{
+			el_operror(OELE, "[%3d] no memory to route alias %d",
+					fd, id);
+			return -1;
+		}
+
+		alias->gen = routegen;
+	}
+
+	pub.ctrl.cmd = PSMQ_CTRL_CMD_PUBLISH;
+	pub.ctrl.data = 0;
+	pub.paylen = msg->paylen - 1;
+	memcpy(pub.data, alias->topic, topiclen);
+	memcpy(pub.data + topiclen, payload + 1, pub.paylen);
+	return psmqd_broker_publish(&pub, fd, prio, &alias->route, trace);
+}
+
+
+/* ==========================================================================
+    Changes settings for client to alter how broker interacts with client.
+    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+     request:
+            ctrl.cmd    char    PSMQ_CTRL_CMD_IOCTL
+            ctrl.data   uchar   file descriptor of requesting client
+            paylen      uint    size of data.payload
+            data
+                ioctl   uchar   ioctl request
+                data    varial  variable, depending on ioctl request
+
+    response
+            ctrl.cmd    char    PSMQ_CTRL_CMD_IOCTL
+            ctrl.data   uchar   0 on success, otherwise errno
+            paylen      uint    size of data.payload
+            data
+                ioctl   uchar   ioctl request that was requested to be set
+                data    varial  newly set value of request
+   ========================================================================== */
+
+
+static void psmqd_broker_reply_ioctl
+(
+	int            fd,       /* fd of client to send message to */
+	unsigned char  err,      /* errno reply */
+	unsigned char  req,      /* ioctl request */
+	void          *data,     /* extra data */
+	int            datalen   /* length of extra */
+)
+{
+	char           buf[16];  /* req + data to send to client */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	/* invalid request is echoed back, but it can be
+	 * as big as client wants */
+	if (datalen > (int)sizeof(buf) - 1)
+		datalen = sizeof(buf) - 1;
+
+	buf[0] = req;
+	if (data)
+		memcpy(buf + 1, data, datalen);
+	psmqd_broker_reply(fd, PSMQ_CTRL_CMD_IOCTL, err, NULL, buf, 1 + datalen, 0);
+}
+
+static int psmqd_broker_ioctl
+(
+	struct psmq_msg  *msg,      /* ioctl request */
+	unsigned short    fd        /* client's file descriptor */
+)
+{
+	struct client    *client;   /* handle to client that requested ioctl */
+	struct target    *target;   /* hot part of client's state */
+	unsigned char     req;      /* ioctl request */
+	char             *data;     /* data associated with req */
+	unsigned short    dlen;     /* length of data */
+	struct bucket    *bucket;   /* bucket to set limit of */
+	unsigned int      limit[2]; /* rate and burst of limit */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	req = msg->data[0];
+	client = &clients[fd];
+	target = &targets[fd];
+
+	if (msg->paylen < 1)
+	{
+		el_oprint(OELE, "[%3d] ioctl error, no request specified", fd);
+		psmqd_broker_reply_ioctl(fd, EINVAL, 0, NULL, 0);
+		return -1;
+	}
+
+	/* set data to contain only data associated
+	 * with req without request id itself */
+	dlen = msg->paylen - 1;
+	data = msg->data + 1;
+
+	switch (req)
+	{
+	case PSMQ_IOCTL_REPLY_TIMEOUT:
+		if (dlen != sizeof(client->reply_timeout))
+		{
+			el_oprint(OELE, "[%3d] ioctl error, invalid data", fd);
+			psmqd_broker_reply_ioctl(fd, EINVAL, req, data, dlen);
+			return -1;
+		}
+
+		memcpy(&client->reply_timeout, data, dlen);
+		el_oprint(OELN, "[%3d] ioctl: set reply_timeout to %u",
+				fd, client->reply_timeout);
+		psmqd_broker_reply_ioctl(fd, 0, req, &client->reply_timeout, dlen);
+		return 0;
+
+	case PSMQ_IOCTL_TRACE:
+		if (dlen != sizeof(target->trace) || data[0] > 1)
+		{
+			el_oprint(OELE, "[%3d] ioctl error, invalid data", fd);
+			psmqd_broker_reply_ioctl(fd, EINVAL, req, data, dlen);
+			return -1;
+		}
+
+		if (target->trace != data[0])
+			ntraced += data[0] ? 1 : -1;
+
+		target->trace = data[0];
+		el_oprint(OELN, "[%3d] ioctl: set trace to %u", fd, target->trace);
+		psmqd_broker_reply_ioctl(fd, 0, req, &target->trace, dlen);
+		return 0;
+
+	case PSMQ_IOCTL_PUB_LIMIT:
+	case PSMQ_IOCTL_RECV_LIMIT:
+		if (dlen == sizeof(limit))
+			memcpy(limit, data, dlen);
+
+		/* bigger values would overflow bucket
+		 * on systems with 32 bit long */
+		if (dlen != sizeof(limit) || limit[0] > PSMQ_LIMIT_MAX ||
+				limit[1] > PSMQ_LIMIT_MAX)
+		{
+			el_oprint(OELE, "[%3d] ioctl error, invalid data", fd);
+			psmqd_broker_reply_ioctl(fd, EINVAL, req, data, dlen);
+			return -1;
+		}
+
+		bucket = req == PSMQ_IOCTL_PUB_LIMIT ?
+			&client->publim : &target->recvlim;
+		psmqd_broker_bucket_set(bucket, limit[0], limit[1]);
+		limit[1] = bucket->burst;
+
+		el_oprint(OELN, "[%3d] ioctl: set %s limit to %u/s burst %u", fd,
+				req == PSMQ_IOCTL_PUB_LIMIT ? "publish" : "receive",
+				limit[0], limit[1]);
+		psmqd_broker_reply_ioctl(fd, 0, req, limit, dlen);
+		return 0;
+
+	default:
+		el_oprint(OELE, "[%3d] ioctl error, invalid request: %d", fd, req);
+		psmqd_broker_reply_ioctl(fd, EINVAL, req, NULL, 0);
+		return -1;
+
+	}
+}
+
+/* ==========================================================================
+    Publishes 'payload' string on 'topic' in the name of broker itself.
+    Payload is list of space separated key=value pairs, when it does not
+    fit into PSMQ_MSG_MAX, it's split between pairs and sent in as many
+    messages as needed, each being valid report on its own. Pair that
+    does not fit even alone is dropped with warning.
+   ========================================================================== */
+
+
+static void psmqd_broker_stats_send
+(
+	const char      *topic,    /* topic to publish on */
+	const char      *payload   /* null terminated payload */
+)
+{
+	struct psmq_msg  msg;      /* message to publish */
+	size_t           tlen;     /* length of topic with null */
+	size_t           max;      /* max length of payload, without null */
+	size_t           plen;     /* length of payload chunk to send */
+	size_t           klen;     /* length of current key=value pair */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	tlen = strlen(topic) + 1;
+	if (tlen + 1 >= sizeof(msg.data))
+	{
+		el_oprint(OELW, "stats topic %s too big for PSMQ_MSG_MAX", topic);
+		return;
+	}
+
+	max = sizeof(msg.data) - tlen - 1;
+	msg.ctrl.cmd = PSMQ_CTRL_CMD_PUBLISH;
+	msg.ctrl.data = 0;
+	memcpy(msg.data, topic, tlen);
+
+	while (*payload)
+	{
+		/* take as many whole pairs as will fit */
+		plen = 0;
+		while (payload[plen])
+		{
+			klen = strcspn(payload + plen + 1, " ") + 1;
+			if (plen + klen > max)
+				break;
+
+			plen += klen;
+		}
+
+		if (plen == 0)
+		{
+			klen = strcspn(payload, " ");
+			el_oprint(OELW, "stats %.*s on %s too big for PSMQ_MSG_MAX, "
+					"dropped", (int)klen, payload, topic);
+			payload += klen;
+			payload += *payload == ' ';
+			continue;
+		}
+
+		memcpy(msg.data + tlen, payload, plen);
+		msg.data[tlen + plen] = '\0';
+		msg.paylen = plen + 1;
+		psmqd_broker_publish(&msg, PSMQD_SELF_FD, 0, NULL, NULL);
+
+		payload += plen;
+		payload += *payload == ' ';
+	}
+}
+
+
+/* ==========================================================================
+    Publishes statistics gathered since broker started. Payloads are
+    human readable, space separated key=value pairs, so they can be
+    looked at with psmq-sub without any extra tools.
+
+        /$sys/broker/stats       global counters, "rate" is number of
+                                 messages published per second since
+                                 previous report
+        /$sys/broker/cmd         number of requests, per command
+        /$sys/broker/latency     routing time histogram, key is upper
+                                 bound of bucket in microseconds
+        /$sys/broker/client/<fd> per client queue depth and counters
+
+    Report that does not fit into single message is sent in parts.
+   ========================================================================== */
+
+
+static void psmqd_broker_stats_publish(void)
+{
+	char             topic[32];  /* topic to publish client stats on */
+	char             st[256];    /* global stats payload */
+	char             cmd[512];   /* per command stats payload */
+	char             lat[512];   /* latency histogram payload */
+	size_t           len;        /* length of payload so far */
+	unsigned long    valid;      /* number of recognized requests */
+	unsigned long    rate;       /* publishes per second */
+	unsigned long    now;        /* current psmq_mono_ms() */
+	unsigned long    elapsed;    /* ms since previous report */
+	struct mq_attr   mqa;        /* client queue attributes */
+	unsigned short   queued;     /* messages queued in broker for client */
+	unsigned char    missed;     /* client missed pubs */
+	int              nclients;   /* number of connected clients */
+	unsigned int     i;          /* iterator */
+	int              fd;         /* client to report */
+	unsigned long    word;       /* not yet reported clients of word */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	nclients = 0;
+	for (i = 0; i != (unsigned int)PSMQD_CUSED_WORDS; ++i)
+		nclients += psmq_bm_count(cused[i]);
+
+	valid = 0;
+	len = 0;
+	cmd[0] = '\0';
+	for (i = 0; i != sizeof(stats.cmds) / sizeof(*stats.cmds); ++i)
+	{
+		valid += stats.cmds[i];
+		len += snprintf(cmd + len, sizeof(cmd) - len, "%s%c=%lu",
+				i ? " " : "", PSMQD_STATS_CMDS[i], stats.cmds[i]);
+
+		/* snprintf() returns length it wanted to print,
+		 * which may be more than there was space for */
+		len = len < sizeof(cmd) ? len : sizeof(cmd) - 1;
+	}
+
+	len = 0;
+	for (i = 0; i != sizeof(stats.hist) / sizeof(*stats.hist); ++i)
+	{
+		if (i == sizeof(stats.hist) / sizeof(*stats.hist) - 1)
+			len += snprintf(lat + len, sizeof(lat) - len, " inf=%lu",
+					stats.hist[i]);
+		else
+			len += snprintf(lat + len, sizeof(lat) - len, "%s%luus=%lu",
+					i ? " " : "", 1ul << i, stats.hist[i]);
+		len = len < sizeof(lat) ? len : sizeof(lat) - 1;
+	}
+
+	/* report may come late when broker was busy, so rate is
+	 * computed over time that really passed, not over configured
+	 * interval */
+	now = psmq_mono_ms();
+	elapsed = now - stats_last;
+	elapsed = elapsed ? elapsed : 1;
+	rate = (stats.published - stats.lastpublished) * 1000 / elapsed;
+
+	snprintf(st, sizeof(st), "clients=%d published=%lu rate=%lu "
+			"delivered=%lu nomatch=%lu invalid=%lu preempted=%lu "
+			"limited=%lu conflated=%lu retained=%lu", nclients,
+			stats.published, rate, stats.delivered, stats.nomatch,
+			stats.received - valid, stats.preempted, stats.limited,
+			stats.conflated, (unsigned long)retained.n);
+
+	/* all payloads are prepared before first publish, since
+	 * publishing stats bumps counters too */
+	psmqd_broker_stats_send(PSMQD_SYS_TOPIC "broker/stats", st);
+	psmqd_broker_stats_send(PSMQD_SYS_TOPIC "broker/cmd", cmd);
+	psmqd_broker_stats_send(PSMQD_SYS_TOPIC "broker/latency", lat);
+
+	for (i = 0; i != (unsigned int)PSMQD_CUSED_WORDS; ++i)
+	{
+		for (word = cused[i]; word; word &= word - 1)
+		{
+			fd = i * PSMQ_BM_BITS + psmq_bm_ctz(word);
+			mqa.mq_curmsgs = 0;
+			mq_getattr(clients[fd].mq, &mqa);
+
+			pthread_mutex_lock(&wlock);
+			queued = clients[fd].qcount;
+			missed = clients[fd].missed_pubs;
+			pthread_mutex_unlock(&wlock);
+
+			sprintf(topic, PSMQD_SYS_TOPIC "broker/client/%d", fd);
+			snprintf(st, sizeof(st), "depth=%ld queued=%u missed=%u "
+					"delivered=%lu limited=%lu", (long)mqa.mq_curmsgs,
+					queued, missed, targets[fd].delivered,
+					clients[fd].limited);
+			psmqd_broker_stats_send(topic, st);
+		}
+	}
+
+	/* don't count our own reports into next rate */
+	stats.lastpublished = stats.published;
+	stats_last = now;
+}
+
+
+/* ==========================================================================
+    Publishes statistics when it's time to do so. Returns number of
+    milliseconds until next report is due, or -1 when statistics are
+    disabled, so it can be used directly as timeout to wait for next
+    message.
+   ========================================================================== */
+
+
+static int psmqd_broker_stats_tick(void)
+{
+	long  left;  /* ms left until next report */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_psmqd_cfg.broker_stats == 0)
+		return -1;
+
+	/* clock wraps, so only difference is meaningful */
+	left = (long)(stats_next - psmq_mono_ms());
+	if (left > 0)
+		return left;
+
+	psmqd_broker_stats_publish();
+	stats_next = psmq_mono_ms() + g_psmqd_cfg.broker_stats;
+	return g_psmqd_cfg.broker_stats;
+}
+
+
+/* ==========================================================================
+    Validates and processes single request 'req' of length 'len' received
+    on control queue. Message is not zeroed before receiving, so it is
+    validated against number of bytes that were actually received.
+    Function makes sure that topic is null terminated and paylen does not
+    claim more data than there was received.
+
+    Requests are described with fd in ctrl.data, as PSMQ_PROTO_V1 client
+    sends them. PSMQ_PROTO_V2 client sets PSMQ_CTRL_V2 in ctrl.cmd, and
+    sends his fd as unsigned short right after the request instead. It's
+    taken off here, so handlers get the same request from both.
+   ========================================================================== */
+
+
+static void psmqd_broker_process
+(
+	struct psmq_req  *req,       /* received request */
+	size_t            len,       /* number of bytes received */
+	unsigned int      prio       /* message priority */
+)
+{
+	struct psmq_msg  *msg;       /* message part of req */
+	unsigned short    fd;        /* client that sent request */
+	size_t            hdrlen;    /* length of message header */
+	size_t            datalen;   /* number of bytes received in msg->data */
+	size_t            needlen;   /* number of bytes msg claims to have */
+	const char       *cmd;       /* command position in PSMQD_STATS_CMDS */
+	struct psmq_trace trace;     /* timestamps of traced publish */
+	struct psmq_trace *tr;       /* trace to pass on or NULL */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	++stats.received;
+
+	/* message was received just now, reading clock
+	 * is not free, so only do it when it's needed */
+	trace.brecv = ntraced ? psmq_trace_now() : 0;
+
+	/* message, received, now what to do with
+	 * it? Well, at first let's try to validate it */
+
+	msg = &req->msg;
+	hdrlen = sizeof(msg->ctrl) + sizeof(msg->paylen);
+	if (len < hdrlen ||
+			((unsigned char)msg->ctrl.cmd & PSMQ_CTRL_V2 &&
+			 len < hdrlen + sizeof(fd)))
+	{
+		el_oprint(OELW, "incoming msg: too short (%lu), hexdump of msg is:",
+				(unsigned long)len);
+		el_opmemory(OELW, req, len);
+		return;
+	}
+
+	fd = (unsigned char)msg->ctrl.data;
+	if ((unsigned char)msg->ctrl.cmd & PSMQ_CTRL_V2)
+	{
+		/* from now on request looks like it
+		 * came from V1 client */
+		len -= sizeof(fd);
+		memcpy(&fd, (char *)req + len, sizeof(fd));
+		msg->ctrl.cmd = (char)((unsigned char)msg->ctrl.cmd & ~PSMQ_CTRL_V2);
+		msg->ctrl.data = 0;
+	}
+
+	/* all topics must be strings, so check if it is
+	 * nullified. Instead of zeroing whole message before
+	 * receiving, terminate only what we received, if there
+	 * is no null in received data, topic ends here. */
+	datalen = len - hdrlen;
+	if (datalen < sizeof(msg->data))
+		msg->data[datalen] = '\0';
+
+	if (memchr(msg->data, '\0', sizeof(msg->data)) == NULL)
+	{
+		el_oprint(OELW, "incoming msg: topic is not null terminated "
+				"hexdump of msg is:");
+		el_opmemory(OELW, msg, len);
+		return;
+	}
+
+	/* does message holds valid payload? Ioctl messages
+	 * don't carry topic, only payload */
+	needlen = msg->paylen;
+	if (msg->ctrl.cmd != PSMQ_CTRL_CMD_IOCTL)
+		needlen += strlen(msg->data) + 1;
+
+	if (needlen > datalen + 1 || needlen > sizeof(msg->data))
+	{
+		/* topic + length of payload claimed by the
+		 * client is more than what we received. One
+		 * byte more is fine, it's the null we put
+		 * after received data, so topic may come
+		 * without its null character. */
+		el_oprint(OELW, "incoming msg: invalid paylen, hexdump of msg is:");
+		el_opmemory(OELW, msg, len);
+		return;
+	}
+
+	if (msg->ctrl.cmd != PSMQ_CTRL_CMD_OPEN && fd >= nslots)
+	{
+		/* all messages are required to send valid
+		 * file descriptor, only open request does
+		 * not require it (since user requests fd
+		 * to be allocated for him to use).
+		 *
+		 * We cannot send back error to the client
+		 * since we do not have proper fd, so only
+		 * log the warning. */
+		el_oprint(OELW, "msg with invalid fd (%d) received, hexdump is:",
+				fd);
+		el_opmemory(OELW, msg, len);
+		return;
+	}
+
+	if (msg->ctrl.cmd != PSMQ_CTRL_CMD_OPEN && clients[fd].mq == (mqd_t)-1)
+	{
+		/* fd is valid, but there is no client using it,
+		 * there is no one to reply to, and we don't want
+		 * any topics to be left on a free slot for next
+		 * client to inherit */
+		el_oprint(OELW, "msg for not connected fd (%d) received, "
+				"hexdump is:", fd);
+		el_opmemory(OELW, msg, len);
+		return;
+	}
+
+	/* at this point we are sure that topic is properly
+	 * nullified and payload fits into buffer */
+
+	el_oprint(OELD, "got control message: %c", msg->ctrl.cmd);
+	el_opmemory(OELD, msg, len);
+
+	cmd = strchr(PSMQD_STATS_CMDS, msg->ctrl.cmd);
+	if (cmd && msg->ctrl.cmd != '\0')
+		++stats.cmds[cmd - PSMQD_STATS_CMDS];
+
+	/* tracing publisher puts his send time right after
+	 * payload, it may be missing if it didn't fit */
+	tr = NULL;
+	if (ntraced)
+	{
+		trace.sent = 0;
+		trace.bsend = 0;
+		tr = &trace;
+
+		if ((msg->ctrl.cmd == PSMQ_CTRL_CMD_PUBLISH ||
+				msg->ctrl.cmd == PSMQ_CTRL_CMD_PUBLISH_SHM ||
+				msg->ctrl.cmd == PSMQ_CTRL_CMD_PUBLISH_ALIAS ||
+				msg->ctrl.cmd == PSMQ_CTRL_CMD_PUBLISH_RETAIN) &&
+				targets[fd].trace &&
+				datalen >= needlen + sizeof(trace.sent))
+			memcpy(&trace.sent, msg->data + needlen, sizeof(trace.sent));
+	}
+
+	switch (msg->ctrl.cmd)
+	{
+		case 'o': psmqd_broker_open(msg); break;
+		case 'c': psmqd_broker_close(fd); break;
+		case 's': psmqd_broker_subscribe(msg, fd); break;
+		case 'u': psmqd_broker_unsubscribe(msg, fd); break;
+		case 'p': psmqd_broker_publish(msg, fd, prio, NULL, tr); break;
+		case 'l': psmqd_broker_publish(msg, fd, prio, NULL, tr); break;
+		case 'b': psmqd_broker_publish_batch(msg, fd, prio, tr); break;
+		case 'a': psmqd_broker_alias(msg, fd); break;
+		case 'n': psmqd_broker_publish_alias(msg, fd, prio, tr); break;
+		case 'r': psmqd_broker_publish(msg, fd, prio, NULL, tr); break;
+		case 'i': psmqd_broker_ioctl(msg, fd); break;
+		case PSMQD_CTRL_CMD_KILL: psmqd_broker_kill(fd); break;
+		default:
+			el_oprint(OELW, "received unknown request '%c'",
+					msg->data[1]);
+	}
+}
+
+
+/* ==========================================================================
+    Processes message 'msg' of length 'len' that was just received from
+    control queue. When batching is enabled (broker_batch > 1), it then
+    takes up to broker_batch - 1 more messages from control queue without
+    blocking. This way, when messages come in bursts, we don't pay for
+    going to sleep and waking up for every single message.
+
+    When there are messages in backlog, received message joins them and
+    the one with highest priority is processed instead. 'len' may be -1
+    then, to process message from backlog only.
+
+    Returns 0 when broker should go back to sleep, and -1 on fatal error.
+   ========================================================================== */
+
+
+static int psmqd_broker_receive
+(
+	struct psmq_req  *msg,     /* received message */
+	ssize_t           len,     /* length of msg, or -1 when receive failed */
+	unsigned int      prio     /* priority of msg */
+)
+{
+	int               i;       /* number of processed messages */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0;;)
+	{
+		if (nbacklog)
+		{
+			/* some messages were taken ahead of
+			 * their turn during fan-out, and they
+			 * are older than what we got now */
+			if (len >= 0)
+				psmqd_broker_backlog_add(msg, len, prio);
+
+			len = psmqd_broker_backlog_take(msg, &prio);
+		}
+
+		if (len < 0)
+		{
+			/* if we are interrupted by signal,
+			 * continue to check if it was
+			 * shutdown signal or not
+			 *
+			 * or
+			 *
+			 * if timeout occured continue to
+			 * check for shutdown flag (check
+			 * comment in psmqd_broker_loop()
+			 * to see why it's here
+			 *
+			 * or
+			 *
+			 * if there are no more messages
+			 * for batch, go back to sleep */
+			if (errno == EINTR || errno == ETIMEDOUT ||
+					errno == EAGAIN)
+				return 0;
+
+			/* got some other, fatal, error. Log
+			 * and exit since error is * unrecoverable */
+			el_operror(OELF, "mq_receive(qctrl)");
+			return -1;
+		}
+
+		psmqd_broker_process(msg, len, prio);
+
+		if (++i == g_psmqd_cfg.broker_batch)
+			return 0;
+
+		/* batch is not yet full, take another
+		 * message, but only if it's already
+		 * there, don't wait for it */
+		len = mq_receive(qbatch, (char *)msg, sizeof(*msg), &prio);
+	}
+}
+
+
+/* ==========================================================================
+    Portable main loop of the broker, it waits for messages and processes
+    them. Used when epoll is not available.
+   ========================================================================== */
+
+
+static int psmqd_broker_loop(void)
+{
+	for (;;)
+	{
+		struct timespec  tp;        /* timeout for mq_timedreceive() */
+		struct psmq_req  msg;       /* received message from client */
+		unsigned int     prio;      /* received message priority */
+		ssize_t          len;       /* length of received message */
+		int              wait;      /* max ms to wait for message */
+		int              tick;      /* ms until next stats report */
+		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+		/* try to send parked messages first, and if some
+		 * of them are still parked, wake up soon to try
+		 * again */
+		if (nparked)
+			psmqd_broker_flush();
+
+		wait = nparked ? PSMQD_FLUSH_MS : 5000;
+		tick = psmqd_broker_stats_tick();
+		if (tick >= 0 && tick < wait)
+			wait = tick;
+
+		/* don't sleep when there are messages in backlog */
+		if (nbacklog)
+			wait = 0;
+
+		psmq_ms_to_tp(wait, &tp);
+
+		if (g_psmqd_shutdown)
+		{
+			/* shutdown flag was set, so we exit our loop, and
+			 * terminate */
+			el_oprint(OELN, "shutdown flag was set, exit broker");
+			return 0;
+		}
+
+		/* wait for message from client, there is no need to use
+		 * timedreceive, to check for g_psmqd_shutdown flag, as we will
+		 * get EINTR when signal is received
+		 *
+		 * Now there is very slim chance, that when SIGINT comes in
+		 * to set g_psmqd_shutdown to 1, it comes exactly in this
+		 * very place, that is after if() check and before
+		 * mq_receive() and that will cause deadlock, since program
+		 * will lock in mq_receive() after signal arrives, so it
+		 * will be locked forever (or until someone sends another
+		 * signal or some message). To prevent it, we wake up every
+		 * 5 seconds to force another check of shutdown flag. It's
+		 * a small price to pay for not having deadlocks. */
+		len = mq_timedreceive(qctrl, (char *)&msg, sizeof(msg), &prio, &tp);
+		if (psmqd_broker_receive(&msg, len, prio) != 0)
+			return -1;
+	}
+}
+
+
+#if PSMQD_EPOLL
+
+/* ==========================================================================
+    Prepares epoll loop. Shutdown signals are blocked and received via
+    signalfd instead, so they cannot slip in between checking shutdown
+    flag and going to sleep, and we don't have to wake up periodically
+    to check for it.
+
+    Returns 0 on success, or -1 when epoll cannot be used.
+   ========================================================================== */
+
+
+static int psmqd_broker_epoll_init(void)
+{
+	struct epoll_event  ev;    /* event to watch for */
+	sigset_t            set;   /* signals to receive via sigfd */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
+		return -1;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &sigold);
+
+	sigfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sigfd == -1)
+		goto error;
+
+	memset(&ev, 0x00, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = PSMQD_EV_SIGNAL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) != 0)
+		goto error;
+
+	ev.data.u32 = PSMQD_EV_QCTRL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, qctrl, &ev) != 0)
+		goto error;
+
+	return 0;
+
+error:
+	if (sigfd != -1)
+		close(sigfd);
+	pthread_sigmask(SIG_SETMASK, &sigold, NULL);
+	close(epfd);
+	sigfd = -1;
+	epfd = -1;
+	return -1;
+}
+
+
+/* ==========================================================================
+    Releases what psmqd_broker_epoll_init() created. Clients' mqueues
+    that are still watched are dropped from epoll when it's closed.
    ========================================================================== */
 
 
-static int psmqd_broker_publish
-(
-	struct psmq_msg  *msg,       /* published message by client */
-	unsigned int      prio       /* message priority */
-)
+static void psmqd_broker_epoll_cleanup(void)
 {
-	unsigned char     fd;        /* client's file descriptor */
-	struct psmqd_tl   *node;     /* node with subscribed topic */
-	void              *payload;  /* payload to publish */
-	char              *topic;    /* topic to publish message on */
-	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+	close(sigfd);
+	close(epfd);
+	sigfd = -1;
+	epfd = -1;
+	pthread_sigmask(SIG_SETMASK, &sigold, NULL);
+}
 
 
-	/* topic is verified for null termination
-	 * during data reception */
-	topic = msg->data;
-	payload = msg->data + strlen(topic) + 1;
+/* ==========================================================================
+    Main loop of the broker for systems with epoll. Broker sleeps until
+    there is message on control queue, shutdown signal arrives or client
+    with parked messages makes room in his queue.
+   ========================================================================== */
+
+
+static int psmqd_broker_loop_epoll(void)
+{
+	struct epoll_event       ev[16];  /* events that occured */
+	struct signalfd_siginfo  si;      /* received shutdown signal */
+	struct psmq_req          msg;     /* received message from client */
+	unsigned int             prio;    /* received message priority */
+	ssize_t                  len;     /* length of received message */
+	int                      n;       /* number of events in ev */
+	int                      wait;    /* ms until next stats report */
+	int                      i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-	el_oprint(OELD, "received publish from topic %s, payload (len: %u):",
-			topic, msg->paylen);
-	el_opmemory(OELD, payload, msg->paylen);
 
-	/* iterate through all clients and send
-	 * message to whoever is subscribed */
-	for (fd = 0; fd != PSMQ_MAX_CLIENTS; ++fd)
+	for (;;)
 	{
-		/* do we have client in this slot? */
-		if (clients[fd].mq == (mqd_t)-1)
-			continue;  /* nope */
+		if (g_psmqd_shutdown)
+		{
+			el_oprint(OELN, "shutdown flag was set, exit broker");
+			return 0;
+		}
 
-		/* iterate through list of topics for that
-		 * client to check if he is interested in
-		 * that message */
-		for (node = clients[fd].topics; node != NULL; node = node->next)
+		/* don't sleep when there are messages in backlog, but
+		 * still tick, so reports are not held back until
+		 * backlog drains */
+		wait = psmqd_broker_stats_tick();
+		n = epoll_wait(epfd, ev, sizeof(ev) / sizeof(*ev),
+				nbacklog ? 0 : wait);
+		if (n < 0)
 		{
-			/* is client subscribed to current topic? */
-			if (psmqd_broker_topic_matches(topic, node->topic) == 0)
-				continue;  /* nope */
+			if (errno == EINTR)
+				continue;
 
-			/* yes, we have a match, send message to the client */
-			if (psmqd_broker_reply(fd, PSMQ_CTRL_CMD_PUBLISH, 0,
-						topic, payload, msg->paylen, prio) != 0)
-			{
-				el_operror(OELE, "[%3d] sending failed. topic %s, prio %u,"
-						" payload (len: %u):", fd, topic, prio, msg->paylen);
-				el_opmemory(OELE, payload, msg->paylen);
+			el_operror(OELF, "epoll_wait()");
+			return -1;
+		}
 
-				if (clients[fd].missed_pubs >= PSMQ_MAX_MISSED_PUBS)
+		for (i = 0; i != n; ++i)
+		{
+			switch (ev[i].data.u32)
+			{
+			case PSMQD_EV_SIGNAL:
+				if (read(sigfd, &si, sizeof(si)) == sizeof(si))
 				{
-					struct psmq_msg  dummy;
-					struct timespec  tp;
-					/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
-
-
-					el_oprint(OELE, "[%3d] failed to send msg to client "
-							"for %d consecutive calls, delete client",
-							fd, PSMQ_MAX_MISSED_PUBS);
-
-					/* client assumed dead, it's queue now is
-					 * most probably full, but there still is
-					 * a chance that client is alive but just
-					 * hanged for a long time and will eventualy
-					 * read something from queue, but since
-					 * queue is full we cannot send him close
-					 * message. So to make sure there is close
-					 * message on the queue, we remove oldest
-					 * message from it and then call close().
-					 * We do not check for return code here,
-					 * if it does not work there is nothing
-					 * we can do. */
-					tp.tv_sec = 0;
-					tp.tv_nsec = 0;
-					mq_timedreceive(clients[fd].mq, (char *)&dummy,
-							sizeof(dummy), NULL, &tp);
-					psmqd_broker_close(fd);
-					break;
+					el_oprint(OELN, "received signal %u", si.ssi_signo);
+					g_psmqd_shutdown = 1;
 				}
-				continue;
-			}
+				break;
 
-			el_oprint(OELD, "published %s to %d", topic, fd);
+			case PSMQD_EV_QCTRL:
+				/* there is message waiting, so this won't block */
+				len = mq_receive(qctrl, (char *)&msg, sizeof(msg), &prio);
+				if (psmqd_broker_receive(&msg, len, prio) != 0)
+					return -1;
+				break;
 
-			/* now it may be possible that another topic will match
-			 * for this client, for example when topic is /a/s/d
-			 * and client subscribed to /a/s/d and /a/s/+. So we
-			 * leave this loop, so we don't send him same message
-			 * twice */
-			break;
+			default:
+				/* client made room in his queue, event
+				 * may be stale if client was closed
+				 * while processing previous events, but
+				 * then there is nothing to flush */
+				psmqd_broker_flush_client(ev[i].data.u32);
+			}
 		}
-	}
 
-	return 0;
+		if (nbacklog && psmqd_broker_receive(&msg, -1, 0) != 0)
+			return -1;
+	}
 }
 
+#endif /* PSMQD_EPOLL */
 
-/* ==========================================================================
-    Changes settings for client to alter how broker interacts with client.
-    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-     request:
-            ctrl.cmd    char    PSMQ_CTRL_CMD_IOCTL
-            ctrl.data   uchar   file descriptor of requesting client
-            paylen      uint    size of data.payload
-            data
-                ioctl   uchar   ioctl request
-                data    varial  variable, depending on ioctl request
+/* ==========================================================================
+    Creates shared memory slab for large payloads, with broker_shm blocks
+    of broker_shm_size bytes each. Clients map it when they connect.
 
-    response
-            ctrl.cmd    char    PSMQ_CTRL_CMD_IOCTL
-            ctrl.data   uchar   0 on success, otherwise errno
-            paylen      uint    size of data.payload
-            data
-                ioctl   uchar   ioctl request that was requested to be set
-                data    varial  newly set value of request
+    Returns 0 on success, or -1 on error.
    ========================================================================== */
 
 
-static void psmqd_broker_reply_ioctl
-(
-	int            fd,       /* fd of client to send message to */
-	unsigned char  err,      /* errno reply */
-	unsigned char  req,      /* ioctl request */
-	void          *data,     /* extra data */
-	int            datalen   /* length of extra */
-)
+static int psmqd_broker_slab_create(void)
 {
-	char           buf[16];  /* req + data to send to client */
+#if PSMQ_HAVE_SHM
+	char           name[256];  /* name of the slab */
+	unsigned int   blksize;    /* size of block, rounded up to align */
+	unsigned int   nblocks;    /* number of blocks in slab */
+	int            fd;         /* slab file descriptor */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-	buf[0] = req;
-	if (data)
-		memcpy(buf + 1, data, datalen);
-	psmqd_broker_reply(fd, PSMQ_CTRL_CMD_IOCTL, err, NULL, buf, 1 + datalen, 0);
-}
-
-static int psmqd_broker_ioctl
-(
-	struct psmq_msg  *msg       /* ioctl request */
-)
-{
-	struct client    *client;   /* handle to client that requested ioctl */
-	unsigned char     fd;       /* client's file descriptor */
-	unsigned char     req;      /* ioctl request */
-	char             *data;     /* data associated with req */
-	unsigned short    dlen;     /* length of data */
-	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
+	if (psmq_shm_name(name, sizeof(name), g_psmqd_cfg.broker_name) != 0)
+	{
+		el_oprint(OELF, "broker name too long for shm slab name");
+		return -1;
+	}
 
-	fd = msg->ctrl.data;
-	req = msg->data[0];
-	client = &clients[fd];
+	nblocks = g_psmqd_cfg.broker_shm;
+	blksize = (g_psmqd_cfg.broker_shm_size + PSMQ_SHM_ALIGN - 1) &
+		~(PSMQ_SHM_ALIGN - 1);
+	slablen = psmq_shm_size(nblocks, blksize);
+	if (slablen > UINT_MAX)
+	{
+		/* descriptors hold offsets as unsigned int */
+		el_oprint(OELF, "shm slab too big, max is %u bytes", UINT_MAX);
+		return -1;
+	}
 
-	if (msg->paylen < 1)
+	/* slab may be left over by crashed broker, clients
+	 * that still have it mapped won't notice, but new
+	 * ones will get fresh one */
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1)
 	{
-		el_oprint(OELE, "[%3d] ioctl error, no request specified", fd);
-		psmqd_broker_reply_ioctl(fd, EINVAL, 0, NULL, 0);
+		el_operror(OELF, "shm_open(%s)", name);
 		return -1;
 	}
 
-	/* set data to contain only data associated
-	 * with req without request id itself */
-	dlen = msg->paylen - 1;
-	data = msg->data + 1;
+	slab = MAP_FAILED;
+	if (ftruncate(fd, slablen) == 0)
+		slab = mmap(NULL, slablen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
 
-	switch (req)
+	if (slab == MAP_FAILED)
 	{
-	case PSMQ_IOCTL_REPLY_TIMEOUT:
-		if (dlen != sizeof(client->reply_timeout))
-		{
-			el_oprint(OELE, "[%3d] ioctl error, invalid data", fd);
-			psmqd_broker_reply_ioctl(fd, EINVAL, req, data, dlen);
-			return -1;
-		}
+		el_operror(OELF, "failed to map shm slab of %lu bytes",
+				(unsigned long)slablen);
+		shm_unlink(name);
+		slab = NULL;
+		return -1;
+	}
 
-		memcpy(&client->reply_timeout, data, dlen);
-		el_oprint(OELN, "[%3d] ioctl: set reply_timeout to %u",
-				fd, client->reply_timeout);
-		psmqd_broker_reply_ioctl(fd, 0, req, &client->reply_timeout, dlen);
-		return 0;
+	/* ftruncate() zeroed memory so all reference
+	 * counters are 0, that is all blocks are free.
+	 * Magic goes last, it tells clients slab is ready */
+	slab->nblocks = nblocks;
+	slab->blksize = blksize;
+	slab->hint = 0;
+	__atomic_store_n(&slab->magic, PSMQ_SHM_MAGIC, __ATOMIC_RELEASE);
 
-	default:
-		el_oprint(OELE, "[%3d] ioctl error, invalid request: %d", fd, req);
-		psmqd_broker_reply_ioctl(fd, EINVAL, req, NULL, 0);
-		return -1;
+	el_oprint(OELN, "created shm slab %s with %u blocks of %u bytes",
+			name, nblocks, blksize);
+	return 0;
+#else
+	el_oprint(OELF, "shared memory is not supported on this system");
+	return -1;
+#endif
+}
 
-	}
+
+/* ==========================================================================
+    Unmaps and removes slab created by psmqd_broker_slab_create().
+   ========================================================================== */
+
+
+static void psmqd_broker_slab_destroy(void)
+{
+#if PSMQ_HAVE_SHM
+	char  name[256];  /* name of the slab */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (slab == NULL)
+		return;
+
+	munmap(slab, slablen);
+	if (psmq_shm_name(name, sizeof(name), g_psmqd_cfg.broker_name) == 0)
+		shm_unlink(name);
+#endif
+
+	slab = NULL;
+	slablen = 0;
 }
 
+
 /* ==========================================================================
                        __     __ _          ____
         ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
@@ -866,9 +4125,81 @@ int psmqd_broker_init(void)
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	/* invalidate all clients, to mark those slot as unused */
-	for (i = 0; i != PSMQ_MAX_CLIENTS; ++i)
-		clients[i].mq = (mqd_t)-1;
+	/* clients table is empty, it will be
+	 * grown when first client connects */
+	clients = NULL;
+	targets = NULL;
+	cused = NULL;
+	rmatched = NULL;
+	wready = NULL;
+	nslots = 0;
+	memset(rscratch, 0x00, sizeof(rscratch));
+
+	wready_head = 0;
+	wready_n = 0;
+	wstop = 0;
+	nparked = 0;
+	ntraced = 0;
+	nbacklog = 0;
+	preempting = 0;
+	memset(&stats, 0x00, sizeof(stats));
+	stats_last = psmq_mono_ms();
+	stats_next = stats_last + g_psmqd_cfg.broker_stats;
+	qsize = g_psmqd_cfg.broker_workers ? PSMQD_CLIENT_QUEUE :
+		g_psmqd_cfg.broker_overflow;
+
+	/* close reply is the same for every client, and we
+	 * must be able to send it even when out of memory, so
+	 * it has static storage and reference that is never
+	 * dropped */
+	closemsg.len = psmqd_broker_msg_fill(&closemsg.msg,
+			PSMQ_CTRL_CMD_CLOSE, 0, NULL, NULL, 0);
+	closemsg.refs = 1;
+	closemsg.prio = 0;
+	closemsg.close = 1;
+
+	subtree = NULL;
+	memset(&topicmap, 0x00, sizeof(topicmap));
+
+	rcache = NULL;
+	if (g_psmqd_cfg.broker_route_cache &&
+			psmqd_broker_rcache_create(g_psmqd_cfg.broker_route_cache) != 0)
+		return -1;
+
+	/* one more than PSMQD_BACKLOG, for message received
+	 * from control queue when backlog is full */
+	backlog = NULL;
+	if (g_psmqd_cfg.broker_preempt)
+	{
+		backlog = malloc((PSMQD_BACKLOG + 1) * sizeof(*backlog));
+		if (backlog == NULL)
+		{
+			el_operror(OELF, "malloc(backlog)");
+			psmqd_broker_rcache_destroy();
+			return -1;
+		}
+	}
+
+	/* retained messages never take more memory than
+	 * user allowed, so whole arena is taken up front */
+	memset(&retained, 0x00, sizeof(retained));
+	if (g_psmqd_cfg.broker_retain &&
+			psmqd_rt_init(&retained, g_psmqd_cfg.broker_retain) != 0)
+	{
+		el_operror(OELF, "failed to create retained store");
+		free(backlog);
+		psmqd_broker_rcache_destroy();
+		return -1;
+	}
+
+	slab = NULL;
+	if (g_psmqd_cfg.broker_shm && psmqd_broker_slab_create() != 0)
+	{
+		psmqd_rt_destroy(&retained);
+		free(backlog);
+		psmqd_broker_rcache_destroy();
+		return -1;
+	}
 
 	/* remove control queue if it exist
 	 *
@@ -886,7 +4217,7 @@ int psmqd_broker_init(void)
 	 * receive various (like register, publish or
 	 * subscribe) requests via it */
 	memset(&mqa, 0x00, sizeof(mqa));
-	mqa.mq_msgsize = sizeof(struct psmq_msg);
+	mqa.mq_msgsize = sizeof(struct psmq_req);
 	mqa.mq_maxmsg = g_psmqd_cfg.broker_maxmsg;
 
 	/* now this is strage behaviour, on dragonfly bsd,
@@ -910,142 +4241,110 @@ int psmqd_broker_init(void)
 	/* tried to open mqueue for 10 times now, and
 	 * it's still failing. Oh well. */
 	if (i == 11)
+	{
+		psmqd_broker_slab_destroy();
+		psmqd_rt_destroy(&retained);
+		free(backlog);
+		psmqd_broker_rcache_destroy();
 		return -1;
+	}
 
-	el_oprint(OELN, "created queue %s with msgsize %ld maxsize %ld",
-			g_psmqd_cfg.broker_name, mqa.mq_msgsize, mqa.mq_maxmsg);
-	return 0;
-}
-
-
-/* ==========================================================================
-    Main loop of the broker, it waits for messages and processes them.
-    Received messages are initially validated here, so once message is
-    rececived, function makes sure that topic is null terminated and
-    paylen is not bigger than payload array.
-   ========================================================================== */
-
-
-int psmqd_broker_start(void)
-{
-	el_oprint(OELN, "starting psmqd broker main loop");
+	/* for batching we need second handle to the same queue,
+	 * that won't block when queue is empty. We could switch
+	 * O_NONBLOCK on qctrl with mq_setattr(), but that would
+	 * cost us two more syscalls for each batch. Preemption
+	 * uses it to peek at control queue during fan-out */
+	qbatch = (mqd_t)-1;
+	if (g_psmqd_cfg.broker_batch > 1 || g_psmqd_cfg.broker_preempt)
+	{
+		qbatch = mq_open(g_psmqd_cfg.broker_name, O_RDONLY | O_NONBLOCK);
+		if (qbatch == (mqd_t)-1)
+		{
+			el_operror(OELF, "mq_open(batch)");
+			goto error;
+		}
+	}
 
-	for (;;)
+	if (g_psmqd_cfg.broker_workers)
 	{
-		struct timespec  tp;        /* timeout for mq_timedreceive() */
-		struct psmq_msg  msg;       /* received message from client */
-		unsigned int     prio;      /* received message priority */
-		unsigned         topiclen;  /* length of topic in msg.data */
+#if PSMQ_NO_SIGNALS == 0
+		sigset_t  set;    /* signals to block in threads */
+		sigset_t  oset;   /* original signal mask */
 		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-		clock_gettime(CLOCK_REALTIME, &tp);
-		tp.tv_sec += 5;
+		/* signals must be delivered to main thread, so
+		 * they can interrupt mq_timedreceive(), threads
+		 * inherit signal mask, so block them for a while */
+		sigfillset(&set);
+		pthread_sigmask(SIG_BLOCK, &set, &oset);
+#endif
 
-		if (g_psmqd_shutdown)
-		{
-			/* shutdown flag was set, so we exit our loop, and
-			 * terminate */
-			el_oprint(OELN, "shutdown flag was set, exit broker");
-			return 0;
-		}
+		workers = malloc(g_psmqd_cfg.broker_workers * sizeof(*workers));
+		i = 0;
+		if (workers)
+			for (; i != g_psmqd_cfg.broker_workers; ++i)
+				if ((errno = pthread_create(&workers[i], NULL,
+								psmqd_broker_worker, NULL)) != 0)
+					break;
 
-		memset(&msg, 0x00, sizeof(msg));
+#if PSMQ_NO_SIGNALS == 0
+		pthread_sigmask(SIG_SETMASK, &oset, NULL);
+#endif
 
-		/* wait for message from client, there is no need to use
-		 * timedreceive, to check for g_psmqd_shutdown flag, as we will
-		 * get EINTR when signal is received
-		 *
-		 * Now there is very slim chance, that when SIGINT comes in
-		 * to set g_psmqd_shutdown to 1, it comes exactly in this
-		 * very place, that is after if() check and before
-		 * mq_receive() and that will cause deadlock, since program
-		 * will lock in mq_receive() after signal arrives, so it
-		 * will be locked forever (or until someone sends another
-		 * signal or some message). To prevent it, we wake up every
-		 * 5 seconds to force another check of shutdown flag. It's
-		 * a small price to pay for not having deadlocks. */
-		if (mq_timedreceive(qctrl, (char *)&msg, sizeof(msg), &prio, &tp) < 0)
+		if (workers == NULL || i != g_psmqd_cfg.broker_workers)
 		{
-			/* if we are interrupted by signal,
-			 * continue to check if it was
-			 * shutdown signal or not
-			 *
-			 * or
-			 *
-			 * if timeout occured continue to
-			 * check for shutdown flag (check
-			 * comment few lines up to see why
-			 * it's here */
-			if (errno == EINTR || errno == ETIMEDOUT)
-				continue;
-
-			/* got some other, fatal, error. Log
-			 * and exit since error is * unrecoverable */
-			el_operror(OELF, "mq_receive(qctrl)");
-			return -1;
+			el_operror(OELF, "failed to start delivery threads");
+			if (workers)
+				psmqd_broker_workers_stop(i);
+			goto error;
 		}
+	}
 
-		/* message, received, now what to do with
-		 * it? Well, at first let's try to validate it */
+	el_oprint(OELN, "created queue %s with msgsize %ld maxsize %ld",
+			g_psmqd_cfg.broker_name, mqa.mq_msgsize, mqa.mq_maxmsg);
+	return 0;
 
-		/* all topics must be strings, so check if it
-		 * is nullified */
-		topiclen = strlen(msg.data);
-		if (topiclen >= sizeof(msg.data))
-		{
-			el_oprint(OELW, "incoming msg: topic is not null terminated "
-					"hexdump of msg is:");
-			el_opmemory(OELW, &msg, sizeof(msg));
-			continue;
-		}
+error:
+	if (qbatch != (mqd_t)-1)
+		mq_close(qbatch);
+	mq_close(qctrl);
+	mq_unlink(g_psmqd_cfg.broker_name);
+	psmqd_broker_slab_destroy();
+	psmqd_rt_destroy(&retained);
+	free(backlog);
+	psmqd_broker_rcache_destroy();
+	return -1;
+}
 
-		/* does message holds valid payload? */
-		if (topiclen + 1 + msg.paylen > sizeof(msg.data))
-		{
-			/* topic + length of payload claimed by the
-			 * client could not have fit into buffer. */
-			el_oprint(OELW, "incoming msg: invalid paylen, hexdump of msg is:");
-			el_opmemory(OELW, &msg, sizeof(msg));
-			continue;
-		}
 
-		if (msg.ctrl.cmd != PSMQ_CTRL_CMD_OPEN &&
-				msg.ctrl.data >= PSMQ_MAX_CLIENTS)
-		{
-			/* all messages are required to send valid
-			 * file descriptor, only open request does
-			 * not require it (since user requests fd
-			 * to be allocated for him to use).
-			 *
-			 * We cannot send back error to the client
-			 * since we do not have proper fd, so only
-			 * log the warning. */
-			el_oprint(OELW, "msg with invalid fd (%d) received, hexdump is:",
-					msg.ctrl.data);
-			el_opmemory(OELW, &msg, sizeof(msg));
-			continue;
-		}
+/* ==========================================================================
+    Runs main loop of the broker. On Linux it's epoll loop, everywhere
+    else, or when epoll cannot be set up, portable loop is used.
+   ========================================================================== */
+
 
-		/* at this point we are sure that topic is properly
-		 * nullified and payload fits into buffer */
+int psmqd_broker_start(void)
+{
+	int  ret;  /* return code */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-		el_oprint(OELD, "got control message: %c", msg.ctrl.cmd);
-		el_opmemory(OELD, &msg, psmq_real_msg_size(msg));
 
-		switch (msg.ctrl.cmd)
-		{
-			case 'o': psmqd_broker_open(&msg); break;
-			case 'c': psmqd_broker_close(msg.ctrl.data); break;
-			case 's': psmqd_broker_subscribe(&msg); break;
-			case 'u': psmqd_broker_unsubscribe(&msg); break;
-			case 'p': psmqd_broker_publish(&msg, prio); break;
-			case 'i': psmqd_broker_ioctl(&msg); break;
-			default:
-				el_oprint(OELW, "received unknown request '%c'",
-						msg.data[1]);
-		}
+	el_oprint(OELN, "starting psmqd broker main loop");
+
+#if PSMQD_EPOLL
+	if (psmqd_broker_epoll_init() == 0)
+	{
+		ret = psmqd_broker_loop_epoll();
+		psmqd_broker_epoll_cleanup();
+		return ret;
 	}
+
+	el_operror(OELW, "epoll not available, using portable loop");
+#endif
+
+	ret = psmqd_broker_loop();
+	return ret;
 }
 
 
@@ -1056,25 +4355,66 @@ int psmqd_broker_start(void)
 
 int psmqd_broker_cleanup(void)
 {
-	int  fd;  /* file descriptor */
+	int            fd;    /* file descriptor */
+	int            i;     /* current word of cused */
+	unsigned long  word;  /* connected clients of current word */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	/* close all opened connections */
-	for (fd = 0; fd != PSMQ_MAX_CLIENTS; ++fd)
-	{
-		/* for empty slots, do nothing */
-		if (clients[fd].mq == (mqd_t)-1)
-			continue;
-
-		/* trigger close request for the client,
-		 * this will close connection and free all
-		 * resources, clients will be informed
-		 * about connection close. */
-		psmqd_broker_close(fd);
-	}
+	/* close all opened connections, trigger close request
+	 * for each client, this will close connection and free
+	 * all resources, clients will be informed about
+	 * connection close. */
+	for (i = 0; i != PSMQD_CUSED_WORDS; ++i)
+		for (word = cused[i]; word; word &= word - 1)
+			psmqd_broker_close(i * PSMQ_BM_BITS + psmq_bm_ctz(word));
+
+	/* threads will send all close replies
+	 * before they exit */
+	if (g_psmqd_cfg.broker_workers)
+		psmqd_broker_workers_stop(g_psmqd_cfg.broker_workers);
+
+	for (fd = 0; fd != nslots; ++fd)
+		free(clients[fd].queue);
+
+	free(clients);
+	free(targets);
+	free(cused);
+	free(rmatched);
+	free(wready);
+	clients = NULL;
+	targets = NULL;
+	cused = NULL;
+	rmatched = NULL;
+	wready = NULL;
+	nslots = 0;
+
+	for (i = 0; i != PSMQD_PREEMPT_DEPTH + 1; ++i)
+		free(rscratch[i].fds);
+	memset(rscratch, 0x00, sizeof(rscratch));
+
+	/* all clients are closed so tree and map should be empty
+	 * by now, but let's be sure nothing is left behind */
+	if (subtree)
+		psmqd_st_destroy(subtree);
+	subtree = NULL;
+	psmqd_tm_destroy(&topicmap);
+	psmqd_broker_rcache_destroy();
+
+	/* messages still in backlog are lost, just like
+	 * those left on control queue */
+	free(backlog);
+	backlog = NULL;
+	nbacklog = 0;
+	psmqd_rt_destroy(&retained);
+
+	/* blocks still borrowed by clients stay valid for
+	 * them, memory is freed once they unmap it too */
+	psmqd_broker_slab_destroy();
 
 	/* close control mqueue */
+	if (qbatch != (mqd_t)-1)
+		mq_close(qbatch);
 	mq_close(qctrl);
 	mq_unlink(g_psmqd_cfg.broker_name);
 	return 0;
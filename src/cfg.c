@@ -106,8 +106,17 @@ static int cfg_parse_args
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
+	/* psmqd_main() can be called more than once (tests do
+	 * that), 0 makes glibc reinitialize getopt() completely,
+	 * with 1 it could still hold pointer into previous argv,
+	 * when previous parsing ended on flag option. Other libcs
+	 * don't know 0, and expect 1 to start over */
+#ifdef __GLIBC__
+	optind = 0;
+#else
 	optind = 1;
-	while ((arg = getopt(argc, argv, ":vhl:dcp:m:b:r")) != -1)
+#endif
+	while ((arg = getopt(argc, argv, ":vhl:dcp:m:n:w:o:s:z:t:i:f:j:k:ea:b:r")) != -1)
 	{
 		switch (arg)
 		{
@@ -118,6 +127,18 @@ static int cfg_parse_args
 #endif
 
 		case 'm': PARSE_INT(broker_maxmsg, 0, INT_MAX); break;
+		case 'n': PARSE_INT(broker_batch, 1, INT_MAX); break;
+		case 'w': PARSE_INT(broker_workers, 0, PSMQ_MAX_CLIENTS); break;
+		case 'o': PARSE_INT(broker_overflow, 0, USHRT_MAX); break;
+		case 's': PARSE_INT(broker_shm, 0, USHRT_MAX); break;
+		case 'z': PARSE_INT(broker_shm_size, 1, 64 * 1024 * 1024); break;
+		case 't': PARSE_INT(broker_route_cache, 0, USHRT_MAX); break;
+		case 'i': PARSE_INT(broker_stats, 0, 24 * 60 * 60 * 1000); break;
+		case 'f': PARSE_INT(broker_preempt, 0, USHRT_MAX); break;
+		case 'j': PARSE_INT(broker_pub_limit, 0, PSMQ_LIMIT_MAX); break;
+		case 'k': PARSE_INT(broker_recv_limit, 0, PSMQ_LIMIT_MAX); break;
+		case 'e': g_psmqd_cfg.broker_limit_errno = 1; break;
+		case 'a': PARSE_INT(broker_retain, 0, INT_MAX); break;
 		case 'b': g_psmqd_cfg.broker_name = optarg; break;
 		case 'r': g_psmqd_cfg.remove_queue = 1; break;
 
@@ -141,6 +162,18 @@ static int cfg_parse_args
 					"\t-b<name>     name for broker control queue, default: /psmqd\n"
 					"\t-r           if set, control queue will be removed before starting\n"
 					"\t-m<maxmsg>   max messages on broker control queue\n"
+					"\t-n<batch>    max messages to process per wake up, default: 1\n"
+					"\t-w<threads>  number of delivery threads, 0 (default) delivers from main loop\n"
+					"\t-o<msgs>     don't block on full client queue, park up to msgs per client\n"
+					"\t-s<blocks>   create shm slab with blocks for large payloads, default: 0\n"
+					"\t-z<size>     size of single shm slab block, default: 65536\n"
+					"\t-t<topics>   cache routes of that many topics, default: 0\n"
+					"\t-i<ms>       publish statistics on /$sys/broker every ms, default: 0\n"
+					"\t-f<n>        look for higher priority messages every n deliveries, default: 0\n"
+					"\t-j<rate>     max messages per second single client can publish, default: 0\n"
+					"\t-k<rate>     max messages per second delivered to single client, default: 0\n"
+					"\t-e           tell client his publish went over the limit, instead of silent drop\n"
+					"\t-a<bytes>    keep retained messages in that much memory, default: 0\n"
 					"\n");
 #if PSMQ_HAVE_EMBEDLOG
 			printf(
@@ -177,6 +210,14 @@ static int cfg_parse_args
 	}
 }
 
+	if (g_psmqd_cfg.broker_workers && g_psmqd_cfg.broker_overflow)
+	{
+		/* delivery threads already take care of slow
+		 * clients, they don't need overflow buffers */
+		fprintf(stderr, "options -w and -o cannot be used together\n");
+		return -1;
+	}
+
 	return 0;
 
 #   undef PARSE_INT
@@ -210,6 +251,8 @@ int psmqd_cfg_init
 	g_psmqd_cfg.log_level = EL_INFO;
 #endif
 	g_psmqd_cfg.broker_maxmsg = 10;
+	g_psmqd_cfg.broker_batch = 1;
+	g_psmqd_cfg.broker_shm_size = 65536;
 	g_psmqd_cfg.broker_name = "/psmqd";
 
 	/* parse options from command line argument
@@ -250,6 +293,18 @@ void psmqd_cfg_print(void)
 #endif
 	CONFIG_PRINT(broker_name, "%s");
 	CONFIG_PRINT(broker_maxmsg, "%d");
+	CONFIG_PRINT(broker_batch, "%d");
+	CONFIG_PRINT(broker_workers, "%d");
+	CONFIG_PRINT(broker_overflow, "%d");
+	CONFIG_PRINT(broker_shm, "%d");
+	CONFIG_PRINT(broker_shm_size, "%d");
+	CONFIG_PRINT(broker_route_cache, "%d");
+	CONFIG_PRINT(broker_stats, "%d");
+	CONFIG_PRINT(broker_preempt, "%d");
+	CONFIG_PRINT(broker_pub_limit, "%d");
+	CONFIG_PRINT(broker_recv_limit, "%d");
+	CONFIG_PRINT(broker_limit_errno, "%d");
+	CONFIG_PRINT(broker_retain, "%d");
 	CONFIG_PRINT(remove_queue, "%d");
 	CONFIG_PRINT_VAR(PSMQ_MSG_MAX, "%u");
 	CONFIG_PRINT_VAR(sizeof(struct psmq_msg), "%zu");
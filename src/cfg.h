@@ -17,6 +17,18 @@ struct psmqd_cfg
 #endif
     const char     *broker_name;
     int             broker_maxmsg;
+    int             broker_batch;
+    int             broker_workers;
+    int             broker_overflow;
+    int             broker_shm;
+    int             broker_shm_size;
+    int             broker_route_cache;
+    int             broker_stats;
+    int             broker_preempt;
+    int             broker_pub_limit;
+    int             broker_recv_limit;
+    int             broker_limit_errno;
+    int             broker_retain;
     int             remove_queue;
 };
 
@@ -58,6 +58,12 @@ static struct el psmqs_out;
 #endif
 static int run;
 static int flush;
+static int trace;
+
+/* how many messages are taken from queue at once, when
+ * messages come in bursts, whole burst is handled with
+ * just one wakeup */
+#define PSMQS_RECEIVE_MAX 16
 
 
 /* ==========================================================================
@@ -168,6 +174,13 @@ static int on_receive
 			return -1;
 
 		case PSMQ_CTRL_CMD_IOCTL:
+			if (payload[0] == PSMQ_IOCTL_TRACE)
+			{
+				el_oprint(OELN, "tracing %s",
+						payload[1] ? "enabled" : "disabled");
+				return 0;
+			}
+
 			memcpy(&timeout, payload + 1, sizeof(timeout));
 			el_oprint(OELN, "reply timeout set %hu", timeout);
 			return 0;
@@ -212,6 +225,83 @@ static int on_receive
 }
 
 
+/* ==========================================================================
+    Prints how long message 'msg' received at 'now' spent on each hop.
+    Publisher to broker is time message waited in broker's control queue,
+    broker is time broker spent on routing it and sending it to clients
+    before us, and broker to sub is time message waited in our queue.
+   ========================================================================== */
+
+
+static void on_receive_trace
+(
+	struct psmq_msg    *msg,  /* received message */
+	unsigned int        now   /* psmq_trace_now() when msg was received */
+)
+{
+	struct psmq_trace   t;    /* timestamps of message */
+	char                pb[16]; /* publisher to broker time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (psmq_msg_trace(msg, &t) != 0 || t.bsend == 0)
+		return;
+
+	/* publisher might not have tracing enabled */
+	strcpy(pb, "?");
+	if (t.sent)
+		sprintf(pb, "%d", (int)(t.brecv - t.sent));
+
+#if PSMQ_HAVE_EMBEDLOG
+	el_oprint(ELN, &psmqs_out, "    pub->broker %sus  broker %dus  "
+			"broker->sub %dus", pb, (int)(t.bsend - t.brecv),
+			(int)(now - t.bsend));
+#else
+	printf("    pub->broker %sus  broker %dus  broker->sub %dus\n",
+			pb, (int)(t.bsend - t.brecv), (int)(now - t.bsend));
+#endif
+}
+
+
+/* ==========================================================================
+    Called by us when we receive large payload message from broker. Only
+    topic and size are printed, payload can be huge.
+   ========================================================================== */
+
+
+static int on_receive_shm
+(
+	struct psmq      *psmq,     /* psmq object */
+	struct psmq_msg  *msg,      /* full received message */
+	unsigned int      prio      /* message priority */
+)
+{
+	const void       *payload;  /* borrowed payload */
+	size_t            paylen;   /* length of payload data */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	payload = psmq_shm_borrow(psmq, msg, &paylen);
+	if (payload == NULL)
+	{
+		el_operror(OELE, "failed to borrow large payload on %s",
+				PSMQ_TOPIC(*msg));
+		return 0;
+	}
+
+#if PSMQ_HAVE_EMBEDLOG
+	el_oprint(ELN, &psmqs_out, "p:%u l:%4lu  %s  (shm)",
+			prio, (unsigned long)paylen, PSMQ_TOPIC(*msg));
+#else
+	printf("p:%u l:%4lu  %s  (shm)\n",
+			prio, (unsigned long)paylen, PSMQ_TOPIC(*msg));
+#endif
+
+	psmq_shm_release(psmq, payload);
+	return 0;
+}
+
+
 /* ==========================================================================
     Opens connection to the broker named $brokname.
    ========================================================================== */
@@ -315,11 +405,12 @@ int psmq_sub_main
 	got_t = 0;
 	flush = 0;
 	run = 1;
+	trace = 0;
 	qname = "/psmq-sub";
 	memset(&psmq, 0x00, sizeof(psmq));
 	optind = 1;
 
-	while ((arg = getopt(argc, argv, ":hvt:b:n:o:")) != -1)
+	while ((arg = getopt(argc, argv, ":hvlt:b:n:o:")) != -1)
 	{
 		struct psmq_msg  msg;  /* control message recieved from broker */
 		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
@@ -328,6 +419,7 @@ int psmq_sub_main
 		switch (arg)
 		{
 		case 'n': qname = optarg; break;
+		case 'l': trace = 1; break;
 
 		case 'b':
 			/* broker name passed, open connection to the broker,
@@ -428,8 +520,8 @@ int psmq_sub_main
 					"\n"
 					"usage: \n"
 					"\t%s [-h | -v]\n"
-					"\t%s <-t topic> <[-t topic]> [-o <file>]\n"
-					"\t%s <[-n mqueue-name]> <[-b name]> <-t topic> <[-t topic]> [-o <file>]\n"
+					"\t%s <-t topic> <[-t topic]> [-o <file>] [-l]\n"
+					"\t%s <[-n mqueue-name]> <[-b name]> <-t topic> <[-t topic]> [-o <file>] [-l]\n"
 					"\n", argv[0], argv[0], argv[0], argv[0]);
 			printf(
 					"\t-h                   shows help and exit\n"
@@ -439,7 +531,8 @@ int psmq_sub_main
 					"\t-b <broker-name>     name of the broker (with leading '/' - like '/qname')\n"
 					"\t-t <topic>           topic to subscribe to, can be used multiple times\n"
 					"\t-o <file>            file where to store logs from incoming messages\n"
-					"\t                     if not set, stdout will be used\n");
+					"\t                     if not set, stdout will be used\n"
+					"\t-l                   print time message spent on each hop\n");
 			printf(
 					"examples:\n"
 					"Subscribe to one topic:\n"
@@ -473,16 +566,24 @@ int psmq_sub_main
 	if (psmq_ioctl(&psmq, PSMQ_IOCTL_REPLY_TIMEOUT, 100) != 0)
 		el_operror(OELW, "failed to set reply timeout, data might be lost");
 
+	if (trace && psmq_ioctl_trace(&psmq, 1) != 0)
+		el_operror(OELW, "failed to enable tracing");
+
 	el_oprint(OELN, "start receiving data");
 
 	while (run)
 	{
-		struct psmq_msg  msg;  /* buffer to receive message from boker */
-		unsigned int     prio; /* received message priority */
+		struct psmq_msg  msgs[PSMQS_RECEIVE_MAX];  /* received messages */
+		unsigned int     prios[PSMQS_RECEIVE_MAX]; /* their priorities */
+		struct psmq_msg *msg;  /* currently processed message */
+		int              n;    /* number of received messages */
+		int              i;    /* current message */
+		unsigned int     now;  /* time messages were received */
 		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-		if (psmq_receive_prio(&psmq, &msg, &prio) != 0)
+		n = psmq_receive_many_prio(&psmq, msgs, prios, PSMQS_RECEIVE_MAX, -1);
+		if (n == -1)
 		{
 			if (flush)
 			{
@@ -501,9 +602,28 @@ int psmq_sub_main
 			break;
 		}
 
-		if (on_receive(&msg, PSMQ_TOPIC(msg), PSMQ_PAYLOAD(msg),
-					msg.paylen, prio) == -1)
-			break;
+		now = trace ? psmq_trace_now() : 0;
+		for (i = 0; i != n; ++i)
+		{
+			msg = &msgs[i];
+			if (msg->ctrl.cmd == PSMQ_CTRL_CMD_PUBLISH_SHM)
+			{
+				on_receive_shm(&psmq, msg, prios[i]);
+				if (trace)
+					on_receive_trace(msg, now);
+				continue;
+			}
+
+			if (on_receive(msg, PSMQ_TOPIC(*msg), PSMQ_PAYLOAD(*msg),
+						msg->paylen, prios[i]) == -1)
+			{
+				run = 0;
+				break;
+			}
+
+			if (trace && msg->ctrl.cmd == PSMQ_CTRL_CMD_PUBLISH)
+				on_receive_trace(msg, now);
+		}
 	}
 
 	psmq_cleanup(&psmq);
@@ -0,0 +1,384 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         -------------------------------------------------------------
+        / rt - retained messages, last payload of every topic that   \
+        | was published with retain flag, packed one after another  |
+        \ in single arena of fixed size allocated once at startup    /
+         -------------------------------------------------------------
+          \     +------------+------------+-------+----------------+
+           \    | /a/b:21.5  | /state:on  | /x:1  |      free      |
+                +------------+------------+-------+----------------+
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "retained.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "valid.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+/* every entry starts at multiple of this, so header can be
+ * accessed directly in arena */
+#define PSMQD_RT_ALIGN (sizeof(unsigned long))
+
+/* message at 'off' + 1 taken from index slot */
+#define PSMQD_RT_AT(rt, off) ((struct psmqd_rt_msg *)((rt)->arena + (off) - 1))
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Returns number of bytes entry with 'topic' and 'paylen' bytes of
+    payload takes in arena.
+   ========================================================================== */
+
+
+static size_t psmqd_rt_entry_size
+(
+	const char      *topic,   /* topic of message */
+	unsigned short   paylen   /* length of payload */
+)
+{
+	size_t           size;    /* size of entry without padding */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	size = sizeof(struct psmqd_rt_msg) + strlen(topic) + 1 + paylen;
+	return (size + PSMQD_RT_ALIGN - 1) / PSMQD_RT_ALIGN * PSMQD_RT_ALIGN;
+}
+
+
+/* ==========================================================================
+    Finds index slot of message on 'topic'. When there is no such message,
+    returned slot is the empty one, where message should be put. Index
+    never gets more than 3/4 full, so there always is empty slot.
+
+    Returns index of found slot.
+   ========================================================================== */
+
+
+static size_t psmqd_rt_slot
+(
+	const struct psmqd_rt  *rt,     /* store to look in */
+	const char             *topic,  /* topic to look for */
+	unsigned long           hash    /* psmqd_tl_hash() of topic */
+)
+{
+	struct psmqd_rt_msg    *m;      /* message in current slot */
+	size_t                  mask;   /* mask to wrap index around */
+	size_t                  i;      /* current slot index */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	mask = rt->nindex - 1;
+	for (i = hash & mask; rt->index[i]; i = (i + 1) & mask)
+	{
+		m = PSMQD_RT_AT(rt, rt->index[i]);
+		if (m->hash == hash && strcmp(PSMQD_RT_TOPIC(m), topic) == 0)
+			break;
+	}
+
+	return i;
+}
+
+
+/* ==========================================================================
+    Removes message in index slot 'i' from arena, all messages after it
+    are moved down, so free space is always in one piece at the end of
+    arena, and their offsets in index are moved down with them. Slot is
+    emptied the same way psmqd_tm_remove_slot() does it, so no tombstones
+    are needed.
+   ========================================================================== */
+
+
+static void psmqd_rt_remove
+(
+	struct psmqd_rt      *rt,    /* store to remove message from */
+	size_t                i      /* index slot of message to remove */
+)
+{
+	struct psmqd_rt_msg  *m;     /* message to remove */
+	unsigned char        *from;  /* first byte after removed message */
+	unsigned int          off;   /* offset + 1 of removed message */
+	unsigned int          size;  /* size of removed message */
+	size_t                mask;  /* mask to wrap index around */
+	size_t                j;     /* slot that is checked for move */
+	size_t                home;  /* slot where j would like to be */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	off = rt->index[i];
+	m = PSMQD_RT_AT(rt, off);
+	size = m->size;
+	from = (unsigned char *)m + size;
+	memmove(m, from, rt->arena + rt->used - from);
+	rt->used -= size;
+	--rt->n;
+
+	for (j = 0; j != rt->nindex; ++j)
+		if (rt->index[j] > off)
+			rt->index[j] -= size;
+
+	mask = rt->nindex - 1;
+	rt->index[i] = 0;
+
+	for (j = (i + 1) & mask; rt->index[j]; j = (j + 1) & mask)
+	{
+		home = PSMQD_RT_AT(rt, rt->index[j])->hash & mask;
+
+		/* entry in 'j' can be moved to 'i' only when
+		 * its home slot is not between 'i' and 'j',
+		 * keeping in mind that index wraps around */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+
+		rt->index[i] = rt->index[j];
+		rt->index[j] = 0;
+		i = j;
+	}
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Initializes store 'rt' with arena that can hold 'size' bytes of
+    messages. Index is sized for as many of the smallest messages as
+    arena can hold, so both are allocated here once, and memory used
+    by retained messages never grows past that.
+
+    errno:
+            EINVAL      rt is invalid (null) or size is 0
+            EINVAL      size is too big for offsets in index
+            ENOMEM      not enough memory for arena
+   ========================================================================== */
+
+
+int psmqd_rt_init
+(
+	struct psmqd_rt  *rt,     /* store to initialize */
+	size_t            size    /* size of arena in bytes */
+)
+{
+	size_t            max;    /* max number of messages in arena */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, rt);
+	VALID(EINVAL, size);
+	VALID(EINVAL, size < UINT_MAX);
+
+	memset(rt, 0x00, sizeof(*rt));
+
+	/* smallest message has one char topic and one
+	 * byte of payload, keep index at most 3/4 full */
+	max = size / psmqd_rt_entry_size("/", 1);
+	for (rt->nindex = 4; rt->nindex / 4 * 3 <= max; rt->nindex *= 2)
+		;
+
+	rt->index = calloc(rt->nindex, sizeof(*rt->index));
+	rt->arena = malloc(size);
+	if (rt->index == NULL || rt->arena == NULL)
+	{
+		free(rt->index);
+		free(rt->arena);
+		memset(rt, 0x00, sizeof(*rt));
+		errno = ENOMEM;
+		return -1;
+	}
+
+	rt->size = size;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Finds retained message on exactly 'topic'. 'hash' must be computed
+    with psmqd_tl_hash(topic).
+
+    Returns found message or NULL when there is none.
+   ========================================================================== */
+
+
+struct psmqd_rt_msg *psmqd_rt_find
+(
+	const struct psmqd_rt  *rt,     /* store to look in */
+	const char             *topic,  /* topic to look for */
+	unsigned long           hash    /* hash of topic */
+)
+{
+	size_t                  i;      /* slot of message in index */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (rt == NULL || topic == NULL || rt->index == NULL)
+		return NULL;
+
+	i = psmqd_rt_slot(rt, topic, hash);
+	return rt->index[i] ? PSMQD_RT_AT(rt, rt->index[i]) : NULL;
+}
+
+
+/* ==========================================================================
+    Sets retained message on 'topic' to 'payload'. Previous message on
+    that topic, if any, is replaced. Empty payload ('paylen' of 0) removes
+    retained message of topic. When new message is of the same size as
+    the old one, which is usual for topics that carry state, it's simply
+    overwritten in place.
+
+    errno:
+            EINVAL      rt or topic is invalid (null)
+            EINVAL      paylen is not 0 but payload is null
+            ENOSPC      there is not enough space left in arena, old
+                        message of topic is kept then
+   ========================================================================== */
+
+
+int psmqd_rt_set
+(
+	struct psmqd_rt      *rt,       /* store to put message in */
+	const char           *topic,    /* topic of message */
+	unsigned long         hash,     /* psmqd_tl_hash() of topic */
+	const void           *payload,  /* payload to retain */
+	unsigned short        paylen    /* length of payload */
+)
+{
+	struct psmqd_rt_msg  *m;        /* old or new message */
+	size_t                size;     /* size of new entry */
+	size_t                oldsize;  /* size of old entry, or 0 */
+	size_t                i;        /* slot of message in index */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, rt);
+	VALID(EINVAL, rt->index);
+	VALID(EINVAL, topic);
+	VALID(EINVAL, paylen == 0 || payload);
+
+	i = psmqd_rt_slot(rt, topic, hash);
+	m = rt->index[i] ? PSMQD_RT_AT(rt, rt->index[i]) : NULL;
+	oldsize = m ? m->size : 0;
+
+	if (paylen == 0)
+	{
+		/* empty payload clears retained message */
+		if (m)
+			psmqd_rt_remove(rt, i);
+
+		return 0;
+	}
+
+	size = psmqd_rt_entry_size(topic, paylen);
+	VALID(ENOSPC, rt->used - oldsize + size <= rt->size);
+
+	if (m && size != oldsize)
+	{
+		/* different size, so old message is removed, and
+		 * new one is put at the end, as usual. Removing
+		 * may move other slots, so look for ours again */
+		psmqd_rt_remove(rt, i);
+		i = psmqd_rt_slot(rt, topic, hash);
+		m = NULL;
+	}
+
+	if (m == NULL)
+	{
+		m = (struct psmqd_rt_msg *)(rt->arena + rt->used);
+		m->hash = hash;
+		m->size = size;
+		strcpy(PSMQD_RT_TOPIC(m), topic);
+		rt->index[i] = rt->used + 1;
+		rt->used += size;
+		++rt->n;
+	}
+
+	m->paylen = paylen;
+	memcpy(PSMQD_RT_PAYLOAD(m), payload, paylen);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Returns message that follows 'm' in the store, or first one when 'm'
+    is NULL. Returns NULL when there are no more messages. Store must not
+    be changed while it's being walked.
+   ========================================================================== */
+
+
+struct psmqd_rt_msg *psmqd_rt_next
+(
+	const struct psmqd_rt      *rt,  /* store to walk */
+	const struct psmqd_rt_msg  *m    /* current message or NULL */
+)
+{
+	const unsigned char        *next; /* message after m */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (rt == NULL || rt->used == 0)
+		return NULL;
+
+	next = m ? (const unsigned char *)m + m->size : rt->arena;
+	if (next == rt->arena + rt->used)
+		return NULL;
+
+	return (struct psmqd_rt_msg *)next;
+}
+
+
+/* ==========================================================================
+    Removes all messages and frees arena of store 'rt'
+   ========================================================================== */
+
+
+int psmqd_rt_destroy
+(
+	struct psmqd_rt  *rt  /* store to destroy */
+)
+{
+	VALID(EINVAL, rt);
+
+	free(rt->index);
+	free(rt->arena);
+	memset(rt, 0x00, sizeof(*rt));
+	return 0;
+}
@@ -0,0 +1,44 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef PSMQ_RETAINED_H
+#define PSMQ_RETAINED_H 1
+
+#include <stddef.h>
+
+/* single retained message, null terminated topic follows header
+ * directly, and payload follows topic */
+struct psmqd_rt_msg
+{
+    unsigned long   hash;    /* psmqd_tl_hash() of topic */
+    unsigned int    size;    /* bytes taken by whole entry, with padding */
+    unsigned short  paylen;  /* length of payload */
+};
+
+/* retained messages packed one after another in single arena,
+ * and found by topic hash in index */
+struct psmqd_rt
+{
+    unsigned char  *arena;
+    size_t          size;   /* capacity of arena in bytes */
+    size_t          used;   /* bytes taken by messages */
+    size_t          n;      /* number of messages */
+    unsigned int   *index;  /* offset + 1 of message in arena, 0 when empty */
+    size_t          nindex; /* number of slots in index, always power of 2 */
+};
+
+#define PSMQD_RT_TOPIC(m) ((char *)((m) + 1))
+#define PSMQD_RT_PAYLOAD(m) (PSMQD_RT_TOPIC(m) + strlen(PSMQD_RT_TOPIC(m)) + 1)
+
+int psmqd_rt_init(struct psmqd_rt *rt, size_t size);
+int psmqd_rt_set(struct psmqd_rt *rt, const char *topic, unsigned long hash,
+        const void *payload, unsigned short paylen);
+struct psmqd_rt_msg *psmqd_rt_find(const struct psmqd_rt *rt,
+        const char *topic, unsigned long hash);
+struct psmqd_rt_msg *psmqd_rt_next(const struct psmqd_rt *rt,
+        const struct psmqd_rt_msg *m);
+int psmqd_rt_destroy(struct psmqd_rt *rt);
+
+#endif /* PSMQ_RETAINED_H */
@@ -0,0 +1,626 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         -------------------------------------------------------------
+        / st - subscription tree, a trie of all topics that clients   \
+        | subscribed to, split on '/'. Each node knows which clients  |
+        | subscribed to topic ending on that node, and which clients  |
+        \ subscribed to anything below it ('*')                       /
+         -------------------------------------------------------------
+          \                 .        +          .
+           \         .  .      .   /\   .    .
+                         .        /  \     .     .
+                  .    +     .   /    \      .
+                           .    /  ..  \  .      +
+                     .         /   ..   \    .
+                       .  +   /__________\  .
+                                  |  |
+                                  |  |
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "sub-tree.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "psmq-common.h"
+#include "topic-list.h"
+#include "valid.h"
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Finds next level in 'topic'. Leading '/' characters are skipped, so
+    "//a/b" will return pointer to "a/b" and 'end' will be set to "/b".
+    This mimics how strtok() would tokenize topic, but without modifying
+    or copying it.
+
+    Returns pointer to first character of level, when there are no more
+    levels in topic, pointer to '\0' is returned.
+   ========================================================================== */
+
+
+static const char *psmqd_st_next_level
+(
+	const char   *topic,  /* topic to get next level from */
+	const char  **end     /* first character after returned level */
+)
+{
+	const char   *level;  /* start of the level */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	while (*topic == '/')
+		++topic;
+
+	for (level = topic; *topic != '/' && *topic != '\0'; ++topic) {}
+
+	*end = topic;
+	return level;
+}
+
+
+/* ==========================================================================
+    Creates new node with copy of 'level' of length 'len'. 'level' does not
+    need to be null terminated.
+
+    Returns NULL on error or address on success
+
+    errno:
+            ENOMEM      not enough memory for new node
+   ========================================================================== */
+
+
+static struct psmqd_st *psmqd_st_new_node
+(
+	const char       *level,  /* level to create new node with */
+	size_t            len     /* length of the level */
+)
+{
+	struct psmqd_st  *node;   /* pointer to new node */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* just like in topic list, allocate node and level
+	 * string in one malloc() call */
+	node = malloc(sizeof(struct psmqd_st) + len + 1);
+	if (node == NULL)
+		return NULL;
+
+	memset(node, 0x00, sizeof(*node));
+	node->level = ((char *)node) + sizeof(struct psmqd_st);
+	memcpy(node->level, level, len);
+	node->level[len] = '\0';
+	node->levellen = len;
+
+	return node;
+}
+
+
+/* ==========================================================================
+    Frees 'node' and its fd lists. Children are not touched.
+   ========================================================================== */
+
+
+static void psmqd_st_free_node
+(
+	struct psmqd_st  *node  /* node to free */
+)
+{
+	free(node->subs.fd);
+	free(node->star.fd);
+	free(node);
+}
+
+
+/* ==========================================================================
+    Returns 1 if node holds no subscribers and has no children, so it can
+    be safely removed from the tree. Otherwise 0 is returned.
+   ========================================================================== */
+
+
+static int psmqd_st_is_empty
+(
+	const struct psmqd_st  *node  /* node to check */
+)
+{
+	return node->subs.n == 0 && node->star.n == 0 &&
+		node->child == NULL && node->plus == NULL;
+}
+
+
+/* ==========================================================================
+    Finds child of 'node' with 'level' of length 'len'.
+
+    Returns pointer to link, that points to found child. If child does not
+    exist, returned link will point to NULL, and it's the place where new
+    child can be hooked in.
+   ========================================================================== */
+
+
+static struct psmqd_st **psmqd_st_find_child
+(
+	struct psmqd_st   *node,   /* node to search children of */
+	const char        *level,  /* level to look for */
+	size_t             len     /* length of level */
+)
+{
+	struct psmqd_st  **link;   /* link to the current child */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (link = &node->child; *link != NULL; link = &(*link)->next)
+		if ((*link)->levellen == len && memcmp((*link)->level, level, len) == 0)
+			return link;
+
+	return link;
+}
+
+
+/* ==========================================================================
+    Recursively walks path of 'sub' starting from node pointed by 'link'
+    and removes 'fd' from node where topic ends. 'i' is index of the level
+    of 'sub' that node pointed by 'link' is parent of. On the way back,
+    nodes that became empty are removed from the tree.
+
+    When 'fd' is -1, no fd is removed, and function only prunes empty nodes
+    along 'sub' path. This is used to clean up after failed add.
+
+    errno:
+            ENOENT      client is not subscribed to 'sub'
+   ========================================================================== */
+
+
+static int psmqd_st_delete_node
+(
+	struct psmqd_st        **link,   /* link to node to start from */
+	const struct psmqd_tl   *sub,    /* topic to remove fd from */
+	unsigned short           i,      /* current level of sub */
+	int                      fd      /* fd to remove, or -1 to only prune */
+)
+{
+	struct psmqd_st         *node;   /* current node */
+	struct psmqd_st        **next;   /* link to next node in path */
+	const char              *level;  /* current level of topic */
+	unsigned short           len;    /* length of current level */
+	int                      ret;    /* return code */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	node = *link;
+	ret = 0;
+
+	if (i == sub->nlevels)
+	{
+		/* this is the node where topic ends */
+		if (fd != -1)
+			ret = psmqd_st_fds_delete(&node->subs, fd);
+	}
+	else if (i == sub->star)
+	{
+		/* '*' ends subscription, anything after it
+		 * is meaningless */
+		if (fd != -1)
+			ret = psmqd_st_fds_delete(&node->star, fd);
+	}
+	else
+	{
+		level = sub->topic + sub->levels[i].off;
+		len = sub->levels[i].len;
+
+		if (i >= sub->nliteral && len == 1 && *level == '+')
+			next = &node->plus;
+		else
+			next = psmqd_st_find_child(node, level, len);
+
+		if (*next != NULL)
+			ret = psmqd_st_delete_node(next, sub, i + 1, fd);
+		else if (fd != -1)
+		{
+			/* path for topic does not exist, so
+			 * noone could have subscribed to it */
+			errno = ENOENT;
+			ret = -1;
+		}
+	}
+
+	if (ret != 0)
+		return ret;
+
+	if (psmqd_st_is_empty(node))
+	{
+		/* node does not hold any value anymore, unlink it
+		 * from parent and free it. */
+		*link = node->next;
+		psmqd_st_free_node(node);
+	}
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Recursively walks tree starting from 'node' and marks all clients that
+    are subscribed to 'topic'. 'topic' here is what is left of the topic
+    to match for the 'node'.
+
+    Returns number of newly matched fds.
+   ========================================================================== */
+
+
+static int psmqd_st_match_node
+(
+	struct psmqd_st   *node,     /* current node */
+	const char        *topic,    /* rest of the topic to match */
+	unsigned long     *matched   /* bitmap with marked fds */
+)
+{
+	struct psmqd_st  **child;    /* child with current level */
+	const char        *level;    /* current level of topic */
+	const char        *end;      /* end of current level */
+	int                n;        /* number of newly matched fds */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	level = psmqd_st_next_level(topic, &end);
+
+	/* whole topic has been matched, clients
+	 * subscribed to exactly this node match */
+	if (*level == '\0')
+		return psmqd_st_fds_mark(&node->subs, matched);
+
+	/* there is at least one more level in topic
+	 * so all '*' subscribers on this node match */
+	n = psmqd_st_fds_mark(&node->star, matched);
+
+	/* now go deeper into both literal
+	 * child, and '+' child that matches
+	 * any one level */
+	child = psmqd_st_find_child(node, level, end - level);
+	if (*child != NULL)
+		n += psmqd_st_match_node(*child, end, matched);
+
+	if (node->plus != NULL)
+		n += psmqd_st_match_node(node->plus, end, matched);
+
+	return n;
+}
+
+
+/* ==========================================================================
+    Recursively frees 'node' and all its children
+   ========================================================================== */
+
+
+static void psmqd_st_destroy_node
+(
+	struct psmqd_st  *node  /* node to free */
+)
+{
+	struct psmqd_st  *next; /* next sibling to free */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (; node != NULL; node = next)
+	{
+		next = node->next;
+
+		if (node->plus)
+			psmqd_st_destroy_node(node->plus);
+
+		psmqd_st_destroy_node(node->child);
+		psmqd_st_free_node(node);
+	}
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Adds 'fd' to 'fds' list. Same fd may be added multiple times, this
+    happens when client subscribes to same topic more than once.
+
+    errno:
+            ENOMEM      not enough memory to grow list
+            ENOSPC      list already holds USHRT_MAX fds
+   ========================================================================== */
+
+
+int psmqd_st_fds_add
+(
+	struct psmqd_st_fds  *fds,   /* list to add fd to */
+	unsigned short        fd     /* fd to add */
+)
+{
+	unsigned short       *nfd;   /* reallocated fd array */
+	unsigned int          size;  /* new size of fd array */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* n and size are unsigned short, list cannot grow
+	 * past that, even though fd array would have space */
+	VALID(ENOSPC, fds->n != USHRT_MAX);
+
+	if (fds->n == fds->size)
+	{
+		/* no more space in array, grow it twice, this
+		 * should happen rarely as clients usually subscribe
+		 * at startup and then keep their subscriptions */
+		size = fds->size ? fds->size * 2 : 4;
+		if (size > USHRT_MAX)
+			size = USHRT_MAX;
+
+		nfd = realloc(fds->fd, size * sizeof(*nfd));
+		if (nfd == NULL)
+			return -1;
+
+		fds->fd = nfd;
+		fds->size = size;
+	}
+
+	fds->fd[fds->n++] = fd;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Removes one occurence of 'fd' from 'fds' list. Order of fds in the list
+    is not preserved.
+
+    errno:
+            ENOENT      fd is not on the list
+   ========================================================================== */
+
+
+int psmqd_st_fds_delete
+(
+	struct psmqd_st_fds  *fds,  /* list to delete fd from */
+	unsigned short        fd    /* fd to delete */
+)
+{
+	unsigned short        i;    /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != fds->n; ++i)
+	{
+		if (fds->fd[i] != fd)
+			continue;
+
+		/* order does not matter, so simply move
+		 * last element into place of removed one */
+		fds->fd[i] = fds->fd[--fds->n];
+
+		if (fds->n == 0)
+		{
+			/* no more subscribers, give memory back */
+			free(fds->fd);
+			fds->fd = NULL;
+			fds->size = 0;
+		}
+
+		return 0;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+
+/* ==========================================================================
+    Marks all fds from 'fds' in 'matched' bitmap.
+
+    Returns number of fds that were not marked before.
+   ========================================================================== */
+
+
+int psmqd_st_fds_mark
+(
+	const struct psmqd_st_fds  *fds,      /* list of fds to mark */
+	unsigned long              *matched   /* bitmap with marked fds */
+)
+{
+	unsigned short              i;        /* iterator */
+	int                         n;        /* number of newly marked fds */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (n = 0, i = 0; i != fds->n; ++i)
+	{
+		n += !psmq_bm_isset(matched, fds->fd[i]);
+		psmq_bm_set(matched, fds->fd[i]);
+	}
+
+	return n;
+}
+
+
+/* ==========================================================================
+    Adds client 'fd' as subscriber of 'sub' into tree pointed by 'root'.
+    'sub' is compiled topic from topic list, so tree does not have to
+    parse topic again, topic must already be validated (starts with '/'
+    etc).
+
+    Tree for subscriptions "/a/b", "/a/+/c", "/a/@" and "/d" looks like
+    this ('@' is '*' here, and in the rest of the comments in this file,
+    so compiler does not think we open nested comment)
+
+                  (root)
+                  /    \
+                 a      d [/d]
+               / |\
+              b  + \
+        [/a/b]   |  [/a/@] (star list of 'a')
+                 c [/a/+/c]
+
+    If 'root' is NULL (meaning tree is empty), function will create new
+    tree.
+
+    errno:
+            EINVAL      root or sub is invalid (null)
+            ENOMEM      not enough memory to create new node
+   ========================================================================== */
+
+
+int psmqd_st_add
+(
+	struct psmqd_st        **root,   /* root of the tree */
+	const struct psmqd_tl   *sub,    /* topic client subscribes to */
+	unsigned short           fd      /* client subscribing to topic */
+)
+{
+	struct psmqd_st         *node;   /* current node */
+	struct psmqd_st        **next;   /* link to next node in path */
+	const char              *level;  /* current level of topic */
+	unsigned short           len;    /* length of current level */
+	unsigned short           i;      /* current level index */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, root);
+	VALID(EINVAL, sub);
+
+	if (*root == NULL)
+		if ((*root = psmqd_st_new_node("", 0)) == NULL)
+			return -1;
+
+	/* walk the path up until the end of topic
+	 * or to the '*' if there is one */
+	for (node = *root, i = 0; i != sub->nlevels && i != sub->star; ++i)
+	{
+		level = sub->topic + sub->levels[i].off;
+		len = sub->levels[i].len;
+
+		if (i >= sub->nliteral && len == 1 && *level == '+')
+			next = &node->plus;
+		else
+			next = psmqd_st_find_child(node, level, len);
+
+		if (*next == NULL)
+		{
+			/* path does not exist yet, create it, new child
+			 * is added at the end of the children list */
+			if ((*next = psmqd_st_new_node(level, len)) == NULL)
+				goto error;
+		}
+
+		node = *next;
+	}
+
+	if (psmqd_st_fds_add(i == sub->star ? &node->star : &node->subs, fd) == 0)
+		return 0;
+
+error:
+	/* we could have already created some nodes on the path
+	 * before failure, these nodes are empty now, so remove
+	 * them, we don't want to leave garbage in the tree */
+	psmqd_st_delete_node(root, sub, 0, -1);
+	errno = ENOMEM;
+	return -1;
+}
+
+
+/* ==========================================================================
+    Removes client 'fd' from subscribers of 'sub'. Nodes that no longer
+    hold any subscribers are removed, if tree becomes empty, 'root' will be
+    set to NULL.
+
+    errno:
+            EINVAL      root or sub is invalid (null)
+            ENOENT      client is not subscribed to 'sub'
+   ========================================================================== */
+
+
+int psmqd_st_delete
+(
+	struct psmqd_st        **root,  /* root of the tree */
+	const struct psmqd_tl   *sub,   /* topic to unsubscribe from */
+	unsigned short           fd     /* client that unsubscribes */
+)
+{
+	VALID(EINVAL, root);
+	VALID(ENOENT, *root);
+	VALID(EINVAL, sub);
+
+	return psmqd_st_delete_node(root, sub, 0, fd);
+}
+
+
+/* ==========================================================================
+    Finds all clients that are subscribed to topics that match published
+    'topic'. For each such client, bit of fd is set in 'matched' bitmap
+    (see psmq_bm_set()). Caller must zero 'matched' before calling this
+    function and it must be big enough to hold highest fd. Client is
+    marked only once, even if multiple of its subscriptions matches
+    'topic'.
+
+    Cost of this function depends on depth of 'topic' and number of
+    wildcard branches in the tree, and not on number of clients.
+
+    Returns number of matched clients or -1 on error.
+
+    errno:
+            EINVAL      topic or matched is invalid (null)
+   ========================================================================== */
+
+
+int psmqd_st_match
+(
+	struct psmqd_st  *root,     /* root of the tree */
+	const char       *topic,    /* published topic */
+	unsigned long    *matched   /* matched fds will be marked here */
+)
+{
+	VALID(EINVAL, topic);
+	VALID(EINVAL, matched);
+
+	/* empty tree, noone is subscribed */
+	if (root == NULL)
+		return 0;
+
+	return psmqd_st_match_node(root, topic, matched);
+}
+
+
+/* ==========================================================================
+    Removes all nodes from tree pointed by 'root'.
+   ========================================================================== */
+
+
+int psmqd_st_destroy
+(
+	struct psmqd_st  *root  /* tree to destroy */
+)
+{
+	VALID(EINVAL, root);
+
+	psmqd_st_destroy_node(root);
+	return 0;
+}
@@ -0,0 +1,42 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef PSMQ_SUB_TREE_H
+#define PSMQ_SUB_TREE_H 1
+
+#include "topic-list.h"
+
+/* list of file descriptors of clients subscribed to single node */
+struct psmqd_st_fds
+{
+    unsigned short  *fd;
+    unsigned short   n;
+    unsigned short   size;
+};
+
+struct psmqd_st
+{
+    char                *level;
+    unsigned short       levellen;
+    struct psmqd_st      *next;
+    struct psmqd_st      *child;
+    struct psmqd_st      *plus;
+    struct psmqd_st_fds   subs;
+    struct psmqd_st_fds   star;
+};
+
+int psmqd_st_fds_add(struct psmqd_st_fds *fds, unsigned short fd);
+int psmqd_st_fds_delete(struct psmqd_st_fds *fds, unsigned short fd);
+int psmqd_st_fds_mark(const struct psmqd_st_fds *fds, unsigned long *matched);
+
+int psmqd_st_add(struct psmqd_st **root, const struct psmqd_tl *sub,
+        unsigned short fd);
+int psmqd_st_delete(struct psmqd_st **root, const struct psmqd_tl *sub,
+        unsigned short fd);
+int psmqd_st_match(struct psmqd_st *root, const char *topic,
+        unsigned long *matched);
+int psmqd_st_destroy(struct psmqd_st *root);
+
+#endif /* PSMQ_SUB_TREE_H */
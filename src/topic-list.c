@@ -26,15 +26,48 @@
    ========================================================================== */
 
 
+#ifdef HAVE_CONFIG_H
+#   include "psmq-config.h"
+#endif
+
 #include "topic-list.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "psmq.h"
 #include "valid.h"
 
 
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+/* initial value of FNV-1a hash */
+#define PSMQD_TL_HASH_INIT 2166136261UL
+
+/* every node in pool starts at multiple of this, so
+ * it can be accessed directly in arena */
+#define PSMQD_TL_ALIGN (sizeof(void *))
+
+/* biggest node pool will take, that is node with the longest topic
+ * client can send, with as many levels as such topic can have. It
+ * puts upper bound on pool size, just like PSMQ_MAX_SUBS does */
+#define PSMQD_TL_NODE_MAX (sizeof(struct psmqd_tl) + \
+		(PSMQ_MSG_MAX / 2 + 1) * sizeof(struct psmqd_tl_level) + PSMQ_MSG_MAX)
+
+/* size of arena when first node is taken from pool */
+#define PSMQD_TL_ARENA_MIN 256
+
+
 /* ==========================================================================
                   _                __           ____
     ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
@@ -45,6 +78,101 @@
    ========================================================================== */
 
 
+/* ==========================================================================
+    Finds next level in 'topic'. Leading '/' characters are skipped, so
+    "//a/b" will return pointer to "a/b" and 'end' will be set to "/b".
+
+    Returns pointer to first character of level, when there are no more
+    levels in topic, pointer to '\0' is returned.
+   ========================================================================== */
+
+
+static const char *psmqd_tl_next_level
+(
+	const char   *topic,  /* topic to get next level from */
+	const char  **end     /* first character after returned level */
+)
+{
+	const char   *level;  /* start of the level */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	while (*topic == '/')
+		++topic;
+
+	for (level = topic; *topic != '/' && *topic != '\0'; ++topic) {}
+
+	*end = topic;
+	return level;
+}
+
+
+/* ==========================================================================
+    Returns 1 when 'level' of length 'len' is wildcard ('+' or '*'),
+    otherwise 0 is returned.
+   ========================================================================== */
+
+
+static int psmqd_tl_is_wildcard
+(
+	const char  *level,  /* level to check */
+	size_t       len     /* length of level */
+)
+{
+	return len == 1 && (*level == '+' || *level == '*');
+}
+
+
+/* ==========================================================================
+    Adds 'level' of length 'len' to 'hash'. Separator is hashed too, so
+    "/ab" and "/a/b" give different hashes. This is FNV-1a.
+   ========================================================================== */
+
+
+static unsigned long psmqd_tl_hash_level
+(
+	unsigned long  hash,   /* hash computed so far */
+	const char    *level,  /* level to add to hash */
+	size_t         len     /* length of level */
+)
+{
+	hash = (hash ^ '/') * 16777619UL;
+
+	while (len--)
+		hash = (hash ^ (unsigned char)*level++) * 16777619UL;
+
+	return hash;
+}
+
+
+/* ==========================================================================
+    Computes hash of 'topic' levels up until first wildcard. This is the
+    same value that is stored in node->hash of node created with 'topic'.
+   ========================================================================== */
+
+
+static unsigned long psmqd_tl_literal_hash
+(
+	const char     *topic  /* topic to compute hash for */
+)
+{
+	unsigned long   hash;  /* computed hash */
+	const char     *level; /* current level of topic */
+	const char     *end;   /* end of current level */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (hash = PSMQD_TL_HASH_INIT;; topic = end)
+	{
+		level = psmqd_tl_next_level(topic, &end);
+		if (*level == '\0' || psmqd_tl_is_wildcard(level, end - level))
+			return hash;
+
+		hash = psmqd_tl_hash_level(hash, level, end - level);
+	}
+}
+
+
 /* ==========================================================================
     Finds a node that contains 'topic' string.
 
@@ -66,12 +194,17 @@ static struct psmqd_tl *psmqd_tl_find_node
 )
 {
 	struct psmqd_tl  *node;  /* current node */
+	unsigned long     hash;  /* hash of 'topic' */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
+	hash = psmqd_tl_literal_hash(topic);
+
 	for (*prev = NULL, node = head; node != NULL; node = node->next)
 	{
-		if (strcmp(node->topic, topic) == 0)
+		/* different hashes means different topics, so
+		 * most of the nodes are rejected without strcmp() */
+		if (node->hash == hash && strcmp(node->topic, topic) == 0)
 			return node; /* this is the node you are looking for */
 
 		*prev = node;
@@ -83,38 +216,267 @@ static struct psmqd_tl *psmqd_tl_find_node
 
 
 /* ==========================================================================
-    Creates new node with copy of 'topic'
+    Returns number of bytes 'node' takes in pool arena
+   ========================================================================== */
+
+
+static size_t psmqd_tl_node_size
+(
+	const struct psmqd_tl  *node   /* node to get size of */
+)
+{
+	size_t                  size;  /* size of node without padding */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	size = sizeof(struct psmqd_tl) +
+		node->nlevels * sizeof(struct psmqd_tl_level) + strlen(node->topic) + 1;
+	return (size + PSMQD_TL_ALIGN - 1) / PSMQD_TL_ALIGN * PSMQD_TL_ALIGN;
+}
+
+
+/* ==========================================================================
+    Takes 'size' bytes for new node from the end of 'pool' arena. When
+    there is no room left, arena is moved to twice as big block, and all
+    nodes of list 'head' are fixed to point to their new places. New
+    node is not yet on the list, so it does not need fixing.
+
+    Returns NULL on error or address of node on success
+
+    errno:
+            ENOMEM          not enough memory for bigger arena
+            ENOSPC          PSMQ_MAX_SUBS nodes are already taken
+            ENAMETOOLONG    size is bigger than any topic client can send
+   ========================================================================== */
+
+
+static struct psmqd_tl *psmqd_tl_pool_take
+(
+	struct psmqd_tl_pool   *pool,   /* pool to take node from */
+	struct psmqd_tl       **head,   /* list with nodes of pool */
+	size_t                  size    /* bytes needed for node */
+)
+{
+	struct psmqd_tl        *node;   /* current node being fixed */
+	unsigned char          *arena;  /* new, bigger arena */
+	size_t                  nsize;  /* size of new arena */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALIDR(ENAMETOOLONG, NULL, size <= PSMQD_TL_NODE_MAX);
+	VALIDR(ENOSPC, NULL, pool->nused < PSMQ_MAX_SUBS);
+	size = (size + PSMQD_TL_ALIGN - 1) / PSMQD_TL_ALIGN * PSMQD_TL_ALIGN;
+
+	if (pool->used + size > pool->size)
+	{
+		nsize = pool->size ? pool->size * 2 : PSMQD_TL_ARENA_MIN;
+		while (nsize < pool->used + size)
+			nsize *= 2;
+
+		/* old arena is freed only after nodes are fixed, so
+		 * their old addresses can still be compared with it */
+		if ((arena = malloc(nsize)) == NULL)
+			return NULL;
+
+		if (pool->used)
+		{
+			memcpy(arena, pool->arena, pool->used);
+			*head = (struct psmqd_tl *)(arena +
+					((unsigned char *)*head - pool->arena));
+
+			for (node = *head; node != NULL; node = node->next)
+			{
+				node->levels = (struct psmqd_tl_level *)(node + 1);
+				node->topic = (char *)(node->levels + node->nlevels);
+				if (node->next)
+					node->next = (struct psmqd_tl *)(arena +
+							((unsigned char *)node->next - pool->arena));
+			}
+		}
+
+		free(pool->arena);
+		pool->arena = arena;
+		pool->size = nsize;
+	}
+
+	node = (struct psmqd_tl *)(pool->arena + pool->used);
+	pool->used += size;
+	++pool->nused;
+	return node;
+}
+
+
+/* ==========================================================================
+    Releases 'node' back to 'pool', or frees it when 'pool' is NULL. Node
+    must already be taken off list 'head'. All nodes after it are moved
+    down in arena, so free space is always in one piece at the end, and
+    pointers in list are moved down with them. Arena is freed when last
+    node is released.
+   ========================================================================== */
+
+
+static void psmqd_tl_free_node
+(
+	struct psmqd_tl_pool   *pool,   /* pool node was taken from or NULL */
+	struct psmqd_tl       **head,   /* list with nodes of pool */
+	struct psmqd_tl        *node    /* node to release */
+)
+{
+	struct psmqd_tl        *n;      /* current node being fixed */
+	struct psmqd_tl        *next;   /* next node, before it was fixed */
+	unsigned char          *from;   /* first byte after released node */
+	size_t                  size;   /* size of released node */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (pool == NULL)
+	{
+		free(node);
+		return;
+	}
+
+	if (pool->nused == 1)
+	{
+		psmqd_tl_pool_destroy(pool);
+		return;
+	}
+
+	/* fix pointers while nodes are still where they
+	 * are, memmove() will then take them down along
+	 * with the rest of the node */
+	size = psmqd_tl_node_size(node);
+	for (n = *head; n != NULL; n = next)
+	{
+		next = n->next;
+		if (next && next > node)
+			n->next = (struct psmqd_tl *)((unsigned char *)next - size);
+
+		if (n > node)
+		{
+			n->levels = (struct psmqd_tl_level *)
+				((unsigned char *)n->levels - size);
+			n->topic -= size;
+		}
+	}
+
+	if (*head && *head > node)
+		*head = (struct psmqd_tl *)((unsigned char *)*head - size);
+
+	from = (unsigned char *)node + size;
+	memmove(node, from, pool->arena + pool->used - from);
+	pool->used -= size;
+	--pool->nused;
+}
+
+
+/* ==========================================================================
+    Creates new node with copy of 'topic'. Topic is also compiled, that
+    is, offsets and lengths of all levels are stored in node together with
+    information about wildcards and hash of literal prefix (levels before
+    first wildcard), so users of the list don't have to parse topic again.
+
+    Node is taken from 'pool', which may move nodes of 'head' list, or is
+    allocated with malloc() when 'pool' is NULL.
 
     Returns NULL on error or address on success
 
     errno:
-            ENOMEM      not enough memory for new node
+            ENOMEM          not enough memory for new node
+            ENOSPC          PSMQ_MAX_SUBS nodes are already taken from pool
+            ENAMETOOLONG    topic is too long to be compiled
    ========================================================================== */
 
 
 static struct psmqd_tl *psmqd_tl_new_node
 (
-	const char      *topic  /* topic to create new node with */
+	struct psmqd_tl_pool   *pool,    /* pool to take node from or NULL */
+	struct psmqd_tl       **head,    /* list with nodes of pool */
+	const char             *topic    /* topic to create new node with */
 )
 {
-	struct psmqd_tl  *node;  /* pointer to new node */
+	struct psmqd_tl        *node;    /* pointer to new node */
+	struct psmqd_tl_level  *l;       /* current level of node */
+	const char             *level;   /* current level of topic */
+	const char             *end;     /* end of current level */
+	const char             *t;       /* rest of the topic */
+	size_t                  len;     /* length of topic */
+	size_t                  nlevels; /* number of levels in topic */
+	size_t                  size;    /* memory needed for node */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	/* allocate enough memory for topic (plus 1 for null character)
-	 * and node in one malloc(), this way we will have only 1
-	 * allocation (for node and string) instead of 2.  */
-	node = malloc(sizeof(struct psmqd_tl) + strlen(topic) + 1);
+	/* offsets are kept in shorts, make sure they fit */
+	len = strlen(topic);
+	if (len > SHRT_MAX)
+	{
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	/* count levels first, so we know how much
+	 * memory we need for them */
+	for (nlevels = 0, t = topic;; t = end, ++nlevels)
+		if (*psmqd_tl_next_level(t, &end) == '\0')
+			break;
+
+	/* allocate enough memory for node, levels and topic (plus
+	 * 1 for null character) in one malloc(), this way we will
+	 * have only 1 allocation instead of 3. Layout in memory is
+	 * struct psmqd_tl, then levels and then topic string.  */
+	size = sizeof(struct psmqd_tl) +
+		nlevels * sizeof(struct psmqd_tl_level) + len + 1;
+
+	if (pool)
+		node = psmqd_tl_pool_take(pool, head, size);
+	else
+		node = malloc(size);
+
 	if (node == NULL)
 		return NULL;
 
-	/* point topic member to where string really is, that is right
-	 * after struct psmqd_tl.  */
-	node->topic = ((char *)node) + sizeof(struct psmqd_tl);
+	/* point levels and topic members to
+	 * where they really are */
+	node->levels = (struct psmqd_tl_level *)(node + 1);
+	node->topic = (char *)(node->levels + nlevels);
 
 	/* make a copy of topic */
 	strcpy(node->topic, topic);
 
+	node->hash = PSMQD_TL_HASH_INIT;
+	node->nlevels = nlevels;
+	node->nliteral = nlevels;
+	node->star = -1;
+	node->has_wildcard = 0;
+	node->flags = 0;
+
+	/* now compile topic */
+	for (l = node->levels, t = node->topic;; t = end)
+	{
+		level = psmqd_tl_next_level(t, &end);
+		if (*level == '\0')
+			break;
+
+		l->off = level - node->topic;
+		l->len = end - level;
+
+		if (psmqd_tl_is_wildcard(level, l->len))
+		{
+			if (node->has_wildcard == 0)
+				node->nliteral = l - node->levels;
+
+			/* '*' consumes rest of the topic, so only
+			 * first such level has any meaning */
+			if (*level == '*' && node->star == -1)
+				node->star = l - node->levels;
+
+			node->has_wildcard = 1;
+		}
+		else if (node->has_wildcard == 0)
+			node->hash = psmqd_tl_hash_level(node->hash, level, l->len);
+
+		++l;
+	}
+
 	/* since this is new node, it
 	 * doesn't point to anything */
 	node->next = NULL;
@@ -124,17 +486,8 @@ static struct psmqd_tl *psmqd_tl_new_node
 
 
 /* ==========================================================================
-                       __     __ _          ____
-        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
-       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
-      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
-     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
-    /_/
-   ========================================================================== */
-
-
-/* ==========================================================================
-    Adds new node with 'topic' to list pointed by 'head'
+    Adds new node with 'topic' to list pointed by 'head', node is taken
+    from 'pool', or allocated when 'pool' is NULL
 
     Function will add node just after head, not at the end of list - this is
     so we can gain some speed by not searching for last node. So when 'head'
@@ -152,21 +505,25 @@ static struct psmqd_tl *psmqd_tl_new_node
 
     If 'head' is NULL (meaning list is empty), function will create new list
     and add 'topic' node to 'head'
+
+    Returns added node, or NULL on error. Topics don't need to be unique,
+    so only returned node is sure to be the one just added.
    ========================================================================== */
 
 
-int psmqd_tl_add
+static struct psmqd_tl *psmqd_tl_insert
 (
-	struct psmqd_tl **head,   /* head of list where to add new node to */
-	const char       *topic   /* topic for new node */
+	struct psmqd_tl_pool  *pool,   /* pool to take node from or NULL */
+	struct psmqd_tl      **head,   /* head of list where to add new node to */
+	const char            *topic   /* topic for new node */
 )
 {
 	struct psmqd_tl  *node;   /* newly created node */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	VALID(EINVAL, head);
-	VALID(EINVAL, topic);
+	VALIDR(EINVAL, NULL, head);
+	VALIDR(EINVAL, NULL, topic);
 
 	/* create new node, let's call it 3
 	 *
@@ -178,9 +535,9 @@ int psmqd_tl_add
 	 *      | 1 | --> | 2 |
 	 *      +---+     +---+
 	 */
-	node = psmqd_tl_new_node(topic);
+	node = psmqd_tl_new_node(pool, head, topic);
 	if (node == NULL)
-		return -1;
+		return NULL;
 
 	if (*head == NULL)
 	{
@@ -189,7 +546,7 @@ int psmqd_tl_add
 		 * case, simply set *head with newly
 		 * created node and exit */
 		*head = node;
-		return 0;
+		return node;
 	}
 
 	/* set new node's next field, to second item
@@ -223,12 +580,14 @@ int psmqd_tl_add
 	 */
 	(*head)->next = node;
 
-	return 0;
+	return node;
 }
 
 
 /* ==========================================================================
-    Removes 'topic' from list 'head'.
+    Removes 'topic' from list 'head', node goes back to 'pool', or is
+    freed when 'pool' is NULL. When 'which' is set, that exact node is
+    removed, and 'topic' is not looked at.
 
     - if 'topic' is in 'head' node, function will modify 'head' pointer
       so 'head' points to proper node
@@ -238,10 +597,12 @@ int psmqd_tl_add
    ========================================================================== */
 
 
-int psmqd_tl_delete
+static int psmqd_tl_remove
 (
-	struct psmqd_tl **head,       /* pointer to head of the list */
-	const char      *topic        /* node with that topic to delete */
+	struct psmqd_tl_pool  *pool,  /* pool node was taken from or NULL */
+	struct psmqd_tl      **head,  /* pointer to head of the list */
+	const char            *topic, /* node with that topic to delete */
+	struct psmqd_tl       *which  /* exact node to delete or NULL */
 )
 {
 	struct psmqd_tl  *node;       /* found node for with 'topic' */
@@ -251,9 +612,15 @@ int psmqd_tl_delete
 
 	VALID(EINVAL, head);
 	VALID(ENOENT, *head);
-	VALID(EINVAL, topic);
+	VALID(EINVAL, topic || which);
+
+	if (which)
+		for (prev_node = NULL, node = *head; node && node != which;
+				prev_node = node, node = node->next)
+			;
+	else
+		node = psmqd_tl_find_node(*head, topic, &prev_node);
 
-	node = psmqd_tl_find_node(*head, topic, &prev_node);
 	if (node == NULL)
 	{
 		/* cannot delete node with name 'topic'
@@ -284,7 +651,7 @@ int psmqd_tl_delete
 
 		/* now '1' is detached from anything and
 		 * can be safely freed */
-		free(node);
+		psmqd_tl_free_node(pool, head, node);
 		return 0;
 	}
 
@@ -316,11 +683,205 @@ int psmqd_tl_delete
 	/* now that list is consistent again, we can
 	 * remove node (2) without destroying list */
 
-	free(node);
+	psmqd_tl_free_node(pool, head, node);
+	return 0;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Adds new node with 'topic' to list pointed by 'head', see
+    psmqd_tl_insert() for details.
+   ========================================================================== */
+
+
+int psmqd_tl_add
+(
+	struct psmqd_tl **head,   /* head of list where to add new node to */
+	const char       *topic   /* topic for new node */
+)
+{
+	return psmqd_tl_insert(NULL, head, topic) ? 0 : -1;
+}
+
+
+/* ==========================================================================
+    Same as psmqd_tl_add(), but returns added node, or NULL on error. List
+    may already have node with the same topic, so psmqd_tl_find() is not
+    guaranteed to find this one.
+   ========================================================================== */
+
+
+struct psmqd_tl *psmqd_tl_add_node
+(
+	struct psmqd_tl **head,   /* head of list where to add new node to */
+	const char       *topic   /* topic for new node */
+)
+{
+	return psmqd_tl_insert(NULL, head, topic);
+}
+
+
+/* ==========================================================================
+    Removes 'topic' from list 'head', see psmqd_tl_remove() for details.
+   ========================================================================== */
+
+
+int psmqd_tl_delete
+(
+	struct psmqd_tl **head,   /* pointer to head of the list */
+	const char       *topic   /* node with that topic to delete */
+)
+{
+	return psmqd_tl_remove(NULL, head, topic, NULL);
+}
+
+
+/* ==========================================================================
+    Same as psmqd_tl_delete(), but removes exactly 'node', which matters
+    when there is more than one node with the same topic.
+   ========================================================================== */
+
+
+int psmqd_tl_delete_node
+(
+	struct psmqd_tl **head,   /* pointer to head of the list */
+	struct psmqd_tl  *node    /* node to delete */
+)
+{
+	VALID(EINVAL, node);
+	return psmqd_tl_remove(NULL, head, NULL, node);
+}
+
+
+/* ==========================================================================
+    Same as psmqd_tl_add(), but node is taken from 'pool'. All nodes of
+    list must come from the same pool, and such list is not freed with
+    psmqd_tl_destroy(), but with psmqd_tl_pool_destroy(). Pool may need
+    to move nodes to make room for new one, so pointers to nodes taken
+    before are no longer valid.
+
+    Returns added node, or NULL on error. List may already have node with
+    the same topic, so psmqd_tl_find() is not guaranteed to find this one.
+
+    errno:
+            ENOMEM          not enough memory to grow pool
+            ENOSPC          all PSMQ_MAX_SUBS nodes of pool are taken
+            ENAMETOOLONG    topic is longer than PSMQ_MSG_MAX
+   ========================================================================== */
+
+
+struct psmqd_tl *psmqd_tl_pool_add
+(
+	struct psmqd_tl_pool  *pool,   /* pool to take node from */
+	struct psmqd_tl      **head,   /* head of list where to add new node to */
+	const char            *topic   /* topic for new node */
+)
+{
+	VALIDR(EINVAL, NULL, pool);
+	return psmqd_tl_insert(pool, head, topic);
+}
+
+
+/* ==========================================================================
+    Same as psmqd_tl_delete(), but node goes back to 'pool'. Nodes after
+    it are moved down to fill the hole, so pointers to nodes taken before
+    are no longer valid.
+   ========================================================================== */
+
+
+int psmqd_tl_pool_delete
+(
+	struct psmqd_tl_pool  *pool,   /* pool node was taken from */
+	struct psmqd_tl      **head,   /* pointer to head of the list */
+	const char            *topic   /* node with that topic to delete */
+)
+{
+	VALID(EINVAL, pool);
+	return psmqd_tl_remove(pool, head, topic, NULL);
+}
+
+
+/* ==========================================================================
+    Same as psmqd_tl_pool_delete(), but removes exactly 'node', which
+    matters when there is more than one node with the same topic.
+   ========================================================================== */
+
+
+int psmqd_tl_pool_delete_node
+(
+	struct psmqd_tl_pool  *pool,   /* pool node was taken from */
+	struct psmqd_tl      **head,   /* pointer to head of the list */
+	struct psmqd_tl       *node    /* node to delete */
+)
+{
+	VALID(EINVAL, pool);
+	VALID(EINVAL, node);
+	return psmqd_tl_remove(pool, head, NULL, node);
+}
+
+
+/* ==========================================================================
+    Releases all memory of 'pool' at once. All lists with nodes from that
+    pool are gone, and must not be used anymore. Pool itself can be used
+    again, as if it was just zeroed.
+   ========================================================================== */
+
+
+int psmqd_tl_pool_destroy
+(
+	struct psmqd_tl_pool  *pool   /* pool to destroy */
+)
+{
+	VALID(EINVAL, pool);
+
+	free(pool->arena);
+	memset(pool, 0x00, sizeof(*pool));
 	return 0;
 }
 
 
+/* ==========================================================================
+    Finds node with 'topic' in list 'head'.
+
+    Returns pointer to found node or NULL when there is no such node.
+
+    errno:
+            EINVAL      topic is invalid (null)
+            ENOENT      'topic' is not on the list
+   ========================================================================== */
+
+
+struct psmqd_tl *psmqd_tl_find
+(
+	struct psmqd_tl  *head,   /* head of list to search */
+	const char       *topic   /* topic to look for */
+)
+{
+	struct psmqd_tl  *node;   /* found node */
+	struct psmqd_tl  *prev;   /* previous node, not used */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALIDR(EINVAL, NULL, topic);
+
+	node = psmqd_tl_find_node(head, topic, &prev);
+	if (node == NULL)
+		errno = ENOENT;
+
+	return node;
+}
+
+
 /* ==========================================================================
     Removes all elements in the list pointed by 'head'. After this function
     is called 'head' should no longer be used without calling psmqd_tl_new()
@@ -346,3 +907,110 @@ int psmqd_tl_destroy
 
 	return 0;
 }
+
+
+/* ==========================================================================
+    Computes hash of all levels of 'topic'. For subscription without any
+    wildcard this is equal to node->hash, so it can be used to check if
+    published topic can possibly match subscription. Multiple '/' in a row
+    are treated as one separator, so "/a//b" and "/a/b" have same hash.
+   ========================================================================== */
+
+
+unsigned long psmqd_tl_hash
+(
+	const char     *topic  /* topic to compute hash for */
+)
+{
+	unsigned long   hash;  /* computed hash */
+	const char     *level; /* current level of topic */
+	const char     *end;   /* end of current level */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (hash = PSMQD_TL_HASH_INIT;; topic = end)
+	{
+		level = psmqd_tl_next_level(topic, &end);
+		if (*level == '\0')
+			return hash;
+
+		hash = psmqd_tl_hash_level(hash, level, end - level);
+	}
+}
+
+
+/* ==========================================================================
+    Checks if published topic matches compiled subscription 'sub'. Result
+    is same as plain walk over both topics would give (tests keep such
+    walk in tst/topic-match.c), but subscription topic is not parsed at
+    all, and when 'sub' has no wildcards, most topics are rejected by
+    comparing hashes. 'pub_hash' must be computed by
+    psmqd_tl_hash(pub_topic), this way caller can compute it once, and
+    then check pub against many subscriptions.
+
+    Return 0 when there is NO match, and 1 when they matches.
+   ========================================================================== */
+
+
+int psmqd_tl_matches
+(
+	const struct psmqd_tl        *sub,        /* compiled subscription */
+	const char                   *pub_topic,  /* published topic */
+	unsigned long                 pub_hash    /* hash of pub_topic */
+)
+{
+	const struct psmqd_tl_level  *l;          /* current level of sub */
+	unsigned short                i;          /* current level index */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* exact topic, different hashes means different
+	 * topics, no need to look at pub at all */
+	if (sub->has_wildcard == 0 && sub->hash != pub_hash)
+		return 0;
+
+	for (i = 0; i != sub->nlevels; ++i)
+	{
+		while (*pub_topic == '/')
+			++pub_topic;
+
+		/* pub topic has less levels than sub, '*'
+		 * needs at least one level to match */
+		if (*pub_topic == '\0')
+			return 0;
+
+		/* '*' matches everything that is left */
+		if (i == sub->star)
+			return 1;
+
+		l = &sub->levels[i];
+
+		if (i >= sub->nliteral &&
+				psmqd_tl_is_wildcard(sub->topic + l->off, l->len))
+		{
+			/* '+' matches any single level */
+			while (*pub_topic != '/' && *pub_topic != '\0')
+				++pub_topic;
+
+			continue;
+		}
+
+		/* strncmp() will stop on pub's null character
+		 * so we won't read past pub topic */
+		if (strncmp(sub->topic + l->off, pub_topic, l->len) != 0)
+			return 0;
+
+		/* levels are equal only when pub
+		 * level ends in the same place */
+		pub_topic += l->len;
+		if (*pub_topic != '/' && *pub_topic != '\0')
+			return 0;
+	}
+
+	/* all sub levels matched, topics match only
+	 * when there are no more levels in pub */
+	while (*pub_topic == '/')
+		++pub_topic;
+
+	return *pub_topic == '\0';
+}
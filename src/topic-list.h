@@ -6,14 +6,60 @@
 #ifndef PSMQ_TOPIC_LIST_H
 #define PSMQ_TOPIC_LIST_H 1
 
+#include <stddef.h>
+
+/* single level of topic, "/a/bc" has two levels, "a" at offset 1 with
+ * length 1 and "bc" at offset 3 with length 2 */
+struct psmqd_tl_level
+{
+    unsigned short  off;
+    unsigned short  len;
+};
+
 struct psmqd_tl
 {
-    char            *topic;
-    struct psmqd_tl  *next;
+    char                   *topic;
+    struct psmqd_tl         *next;
+
+    /* topic compiled when node is created, so it does not
+     * have to be parsed again each time it's used */
+    struct psmqd_tl_level   *levels;
+    unsigned long            hash;      /* hash of literal prefix */
+    unsigned short           nlevels;   /* number of levels */
+    unsigned short           nliteral;  /* levels before first wildcard */
+    short                    star;      /* index of '*' level or -1 */
+    unsigned char            has_wildcard;
+    unsigned char            flags;     /* PSMQ_SUB_* given on subscribe */
+};
+
+/* arena with all nodes of single list, packed back to back in one
+ * block of memory. Block grows when there is no room for new node,
+ * and nodes after deleted one are moved down, so there are never any
+ * holes in it. Both may move nodes, so node pointers are valid only
+ * until next add or delete. Zeroed pool is empty and takes no memory */
+struct psmqd_tl_pool
+{
+    unsigned char    *arena;  /* memory of all nodes, or NULL */
+    size_t            size;   /* capacity of arena in bytes */
+    size_t            used;   /* bytes taken by nodes */
+    unsigned short    nused;  /* number of taken nodes */
 };
 
 int psmqd_tl_add(struct psmqd_tl **head, const char *topic);
+struct psmqd_tl *psmqd_tl_add_node(struct psmqd_tl **head, const char *topic);
 int psmqd_tl_delete(struct psmqd_tl **head, const char *topic);
+int psmqd_tl_delete_node(struct psmqd_tl **head, struct psmqd_tl *node);
+struct psmqd_tl *psmqd_tl_find(struct psmqd_tl *head, const char *topic);
 int psmqd_tl_destroy(struct psmqd_tl *head);
+struct psmqd_tl *psmqd_tl_pool_add(struct psmqd_tl_pool *pool,
+        struct psmqd_tl **head, const char *topic);
+int psmqd_tl_pool_delete(struct psmqd_tl_pool *pool, struct psmqd_tl **head,
+        const char *topic);
+int psmqd_tl_pool_delete_node(struct psmqd_tl_pool *pool,
+        struct psmqd_tl **head, struct psmqd_tl *node);
+int psmqd_tl_pool_destroy(struct psmqd_tl_pool *pool);
+unsigned long psmqd_tl_hash(const char *topic);
+int psmqd_tl_matches(const struct psmqd_tl *sub, const char *pub_topic,
+        unsigned long pub_hash);
 
 #endif /* PSMQ_TOPIC_LIST_H */
@@ -0,0 +1,383 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         -------------------------------------------------------------
+        / tm - topic map, open addressing hash table that maps exact  \
+        | topics (ones without wildcards) to clients subscribed to    |
+        \ them, so they can be found with single lookup               /
+         -------------------------------------------------------------
+          \     +---+---+---+---+---+---+---+---+
+           \    |   | a |   | b | c |   | d |   |
+                +---+---+---+---+---+---+---+---+
+                      |       |   |       |
+                     [1]    [0,3] [2]   [1,4]
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "topic-map.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "valid.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+/* initial number of slots in the map, must be power of 2 */
+#define PSMQD_TM_INITIAL_SIZE 16
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Finds slot that holds 'sub' topic. If there is no such topic in the
+    map, returned slot is the empty one, where 'sub' should be put. Map
+    must have at least one empty slot, or else this function will never
+    return.
+
+    Returns index of found slot.
+   ========================================================================== */
+
+
+static size_t psmqd_tm_find_slot
+(
+	const struct psmqd_tm  *tm,    /* map to search in */
+	const struct psmqd_tl  *sub    /* topic to look for */
+)
+{
+	struct psmqd_tm_entry  *e;     /* current slot */
+	size_t                  mask;  /* mask to wrap index around */
+	size_t                  i;     /* current slot index */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	mask = tm->size - 1;
+
+	for (i = sub->hash & mask;; i = (i + 1) & mask)
+	{
+		e = &tm->entries[i];
+
+		if (e->sub == NULL)
+			return i;
+
+		if (e->sub->hash == sub->hash && strcmp(e->sub->topic, sub->topic) == 0)
+			return i;
+	}
+}
+
+
+/* ==========================================================================
+    Grows map twice (or creates it when it is empty) and moves all
+    entries into new slots.
+
+    errno:
+            ENOMEM      not enough memory for new slots
+   ========================================================================== */
+
+
+static int psmqd_tm_grow
+(
+	struct psmqd_tm        *tm        /* map to grow */
+)
+{
+	struct psmqd_tm_entry  *entries;  /* new slots */
+	size_t                  size;     /* new number of slots */
+	size_t                  mask;     /* mask to wrap index around */
+	size_t                  i;        /* iterator over old slots */
+	size_t                  j;        /* index of slot in new map */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	size = tm->size ? tm->size * 2 : PSMQD_TM_INITIAL_SIZE;
+	entries = calloc(size, sizeof(*entries));
+	if (entries == NULL)
+		return -1;
+
+	/* slots depend on map size, so every entry
+	 * must be placed again in new map */
+	mask = size - 1;
+	for (i = 0; i != tm->size; ++i)
+	{
+		if (tm->entries[i].sub == NULL)
+			continue;
+
+		for (j = tm->entries[i].sub->hash & mask;
+				entries[j].sub != NULL; j = (j + 1) & mask) {}
+
+		entries[j] = tm->entries[i];
+	}
+
+	free(tm->entries);
+	tm->entries = entries;
+	tm->size = size;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Frees entry in slot 'i' and makes it empty. Since this is open
+    addressing with linear probing, entries that come after 'i' and were
+    pushed away from their home slot are moved back, so lookups don't stop
+    too early on the slot we just emptied. Thanks to that, there is no
+    need for tombstones.
+   ========================================================================== */
+
+
+static void psmqd_tm_remove_slot
+(
+	struct psmqd_tm        *tm,    /* map to remove slot from */
+	size_t                  i      /* slot to remove */
+)
+{
+	struct psmqd_tm_entry  *e;     /* entries of the map */
+	size_t                  mask;  /* mask to wrap index around */
+	size_t                  j;     /* slot that is checked for move */
+	size_t                  home;  /* slot where j would like to be */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	e = tm->entries;
+	mask = tm->size - 1;
+
+	psmqd_tl_destroy(e[i].sub);
+	free(e[i].fds.fd);
+	memset(&e[i], 0x00, sizeof(e[i]));
+	--tm->n;
+
+	if (tm->n == 0)
+	{
+		/* map is empty, give all memory back */
+		free(tm->entries);
+		memset(tm, 0x00, sizeof(*tm));
+		return;
+	}
+
+	for (j = (i + 1) & mask; e[j].sub != NULL; j = (j + 1) & mask)
+	{
+		home = e[j].sub->hash & mask;
+
+		/* entry in 'j' can be moved to 'i' only when
+		 * its home slot is not between 'i' and 'j',
+		 * keeping in mind that map wraps around */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+
+		e[i] = e[j];
+		memset(&e[j], 0x00, sizeof(e[j]));
+		i = j;
+	}
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Adds client 'fd' as subscriber of 'sub' into map 'tm'. Only exact
+    topics (without wildcards) can be added to the map. Map keeps its own
+    copy of compiled topic, so 'sub' may be freed once this function
+    returns. Map is grown when more than half of its slots are used.
+
+    Map must be zeroed before first use.
+
+    errno:
+            EINVAL      tm or sub is invalid (null) or sub has wildcards
+            ENOMEM      not enough memory to add new topic
+   ========================================================================== */
+
+
+int psmqd_tm_add
+(
+	struct psmqd_tm        *tm,   /* map to add subscription to */
+	const struct psmqd_tl  *sub,  /* topic client subscribes to */
+	unsigned short          fd    /* client subscribing to topic */
+)
+{
+	struct psmqd_tm_entry  *e;    /* slot for sub */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, tm);
+	VALID(EINVAL, sub);
+	VALID(EINVAL, sub->has_wildcard == 0);
+
+	/* keep load factor at most at 50%, linear probing
+	 * gets slow quickly when map fills up */
+	if ((tm->n + 1) * 2 > tm->size)
+		if (psmqd_tm_grow(tm) != 0)
+			return -1;
+
+	e = &tm->entries[psmqd_tm_find_slot(tm, sub)];
+
+	if (e->sub == NULL)
+	{
+		/* first subscriber of that topic, make
+		 * map's own copy of compiled topic */
+		if (psmqd_tl_add(&e->sub, sub->topic) != 0)
+			return -1;
+
+		++tm->n;
+	}
+
+	if (psmqd_st_fds_add(&e->fds, fd) == 0)
+		return 0;
+
+	/* no memory for fd, if we just created
+	 * the entry, it's empty now, remove it */
+	if (e->fds.n == 0)
+		psmqd_tm_remove_slot(tm, e - tm->entries);
+
+	errno = ENOMEM;
+	return -1;
+}
+
+
+/* ==========================================================================
+    Removes client 'fd' from subscribers of 'sub'. When topic has no more
+    subscribers, it is removed from the map.
+
+    errno:
+            EINVAL      tm or sub is invalid (null)
+            ENOENT      client is not subscribed to 'sub'
+   ========================================================================== */
+
+
+int psmqd_tm_delete
+(
+	struct psmqd_tm        *tm,   /* map to delete subscription from */
+	const struct psmqd_tl  *sub,  /* topic to unsubscribe from */
+	unsigned short          fd    /* client that unsubscribes */
+)
+{
+	struct psmqd_tm_entry  *e;    /* slot with sub */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, tm);
+	VALID(EINVAL, sub);
+	VALID(ENOENT, tm->n);
+
+	e = &tm->entries[psmqd_tm_find_slot(tm, sub)];
+	VALID(ENOENT, e->sub);
+
+	if (psmqd_st_fds_delete(&e->fds, fd) != 0)
+		return -1;
+
+	if (e->fds.n == 0)
+		psmqd_tm_remove_slot(tm, e - tm->entries);
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Finds clients that are subscribed to exactly published 'topic'. For
+    each such client, bit of fd is set in 'matched'. 'hash' must be computed
+    with psmqd_tl_hash(topic). Rules for 'matched' are the same as for
+    psmqd_st_match().
+
+    Returns number of newly matched clients or -1 on error.
+
+    errno:
+            EINVAL      tm, topic or matched is invalid (null)
+   ========================================================================== */
+
+
+int psmqd_tm_match
+(
+	struct psmqd_tm        *tm,       /* map to look in */
+	const char             *topic,    /* published topic */
+	unsigned long           hash,     /* hash of published topic */
+	unsigned long          *matched   /* matched fds will be marked here */
+)
+{
+	struct psmqd_tm_entry  *e;        /* current slot */
+	size_t                  mask;     /* mask to wrap index around */
+	size_t                  i;        /* current slot index */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, tm);
+	VALID(EINVAL, topic);
+	VALID(EINVAL, matched);
+
+	/* nobody subscribed to exact topic */
+	if (tm->n == 0)
+		return 0;
+
+	mask = tm->size - 1;
+
+	/* published topic may contain multiple '/' in a row, so
+	 * strcmp() is not enough here, psmqd_tl_matches() will
+	 * compare levels just like in any other place */
+	for (i = hash & mask; (e = &tm->entries[i])->sub != NULL; i = (i + 1) & mask)
+		if (psmqd_tl_matches(e->sub, topic, hash))
+			return psmqd_st_fds_mark(&e->fds, matched);
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Removes all entries from the map 'tm'. Map can be used again after
+    that without any initialization.
+   ========================================================================== */
+
+
+int psmqd_tm_destroy
+(
+	struct psmqd_tm  *tm  /* map to destroy */
+)
+{
+	size_t            i;  /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, tm);
+
+	for (i = 0; i != tm->size; ++i)
+	{
+		if (tm->entries[i].sub == NULL)
+			continue;
+
+		psmqd_tl_destroy(tm->entries[i].sub);
+		free(tm->entries[i].fds.fd);
+	}
+
+	free(tm->entries);
+	memset(tm, 0x00, sizeof(*tm));
+	return 0;
+}
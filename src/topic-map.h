@@ -0,0 +1,36 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef PSMQ_TOPIC_MAP_H
+#define PSMQ_TOPIC_MAP_H 1
+
+#include <stddef.h>
+
+#include "sub-tree.h"
+#include "topic-list.h"
+
+/* single slot of the map, slot is empty when sub is NULL */
+struct psmqd_tm_entry
+{
+    struct psmqd_tl      *sub;
+    struct psmqd_st_fds   fds;
+};
+
+struct psmqd_tm
+{
+    struct psmqd_tm_entry  *entries;
+    size_t                  size;  /* number of slots, always power of 2 */
+    size_t                  n;     /* number of used slots */
+};
+
+int psmqd_tm_add(struct psmqd_tm *tm, const struct psmqd_tl *sub,
+        unsigned short fd);
+int psmqd_tm_delete(struct psmqd_tm *tm, const struct psmqd_tl *sub,
+        unsigned short fd);
+int psmqd_tm_match(struct psmqd_tm *tm, const char *topic, unsigned long hash,
+        unsigned long *matched);
+int psmqd_tm_destroy(struct psmqd_tm *tm);
+
+#endif /* PSMQ_TOPIC_MAP_H */
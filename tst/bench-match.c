@@ -0,0 +1,383 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         -------------------------------------------------------------
+        / micro benchmark comparing topic matcher from topic-match.c  \
+        | with old strtok() based implementation, that used to copy   |
+        \ both topics on every single call                            /
+         -------------------------------------------------------------
+                \   ^__^
+                 \  (oo)\_______
+                    (__)\       )\/\
+                        ||----w |
+                        ||     ||
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#ifdef HAVE_CONFIG_H
+#   include "psmq-config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "psmq.h"
+#include "topic-list.h"
+#include "topic-match.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+/* topics that are published, mix of short and deep topics, some
+ * of them will match subscriptions below, most of them won't */
+static const char *pubs[] =
+{
+	"/sensor/temp/room1", "/sensor/temp/room2", "/sensor/temp/kitchen",
+	"/sensor/humidity/room1", "/sensor/humidity/garage",
+	"/sensor/pressure/outside", "/actuator/valve/1/state",
+	"/actuator/valve/2/state", "/actuator/pump/main/speed",
+	"/sys/psmqd/uptime", "/sys/net/eth0/rx", "/sys/net/eth0/tx",
+	"/sys/net/wlan0/rssi", "/app/gui/button/ok", "/app/gui/button/cancel",
+	"/app/log/error", "/app/log/warning", "/app/log/info",
+	"/gps/fix", "/gps/position/lat", "/gps/position/lon",
+	"/can/0/frame/0x123", "/can/0/frame/0x7ff", "/can/1/frame/0x100",
+	"/power/battery/voltage", "/power/battery/current", "/power/mains",
+	"/a", "/b/c", "/very/long/topic/with/many/levels/inside/it/x"
+};
+
+/* topics clients subscribe to, mix of exact topics and wildcards */
+static const char *subs[] =
+{
+	"/sensor/temp/room1", "/sensor/temp/+", "/sensor/*", "/sensor/+/room1",
+	"/actuator/valve/+/state", "/actuator/*", "/sys/net/+/rx",
+	"/sys/net/eth0/tx", "/sys/*", "/app/log/error", "/app/log/+",
+	"/app/gui/button/ok", "/gps/position/+", "/gps/fix", "/can/+/frame/*",
+	"/can/0/frame/0x123", "/power/battery/voltage", "/power/+",
+	"/power/battery/+", "/*", "/a", "/+/c",
+	"/very/long/topic/with/many/levels/inside/it/x",
+	"/very/long/topic/with/+/levels/*", "/not/existing/topic"
+};
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Old implementation of matcher, as it was in broker before it was
+    rewritten. Kept here only to compare speed with.
+   ========================================================================== */
+
+
+static int topic_matches_strtok
+(
+	const char  *pub_topic,  /* topic message was publish with */
+	const char  *sub_topic   /* client's subscribe topic (may contain * or + */
+)
+{
+	char        *pubts;      /* saveptr of pubt for strtok_r */
+	char        *subts;      /* saveptr of subt for strtok_r */
+	char        *pubtok;     /* current token of pub topic */
+	char        *subtok;     /* current token of sub topic */
+	char         pubt[PSMQ_MSG_MAX];  /* copy of pub_topic */
+	char         subt[PSMQ_MSG_MAX];  /* copy of sub_topic */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* topics are equal, no need to parse them */
+	if (strcmp(pub_topic, sub_topic) == 0)
+		return 1;
+
+	strcpy(pubt, pub_topic);
+	strcpy(subt, sub_topic);
+
+	/* first tokenize will always be valid, since
+	 * all topics must start from '/' and this is
+	 * checked before this function is called */
+
+	pubtok = strtok_r(pubt, "/", &pubts);
+	subtok = strtok_r(subt, "/", &subts);
+
+	/* let's iterate through all parts of the topic */
+	while(pubtok && subtok)
+	{
+		if (strcmp(subtok, "*") == 0)
+		{
+			/* path is equal up until now, and
+			 * current token is '*' so we can stop
+			 * parsing now and treat topics as
+			 * matching.
+			 *
+			 * Note, '*' was replaces with '@' to
+			 * make compilers happy.  A little
+			 * quiz, guess why?
+			 *
+			 * Examples of matching topics:
+			 *
+			 *      pub: /a/b/c/d
+			 *      sub: /a/b/@
+			 *
+			 *      pub: /a/b/c/d
+			 *      sub: /a/@
+			 *
+			 *      pub: /a/b/c/d
+			 *      sub: /@
+			 */
+
+			return 1;
+		}
+
+		if (strcmp(subtok, "+") == 0)
+		{
+			/* path is equal up intil now, and
+			 * current token is '+' so we treat
+			 * whole token as valid and continue
+			 * for the next one.
+			 *
+			 * Examples of matching topics:
+			 *
+			 *      pub: /a/b/c/d
+			 *      sub: /+/b/c/d
+			 *
+			 *      pub: /a/b/c/d
+			 *      sub: /a/b/+/d
+			 *
+			 *      pub: /a/b/c/d
+			 *      sub: /a/b/c/+
+			 */
+
+			pubtok = strtok_r(NULL, "/", &pubts);
+			subtok = strtok_r(NULL, "/", &subts);
+			continue;
+		}
+
+		if (strcmp(subtok, pubtok) != 0)
+			return 0; /* topics don't match */
+
+		/* tokens are valid, take another token
+		 * and continue with the checks */
+		pubtok = strtok_r(NULL, "/", &pubts);
+		subtok = strtok_r(NULL, "/", &subts);
+	}
+
+	/* we get here when we read all tokenes from
+	 * either pub topic or sub topic */
+
+	/* if both sub topic and pub topic were fully
+	 * tokenized and they match, topics are equal */
+	if (subtok == pubtok)
+		return 1;
+
+	/* only one of the sub topic or pub topic was
+	 * tokenized fully, so these topics don't match */
+	return 0;
+}
+
+
+/* ==========================================================================
+    Returns current monotonic time in nanoseconds
+   ========================================================================== */
+
+
+static double now_ns(void)
+{
+	struct timespec  tp;  /* current time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1e9 + tp.tv_nsec;
+}
+
+
+/* ==========================================================================
+    Runs 'matches' function for every pub/sub combination 'iters' times.
+
+    Returns number of nanoseconds single call took on average.
+   ========================================================================== */
+
+
+static double bench
+(
+	int         (*matches)(const char *, const char *),  /* tested matcher */
+	long          iters,    /* how many times to run whole corpus */
+	long         *nmatch    /* number of matches found will be stored here */
+)
+{
+	long          i;        /* iterator */
+	size_t        p;        /* pub iterator */
+	size_t        s;        /* sub iterator */
+	double        start;    /* time when benchmark started */
+	double        calls;    /* number of calls made */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	*nmatch = 0;
+	start = now_ns();
+
+	for (i = 0; i != iters; ++i)
+		for (p = 0; p != sizeof(pubs)/sizeof(*pubs); ++p)
+			for (s = 0; s != sizeof(subs)/sizeof(*subs); ++s)
+				*nmatch += matches(pubs[p], subs[s]);
+
+	calls = (double)iters * (sizeof(pubs)/sizeof(*pubs)) *
+		(sizeof(subs)/sizeof(*subs));
+	return (now_ns() - start) / calls;
+}
+
+
+/* ==========================================================================
+    Same as bench() but for psmqd_tl_matches(). Subscriptions are compiled
+    once, and hash of pub topic is computed once per published topic, just
+    like broker would do it.
+
+    Returns number of nanoseconds single call took on average or -1 when
+    subscriptions could not be compiled.
+   ========================================================================== */
+
+
+static double bench_compiled
+(
+	long              iters,    /* how many times to run whole corpus */
+	long             *nmatch    /* number of matches found */
+)
+{
+	struct psmqd_tl  *tl;       /* compiled subscriptions */
+	struct psmqd_tl  *node;     /* current subscription */
+	unsigned long     hash;     /* hash of current pub topic */
+	long              i;        /* iterator */
+	size_t            p;        /* pub iterator */
+	size_t            s;        /* sub iterator */
+	double            start;    /* time when benchmark started */
+	double            calls;    /* number of calls made */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (tl = NULL, s = 0; s != sizeof(subs)/sizeof(*subs); ++s)
+		if (psmqd_tl_add(&tl, subs[s]) != 0)
+			return -1;
+
+	*nmatch = 0;
+	start = now_ns();
+
+	for (i = 0; i != iters; ++i)
+		for (p = 0; p != sizeof(pubs)/sizeof(*pubs); ++p)
+		{
+			hash = psmqd_tl_hash(pubs[p]);
+			for (node = tl; node != NULL; node = node->next)
+				*nmatch += psmqd_tl_matches(node, pubs[p], hash);
+		}
+
+	calls = (double)iters * (sizeof(pubs)/sizeof(*pubs)) *
+		(sizeof(subs)/sizeof(*subs));
+	start = (now_ns() - start) / calls;
+	psmqd_tl_destroy(tl);
+	return start;
+}
+
+
+/* ==========================================================================
+                                              _
+                           ____ ___   ____ _ (_)____
+                          / __ `__ \ / __ `// // __ \
+                         / / / / / // /_/ // // / / /
+                        /_/ /_/ /_/ \__,_//_//_/ /_/
+
+   ========================================================================== */
+
+
+int main
+(
+	int     argc,      /* number of arguments in argv */
+	char   *argv[]     /* arguments from command line */
+)
+{
+	long    iters;     /* number of iterations of whole corpus */
+	long    nold;      /* number of matches found by old matcher */
+	long    nnew;      /* number of matches found by new matcher */
+	long    ncomp;     /* number of matches found by compiled matcher */
+	double  told;      /* ns per call of old matcher */
+	double  tnew;      /* ns per call of new matcher */
+	double  tcomp;     /* ns per call of compiled matcher */
+	size_t  p;         /* pub iterator */
+	size_t  s;         /* sub iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	iters = argc > 1 ? atol(argv[1]) : 20000;
+	if (iters <= 0)
+	{
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	/* old matcher copies topics into PSMQ_MSG_MAX buffers */
+	for (p = 0; p != sizeof(pubs)/sizeof(*pubs); ++p)
+		if (strlen(pubs[p]) >= PSMQ_MSG_MAX)
+		{
+			fprintf(stderr, "PSMQ_MSG_MAX too small to run benchmark\n");
+			return 1;
+		}
+
+	for (s = 0; s != sizeof(subs)/sizeof(*subs); ++s)
+		if (strlen(subs[s]) >= PSMQ_MSG_MAX)
+		{
+			fprintf(stderr, "PSMQ_MSG_MAX too small to run benchmark\n");
+			return 1;
+		}
+
+	/* benchmark is worthless if matchers don't agree */
+	for (p = 0; p != sizeof(pubs)/sizeof(*pubs); ++p)
+		for (s = 0; s != sizeof(subs)/sizeof(*subs); ++s)
+			if (topic_matches_strtok(pubs[p], subs[s]) !=
+					psmqt_topic_matches(pubs[p], subs[s]))
+			{
+				fprintf(stderr, "matchers disagree, pub: %s sub: %s\n",
+						pubs[p], subs[s]);
+				return 1;
+			}
+
+	told = bench(topic_matches_strtok, iters, &nold);
+	tnew = bench(psmqt_topic_matches, iters, &nnew);
+	if ((tcomp = bench_compiled(iters, &ncomp)) < 0)
+	{
+		perror("failed to compile subscriptions");
+		return 1;
+	}
+
+	printf("pub topics.......: %lu\n", (unsigned long)(sizeof(pubs)/sizeof(*pubs)));
+	printf("sub topics.......: %lu\n", (unsigned long)(sizeof(subs)/sizeof(*subs)));
+	printf("iterations.......: %ld\n", iters);
+	printf("matches..........: %ld\n", nnew / iters);
+	printf("strtok matcher...: %.2f ns/call\n", told);
+	printf("in-place matcher.: %.2f ns/call\n", tnew);
+	printf("compiled matcher.: %.2f ns/call\n", tcomp);
+	printf("speedup..........: %.2fx (in-place), %.2fx (compiled)\n",
+			told / tnew, told / tcomp);
+
+	return nold != nnew || nold != ncomp;
+}
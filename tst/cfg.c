@@ -49,6 +49,18 @@ static void cfg_all_default(void)
 	mt_fail(g_psmqd_cfg.colorful_output == 0);
 	mt_fail(g_psmqd_cfg.remove_queue == 0);
 	mt_fail(g_psmqd_cfg.broker_maxmsg == 10);
+	mt_fail(g_psmqd_cfg.broker_batch == 1);
+	mt_fail(g_psmqd_cfg.broker_workers == 0);
+	mt_fail(g_psmqd_cfg.broker_overflow == 0);
+	mt_fail(g_psmqd_cfg.broker_shm == 0);
+	mt_fail(g_psmqd_cfg.broker_shm_size == 65536);
+	mt_fail(g_psmqd_cfg.broker_route_cache == 0);
+	mt_fail(g_psmqd_cfg.broker_stats == 0);
+	mt_fail(g_psmqd_cfg.broker_preempt == 0);
+	mt_fail(g_psmqd_cfg.broker_pub_limit == 0);
+	mt_fail(g_psmqd_cfg.broker_recv_limit == 0);
+	mt_fail(g_psmqd_cfg.broker_limit_errno == 0);
+	mt_fail(g_psmqd_cfg.broker_retain == 0);
 	mt_fail(strcmp(g_psmqd_cfg.broker_name, "/psmqd") == 0);
 	mt_fail(g_psmqd_cfg.program_log == NULL);
 }
@@ -68,6 +80,17 @@ static void cfg_short_opts(void)
 		"-p", "/var/log/psmqd",
 		"-b/brokeros",
 		"-m1337",
+		"-n16",
+		"-w4",
+		"-s8",
+		"-z4096",
+		"-t256",
+		"-i1000",
+		"-f8",
+		"-j100",
+		"-k200",
+		"-e",
+		"-a4096",
 		"-r"
 	};
 	int argc = sizeof(argv) / sizeof(const char *);
@@ -79,6 +102,17 @@ static void cfg_short_opts(void)
 	mt_fail(g_psmqd_cfg.colorful_output == 1);
 	mt_fail(g_psmqd_cfg.remove_queue == 1);
 	mt_fail(g_psmqd_cfg.broker_maxmsg == 1337);
+	mt_fail(g_psmqd_cfg.broker_batch == 16);
+	mt_fail(g_psmqd_cfg.broker_workers == 4);
+	mt_fail(g_psmqd_cfg.broker_shm == 8);
+	mt_fail(g_psmqd_cfg.broker_shm_size == 4096);
+	mt_fail(g_psmqd_cfg.broker_route_cache == 256);
+	mt_fail(g_psmqd_cfg.broker_stats == 1000);
+	mt_fail(g_psmqd_cfg.broker_preempt == 8);
+	mt_fail(g_psmqd_cfg.broker_pub_limit == 100);
+	mt_fail(g_psmqd_cfg.broker_recv_limit == 200);
+	mt_fail(g_psmqd_cfg.broker_limit_errno == 1);
+	mt_fail(g_psmqd_cfg.broker_retain == 4096);
 	mt_fail(strcmp(g_psmqd_cfg.broker_name, "/brokeros") == 0);
 	mt_fail(strcmp(g_psmqd_cfg.program_log, "/var/log/psmqd") == 0);
 }
@@ -95,6 +129,7 @@ static void cfg_mixed_opts(void)
 		"kurload",
 		"-l4",
 		"-p", "/var/log/psmqd",
+		"-o64",
 		"-m1337"
 	};
 	int argc = sizeof(argv) / sizeof(const char *);
@@ -106,6 +141,7 @@ static void cfg_mixed_opts(void)
 	mt_fail(g_psmqd_cfg.colorful_output == 0);
 	mt_fail(g_psmqd_cfg.remove_queue == 0);
 	mt_fail(g_psmqd_cfg.broker_maxmsg == 1337);
+	mt_fail(g_psmqd_cfg.broker_overflow == 64);
 	mt_fail(strcmp(g_psmqd_cfg.broker_name, "/psmqd") == 0);
 	mt_fail(strcmp(g_psmqd_cfg.program_log, "/var/log/psmqd") == 0);
 }
@@ -171,6 +207,21 @@ static void cfg_unknown_option(void)
 }
 
 
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void cfg_workers_and_overflow(void)
+{
+	int    argc = 3;
+	char  *argv[] = { "psmqd", "-w2", "-o8", NULL };
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	mt_fail(psmqd_cfg_init(argc, argv) == -1);
+}
+
+
 /* ==========================================================================
              __               __
             / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
@@ -190,4 +241,5 @@ void psmqd_cfg_test_group()
 	mt_run(cfg_print_version);
 	mt_run(cfg_missing_argument);
 	mt_run(cfg_unknown_option);
+	mt_run(cfg_workers_and_overflow);
 }
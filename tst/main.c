@@ -15,6 +15,9 @@ mt_defs();  /* definitions for mtest */
 
 void psmqd_cfg_test_group(void);
 void psmqd_tl_test_group(void);
+void psmqd_st_test_group(void);
+void psmqd_tm_test_group(void);
+void psmqd_rt_test_group(void);
 void psmqd_test_group(void);
 void psmq_test_group(void);
 
@@ -45,6 +48,9 @@ int main(void)
 	el_option(EL_FINFO, 1);
 	psmqd_cfg_test_group();
 	psmqd_tl_test_group();
+	psmqd_st_test_group();
+	psmqd_tm_test_group();
+	psmqd_rt_test_group();
 	psmqd_test_group();
 	psmq_test_group();
 	el_cleanup();
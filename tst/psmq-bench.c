@@ -0,0 +1,730 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         -------------------------------------------------------------
+        / throughput and latency benchmark of the whole thing, broker \
+        | is spawned as separate process, publishers and subscribers  |
+        | are threads of this one. Every combination of payload size, |
+        | topic depth, wildcard ratio and number of subscriptions is  |
+        \ run and reported as single line                             /
+         -------------------------------------------------------------
+                \   ^__^
+                 \  (oo)\_______
+                    (__)\       )\/\
+                        ||----w |
+                        ||     ||
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#ifdef HAVE_CONFIG_H
+#   include "psmq-config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "psmq.h"
+
+int psmqd_main(int argc, char *argv[]);
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+#define BENCH_BROKER    "/psmq-bench"
+#define BENCH_LIST_MAX  16     /* max values in single sweep list */
+#define BENCH_TIMEOUT   2000   /* ms without message before sub gives up */
+#define BENCH_RECV_MAX  16     /* messages taken from queue at once */
+
+/* sweep values passed with -l -d -w -t options */
+struct list
+{
+	int  v[BENCH_LIST_MAX];
+	int  n;
+};
+
+/* single benchmark run */
+struct run
+{
+	int   paylen;    /* payload size, with send time in it */
+	int   depth;     /* number of levels of published topic */
+	int   wild;      /* percent of subscriptions that are wildcards */
+	int   nsubs;     /* subscriptions per subscriber, one matches */
+};
+
+struct pub
+{
+	struct psmq     psmq;
+	char            qname[32];
+	pthread_t       t;
+};
+
+struct sub
+{
+	struct psmq     psmq;
+	char            qname[32];
+	pthread_t       t;
+	long            got;       /* number of received messages */
+	unsigned int   *lat;       /* latency of each message in ns */
+	double          last;      /* time last message was received */
+};
+
+static int                npub = 1;     /* number of publishers */
+static int                nsub = 4;     /* number of subscribers */
+static long               nmsg = 20000; /* messages per publisher */
+static long               rate;         /* msgs/s per publisher, 0 - max */
+static char             **bargv;        /* extra args for broker */
+static int                bargc;        /* number of extra args for broker */
+static pthread_barrier_t  start;        /* publishers start all at once */
+static char               topic[PSMQ_MSG_MAX]; /* published topic */
+static struct run         cur;          /* currently running benchmark */
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Returns current monotonic time in nanoseconds
+   ========================================================================== */
+
+
+static double now_ns(void)
+{
+	struct timespec  tp;  /* current time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1e9 + tp.tv_nsec;
+}
+
+
+/* ==========================================================================
+    Parses comma separated list of numbers 's' into 'l'.
+
+    Returns 0 on success or -1 when 's' is not a valid list.
+   ========================================================================== */
+
+
+static int parse_list
+(
+	struct list  *l,     /* parsed list */
+	const char   *s      /* string to parse */
+)
+{
+	char         *end;   /* where strtol() stopped */
+	long          v;     /* parsed value */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (l->n = 0; l->n != BENCH_LIST_MAX; s = end + 1)
+	{
+		v = strtol(s, &end, 10);
+		if (end == s || v < 0 || v > 1000000)
+			return -1;
+
+		l->v[l->n++] = v;
+		if (*end == '\0')
+			return 0;
+
+		if (*end != ',')
+			return -1;
+	}
+
+	return -1;
+}
+
+
+/* ==========================================================================
+    Builds topic of 'depth' levels, with 'first' and 'second' as first
+    two levels, into 't' buffer.
+   ========================================================================== */
+
+
+static void make_topic
+(
+	char        *t,       /* buffer for topic, PSMQ_MSG_MAX long */
+	const char  *first,   /* first level of topic */
+	const char  *second,  /* second level of topic */
+	int          depth    /* number of levels in topic */
+)
+{
+	size_t       len;     /* length of topic so far */
+	int          i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	len = snprintf(t, PSMQ_MSG_MAX, "/%s/%s", first, second);
+	for (i = 3; i <= depth && len < PSMQ_MSG_MAX; ++i)
+		len += snprintf(t + len, PSMQ_MSG_MAX - len, "/l%d", i);
+}
+
+
+/* ==========================================================================
+    Starts broker in child process. Extra arguments passed after "--" on
+    command line go to broker.
+
+    Returns pid of broker or -1 on error.
+   ========================================================================== */
+
+
+static pid_t broker_start(void)
+{
+	pid_t        pid;       /* pid of broker process */
+	mqd_t        mq;        /* broker control queue */
+	const char  *argv[32];  /* arguments for psmqd_main() */
+	int          argc;      /* number of arguments in argv */
+	int          i;         /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	mq_unlink(BENCH_BROKER);
+	pid = fork();
+	if (pid == -1)
+		return -1;
+
+	if (pid == 0)
+	{
+		argc = 0;
+		argv[argc++] = "psmqd";
+		argv[argc++] = "-b" BENCH_BROKER;
+		argv[argc++] = "-l0";
+		for (i = 0; i != bargc && argc != 31; ++i)
+			argv[argc++] = bargv[i];
+		argv[argc] = NULL;
+
+		_exit(psmqd_main(argc, (char **)argv));
+	}
+
+	/* wait until broker creates its queue */
+	for (i = 0; i != 5000; ++i)
+	{
+		mq = mq_open(BENCH_BROKER, O_RDONLY);
+		if (mq != (mqd_t)-1)
+		{
+			mq_close(mq);
+			return pid;
+		}
+
+		usleep(1000);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+
+/* ==========================================================================
+    Stops broker 'pid' and stores cpu time it used in 'cpu' (in seconds).
+   ========================================================================== */
+
+
+static void broker_stop
+(
+	pid_t          pid,  /* broker process */
+	double        *cpu   /* cpu time used by broker */
+)
+{
+	struct rusage  ru;   /* resources used by broker */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	memset(&ru, 0x00, sizeof(ru));
+	kill(pid, SIGTERM);
+	wait4(pid, NULL, 0, &ru);
+	mq_unlink(BENCH_BROKER);
+
+	*cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+
+/* ==========================================================================
+    Publisher thread, sends nmsg messages on topic, as fast as it can or
+    with 'rate' messages per second. Every payload starts with time it
+    was sent.
+   ========================================================================== */
+
+
+static void *pub_thread
+(
+	void             *arg      /* struct pub of this thread */
+)
+{
+	struct pub       *p;       /* publisher data */
+	char              payload[PSMQ_MSG_MAX];  /* payload to send */
+	struct timespec   next;    /* when to send next message */
+	double            sent;    /* time message is sent */
+	long              i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	p = arg;
+	memset(payload, 0xa5, sizeof(payload));
+	pthread_barrier_wait(&start);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (i = 0; i != nmsg; ++i)
+	{
+		if (rate)
+		{
+			next.tv_nsec += 1000000000l / rate;
+			while (next.tv_nsec >= 1000000000l)
+			{
+				next.tv_nsec -= 1000000000l;
+				next.tv_sec += 1;
+			}
+
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+
+		sent = now_ns();
+		memcpy(payload, &sent, sizeof(sent));
+		if (psmq_publish(&p->psmq, topic, payload, cur.paylen) != 0)
+		{
+			perror("psmq_publish()");
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+
+/* ==========================================================================
+    Subscriber thread, receives messages until it gets all of them, or
+    there was nothing for BENCH_TIMEOUT.
+   ========================================================================== */
+
+
+static void *sub_thread
+(
+	void             *arg      /* struct sub of this thread */
+)
+{
+	struct sub       *s;       /* subscriber data */
+	struct psmq_msg   msgs[BENCH_RECV_MAX];  /* received messages */
+	double            sent;    /* time message was sent */
+	double            now;     /* time message was received */
+	long              expect;  /* number of messages to receive */
+	int               n;       /* number of received messages */
+	int               i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	s = arg;
+	expect = npub * nmsg;
+
+	while (s->got != expect)
+	{
+		n = psmq_receive_many(&s->psmq, msgs, BENCH_RECV_MAX,
+				BENCH_TIMEOUT);
+		if (n == -1)
+			break;
+
+		now = now_ns();
+		for (i = 0; i != n && s->got != expect; ++i)
+		{
+			if (msgs[i].ctrl.cmd != PSMQ_CTRL_CMD_PUBLISH)
+				continue;
+
+			memcpy(&sent, PSMQ_PAYLOAD(msgs[i]), sizeof(sent));
+			s->lat[s->got++] = now - sent;
+			s->last = now;
+		}
+	}
+
+	return NULL;
+}
+
+
+/* ==========================================================================
+    Connects 'psmq' to broker with queue name made from 'prefix' and 'i',
+    stored in 'qname'.
+
+    Returns 0 on success or -1 on errors.
+   ========================================================================== */
+
+
+static int client_init
+(
+	struct psmq  *psmq,    /* client to connect */
+	char         *qname,   /* queue name, 32 bytes */
+	const char   *prefix,  /* queue name prefix */
+	int           i        /* client number */
+)
+{
+	sprintf(qname, "/psmq-bench-%s%d", prefix, i);
+	mq_unlink(qname);
+	if (psmq_init_named(psmq, BENCH_BROKER, qname, 10) == 0)
+		return 0;
+
+	fprintf(stderr, "failed to connect %s to broker: %s\n",
+			qname, strerror(errno));
+	return -1;
+}
+
+
+/* ==========================================================================
+    Subscribes subscriber 's' to cur.nsubs topics, only first one matches
+    published topic. First cur.wild percent of them are wildcards.
+
+    Returns 0 on success or -1 on errors.
+   ========================================================================== */
+
+
+static int sub_subscribe
+(
+	struct sub       *s        /* subscriber to subscribe */
+)
+{
+	char              t[PSMQ_MSG_MAX];  /* topic to subscribe to */
+	char              first[16];  /* first level of topic */
+	struct psmq_msg   msg;     /* subscribe reply */
+	int               i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != cur.nsubs; ++i)
+	{
+		if (i == 0)
+			strcpy(first, "bench");
+		else
+			sprintf(first, "f%d", i);
+
+		make_topic(t, first, i * 100 < cur.wild * cur.nsubs ? "+" : "t",
+				cur.depth);
+		if (psmq_subscribe(&s->psmq, t) != 0 ||
+				psmq_timedreceive_ms(&s->psmq, &msg, 1000) != 0 ||
+				msg.ctrl.cmd != PSMQ_CTRL_CMD_SUBSCRIBE ||
+				msg.ctrl.data != 0)
+		{
+			fprintf(stderr, "failed to subscribe to %s\n", t);
+			return -1;
+		}
+	}
+
+	/* don't lose messages when we are slower than
+	 * publishers, let broker wait for us instead */
+	if (psmq_ioctl_reply_timeout(&s->psmq, 1000) != 0 ||
+			psmq_timedreceive_ms(&s->psmq, &msg, 1000) != 0)
+		return -1;
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Compares two latencies for qsort()
+   ========================================================================== */
+
+
+static int lat_cmp
+(
+	const void  *a,  /* first latency */
+	const void  *b   /* second latency */
+)
+{
+	unsigned int  la = *(const unsigned int *)a;
+	unsigned int  lb = *(const unsigned int *)b;
+
+	return la < lb ? -1 : la > lb;
+}
+
+
+/* ==========================================================================
+    Runs single benchmark described by 'cur', and prints its results.
+
+    Returns 0 on success or -1 on errors.
+   ========================================================================== */
+
+
+static int bench_run(void)
+{
+	struct pub       *pubs;    /* publishers */
+	struct sub       *subs;    /* subscribers */
+	unsigned int     *lat;     /* latencies of all received messages */
+	pid_t             broker;  /* broker process */
+	double            t0;      /* time publishing started */
+	double            t1;      /* time last message was received */
+	double            cpu;     /* broker cpu time */
+	long              got;     /* number of all received messages */
+	long              lost;    /* number of messages not received */
+	long              n;       /* number of latencies stored in lat */
+	int               ret;     /* return code */
+	int               i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	make_topic(topic, "bench", "t", cur.depth);
+	if (strlen(topic) + 1 + cur.paylen > PSMQ_MSG_MAX)
+	{
+		printf("%5d %5d %5d %6d  topic and payload too big\n",
+				cur.paylen, cur.depth, cur.wild, cur.nsubs);
+		return 0;
+	}
+
+	if ((broker = broker_start()) == -1)
+	{
+		fprintf(stderr, "failed to start broker\n");
+		return -1;
+	}
+
+	ret = -1;
+	got = lost = 0;
+	t0 = t1 = 0;
+	pubs = calloc(npub, sizeof(*pubs));
+	subs = calloc(nsub, sizeof(*subs));
+	lat = malloc(sizeof(*lat) * nsub * npub * nmsg);
+	if (pubs == NULL || subs == NULL || lat == NULL)
+		goto error;
+
+	for (i = 0; i != nsub; ++i)
+	{
+		subs[i].lat = lat + (long)i * npub * nmsg;
+		if (client_init(&subs[i].psmq, subs[i].qname, "s", i) != 0)
+			goto error;
+
+		if (sub_subscribe(&subs[i]) != 0)
+			goto error;
+	}
+
+	for (i = 0; i != npub; ++i)
+		if (client_init(&pubs[i].psmq, pubs[i].qname, "p", i) != 0)
+			goto error;
+
+	pthread_barrier_init(&start, NULL, npub + 1);
+	for (i = 0; i != nsub; ++i)
+		pthread_create(&subs[i].t, NULL, sub_thread, &subs[i]);
+	for (i = 0; i != npub; ++i)
+		pthread_create(&pubs[i].t, NULL, pub_thread, &pubs[i]);
+
+	t0 = now_ns();
+	pthread_barrier_wait(&start);
+
+	for (i = 0; i != npub; ++i)
+		pthread_join(pubs[i].t, NULL);
+	for (i = 0; i != nsub; ++i)
+		pthread_join(subs[i].t, NULL);
+	pthread_barrier_destroy(&start);
+
+	/* compact latencies of all subscribers */
+	got = 0;
+	t1 = t0;
+	for (i = 0; i != nsub; ++i)
+	{
+		memmove(lat + got, subs[i].lat, sizeof(*lat) * subs[i].got);
+		got += subs[i].got;
+		if (subs[i].last > t1)
+			t1 = subs[i].last;
+	}
+
+	lost = (long)nsub * npub * nmsg - got;
+	ret = 0;
+
+error:
+	for (i = 0; pubs && i != npub; ++i)
+		if (pubs[i].qname[0])
+		{
+			psmq_cleanup(&pubs[i].psmq);
+			mq_unlink(pubs[i].qname);
+		}
+
+	for (i = 0; subs && i != nsub; ++i)
+		if (subs[i].qname[0])
+		{
+			psmq_cleanup(&subs[i].psmq);
+			mq_unlink(subs[i].qname);
+		}
+
+	broker_stop(broker, &cpu);
+
+	if (ret == 0 && got)
+	{
+		qsort(lat, got, sizeof(*lat), lat_cmp);
+		n = got - 1;
+		printf("%5d %5d %5d %6d %10.0f %9.1f %9.1f %9.1f %6.1f %6ld\n",
+				cur.paylen, cur.depth, cur.wild, cur.nsubs,
+				got / ((t1 - t0) / 1e9),
+				lat[n * 50 / 100] / 1e3, lat[n * 99 / 100] / 1e3,
+				lat[n * 999 / 1000] / 1e3, cpu * 1e11 / (t1 - t0), lost);
+	}
+	else if (ret == 0)
+		printf("%5d %5d %5d %6d  no messages received\n",
+				cur.paylen, cur.depth, cur.wild, cur.nsubs);
+
+	fflush(stdout);
+	free(pubs);
+	free(subs);
+	free(lat);
+	return ret;
+}
+
+
+/* ==========================================================================
+                                              _
+                           ____ ___   ____ _ (_)____
+                          / __ `__ \ / __ `// // __ \
+                         / / / / / // /_/ // // / / /
+                        /_/ /_/ /_/ \__,_//_//_/ /_/
+
+   ========================================================================== */
+
+
+int main
+(
+	int          argc,     /* number of arguments in argv */
+	char        *argv[]    /* arguments from command line */
+)
+{
+	struct list  paylens;  /* payload sizes to sweep */
+	struct list  depths;   /* topic depths to sweep */
+	struct list  wilds;    /* wildcard ratios to sweep */
+	struct list  nsubs;    /* subscription counts to sweep */
+	int          arg;      /* arg for getopt() */
+	int          p;        /* paylens iterator */
+	int          d;        /* depths iterator */
+	int          w;        /* wilds iterator */
+	int          s;        /* nsubs iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	parse_list(&paylens, "16,128");
+	parse_list(&depths, "2,8");
+	parse_list(&wilds, "0,100");
+	parse_list(&nsubs, "1,64");
+
+	while ((arg = getopt(argc, argv, ":hp:s:m:r:l:d:w:t:")) != -1)
+	{
+		switch (arg)
+		{
+		case 'p': npub = atoi(optarg); break;
+		case 's': nsub = atoi(optarg); break;
+		case 'm': nmsg = atol(optarg); break;
+		case 'r': rate = atol(optarg); break;
+
+		case 'l':
+		case 'd':
+		case 'w':
+		case 't':
+			if (parse_list(arg == 'l' ? &paylens : arg == 'd' ? &depths :
+						arg == 'w' ? &wilds : &nsubs, optarg) == 0)
+				break;
+
+			fprintf(stderr, "invalid list for -%c: %s\n", arg, optarg);
+			return 1;
+
+		case 'h':
+			printf(
+"%s - throughput and latency benchmark of psmqd\n"
+"\n"
+"usage: %s [options] [-- broker options]\n"
+"\n"
+"\t-p<n>        number of publishers, default: 1\n"
+"\t-s<n>        number of subscribers, default: 4\n"
+"\t-m<n>        messages sent by each publisher, default: 20000\n"
+"\t-r<n>        messages per second sent by each publisher, default: 0 (max)\n"
+"\t-l<list>     payload sizes to sweep, default: 16,128\n"
+"\t-d<list>     topic depths to sweep, default: 2,8\n"
+"\t-w<list>     percents of wildcard subscriptions to sweep, default: 0,100\n"
+"\t-t<list>     subscriptions per subscriber to sweep, default: 1,64\n"
+"\n"
+"Every subscriber receives every published message, through one of its\n"
+"subscriptions, rest of them don't match anything. Lists are comma\n"
+"separated. Options after -- are passed to broker, ie. -- -w4\n",
+					argv[0], argv[0]);
+			return 0;
+
+		case ':':
+			fprintf(stderr, "option -%c requires an argument\n", optopt);
+			return 1;
+
+		case '?':
+			fprintf(stderr, "unknown option -%c\n", optopt);
+			return 1;
+		}
+	}
+
+	bargv = argv + optind;
+	bargc = argc - optind;
+
+	if (npub < 1 || nsub < 1 || nmsg < 1 || rate < 0 ||
+			npub + nsub > PSMQ_MAX_CLIENTS)
+	{
+		fprintf(stderr, "invalid number of clients or messages\n");
+		return 1;
+	}
+
+	for (p = 0; p != paylens.n; ++p)
+		if (paylens.v[p] < (int)sizeof(double))
+		{
+			fprintf(stderr, "payload must be at least %d bytes\n",
+					(int)sizeof(double));
+			return 1;
+		}
+
+	for (d = 0; d != depths.n; ++d)
+		if (depths.v[d] < 2)
+		{
+			fprintf(stderr, "topic depth must be at least 2\n");
+			return 1;
+		}
+
+	printf("publishers: %d, subscribers: %d, messages: %ld, rate: %ld\n",
+			npub, nsub, nmsg, rate);
+	printf("%5s %5s %5s %6s %10s %9s %9s %9s %6s %6s\n", "pay", "depth",
+			"wild%", "subs", "msgs/s", "p50us", "p99us", "p999us", "cpu%",
+			"lost");
+
+	for (p = 0; p != paylens.n; ++p)
+	for (d = 0; d != depths.n; ++d)
+	for (w = 0; w != wilds.n; ++w)
+	for (s = 0; s != nsubs.n; ++s)
+	{
+		cur.paylen = paylens.v[p];
+		cur.depth = depths.v[d];
+		cur.wild = wilds.v[w];
+		cur.nsubs = nsubs.v[s] ? nsubs.v[s] : 1;
+
+		if (bench_run() != 0)
+			return 1;
+	}
+
+	return 0;
+}
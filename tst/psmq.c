@@ -370,6 +370,9 @@ void psmq_test_group(void)
 	char             long_qname[512];
 	struct timespec  tp;
 	struct timespec  tp_inval;
+	size_t           shmlen;
+	struct psmq_pub  pubs[2];
+	struct psmq_trace trace;
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 	tp_inval.tv_sec = -1;
@@ -392,6 +395,10 @@ void psmq_test_group(void)
 	CHECK_ERR(psmq_init_named(&psmq, "/b", "/q",  0), EINVAL);
 	CHECK_ERR(psmq_init_named(&psmq, "/b", "/q", -1), EINVAL);
 	CHECK_ERR(psmq_init_named(&psmq, "/b", buf, 10), ENAMETOOLONG);
+	CHECK_ERR(psmq_init_class(&psmq, "/b", "/q", 10, PSMQ_MSG_CLASS_MIN - 1),
+			EINVAL);
+	CHECK_ERR(psmq_init_class(&psmq, "/b", "/q", 10, PSMQ_MSG_MAX + 1),
+			EINVAL);
 	CHECK_ERR(psmq_cleanup(NULL), EINVAL);
 	CHECK_ERR(psmq_cleanup(&psmq_uninit), EBADF);
 
@@ -409,7 +416,45 @@ void psmq_test_group(void)
 	CHECK_ERR(psmq_publish(&psmq, buf, NULL, PSMQ_MSG_MAX), ENOBUFS);
 	CHECK_ERR(psmq_publish(&psmq, buf, NULL, PSMQ_MSG_MAX - 2), ENOBUFS);
 
+	CHECK_ERR(psmq_publish_retain(NULL, "/t", NULL, 0, 0), EINVAL);
+	CHECK_ERR(psmq_publish_retain(&psmq_uninit, "/t", NULL, 0, 0), EBADF);
+	CHECK_ERR(psmq_publish_retain(&psmq, NULL, NULL, 0, 0), EINVAL);
+	CHECK_ERR(psmq_publish_retain(&psmq, "t", NULL, 0, 0), EBADMSG);
+	CHECK_ERR(psmq_publish_retain(&psmq, buf, NULL, PSMQ_MSG_MAX - 2, 0),
+			ENOBUFS);
+
+	pubs[0].topic = "/t";
+	pubs[0].payload = NULL;
+	pubs[0].paylen = 0;
+	pubs[1] = pubs[0];
+	CHECK_ERR(psmq_publish_batch(NULL, pubs, 2, 0), EINVAL);
+	CHECK_ERR(psmq_publish_batch(&psmq, NULL, 2, 0), EINVAL);
+	CHECK_ERR(psmq_publish_batch(&psmq, pubs, 0, 0), EINVAL);
+	CHECK_ERR(psmq_publish_batch(&psmq_uninit, pubs, 2, 0), EBADF);
+	pubs[1].topic = NULL;
+	CHECK_ERR(psmq_publish_batch(&psmq, pubs, 2, 0), EINVAL);
+	pubs[1].topic = "t";
+	CHECK_ERR(psmq_publish_batch(&psmq, pubs, 2, 0), EBADMSG);
+	pubs[1].topic = "/t";
+	pubs[1].paylen = PSMQ_MSG_MAX - 5;
+	CHECK_ERR(psmq_publish_batch(&psmq, pubs, 2, 0), ENOBUFS);
+
+	CHECK_ERR(psmq_alias(NULL, "/t", 0), EINVAL);
+	CHECK_ERR(psmq_alias(&psmq, NULL, 0), EINVAL);
+	CHECK_ERR(psmq_alias(&psmq, "/t", PSMQ_MAX_ALIASES), EINVAL);
+	CHECK_ERR(psmq_alias(&psmq, "t", 0), EBADMSG);
+	CHECK_ERR(psmq_alias(&psmq_uninit, "/t", 0), EBADF);
+	CHECK_ERR(psmq_publish_alias(NULL, 0, NULL, 0, 0), EINVAL);
+	CHECK_ERR(psmq_publish_alias(&psmq, PSMQ_MAX_ALIASES, NULL, 0, 0),
+			EINVAL);
+	CHECK_ERR(psmq_publish_alias(&psmq, 0, NULL, PSMQ_MSG_MAX - 1, 0), ENOBUFS);
+	CHECK_ERR(psmq_publish_alias(&psmq_uninit, 0, NULL, 0, 0), EBADF);
+
 	CHECK_ERR(psmq_receive(NULL, &msg), EINVAL);
+	CHECK_ERR(psmq_receive_many(NULL, &msg, 1, 0), EINVAL);
+	CHECK_ERR(psmq_receive_many(&psmq, NULL, 1, 0), EINVAL);
+	CHECK_ERR(psmq_receive_many(&psmq, &msg, 0, 0), EINVAL);
+	CHECK_ERR(psmq_receive_many(&psmq_uninit, &msg, 1, 0), EBADF);
 	CHECK_ERR(psmq_receive(&psmq_uninit, &msg), EBADF);
 	CHECK_ERR(psmq_timedreceive(NULL, &msg, &tp), EINVAL);
 	CHECK_ERR(psmq_timedreceive(&psmq_uninit, &msg, &tp), EBADF);
@@ -425,10 +470,24 @@ void psmq_test_group(void)
 
 	CHECK_ERR(psmq_subscribe(NULL, "/t"), EINVAL);
 	CHECK_ERR(psmq_subscribe(&psmq_uninit, "/t"), EBADF);
+	CHECK_ERR(psmq_subscribe_flags(NULL, "/t", 0), EINVAL);
+	CHECK_ERR(psmq_subscribe_flags(&psmq_uninit, "/t", 0), EBADF);
 
 	CHECK_ERR(psmq_unsubscribe(NULL, "/t"), EINVAL);
 	CHECK_ERR(psmq_unsubscribe(&psmq_uninit, "/t"), EBADF);
 
+	mt_run_quick(psmq_shm_alloc(NULL, 1) == NULL && errno == EINVAL);
+	mt_run_quick(psmq_shm_alloc(&psmq_uninit, 1) == NULL && errno == ENOTSUP);
+	mt_run_quick(psmq_shm_borrow(NULL, &msg, &shmlen) == NULL &&
+			errno == EINVAL);
+	mt_run_quick(psmq_shm_borrow(&psmq_uninit, NULL, &shmlen) == NULL &&
+			errno == EINVAL);
+	CHECK_ERR(psmq_publish_shm(NULL, "/t", buf, 1, 0), EINVAL);
+	CHECK_ERR(psmq_publish_shm(&psmq_uninit, NULL, buf, 1, 0), EINVAL);
+	CHECK_ERR(psmq_publish_shm(&psmq_uninit, "/t", buf, 1, 0), ENOTSUP);
+	CHECK_ERR(psmq_shm_release(NULL, buf), EINVAL);
+	CHECK_ERR(psmq_shm_release(&psmq_uninit, buf), ENOTSUP);
+
 	/* tests that creates own custom set of
 	 * clients, and only need broker to start/stop */
 	mt_prepare_test = psmqt_prepare_test;
@@ -467,6 +526,9 @@ void psmq_test_group(void)
 	CHECK_ERR(psmq_subscribe(&gt_pub_psmq, buf), ENOBUFS);
 	buf[PSMQ_MSG_MAX] = '\0';
 	CHECK_ERR(psmq_subscribe(&gt_pub_psmq, buf), ENOBUFS);
+	CHECK_ERR(psmq_subscribe_flags(&gt_pub_psmq, NULL, 0), EINVAL);
+	CHECK_ERR(psmq_subscribe_flags(&gt_pub_psmq, "/t", 0x80), EINVAL);
+	CHECK_ERR(psmq_subscribe_flags(&gt_pub_psmq, "t", 0), EBADMSG);
 
 	CHECK_ERR(psmq_unsubscribe(&gt_pub_psmq, NULL), EINVAL);
 	CHECK_ERR(psmq_unsubscribe(&gt_pub_psmq, ""), EINVAL);
@@ -481,6 +543,25 @@ void psmq_test_group(void)
 	CHECK_ERR(psmq_ioctl_reply_timeout(&psmq_uninit, 10), EBADF);
 	CHECK_ERR(psmq_ioctl(&gt_sub_psmq, PSMQ_IOCTL_REPLY_TIMEOUT, USHRT_MAX + 1u),
 			EINVAL);
+	CHECK_ERR(psmq_ioctl_trace(NULL, 1), EINVAL);
+	CHECK_ERR(psmq_ioctl_trace(&psmq_uninit, 1), EBADF);
+	CHECK_ERR(psmq_ioctl(&gt_sub_psmq, PSMQ_IOCTL_TRACE, 2), EINVAL);
+	CHECK_ERR(psmq_ioctl_pub_limit(NULL, 10, 0), EINVAL);
+	CHECK_ERR(psmq_ioctl_pub_limit(&psmq_uninit, 10, 0), EBADF);
+	CHECK_ERR(psmq_ioctl_pub_limit(&gt_sub_psmq, PSMQ_LIMIT_MAX + 1, 0), EINVAL);
+	CHECK_ERR(psmq_ioctl_recv_limit(NULL, 10, 0), EINVAL);
+	CHECK_ERR(psmq_ioctl_recv_limit(&psmq_uninit, 10, 0), EBADF);
+	CHECK_ERR(psmq_ioctl_recv_limit(&gt_sub_psmq, 10, PSMQ_LIMIT_MAX + 1), EINVAL);
+
+	memset(&msg, 0x00, sizeof(msg));
+	msg.ctrl.cmd = PSMQ_CTRL_CMD_PUBLISH;
+	CHECK_ERR(psmq_msg_trace(NULL, &trace), EINVAL);
+	CHECK_ERR(psmq_msg_trace(&msg, NULL), EINVAL);
+	msg.paylen = PSMQ_MSG_MAX - 1;
+	CHECK_ERR(psmq_msg_trace(&msg, &trace), ENOBUFS);
+	msg.ctrl.cmd = PSMQ_CTRL_CMD_SUBSCRIBE;
+	msg.paylen = 0;
+	CHECK_ERR(psmq_msg_trace(&msg, &trace), EINVAL);
 
 
 	mt_run(psmq_unsub);
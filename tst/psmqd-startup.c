@@ -21,6 +21,8 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -45,6 +47,8 @@
 int psmqd_main(int argc, char *argv[]);
 mt_defs_ext();
 
+#define PSMQT_MAX_ARGS 16
+
 struct main_args
 {
 	int     argc;
@@ -69,6 +73,15 @@ struct psmq  gt_sub_psmq;               /* sub psmq for tests */
 char         gt_pub_name[QNAME_LEN];    /* pub queue name for tests */
 char         gt_sub_name[QNAME_LEN];    /* sub queue name for tests */
 struct psmq_msg gt_recvd_msg;           /* received message */
+int          gt_broker_batch = 1;       /* batch size broker is started with */
+int          gt_broker_workers = 0;     /* delivery threads broker starts */
+int          gt_broker_overflow = 0;    /* parked messages per client */
+int          gt_broker_shm = 0;         /* blocks in broker's shm slab */
+int          gt_broker_route_cache = 0; /* topics in broker's route cache */
+int          gt_broker_stats = 0;   /* ms between broker's stats reports */
+int          gt_broker_preempt = 0; /* deliveries between preemption checks */
+int          gt_broker_limit_errno = 0; /* report publishes over limit */
+int          gt_broker_retain = 0;  /* bytes for retained messages */
 
 
 /* ==========================================================================
@@ -112,8 +125,37 @@ static void *psmqt_thread
 }
 
 
+/* ==========================================================================
+    Appends argument, formatted like printf() does, to 'args'.
+   ========================================================================== */
+
+
+static void psmqt_add_arg
+(
+	struct main_args  *args,     /* args to append argument to */
+	const char        *fmt,      /* printf() like format of argument */
+	...                          /* values for format */
+)
+{
+	char               arg[32];  /* formatted argument */
+	va_list            ap;       /* values for format */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	va_start(ap, fmt);
+	vsnprintf(arg, sizeof(arg), fmt, ap);
+	va_end(ap);
+
+	args->argv[args->argc] = malloc(strlen(arg) + 1);
+	strcpy(args->argv[args->argc++], arg);
+}
+
+
 /* ==========================================================================
     Creates thread that will run psmqd_main() with some default parameters.
+    Broker options from gt_broker_* are passed only when they differ from
+    broker's defaults.
+
     After starting thread, it waits some time to confirm daemon really did
     start.
 
@@ -123,23 +165,39 @@ static void *psmqt_thread
 
 static int psmqt_run_default(void)
 {
-	int                i;      /* simple iterator */
 	time_t             start;  /* starting point of waiting for confirmation */
 	struct main_args  *args;   /* allocated args to create psmqd_main() with */
 	struct timespec    tp;     /* time to sleep between psmqd_main() run check*/
-	const char        *argv[] = { "psmqd", "-l6", "-p./psmqd.log",
-		"-m10", NULL };
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
 	args = malloc(sizeof(*args));
-	args->argc = sizeof(argv)/sizeof(*argv) - 1;
-	args->argv = calloc(args->argc, sizeof(const char *));
-	for (i = 0; i != args->argc; ++i)
-	{
-		args->argv[i] = malloc(strlen(argv[i]) + 1);
-		strcpy(args->argv[i], argv[i]);
-	}
+	args->argc = 0;
+	args->argv = calloc(PSMQT_MAX_ARGS, sizeof(char *));
+
+	psmqt_add_arg(args, "psmqd");
+	psmqt_add_arg(args, "-l6");
+	psmqt_add_arg(args, "-p./psmqd.log");
+	psmqt_add_arg(args, "-m10");
+
+	if (gt_broker_batch != 1)
+		psmqt_add_arg(args, "-n%d", gt_broker_batch);
+	if (gt_broker_workers)
+		psmqt_add_arg(args, "-w%d", gt_broker_workers);
+	if (gt_broker_overflow)
+		psmqt_add_arg(args, "-o%d", gt_broker_overflow);
+	if (gt_broker_shm)
+		psmqt_add_arg(args, "-s%d", gt_broker_shm);
+	if (gt_broker_route_cache)
+		psmqt_add_arg(args, "-t%d", gt_broker_route_cache);
+	if (gt_broker_stats)
+		psmqt_add_arg(args, "-i%d", gt_broker_stats);
+	if (gt_broker_preempt)
+		psmqt_add_arg(args, "-f%d", gt_broker_preempt);
+	if (gt_broker_retain)
+		psmqt_add_arg(args, "-a%d", gt_broker_retain);
+	if (gt_broker_limit_errno)
+		psmqt_add_arg(args, "-e");
 
 	memset(gt_broker_name, 0x00, sizeof(gt_broker_name));
 	strcpy(gt_broker_name, "/psmqd");
@@ -431,7 +489,7 @@ int psmqt_receive_expect
 		return -1;
 
 	topiclen = 0;
-	if (strchr("spu", cmd))
+	if (strchr("spua", cmd))
 		topiclen = strlen(msg.data) + 1;
 
 	e = 0;
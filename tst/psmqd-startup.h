@@ -20,6 +20,15 @@ extern struct psmq      gt_sub_psmq;
 extern char             gt_pub_name[QNAME_LEN];
 extern char             gt_sub_name[QNAME_LEN];
 extern struct psmq_msg  gt_recvd_msg;
+extern int              gt_broker_batch;
+extern int              gt_broker_workers;
+extern int              gt_broker_overflow;
+extern int              gt_broker_shm;
+extern int              gt_broker_route_cache;
+extern int              gt_broker_stats;
+extern int              gt_broker_preempt;
+extern int              gt_broker_limit_errno;
+extern int              gt_broker_retain;
 
 
 void psmqt_gen_random_string(char *s, size_t l);
@@ -18,9 +18,11 @@
 
 #include <embedlog.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <mqueue.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -67,7 +69,7 @@ struct multi_ps_targs
 /* Function exported from libpsmq, even tho it is exported publicly
  * it's declaration can't be found in include files and is intended
  * for internal use only, like in tests. */
-int psmq_publish_msg(struct psmq *psmq, char cmd, unsigned char data,
+int psmq_publish_msg(struct psmq *psmq, char cmd, unsigned short fd,
 	const char *topic, const void *payload, size_t paylen, unsigned int prio);
 
 /* ==========================================================================
@@ -383,6 +385,43 @@ static void psmqd_create_too_much_client(void)
 }
 
 
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_reuse_client_slot(void)
+{
+	char         qname[PSMQ_MAX_CLIENTS + 1][QNAME_LEN];
+	struct psmq  psmq[PSMQ_MAX_CLIENTS + 1];
+	int          i;
+	int          fd;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	psmqt_gen_unique_queue_name_array(qname, PSMQ_MAX_CLIENTS + 1, QNAME_LEN);
+
+	for (i = 0; i != PSMQ_MAX_CLIENTS; ++i)
+		mt_fail(psmq_init_named(&psmq[i], gt_broker_name, qname[i], 10) == 0);
+
+	/* free slot somewhere in the middle, next client must
+	 * get exactly that one, and broker is full again */
+	i = PSMQ_MAX_CLIENTS * 2 / 3;
+	fd = psmq[i].fd;
+	mt_fok(psmq_cleanup(&psmq[i]));
+	mt_fok(psmq_init_named(&psmq[i], gt_broker_name, qname[i], 10));
+	mt_fail(psmq[i].fd == fd);
+
+	i = PSMQ_MAX_CLIENTS;
+	mt_ferr(psmq_init_named(&psmq[i], gt_broker_name, qname[i], 10), ENOSPC);
+	mq_unlink(qname[i]);
+
+	for (i = 0; i != PSMQ_MAX_CLIENTS; ++i)
+	{
+		mt_fok(psmq_cleanup(&psmq[i]));
+		mq_unlink(qname[i]);
+	}
+}
+
+
 /* ==========================================================================
    ========================================================================== */
 
@@ -580,7 +619,919 @@ static void psmqd_unsubscribe(void)
 	mt_ferr(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 100), EINTR);
 #else
 	mt_ferr(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 100), ETIMEDOUT);
-#endif
+#endif
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_unsubscribe_with_bad_topics(void)
+{
+	char             qname[QNAME_LEN];
+	struct psmq      psmq;
+	struct psmq_msg  msg;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	psmqt_gen_queue_name(qname, sizeof(qname));
+	mt_assert(psmq_init_named(&psmq, gt_broker_name, qname, 10) == 0);
+	mt_fok(psmq_subscribe(&psmq, "/t"));
+	mt_fok(psmqt_receive_expect(&psmq, 's', 0, 0, "/t", NULL));
+
+	memset(&msg, 0x00, sizeof(msg));
+
+	mt_ferr(psmq_unsubscribe(&psmq, "a"), EBADMSG);
+	mt_ferr(psmq_unsubscribe(&psmq, NULL), EINVAL);
+	mt_ferr(psmq_unsubscribe(&psmq, ""), EINVAL);
+	mt_fok(psmq_unsubscribe(&psmq, "/a/"));
+	mt_fok(psmqt_receive_expect(&psmq, 'u', ENOENT, 0, "/a/", NULL));
+
+	mt_fok(psmq_cleanup(&psmq));
+	mq_unlink(qname);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_small_msg_class(void)
+{
+	char             qname[2][QNAME_LEN];
+	char             buf[PSMQ_MSG_MAX - 3];
+	struct psmq      pub_psmq;
+	struct psmq      sub_psmq;
+	struct psmq_msg  msg;
+	struct mq_attr   mqa;
+	int              i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	psmqt_gen_unique_queue_name_array(qname, 2, QNAME_LEN);
+	mt_fail(psmq_init_named(&pub_psmq, gt_broker_name, qname[0], 10) == 0);
+	mt_fail(psmq_init_class(&sub_psmq, gt_broker_name, qname[1], 10,
+				PSMQ_MSG_CLASS_SMALL) == 0);
+
+	/* kernel should really create smaller queue */
+	mt_fok(mq_getattr(sub_psmq.qsub, &mqa));
+	mt_fail(mqa.mq_msgsize ==
+			(long)(offsetof(struct psmq_msg, data) + PSMQ_MSG_CLASS_SMALL));
+
+	mt_fok(psmq_subscribe(&sub_psmq, "/t"));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 's', 0, 0, "/t", NULL));
+
+	/* topic itself won't fit, so broker's ack wouldn't too */
+	psmqt_gen_random_string(buf, PSMQ_MSG_CLASS_SMALL + 1);
+	buf[0] = '/';
+	mt_ferr(psmq_subscribe(&sub_psmq, buf), ENOBUFS);
+
+	/* messages that don't fit client's queue are not sent
+	 * to him, but he is not punished for that either, so
+	 * he won't be disconnected even after many of these */
+	if (sizeof(buf) > PSMQ_MSG_CLASS_SMALL)
+	{
+		psmqt_gen_random_string(buf, sizeof(buf));
+		for (i = 0; i != 2 * 10; ++i)
+			mt_fok(psmq_publish(&pub_psmq, "/t", buf, sizeof(buf)));
+	}
+
+	mt_fok(psmq_publish(&pub_psmq, "/t", "s", 2));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 'p', 0, 2, "/t", "s"));
+	mt_ferr(psmq_timedreceive_ms(&sub_psmq, &msg, 100), ETIMEDOUT);
+
+	mt_fok(psmq_cleanup(&pub_psmq));
+	mt_fok(psmq_cleanup(&sub_psmq));
+	mq_unlink(qname[0]);
+	mq_unlink(qname[1]);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_publish_batch(void)
+{
+	struct psmq_msg  msg;
+	struct psmq_pub  pubs[4];
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	pubs[0].topic = "/t"; pubs[0].payload = "a"; pubs[0].paylen = 2;
+	pubs[1].topic = "/x"; pubs[1].payload = "b"; pubs[1].paylen = 2;
+	pubs[2].topic = "/t"; pubs[2].payload = NULL; pubs[2].paylen = 0;
+	pubs[3].topic = "/t"; pubs[3].payload = "c"; pubs[3].paylen = 2;
+
+	mt_fok(psmq_publish_batch(&gt_pub_psmq, pubs, 4, 0));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/t", "a"));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 0, "/t", NULL));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/t", "c"));
+	mt_ferr(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 100), ETIMEDOUT);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_publish_batch_split(void)
+{
+	struct psmq_msg  msg;
+	struct psmq_pub  pubs[8];
+	char             bufs[8][PSMQ_MSG_MAX / 3];
+	int              i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* only two such records fit into single message,
+	 * so library has to send a few of them */
+	for (i = 0; i != 8; ++i)
+	{
+		psmqt_gen_random_string(bufs[i], sizeof(bufs[i]));
+		bufs[i][0] = 'a' + i;
+		pubs[i].topic = "/t";
+		pubs[i].payload = bufs[i];
+		pubs[i].paylen = sizeof(bufs[i]);
+	}
+
+	mt_fok(psmq_publish_batch(&gt_pub_psmq, pubs, 8, 0));
+	for (i = 0; i != 8; ++i)
+		mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, sizeof(bufs[i]),
+					"/t", bufs[i]));
+	mt_ferr(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 100), ETIMEDOUT);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_publish_batch_malformed(void)
+{
+	struct psmq_msg  msg;
+	unsigned short   paylen;
+	char             recs[16];
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* first record is valid, second one claims
+	 * more payload than there is in message */
+	paylen = 2;
+	memcpy(recs, &paylen, sizeof(paylen));
+	memcpy(recs + 2, "/t\0v", 5);
+	paylen = 100;
+	memcpy(recs + 7, &paylen, sizeof(paylen));
+	memcpy(recs + 9, "/t\0w", 5);
+
+	mt_fok(psmq_publish_msg(&gt_pub_psmq, PSMQ_CTRL_CMD_PUBLISH_BATCH,
+				gt_pub_psmq.fd, "", recs, 14, 0));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/t", "v"));
+	mt_ferr(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 100), ETIMEDOUT);
+
+	/* record without null terminated topic */
+	paylen = 0;
+	memcpy(recs, &paylen, sizeof(paylen));
+	memcpy(recs + 2, "/t", 2);
+	mt_fok(psmq_publish_msg(&gt_pub_psmq, PSMQ_CTRL_CMD_PUBLISH_BATCH,
+				gt_pub_psmq.fd, "", recs, 4, 0));
+	mt_ferr(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 100), ETIMEDOUT);
+
+	/* broker should still be fine */
+	mt_fok(psmq_publish(&gt_pub_psmq, "/t", "t", 2));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/t", "t"));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_receive_many(void)
+{
+	struct psmq_msg  msgs[8];
+	unsigned int     prios[8];
+	char             payload[2];
+	int              i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	payload[1] = '\0';
+	for (i = 0; i != 5; ++i)
+	{
+		payload[0] = 'a' + i;
+		mt_fok(psmq_publish(&gt_pub_psmq, "/t", payload, 2));
+	}
+
+	/* broker processes requests in order, so once subscribe
+	 * is acked, all messages are waiting in subscriber queue */
+	mt_fok(psmq_subscribe(&gt_pub_psmq, "/y"));
+	mt_fok(psmqt_receive_expect(&gt_pub_psmq, 's', 0, 0, "/y", NULL));
+
+	/* more messages than array can hold */
+	mt_fail(psmq_receive_many(&gt_sub_psmq, msgs, 3, 0) == 3);
+	mt_fail(strcmp(PSMQ_PAYLOAD(msgs[0]), "a") == 0);
+	mt_fail(strcmp(PSMQ_PAYLOAD(msgs[1]), "b") == 0);
+	mt_fail(strcmp(PSMQ_PAYLOAD(msgs[2]), "c") == 0);
+
+	/* less messages than array can hold */
+	mt_fail(psmq_receive_many_prio(&gt_sub_psmq, msgs, prios, 8, -1) == 2);
+	mt_fail(strcmp(PSMQ_PAYLOAD(msgs[0]), "d") == 0);
+	mt_fail(strcmp(PSMQ_PAYLOAD(msgs[1]), "e") == 0);
+	mt_fail(prios[0] == 0);
+
+	/* nothing in the queue */
+	mt_fail(psmq_receive_many(&gt_sub_psmq, msgs, 8, 100) == -1);
+	mt_fail(errno == ETIMEDOUT);
+
+	mt_fok(psmq_publish(&gt_pub_psmq, "/t", "z", 2));
+	mt_fail(psmq_receive_many(&gt_sub_psmq, msgs, 8, 1000) == 1);
+	mt_fail(strcmp(PSMQ_PAYLOAD(msgs[0]), "z") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_topic_alias(void)
+{
+	struct psmq_msg  msg;
+	unsigned char    id;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	mt_fok(psmq_alias(&gt_pub_psmq, "/t", 3));
+	mt_fok(psmqt_receive_expect(&gt_pub_psmq, 'a', 0, 0, "/t", NULL));
+	mt_fok(psmq_publish_alias(&gt_pub_psmq, 3, "a", 2, 0));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/t", "a"));
+
+	/* alias on topic matched by wildcard */
+	mt_fok(psmq_subscribe(&gt_sub_psmq, "/w/+"));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 's', 0, 0, "/w/+", NULL));
+	mt_fok(psmq_alias(&gt_pub_psmq, "/w/a", 0));
+	mt_fok(psmqt_receive_expect(&gt_pub_psmq, 'a', 0, 0, "/w/a", NULL));
+	mt_fok(psmq_publish_alias(&gt_pub_psmq, 0, "b", 2, 0));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/w/a", "b"));
+	mt_fok(psmq_publish_alias(&gt_pub_psmq, 0, NULL, 0, 0));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 0, "/w/a", NULL));
+
+	/* subscribers of aliased topic change, broker must notice */
+	mt_fok(psmq_unsubscribe(&gt_sub_psmq, "/t"));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'u', 0, 0, "/t", NULL));
+	mt_fok(psmq_publish_alias(&gt_pub_psmq, 3, "c", 2, 0));
+	mt_ferr(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 100), ETIMEDOUT);
+	mt_fok(psmq_subscribe(&gt_sub_psmq, "/t"));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 's', 0, 0, "/t", NULL));
+	mt_fok(psmq_publish_alias(&gt_pub_psmq, 3, "d", 2, 0));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/t", "d"));
+
+	/* registering alias again replaces it */
+	mt_fok(psmq_alias(&gt_pub_psmq, "/w/b", 3));
+	mt_fok(psmqt_receive_expect(&gt_pub_psmq, 'a', 0, 0, "/w/b", NULL));
+	mt_fok(psmq_publish_alias(&gt_pub_psmq, 3, "e", 2, 0));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/w/b", "e"));
+
+	/* alias that was never registered */
+	mt_fok(psmq_publish_alias(&gt_pub_psmq, 5, "f", 2, 0));
+	mt_ferr(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 100), ETIMEDOUT);
+
+	/* invalid requests, that library would not send */
+	mt_fok(psmq_publish_msg(&gt_pub_psmq, PSMQ_CTRL_CMD_ALIAS,
+				gt_pub_psmq.fd, "/t", NULL, 0, 0));
+	mt_fok(psmqt_receive_expect(&gt_pub_psmq, 'a', EBADMSG, 0, "/t", NULL));
+	id = PSMQ_MAX_ALIASES;
+	mt_fok(psmq_publish_msg(&gt_pub_psmq, PSMQ_CTRL_CMD_ALIAS,
+				gt_pub_psmq.fd, "/t", &id, 1, 0));
+	mt_fok(psmqt_receive_expect(&gt_pub_psmq, 'a', EINVAL, 0, "/t", NULL));
+	mt_fok(psmq_publish_msg(&gt_pub_psmq, PSMQ_CTRL_CMD_PUBLISH_ALIAS,
+				gt_pub_psmq.fd, "", NULL, 0, 0));
+	mt_fok(psmq_publish_msg(&gt_pub_psmq, PSMQ_CTRL_CMD_PUBLISH_ALIAS,
+				gt_pub_psmq.fd, "", &id, 1, 0));
+	mt_ferr(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 100), ETIMEDOUT);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_v1_client(void)
+{
+	char             qname[QNAME_LEN];
+	struct psmq      psmq;
+	struct psmq_msg  msg;
+	struct mq_attr   mqa;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* library always asks for V2 */
+	mt_fail(gt_pub_psmq.proto == PSMQ_PROTO_V2);
+	mt_fail(gt_sub_psmq.proto == PSMQ_PROTO_V2);
+
+	/* client built with old library does not send protocol
+	 * in open, and must get fd in single byte */
+	psmqt_gen_queue_name(qname, sizeof(qname));
+	memset(&psmq, 0x00, sizeof(psmq));
+	memset(&mqa, 0x00, sizeof(mqa));
+	mqa.mq_msgsize = sizeof(struct psmq_msg);
+	mqa.mq_maxmsg = 10;
+	psmq.qsub = mq_open(qname, O_RDWR | O_CREAT, 0600, &mqa);
+	mt_assert(psmq.qsub != (mqd_t)-1);
+	psmq.qpub = mq_open(gt_broker_name, O_WRONLY);
+	mt_assert(psmq.qpub != (mqd_t)-1);
+	psmq.proto = PSMQ_PROTO_V1;
+	psmq.msgclass = PSMQ_MSG_MAX;
+
+	mt_fok(psmq_publish_msg(&psmq, PSMQ_CTRL_CMD_OPEN, 0, qname, NULL, 0, 0));
+	mt_fok(psmq_timedreceive_ms(&psmq, &msg, 1000));
+	mt_fail(msg.ctrl.cmd == PSMQ_CTRL_CMD_OPEN);
+	mt_fail(msg.ctrl.data == 0);
+	mt_fail(msg.paylen == 1);
+	psmq.fd = (unsigned char)msg.data[0];
+
+	/* and broker must understand his requests */
+	mt_fok(psmq_subscribe(&psmq, "/v"));
+	mt_fok(psmqt_receive_expect(&psmq, 's', 0, 0, "/v", NULL));
+	mt_fok(psmq_publish(&gt_pub_psmq, "/v", "a", 2));
+	mt_fok(psmqt_receive_expect(&psmq, 'p', 0, 2, "/v", "a"));
+	mt_fok(psmq_publish(&psmq, "/t", "b", 2));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/t", "b"));
+
+	mt_fok(psmq_cleanup(&psmq));
+	mq_unlink(qname);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_trace(void)
+{
+	struct psmq_msg    msg;
+	struct psmq_trace  t;
+	unsigned int       now;
+	char               buf[2];
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	buf[0] = PSMQ_IOCTL_TRACE;
+	buf[1] = 1;
+	mt_fok(psmq_ioctl_trace(&gt_sub_psmq, 1));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'i', 0, 2, NULL, buf));
+
+	/* publisher does not trace, so only broker stamps */
+	mt_fok(psmq_publish(&gt_pub_psmq, "/t", "a", 2));
+	mt_fok(psmq_receive(&gt_sub_psmq, &msg));
+	now = psmq_trace_now();
+	mt_fail(strcmp(PSMQ_PAYLOAD(msg), "a") == 0);
+	mt_fok(psmq_msg_trace(&msg, &t));
+	mt_fail(t.sent == 0);
+	mt_fail(t.brecv != 0);
+	mt_fail((int)(t.bsend - t.brecv) >= 0);
+	mt_fail((int)(now - t.bsend) >= 0);
+
+	/* now whole way is traced, alias publish too */
+	mt_fok(psmq_ioctl_trace(&gt_pub_psmq, 1));
+	mt_fok(psmqt_receive_expect(&gt_pub_psmq, 'i', 0, 2, NULL, buf));
+	mt_fok(psmq_alias(&gt_pub_psmq, "/t", 3));
+	mt_fok(psmqt_receive_expect(&gt_pub_psmq, 'a', 0, 0, "/t", NULL));
+	mt_fok(psmq_publish(&gt_pub_psmq, "/t", "b", 2));
+	mt_fok(psmq_publish_alias(&gt_pub_psmq, 3, "c", 2, 0));
+
+	mt_fok(psmq_receive(&gt_sub_psmq, &msg));
+	mt_fail(strcmp(PSMQ_PAYLOAD(msg), "b") == 0);
+	mt_fail(msg.paylen == 2);
+	mt_fok(psmq_msg_trace(&msg, &t));
+	mt_fail(t.sent != 0);
+	mt_fail((int)(t.brecv - t.sent) >= 0);
+	mt_fail((int)(t.bsend - t.brecv) >= 0);
+
+	mt_fok(psmq_receive(&gt_sub_psmq, &msg));
+	mt_fail(strcmp(PSMQ_PAYLOAD(msg), "c") == 0);
+	mt_fok(psmq_msg_trace(&msg, &t));
+	mt_fail(t.sent != 0);
+	mt_fail((int)(t.brecv - t.sent) >= 0);
+
+	/* subscriber that stops tracing gets plain messages,
+	 * even though publisher still stamps them */
+	buf[1] = 0;
+	mt_fok(psmq_ioctl_trace(&gt_sub_psmq, 0));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'i', 0, 2, NULL, buf));
+	mt_fok(psmq_publish(&gt_pub_psmq, "/t", "d", 2));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/t", "d"));
+
+	/* broker accepts only 0 and 1 */
+	buf[1] = 2;
+	mt_fok(psmq_publish_msg(&gt_sub_psmq, 'i', gt_sub_psmq.fd,
+				NULL, buf, 2, 0));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'i', EINVAL, 2, NULL, buf));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_set_limit
+(
+	struct psmq   *psmq,
+	int            req,
+	unsigned int   rate,
+	unsigned int   burst
+)
+{
+	unsigned int   limit[2];
+	char           buf[1 + sizeof(limit)];
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* broker replies with burst it really set */
+	limit[0] = rate;
+	limit[1] = burst ? burst : rate;
+	buf[0] = req;
+	memcpy(buf + 1, limit, sizeof(limit));
+
+	mt_fok(psmq_ioctl(psmq, req, rate, burst));
+	mt_fok(psmqt_receive_expect(psmq, 'i', 0, sizeof(buf), NULL, buf));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_rate_limit(void)
+{
+	struct psmq_msg  msg;
+	char             buf[16];
+	char             i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* 3 messages at once, and then one per second, so
+	 * last two of these are dropped */
+	psmqd_set_limit(&gt_pub_psmq, PSMQ_IOCTL_PUB_LIMIT, 1, 3);
+	for (i = 0; i != 5; ++i)
+		mt_fok(psmq_publish(&gt_pub_psmq, "/t", &i, sizeof(i)));
+
+	for (i = 0; i != 3; ++i)
+		mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, sizeof(i), "/t", &i));
+	mt_ferr(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 100), ETIMEDOUT);
+
+	/* drop is silent by default */
+	mt_ferr(psmq_timedreceive_ms(&gt_pub_psmq, &msg, 10), ETIMEDOUT);
+
+	/* no limit, no drops */
+	psmqd_set_limit(&gt_pub_psmq, PSMQ_IOCTL_PUB_LIMIT, 0, 0);
+	for (i = 0; i != 5; ++i)
+		mt_fok(psmq_publish(&gt_pub_psmq, "/t", &i, sizeof(i)));
+	for (i = 0; i != 5; ++i)
+		mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, sizeof(i), "/t", &i));
+
+	/* subscriber is limited now, burst same as rate */
+	psmqd_set_limit(&gt_sub_psmq, PSMQ_IOCTL_RECV_LIMIT, 2, 0);
+	for (i = 0; i != 5; ++i)
+		mt_fok(psmq_publish(&gt_pub_psmq, "/t", &i, sizeof(i)));
+	for (i = 0; i != 2; ++i)
+		mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, sizeof(i), "/t", &i));
+	mt_ferr(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 100), ETIMEDOUT);
+	psmqd_set_limit(&gt_sub_psmq, PSMQ_IOCTL_RECV_LIMIT, 0, 0);
+
+	/* invalid requests are rejected by broker too */
+	memset(buf, 0x00, sizeof(buf));
+	buf[0] = PSMQ_IOCTL_PUB_LIMIT;
+	mt_fok(psmq_publish_msg(&gt_pub_psmq, PSMQ_CTRL_CMD_IOCTL,
+				gt_pub_psmq.fd, NULL, buf, 2, 0));
+	mt_fok(psmqt_receive_expect(&gt_pub_psmq, 'i', EINVAL, 2, NULL, buf));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_rate_limit_errno(void)
+{
+	struct psmq_msg  msg;
+	char             i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	psmqd_set_limit(&gt_pub_psmq, PSMQ_IOCTL_PUB_LIMIT, 1, 1);
+	for (i = 0; i != 3; ++i)
+		mt_fok(psmq_publish(&gt_pub_psmq, "/t", &i, sizeof(i)));
+
+	i = 0;
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, sizeof(i), "/t", &i));
+	mt_ferr(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 100), ETIMEDOUT);
+
+	/* only first of dropped messages is reported */
+	mt_fok(psmqt_receive_expect(&gt_pub_psmq, 'p', EAGAIN, 0, "/t", NULL));
+	mt_ferr(psmq_timedreceive_ms(&gt_pub_psmq, &msg, 10), ETIMEDOUT);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_route_cache(void)
+{
+	char             qname[QNAME_LEN];
+	struct psmq      psmq;
+	struct psmq_msg  msg;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* more topics than cache can hold, so they evict each other */
+	mt_fok(psmq_publish(&gt_pub_psmq, "/t", "a", 2));
+	mt_fok(psmq_publish(&gt_pub_psmq, "/a", "b", 2));
+	mt_fok(psmq_publish(&gt_pub_psmq, "/b", "c", 2));
+	mt_fok(psmq_publish(&gt_pub_psmq, "/t", "d", 2));
+	mt_fok(psmq_publish(&gt_pub_psmq, "/t", "e", 2));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/t", "a"));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/t", "d"));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/t", "e"));
+
+	/* cached routes must follow subscriptions */
+	mt_fok(psmq_subscribe(&gt_sub_psmq, "/+"));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 's', 0, 0, "/+", NULL));
+	mt_fok(psmq_publish(&gt_pub_psmq, "/a", "f", 2));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/a", "f"));
+	mt_fok(psmq_unsubscribe(&gt_sub_psmq, "/+"));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'u', 0, 0, "/+", NULL));
+	mt_fok(psmq_unsubscribe(&gt_sub_psmq, "/t"));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'u', 0, 0, "/t", NULL));
+	mt_fok(psmq_publish(&gt_pub_psmq, "/a", "g", 2));
+	mt_fok(psmq_publish(&gt_pub_psmq, "/t", "h", 2));
+	mt_ferr(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 100), ETIMEDOUT);
+
+	/* client that closed must not get anything, even
+	 * when another client takes over his fd */
+	psmqt_gen_queue_name(qname, sizeof(qname));
+	mt_fok(psmq_init_named(&psmq, gt_broker_name, qname, 10));
+	mt_fok(psmq_subscribe(&psmq, "/c"));
+	mt_fok(psmqt_receive_expect(&psmq, 's', 0, 0, "/c", NULL));
+	mt_fok(psmq_publish(&gt_pub_psmq, "/c", "i", 2));
+	mt_fok(psmqt_receive_expect(&psmq, 'p', 0, 2, "/c", "i"));
+	mt_fok(psmq_cleanup(&psmq));
+	mt_fok(psmq_init_named(&psmq, gt_broker_name, qname, 10));
+	mt_fok(psmq_publish(&gt_pub_psmq, "/c", "j", 2));
+	mt_ferr(psmq_timedreceive_ms(&psmq, &msg, 100), ETIMEDOUT);
+	mt_fok(psmq_cleanup(&psmq));
+	mq_unlink(qname);
+}
+
+
+/* ==========================================================================
+    Client can have at most PSMQ_MAX_SUBS subscriptions, unsubscribe
+    makes room for new one, and close releases all of them
+   ========================================================================== */
+
+
+static void psmqd_max_subs(void)
+{
+	char             topic[32];
+	char             qname[QNAME_LEN];
+	struct psmq      psmq;
+	int              i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* gt_sub_psmq is already subscribed to /t */
+	for (i = 1; i != PSMQ_MAX_SUBS; ++i)
+	{
+		sprintf(topic, "/m/%d", i);
+		mt_fok(psmq_subscribe(&gt_sub_psmq, topic));
+		mt_fok(psmqt_receive_expect(&gt_sub_psmq, 's', 0, 0, topic, NULL));
+	}
+
+	mt_fok(psmq_subscribe(&gt_sub_psmq, "/m/x"));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 's', ENOSPC, 0, "/m/x", NULL));
+
+	/* subscriptions that made it still work */
+	mt_fok(psmq_publish(&gt_pub_psmq, "/t", "a", 2));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/t", "a"));
+
+	mt_fok(psmq_unsubscribe(&gt_sub_psmq, "/t"));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'u', 0, 0, "/t", NULL));
+	mt_fok(psmq_subscribe(&gt_sub_psmq, "/m/x"));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 's', 0, 0, "/m/x", NULL));
+	mt_fok(psmq_publish(&gt_pub_psmq, "/m/x", "b", 2));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/m/x", "b"));
+
+	/* fd of closed client is reused by new one, he must
+	 * start with empty pool */
+	mt_fok(psmq_cleanup(&gt_sub_psmq));
+	psmqt_gen_unique_queue_name_array(&qname, 1, QNAME_LEN);
+	mt_fok(psmq_init_named(&psmq, gt_broker_name, qname, 10));
+	for (i = 0; i != PSMQ_MAX_SUBS; ++i)
+	{
+		sprintf(topic, "/n/%d", i);
+		mt_fok(psmq_subscribe(&psmq, topic));
+		mt_fok(psmqt_receive_expect(&psmq, 's', 0, 0, topic, NULL));
+	}
+
+	mt_fok(psmq_cleanup(&psmq));
+	mq_unlink(qname);
+
+	/* cleanup of test will close it again */
+	mt_fok(psmq_init_named(&gt_sub_psmq, gt_broker_name, gt_sub_name, 10));
+}
+
+
+/* ==========================================================================
+    Client that subscribes, gets last retained message of every matching
+    topic right after subscribe reply, be it exact or wildcard
+    subscription.
+   ========================================================================== */
+
+
+static void psmqd_retained(void)
+{
+	char             qname[2][QNAME_LEN];
+	struct psmq      pub_psmq;
+	struct psmq      sub_psmq;
+	struct psmq_msg  msg;
+	char             i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	psmqt_gen_unique_queue_name_array(qname, 2, QNAME_LEN);
+	mt_fail(psmq_init_named(&pub_psmq, gt_broker_name, qname[0], 10) == 0);
+	mt_fail(psmq_init_named(&sub_psmq, gt_broker_name, qname[1], 10) == 0);
+
+	/* /r/a is retained twice, only last one is kept,
+	 * /r/c is not retained at all */
+	i = 1;
+	mt_fok(psmq_publish_retain(&pub_psmq, "/r/a", &i, sizeof(i), 0));
+	i = 2;
+	mt_fok(psmq_publish_retain(&pub_psmq, "/r/b", &i, sizeof(i), 0));
+	i = 3;
+	mt_fok(psmq_publish_retain(&pub_psmq, "/r/a", &i, sizeof(i), 0));
+	i = 4;
+	mt_fok(psmq_publish_retain(&pub_psmq, "/x", &i, sizeof(i), 0));
+	i = 5;
+	mt_fok(psmq_publish(&pub_psmq, "/r/c", &i, sizeof(i)));
+
+	mt_fok(psmq_subscribe(&sub_psmq, "/r/a"));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 's', 0, 0, "/r/a", NULL));
+	i = 3;
+	mt_fok(psmqt_receive_expect(&sub_psmq, 'p', 0, sizeof(i), "/r/a", &i));
+	mt_ferr(psmq_timedreceive_ms(&sub_psmq, &msg, 100), ETIMEDOUT);
+
+	mt_fok(psmq_subscribe(&sub_psmq, "/r/+"));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 's', 0, 0, "/r/+", NULL));
+	i = 3;
+	mt_fok(psmqt_receive_expect(&sub_psmq, 'p', 0, sizeof(i), "/r/a", &i));
+	i = 2;
+	mt_fok(psmqt_receive_expect(&sub_psmq, 'p', 0, sizeof(i), "/r/b", &i));
+	mt_ferr(psmq_timedreceive_ms(&sub_psmq, &msg, 100), ETIMEDOUT);
+
+	/* retained message is also delivered as any other */
+	i = 6;
+	mt_fok(psmq_publish_retain(&pub_psmq, "/r/b", &i, sizeof(i), 0));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 'p', 0, sizeof(i), "/r/b", &i));
+
+	/* empty payload clears retained message */
+	mt_fok(psmq_publish_retain(&pub_psmq, "/r/b", NULL, 0, 0));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 'p', 0, 0, "/r/b", NULL));
+	mt_fok(psmq_subscribe(&pub_psmq, "/r/*"));
+	mt_fok(psmqt_receive_expect(&pub_psmq, 's', 0, 0, "/r/*", NULL));
+	i = 3;
+	mt_fok(psmqt_receive_expect(&pub_psmq, 'p', 0, sizeof(i), "/r/a", &i));
+	mt_ferr(psmq_timedreceive_ms(&pub_psmq, &msg, 100), ETIMEDOUT);
+
+	mt_fok(psmq_cleanup(&pub_psmq));
+	mt_fok(psmq_cleanup(&sub_psmq));
+	mq_unlink(qname[0]);
+	mq_unlink(qname[1]);
+}
+
+
+/* ==========================================================================
+    Broker started without -a routes retained publish as ordinary one,
+    and remembers nothing
+   ========================================================================== */
+
+
+static void psmqd_retained_disabled(void)
+{
+	struct psmq_msg  msg;
+	char             i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	i = 1;
+	mt_fok(psmq_publish_retain(&gt_pub_psmq, "/t", &i, sizeof(i), 0));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, sizeof(i), "/t", &i));
+	mt_fok(psmq_subscribe(&gt_pub_psmq, "/t"));
+	mt_fok(psmqt_receive_expect(&gt_pub_psmq, 's', 0, 0, "/t", NULL));
+	mt_ferr(psmq_timedreceive_ms(&gt_pub_psmq, &msg, 100), ETIMEDOUT);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_stats(void)
+{
+	struct psmq_msg  msg;
+	const char      *payload;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	mt_fok(psmq_subscribe(&gt_sub_psmq, "/$sys/broker/stats"));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 's', 0, 0,
+				"/$sys/broker/stats", NULL));
+	mt_fok(psmq_subscribe(&gt_sub_psmq, "/$sys/broker/client/+"));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 's', 0, 0,
+				"/$sys/broker/client/+", NULL));
+
+	/* clients cannot pretend to be broker, fake
+	 * report would be received before real one */
+	mt_fok(psmq_publish(&gt_pub_psmq, "/$sys/broker/stats", "clients=9", 10));
+	mt_fok(psmq_publish(&gt_pub_psmq, "/t", "a", 2));
+	mt_fok(psmqt_receive_expect(&gt_sub_psmq, 'p', 0, 2, "/t", "a"));
+
+	/* wait for report with the above publish in it */
+	for (;;)
+	{
+		mt_assert(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 1000) == 0);
+		mt_assert(msg.ctrl.data == 0);
+
+		if (strcmp(msg.data, "/$sys/broker/stats") != 0)
+			continue;
+
+		payload = msg.data + strlen(msg.data) + 1;
+		mt_fail(strncmp(payload, "clients=2 ", 10) == 0);
+		if (strstr(payload, "published=0 ") == NULL)
+			break;
+	}
+
+	/* per client reports follow global ones */
+	for (;;)
+	{
+		mt_assert(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 1000) == 0);
+		mt_assert(msg.ctrl.data == 0);
+
+		if (strncmp(msg.data, "/$sys/broker/client/", 20) == 0)
+			break;
+	}
+
+	payload = msg.data + strlen(msg.data) + 1;
+	mt_fail(strncmp(payload, "depth=", 6) == 0);
+	mt_fail(strstr(payload, " delivered=") != NULL);
+
+	/* histogram may not fit into single message, then it comes
+	 * in parts, but all buckets must be there, up to the last */
+	mt_fok(psmq_subscribe(&gt_sub_psmq, "/$sys/broker/latency"));
+	for (;;)
+	{
+		mt_assert(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 1000) == 0);
+		mt_assert(msg.ctrl.data == 0);
+
+		if (msg.ctrl.cmd != PSMQ_CTRL_CMD_PUBLISH ||
+				strcmp(msg.data, "/$sys/broker/latency") != 0)
+			continue;
+
+		payload = msg.data + strlen(msg.data) + 1;
+		mt_fail(payload[0] != ' ' && payload[0] != '\0');
+		if (strstr(payload, "inf=") != NULL)
+			break;
+	}
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_shm_not_enabled(void)
+{
+	mt_fail(psmq_shm_alloc(&gt_pub_psmq, 1) == NULL);
+	mt_fail(errno == ENOTSUP);
+}
+
+
+#if PSMQ_HAVE_SHM
+
+/* ==========================================================================
+    Checks that all blocks of slab are free, that is they can be
+    allocated again.
+   ========================================================================== */
+
+
+static void psmqt_shm_expect_all_free(void)
+{
+	void  *bufs[4 + 1];
+	int    i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* broker processes requests in order, so once
+	 * subscribe is acked, all publishes are done too */
+	mt_fok(psmq_subscribe(&gt_pub_psmq, "/y"));
+	mt_fok(psmqt_receive_expect(&gt_pub_psmq, 's', 0, 0, "/y", NULL));
+
+	for (i = 0; i != gt_broker_shm; ++i)
+		mt_assert((bufs[i] = psmq_shm_alloc(&gt_pub_psmq, 1)) != NULL);
+
+	mt_fail(psmq_shm_alloc(&gt_pub_psmq, 1) == NULL);
+	mt_fail(errno == ENOSPC);
+
+	for (i = 0; i != gt_broker_shm; ++i)
+		mt_fok(psmq_shm_release(&gt_pub_psmq, bufs[i]));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_shm_publish_receive(void)
+{
+	char            *buf;
+	const char      *payload;
+	size_t           paylen;
+	int              i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* way bigger than anything that fits into mqueue */
+	mt_assert((buf = psmq_shm_alloc(&gt_pub_psmq, 16384)) != NULL);
+	for (i = 0; i != 16384; ++i)
+		buf[i] = i;
+
+	mt_fok(psmq_publish_shm(&gt_pub_psmq, "/t", buf, 16384, 0));
+	mt_fok(psmq_receive(&gt_sub_psmq, &gt_recvd_msg));
+	mt_fail(gt_recvd_msg.ctrl.cmd == PSMQ_CTRL_CMD_PUBLISH_SHM);
+	mt_fail(strcmp(PSMQ_TOPIC(gt_recvd_msg), "/t") == 0);
+
+	payload = psmq_shm_borrow(&gt_sub_psmq, &gt_recvd_msg, &paylen);
+	mt_assert(payload != NULL);
+	mt_fail(paylen == 16384);
+	for (i = 0; i != 16384; ++i)
+		if (payload[i] != (char)i)
+			break;
+	mt_fail(i == 16384);
+	mt_fok(psmq_shm_release(&gt_sub_psmq, payload));
+
+	psmqt_shm_expect_all_free();
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_shm_publish_no_subscribers(void)
+{
+	char            *buf;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	mt_assert((buf = psmq_shm_alloc(&gt_pub_psmq, 100)) != NULL);
+	mt_fok(psmq_publish_shm(&gt_pub_psmq, "/x", buf, 100, 0));
+	psmqt_shm_expect_all_free();
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_shm_invalid_descriptor(void)
+{
+	struct psmq_shm_desc  desc;
+	struct psmq_msg       msg;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* offset in the middle of block */
+	desc.slab = 0;
+	desc.offset = psmq_shm_data_off(gt_broker_shm) + 1;
+	desc.len = 1;
+	mt_fok(psmq_publish_msg(&gt_pub_psmq, PSMQ_CTRL_CMD_PUBLISH_SHM,
+				gt_pub_psmq.fd, "/t", &desc, sizeof(desc), 0));
+
+	/* past last block */
+	desc.offset = psmq_shm_data_off(gt_broker_shm) + gt_broker_shm * 65536;
+	mt_fok(psmq_publish_msg(&gt_pub_psmq, PSMQ_CTRL_CMD_PUBLISH_SHM,
+				gt_pub_psmq.fd, "/t", &desc, sizeof(desc), 0));
+
+	/* bigger than block */
+	desc.offset = psmq_shm_data_off(gt_broker_shm);
+	desc.len = 65536 + 1;
+	mt_fok(psmq_publish_msg(&gt_pub_psmq, PSMQ_CTRL_CMD_PUBLISH_SHM,
+				gt_pub_psmq.fd, "/t", &desc, sizeof(desc), 0));
+
+	mt_ferr(psmq_timedreceive_ms(&gt_sub_psmq, &msg, 100), ETIMEDOUT);
+	psmqt_shm_expect_all_free();
 }
 
 
@@ -588,31 +1539,38 @@ static void psmqd_unsubscribe(void)
    ========================================================================== */
 
 
-static void psmqd_unsubscribe_with_bad_topics(void)
+static void psmqd_shm_invalid_args(void)
 {
-	char             qname[QNAME_LEN];
-	struct psmq      psmq;
-	struct psmq_msg  msg;
+	char             buf[1];
+	void            *shm;
+	size_t           len;
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	psmqt_gen_queue_name(qname, sizeof(qname));
-	mt_assert(psmq_init_named(&psmq, gt_broker_name, qname, 10) == 0);
-	mt_fok(psmq_subscribe(&psmq, "/t"));
-	mt_fok(psmqt_receive_expect(&psmq, 's', 0, 0, "/t", NULL));
+	mt_fail(psmq_shm_alloc(&gt_pub_psmq, 65536 + 1) == NULL);
+	mt_fail(errno == EMSGSIZE);
+	mt_ferr(psmq_publish_shm(&gt_pub_psmq, "/t", buf, 1, 0), EINVAL);
+	mt_ferr(psmq_shm_release(&gt_pub_psmq, buf), EINVAL);
 
-	memset(&msg, 0x00, sizeof(msg));
+	mt_assert((shm = psmq_shm_alloc(&gt_pub_psmq, 1)) != NULL);
+	mt_ferr(psmq_publish_shm(&gt_pub_psmq, "/t", (char *)shm + 1, 1, 0),
+			EINVAL);
+	mt_ferr(psmq_publish_shm(&gt_pub_psmq, "/t", shm, 65536 + 1, 0),
+			EMSGSIZE);
+	mt_ferr(psmq_publish_shm(&gt_pub_psmq, "t", shm, 1, 0), EBADMSG);
+	mt_fok(psmq_shm_release(&gt_pub_psmq, shm));
 
-	mt_ferr(psmq_unsubscribe(&psmq, "a"), EBADMSG);
-	mt_ferr(psmq_unsubscribe(&psmq, NULL), EINVAL);
-	mt_ferr(psmq_unsubscribe(&psmq, ""), EINVAL);
-	mt_fok(psmq_unsubscribe(&psmq, "/a/"));
-	mt_fok(psmqt_receive_expect(&psmq, 'u', ENOENT, 0, "/a/", NULL));
+	/* normal message cannot be borrowed */
+	mt_fok(psmq_publish(&gt_pub_psmq, "/t", "t", 2));
+	mt_fok(psmq_receive(&gt_sub_psmq, &gt_recvd_msg));
+	mt_fail(psmq_shm_borrow(&gt_sub_psmq, &gt_recvd_msg, &len) == NULL);
+	mt_fail(errno == EINVAL);
 
-	mt_fok(psmq_cleanup(&psmq));
-	mq_unlink(qname);
+	psmqt_shm_expect_all_free();
 }
 
+#endif /* PSMQ_HAVE_SHM */
+
 
 /* ==========================================================================
    ========================================================================== */
@@ -709,6 +1667,239 @@ static void psmqd_detect_dead_client(void)
 }
 
 
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_alias_detect_dead_client(void)
+{
+	char             qname[2][QNAME_LEN];
+	struct psmq      pub_psmq;
+	struct psmq      sub_psmq;
+	struct timespec  tp;
+	char             i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* client publishes on alias he is subscribed to himself,
+	 * so he gets killed by broker in the middle of fan-out
+	 * over route of his own alias */
+	psmqt_gen_unique_queue_name_array(qname, 2, QNAME_LEN);
+	mt_fail(psmq_init_named(&pub_psmq, gt_broker_name, qname[0], 10) == 0);
+	mt_fok(psmq_subscribe(&pub_psmq, "/t"));
+	mt_fok(psmqt_receive_expect(&pub_psmq, 's', 0, 0, "/t", NULL));
+	mt_fok(psmq_alias(&pub_psmq, "/t", 0));
+	mt_fok(psmqt_receive_expect(&pub_psmq, 'a', 0, 0, "/t", NULL));
+
+	for (i = 0; i != 10; ++i)
+		mt_fok(psmq_publish_alias(&pub_psmq, 0, &i, sizeof(i), 0));
+	for (i = 0; i != 10; ++i)
+		mt_fok(psmq_publish_alias(&pub_psmq, 0, &i, sizeof(i), 0));
+
+#ifdef HIGH_LOAD_ENV
+	tp.tv_sec = 20;
+#else
+	tp.tv_sec = 1;
+#endif
+	tp.tv_nsec = 0;
+	nanosleep(&tp, NULL);
+
+	for (i = 1; i != 10; ++i)
+		mt_fok(psmqt_receive_expect(&pub_psmq, 'p', 0, sizeof(i), "/t", &i));
+
+	mt_fok(psmqt_receive_expect(&pub_psmq, 'c', 0, 0, NULL, NULL));
+
+	/* broker must still be alive and well */
+	mt_fail(psmq_init_named(&sub_psmq, gt_broker_name, qname[1], 10) == 0);
+	mt_fok(psmq_subscribe(&sub_psmq, "/t"));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 's', 0, 0, "/t", NULL));
+
+	mt_fok(psmq_cleanup(&pub_psmq));
+	mt_fok(psmq_cleanup(&sub_psmq));
+	mq_unlink(qname[0]);
+	mq_unlink(qname[1]);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_park_on_full_queue(void)
+{
+	char             qname[2][QNAME_LEN];
+	struct psmq      pub_psmq;
+	struct psmq      sub_psmq;
+	struct psmq_msg  msg;
+	char             i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	psmqt_gen_unique_queue_name_array(qname, 2, QNAME_LEN);
+	mt_fail(psmq_init_named(&pub_psmq, gt_broker_name, qname[0], 10) == 0);
+	mt_fail(psmq_init_named(&sub_psmq, gt_broker_name, qname[1], 2) == 0);
+	mt_fok(psmq_subscribe(&sub_psmq, "/t"));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 's', 0, 0, "/t", NULL));
+
+	/* queue of subscriber can hold only 2 messages, rest
+	 * should be parked in broker and not lost */
+	for (i = 0; i != 8; ++i)
+		mt_fok(psmq_publish(&pub_psmq, "/t", &i, sizeof(i)));
+
+	for (i = 0; i != 8; ++i)
+		mt_fok(psmqt_receive_expect(&sub_psmq, 'p', 0, sizeof(i), "/t", &i));
+
+	mt_ferr(psmq_timedreceive_ms(&sub_psmq, &msg, 100), ETIMEDOUT);
+
+	mt_fok(psmq_cleanup(&pub_psmq));
+	mt_fok(psmq_cleanup(&sub_psmq));
+	mq_unlink(qname[0]);
+	mq_unlink(qname[1]);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_conflate(void)
+{
+	char             qname[2][QNAME_LEN];
+	struct psmq      pub_psmq;
+	struct psmq      sub_psmq;
+	struct psmq_msg  msg;
+	char             buf[4];
+	char             i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	psmqt_gen_unique_queue_name_array(qname, 2, QNAME_LEN);
+	mt_fail(psmq_init_named(&pub_psmq, gt_broker_name, qname[0], 10) == 0);
+	mt_fail(psmq_init_named(&sub_psmq, gt_broker_name, qname[1], 1) == 0);
+	mt_fok(psmq_subscribe_flags(&sub_psmq, "/c/+", PSMQ_SUB_CONFLATE));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 's', 0, 0, "/c/+", NULL));
+	mt_fok(psmq_subscribe(&sub_psmq, "/t"));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 's', 0, 0, "/t", NULL));
+
+	/* plain subscription to the same topic must not take
+	 * conflate away from the first one */
+	mt_fok(psmq_subscribe(&sub_psmq, "/c/+"));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 's', 0, 0, "/c/+", NULL));
+
+	/* first message fills queue of subscriber, rest
+	 * is parked, there are more of them than broker
+	 * would park, but only last value of each /c/
+	 * topic is kept, and /t is not conflated */
+	i = 0;
+	mt_fok(psmq_publish(&pub_psmq, "/t", &i, sizeof(i)));
+	for (i = 1; i != 20; ++i)
+	{
+		mt_fok(psmq_publish(&pub_psmq, "/c/1", &i, sizeof(i)));
+		mt_fok(psmq_publish(&pub_psmq, "/c/2", &i, sizeof(i)));
+	}
+	i = 1;
+	mt_fok(psmq_publish(&pub_psmq, "/t", &i, sizeof(i)));
+
+	/* broker processes requests in order, so when we
+	 * get this reply, all of the above are routed */
+	mt_fok(psmq_subscribe(&pub_psmq, "/s"));
+	mt_fok(psmqt_receive_expect(&pub_psmq, 's', 0, 0, "/s", NULL));
+
+	i = 0;
+	mt_fok(psmqt_receive_expect(&sub_psmq, 'p', 0, sizeof(i), "/t", &i));
+	i = 19;
+	mt_fok(psmqt_receive_expect(&sub_psmq, 'p', 0, sizeof(i), "/c/1", &i));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 'p', 0, sizeof(i), "/c/2", &i));
+	i = 1;
+	mt_fok(psmqt_receive_expect(&sub_psmq, 'p', 0, sizeof(i), "/t", &i));
+	mt_ferr(psmq_timedreceive_ms(&sub_psmq, &msg, 100), ETIMEDOUT);
+
+	/* the same goes for subscriber that traces messages */
+	buf[0] = PSMQ_IOCTL_TRACE;
+	buf[1] = 1;
+	mt_fok(psmq_ioctl_trace(&sub_psmq, 1));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 'i', 0, 2, NULL, buf));
+
+	i = 0;
+	mt_fok(psmq_publish(&pub_psmq, "/t", &i, sizeof(i)));
+	for (i = 1; i != 20; ++i)
+		mt_fok(psmq_publish(&pub_psmq, "/c/1", &i, sizeof(i)));
+	mt_fok(psmq_subscribe(&pub_psmq, "/s"));
+	mt_fok(psmqt_receive_expect(&pub_psmq, 's', 0, 0, "/s", NULL));
+
+	i = 0;
+	mt_fok(psmqt_receive_expect(&sub_psmq, 'p', 0, sizeof(i), "/t", &i));
+	i = 19;
+	mt_fok(psmqt_receive_expect(&sub_psmq, 'p', 0, sizeof(i), "/c/1", &i));
+	mt_ferr(psmq_timedreceive_ms(&sub_psmq, &msg, 100), ETIMEDOUT);
+
+	/* subscription with unknown flag is rejected */
+	buf[0] = 0x80;
+	mt_fok(psmq_publish_msg(&pub_psmq, PSMQ_CTRL_CMD_SUBSCRIBE,
+				pub_psmq.fd, "/f", buf, 1, 0));
+	mt_fok(psmqt_receive_expect(&pub_psmq, 's', EINVAL, 0, "/f", NULL));
+	mt_fok(psmq_publish_msg(&pub_psmq, PSMQ_CTRL_CMD_SUBSCRIBE,
+				pub_psmq.fd, "/f", buf, 2, 0));
+	mt_fok(psmqt_receive_expect(&pub_psmq, 's', EBADMSG, 0, "/f", NULL));
+
+	mt_fok(psmq_cleanup(&pub_psmq));
+	mt_fok(psmq_cleanup(&sub_psmq));
+	mq_unlink(qname[0]);
+	mq_unlink(qname[1]);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_overflow_detect_dead_client(void)
+{
+	char             qname[2][QNAME_LEN];
+	struct psmq      pub_psmq;
+	struct psmq      sub_psmq;
+	struct timespec  tp;
+	int              n;
+	char             i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	psmqt_gen_unique_queue_name_array(qname, 2, QNAME_LEN);
+	mt_fail(psmq_init_named(&pub_psmq, gt_broker_name, qname[0], 10) == 0);
+	mt_fail(psmq_init_named(&sub_psmq, gt_broker_name, qname[1], 10) == 0);
+	mt_fok(psmq_subscribe(&sub_psmq, "/t"));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 's', 0, 0, "/t", NULL));
+
+	/* fill client's queue, then broker's overflow buffer
+	 * and then make client miss enough pubs to get him
+	 * disconnected */
+	n = 10 + gt_broker_overflow + 10;
+	for (i = 0; i != n; ++i)
+		mt_fok(psmq_publish(&pub_psmq, "/t", &i, sizeof(i)));
+
+#ifdef HIGH_LOAD_ENV
+	tp.tv_sec = 20;
+#else
+	tp.tv_sec = 1;
+#endif
+	tp.tv_nsec = 0;
+	nanosleep(&tp, NULL);
+
+	/* parked messages are dropped when client is
+	 * closed, he should get only what was on his
+	 * queue, without oldest message, and close */
+	for (i = 1; i != 10; ++i)
+		mt_fok(psmqt_receive_expect(&sub_psmq, 'p', 0, sizeof(i), "/t", &i));
+
+	mt_fok(psmqt_receive_expect(&sub_psmq, 'c', 0, 0, NULL, NULL));
+
+	mt_fok(psmq_cleanup(&pub_psmq));
+	mt_fok(psmq_cleanup(&sub_psmq));
+	mq_unlink(qname[0]);
+	mq_unlink(qname[1]);
+}
+
+
 /* ==========================================================================
    ========================================================================== */
 
@@ -1263,6 +2454,72 @@ static void psmqd_reply_to_full_queue(void)
 }
 
 
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_preempt(void)
+{
+	char             qname[3][QNAME_LEN];
+	struct psmq      pub_psmq;
+	struct psmq      slow_psmq;
+	struct psmq      sub_psmq;
+	struct psmq_msg  msg;
+	struct timespec  tp;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* slow client connects before sub, so he is first
+	 * to get message during fan-out */
+	psmqt_gen_unique_queue_name_array(qname, 3, QNAME_LEN);
+	mt_fail(psmq_init_named(&pub_psmq, gt_broker_name, qname[0], 10) == 0);
+	mt_fail(psmq_init_named(&slow_psmq, gt_broker_name, qname[1], 1) == 0);
+	mt_fail(psmq_init_named(&sub_psmq, gt_broker_name, qname[2], 1) == 0);
+	mt_fok(psmq_subscribe(&slow_psmq, "/fill"));
+	mt_fok(psmqt_receive_expect(&slow_psmq, 's', 0, 0, "/fill", NULL));
+	mt_fok(psmq_subscribe(&slow_psmq, "/low"));
+	mt_fok(psmqt_receive_expect(&slow_psmq, 's', 0, 0, "/low", NULL));
+	mt_fok(psmq_ioctl_reply_timeout(&slow_psmq, 1000));
+	psmqt_receive_expect(&slow_psmq, 'i', 0, 0, NULL, NULL);
+	mt_fok(psmq_subscribe(&sub_psmq, "/low"));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 's', 0, 0, "/low", NULL));
+	mt_fok(psmq_subscribe(&sub_psmq, "/high"));
+	mt_fok(psmqt_receive_expect(&sub_psmq, 's', 0, 0, "/high", NULL));
+
+	/* fill slow client's queue, so broker waits for
+	 * him in the middle of /low fan-out */
+	mt_fok(psmq_publish(&pub_psmq, "/fill", "f", 2));
+	mt_fok(psmq_publish_prio(&pub_psmq, "/low", "l", 2, 0));
+
+	tp.tv_sec = 0;
+	tp.tv_nsec = 300000000l;
+	nanosleep(&tp, NULL);
+	mt_fok(psmq_publish_prio(&pub_psmq, "/high", "h", 2, 5));
+
+	/* sub can hold only one message, whatever comes
+	 * to him second is dropped, and that should be
+	 * /low, since /high preempted it */
+#ifdef HIGH_LOAD_ENV
+	tp.tv_sec = 20;
+#else
+	tp.tv_sec = 1;
+#endif
+	tp.tv_nsec = 500000000l;
+	nanosleep(&tp, NULL);
+	mt_fok(psmqt_receive_expect(&sub_psmq, 'p', 0, 2, "/high", "h"));
+	mt_ferr(psmq_timedreceive_ms(&sub_psmq, &msg, 100), ETIMEDOUT);
+	mt_fok(psmqt_receive_expect(&slow_psmq, 'p', 0, 2, "/fill", "f"));
+	mt_ferr(psmq_timedreceive_ms(&slow_psmq, &msg, 100), ETIMEDOUT);
+
+	mt_fok(psmq_cleanup(&pub_psmq));
+	mt_fok(psmq_cleanup(&slow_psmq));
+	mt_fok(psmq_cleanup(&sub_psmq));
+	mq_unlink(qname[0]);
+	mq_unlink(qname[1]);
+	mq_unlink(qname[2]);
+}
+
+
 /* ==========================================================================
    ========================================================================== */
 
@@ -1313,6 +2570,56 @@ void psmqd_no_ioctl_request(void)
 }
 
 
+/* ==========================================================================
+    Runs tests that route messages between clients. Called once for each
+    broker mode (batch, workers, overflow...), caller sets gt_broker_*
+    knob of the mode before call, and runs tests specific to that mode
+    after it. 'mode' is only used to name multi pub sub test, 'mps' is
+    number of publishers and subscribers for that test.
+
+    On return tests are left prepared with default set of clients.
+   ========================================================================== */
+
+
+static void psmqd_run_routing_tests
+(
+	const char       *mode,  /* name of the broker mode */
+	struct multi_ps  *mps    /* clients for multi pub sub test */
+)
+{
+	char  mps_name[96];
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	mt_prepare_test = psmqt_prepare_test;
+	mt_cleanup_test = psmqt_cleanup_test;
+
+	mt_run(psmqd_create_max_client);
+	mt_run(psmqd_topic_plus_wildcard);
+	mt_run(psmqd_topic_star_wildcard);
+	mt_run(psmqd_topic_mixed_wildcard);
+	mt_run(psmqd_small_msg_class);
+
+	sprintf(mps_name, "[psmqd_multi_pub_sub() num_pub: %d num_sub: %d %s]",
+			mps->num_pub, mps->num_sub, mode);
+	mt_run_param_named(psmqd_multi_pub_sub, mps, mps_name);
+
+	mt_prepare_test = psmqt_prepare_test_with_clients;
+	mt_cleanup_test = psmqt_cleanup_test_with_clients;
+
+	mt_run(psmqd_send_empty_msg);
+	mt_run(psmqd_send_full_msg);
+	mt_run(psmqd_send_msg);
+	mt_run(psmqd_send_too_big_msg);
+	mt_run(psmqd_publish_batch);
+	mt_run(psmqd_publish_batch_split);
+	mt_run(psmqd_topic_alias);
+	mt_run(psmqd_v1_client);
+	mt_run(psmqd_trace);
+	mt_run(psmqd_invalid_ioctl_request);
+}
+
+
 /* ==========================================================================
              __               __
             / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
@@ -1367,6 +2674,14 @@ void psmqd_test_group(void)
 	mt_run(psmqd_send_msg_when_noone_is_listening);
 	mt_run(psmqd_send_too_big_msg);
 	mt_run(psmqd_send_unknown_control_msg);
+	mt_run(psmqd_publish_batch);
+	mt_run(psmqd_publish_batch_split);
+	mt_run(psmqd_publish_batch_malformed);
+	mt_run(psmqd_receive_many);
+	mt_run(psmqd_topic_alias);
+	mt_run(psmqd_v1_client);
+	mt_run(psmqd_trace);
+	mt_run(psmqd_route_cache);
 	mt_run(psmqd_unsubscribe);
 	mt_run(psmqd_invalid_ioctl_request);
 	mt_run(psmqd_invalid_ioctl_request2);
@@ -1382,6 +2697,7 @@ void psmqd_test_group(void)
 	mt_run(psmqd_create_max_client);
 	mt_run(psmqd_create_multiple_client);
 	mt_run(psmqd_create_too_much_client);
+	mt_run(psmqd_reuse_client_slot);
 	mt_run(psmqd_send_msg_with_bad_fd);
 	mt_run(psmqd_start_stop);
 	mt_run(psmqd_subscribe_with_bad_topics);
@@ -1391,6 +2707,8 @@ void psmqd_test_group(void)
 	mt_run(psmqd_topic_mixed_wildcard);
 	mt_run(psmqd_reply_to_full_queue);
 	mt_run(psmqd_detect_dead_client);
+	mt_run(psmqd_alias_detect_dead_client);
+	mt_run(psmqd_small_msg_class);
 
 	for (mps.num_pub = 1; mps.num_pub <= num_pub_max; ++mps.num_pub)
 	{
@@ -1401,4 +2719,117 @@ void psmqd_test_group(void)
 			mt_run_param_named(psmqd_multi_pub_sub, &mps, mps_name);
 		}
 	}
+
+	/* run routing tests again, but this time with broker
+	 * processing messages in batches */
+
+	mps.num_pub = num_pub_max;
+	mps.num_sub = num_sub_max;
+
+	gt_broker_batch = 8;
+	psmqd_run_routing_tests("batch: 8", &mps);
+	mt_prepare_test = psmqt_prepare_test;
+	mt_cleanup_test = psmqt_cleanup_test;
+	mt_run(psmqd_reply_to_full_queue);
+	mt_run(psmqd_detect_dead_client);
+	gt_broker_batch = 1;
+
+	/* and once more with delivery threads sending
+	 * messages to clients */
+
+	gt_broker_workers = 4;
+	psmqd_run_routing_tests("workers: 4", &mps);
+	mt_prepare_test = psmqt_prepare_test;
+	mt_cleanup_test = psmqt_cleanup_test;
+	mt_run(psmqd_reply_to_full_queue);
+	mt_run(psmqd_detect_dead_client);
+	gt_broker_workers = 0;
+
+	/* and with non blocking delivery, full queue of the
+	 * client no longer means lost message, so tests that
+	 * check for that are replaced */
+
+	gt_broker_overflow = 16;
+	psmqd_run_routing_tests("overflow: 16", &mps);
+	mt_run(psmqd_shm_not_enabled);
+#if PSMQ_HAVE_SHM
+	gt_broker_shm = 4;
+	mt_run(psmqd_shm_publish_receive);
+	mt_run(psmqd_shm_publish_no_subscribers);
+	gt_broker_shm = 0;
+#endif
+	mt_prepare_test = psmqt_prepare_test;
+	mt_cleanup_test = psmqt_cleanup_test;
+	mt_run(psmqd_park_on_full_queue);
+	mt_run(psmqd_conflate);
+	mt_run(psmqd_overflow_detect_dead_client);
+	gt_broker_overflow = 0;
+
+	/* large payloads via shared memory slab, in all
+	 * delivery modes */
+
+	mt_prepare_test = psmqt_prepare_test_with_clients;
+	mt_cleanup_test = psmqt_cleanup_test_with_clients;
+
+#if PSMQ_HAVE_SHM
+	gt_broker_shm = 4;
+	mt_run(psmqd_shm_publish_receive);
+	mt_run(psmqd_shm_publish_no_subscribers);
+	mt_run(psmqd_shm_invalid_descriptor);
+	mt_run(psmqd_shm_invalid_args);
+
+	gt_broker_workers = 4;
+	mt_run(psmqd_shm_publish_receive);
+	mt_run(psmqd_shm_publish_no_subscribers);
+	gt_broker_workers = 0;
+	gt_broker_shm = 0;
+#endif
+
+	/* all of the above that does routing, but with route
+	 * cache so small that topics evict each other */
+
+	gt_broker_route_cache = 2;
+	psmqd_run_routing_tests("route cache: 2", &mps);
+	mt_run(psmqd_send_msg_when_noone_is_listening);
+	mt_run(psmqd_route_cache);
+	gt_broker_route_cache = 0;
+
+	/* features that are not about routing itself, and
+	 * only need default broker */
+
+	mt_run(psmqd_rate_limit);
+	gt_broker_limit_errno = 1;
+	mt_run(psmqd_rate_limit_errno);
+	gt_broker_limit_errno = 0;
+	mt_run(psmqd_max_subs);
+	mt_run(psmqd_retained_disabled);
+	gt_broker_retain = 4096;
+	mt_run(psmqd_retained);
+	gt_broker_workers = 4;
+	mt_run(psmqd_retained);
+	gt_broker_workers = 0;
+	gt_broker_retain = 0;
+
+	gt_broker_stats = 50;
+	mt_run(psmqd_stats);
+	gt_broker_workers = 4;
+	mt_run(psmqd_stats);
+	gt_broker_workers = 0;
+	gt_broker_stats = 0;
+
+	/* fan-out that can be interrupted by higher priority
+	 * messages, they should change nothing but order */
+
+	gt_broker_preempt = 1;
+	psmqd_run_routing_tests("preempt: 1", &mps);
+	gt_broker_route_cache = 2;
+	mt_run(psmqd_route_cache);
+	gt_broker_route_cache = 0;
+	mt_prepare_test = psmqt_prepare_test;
+	mt_cleanup_test = psmqt_cleanup_test;
+	mt_run(psmqd_reply_to_full_queue);
+	mt_run(psmqd_detect_dead_client);
+	mt_run(psmqd_alias_detect_dead_client);
+	mt_run(psmqd_preempt);
+	gt_broker_preempt = 0;
 }
@@ -0,0 +1,357 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "retained.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mtest.h"
+#include "topic-list.h"
+
+mt_defs_ext();
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Sets retained message on 'topic' to string 'payload', or clears it
+    when 'payload' is NULL
+   ========================================================================== */
+
+
+static int rt_set
+(
+	struct psmqd_rt  *rt,      /* store to set message in */
+	const char       *topic,   /* topic of message */
+	const char       *payload  /* payload or NULL */
+)
+{
+	return psmqd_rt_set(rt, topic, psmqd_tl_hash(topic), payload,
+			payload ? strlen(payload) + 1 : 0);
+}
+
+
+/* ==========================================================================
+    Checks if retained message on 'topic' holds string 'payload', or that
+    there is no message when 'payload' is NULL
+
+    Returns 0 when message is as expected, and -1 otherwise
+   ========================================================================== */
+
+
+static int rt_check
+(
+	struct psmqd_rt      *rt,      /* store to look in */
+	const char           *topic,   /* topic of message */
+	const char           *payload  /* expected payload or NULL */
+)
+{
+	struct psmqd_rt_msg  *m;       /* found message */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	m = psmqd_rt_find(rt, topic, psmqd_tl_hash(topic));
+	if (payload == NULL)
+		return m == NULL ? 0 : -1;
+
+	if (m == NULL || m->paylen != strlen(payload) + 1)
+		return -1;
+
+	return strcmp(PSMQD_RT_PAYLOAD(m), payload) == 0 ? 0 : -1;
+}
+
+
+/* ==========================================================================
+                           __               __
+                          / /_ ___   _____ / /_ _____
+                         / __// _ \ / ___// __// ___/
+                        / /_ /  __/(__  )/ /_ (__  )
+                        \__/ \___//____/ \__//____/
+
+   ========================================================================== */
+
+
+static void psmqd_rt_set_and_find(void)
+{
+	struct psmqd_rt  rt;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_fok(psmqd_rt_init(&rt, 1024));
+	mt_fok(rt_set(&rt, "/a", "1"));
+	mt_fok(rt_set(&rt, "/a/b", "2"));
+	mt_fok(rt_set(&rt, "/c", "3"));
+	mt_fail(rt.n == 3);
+	mt_fok(rt_check(&rt, "/a", "1"));
+	mt_fok(rt_check(&rt, "/a/b", "2"));
+	mt_fok(rt_check(&rt, "/c", "3"));
+	mt_fok(rt_check(&rt, "/b", NULL));
+	mt_fok(rt_check(&rt, "/a/bc", NULL));
+	psmqd_rt_destroy(&rt);
+	mt_fail(rt.arena == NULL);
+	mt_fail(rt.n == 0);
+}
+
+
+/* ==========================================================================
+    Replacing message with payload of the same size must not move it,
+    different size moves it to the end, rest of messages stay intact.
+   ========================================================================== */
+
+
+static void psmqd_rt_replace(void)
+{
+	struct psmqd_rt      rt;
+	struct psmqd_rt_msg  *m;
+	size_t               used;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_fok(psmqd_rt_init(&rt, 1024));
+	mt_fok(rt_set(&rt, "/a", "on"));
+	mt_fok(rt_set(&rt, "/b", "20.5"));
+	used = rt.used;
+	m = psmqd_rt_find(&rt, "/a", psmqd_tl_hash("/a"));
+
+	mt_fok(rt_set(&rt, "/a", "of"));
+	mt_fail(psmqd_rt_find(&rt, "/a", psmqd_tl_hash("/a")) == m);
+	mt_fail(rt.used == used);
+	mt_fok(rt_check(&rt, "/a", "of"));
+
+	mt_fok(rt_set(&rt, "/a", "off, and this is long enough to change size"));
+	mt_fail(rt.n == 2);
+	mt_fail(rt.used > used);
+	mt_fok(rt_check(&rt, "/a", "off, and this is long enough to change size"));
+	mt_fok(rt_check(&rt, "/b", "20.5"));
+	mt_fail(psmqd_rt_next(&rt, NULL) ==
+			psmqd_rt_find(&rt, "/b", psmqd_tl_hash("/b")));
+
+	mt_fok(rt_set(&rt, "/a", "on"));
+	mt_fail(rt.used == used);
+	mt_fok(rt_check(&rt, "/a", "on"));
+	mt_fok(rt_check(&rt, "/b", "20.5"));
+	psmqd_rt_destroy(&rt);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_rt_clear(void)
+{
+	struct psmqd_rt  rt;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_fok(psmqd_rt_init(&rt, 1024));
+	mt_fok(rt_set(&rt, "/a", "1"));
+	mt_fok(rt_set(&rt, "/b", "2"));
+	mt_fok(rt_set(&rt, "/c", "3"));
+	mt_fok(rt_set(&rt, "/b", NULL));
+	mt_fok(rt_set(&rt, "/d", NULL));
+	mt_fail(rt.n == 2);
+	mt_fok(rt_check(&rt, "/a", "1"));
+	mt_fok(rt_check(&rt, "/b", NULL));
+	mt_fok(rt_check(&rt, "/c", "3"));
+	mt_fok(rt_set(&rt, "/a", NULL));
+	mt_fok(rt_set(&rt, "/c", NULL));
+	mt_fail(rt.n == 0);
+	mt_fail(rt.used == 0);
+	mt_fail(psmqd_rt_next(&rt, NULL) == NULL);
+	psmqd_rt_destroy(&rt);
+}
+
+
+/* ==========================================================================
+    Fills store up to the limit, message that does not fit must be
+    rejected without touching anything that is already there.
+   ========================================================================== */
+
+
+static void psmqd_rt_full(void)
+{
+	struct psmqd_rt  rt;
+	char             topic[32];
+	size_t           used;
+	size_t           n;
+	int              i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_fok(psmqd_rt_init(&rt, 512));
+
+	for (i = 0; ; ++i)
+	{
+		sprintf(topic, "/t/%d", i);
+		if (rt_set(&rt, topic, "value") != 0)
+			break;
+	}
+
+	mt_fail(errno == ENOSPC);
+	mt_fail(rt.used <= rt.size);
+	mt_fail(rt.n == (size_t)i);
+	used = rt.used;
+	n = rt.n;
+
+	/* same size fits in place, bigger one does not */
+	mt_fok(rt_set(&rt, "/t/0", "VALUE"));
+	mt_ferr(rt_set(&rt, "/t/1", "much bigger value than store can take"),
+			ENOSPC);
+	mt_fail(rt.used == used);
+	mt_fail(rt.n == n);
+	mt_fok(rt_check(&rt, "/t/0", "VALUE"));
+	mt_fok(rt_check(&rt, "/t/1", "value"));
+
+	/* after making room it fits */
+	mt_fok(rt_set(&rt, "/t/2", NULL));
+	mt_fok(rt_set(&rt, "/t/3", NULL));
+	mt_fok(rt_set(&rt, "/t/4", NULL));
+	mt_fok(rt_set(&rt, "/t/1", "much bigger value than store can take"));
+	mt_fok(rt_check(&rt, "/t/1", "much bigger value than store can take"));
+
+	for (i = 5; (size_t)i != n; ++i)
+	{
+		sprintf(topic, "/t/%d", i);
+		mt_fok(rt_check(&rt, topic, "value"));
+	}
+
+	psmqd_rt_destroy(&rt);
+}
+
+
+/* ==========================================================================
+    Removing and resizing messages moves other ones in arena, and in
+    index, all of them must still be found after that.
+   ========================================================================== */
+
+
+static void psmqd_rt_many(void)
+{
+	struct psmqd_rt  rt;
+	char             topic[32];
+	char             payload[32];
+	int              i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_fok(psmqd_rt_init(&rt, 8192));
+
+	for (i = 0; i != 200; ++i)
+	{
+		sprintf(topic, "/t/%d", i);
+		mt_fok(rt_set(&rt, topic, "v"));
+	}
+
+	for (i = 0; i != 200; ++i)
+	{
+		sprintf(topic, "/t/%d", i);
+		if (i % 3 == 0)
+			mt_fok(rt_set(&rt, topic, NULL));
+		else if (i % 5 == 0)
+			mt_fok(rt_set(&rt, topic, "value that needs more space"));
+	}
+
+	mt_fail(rt.n == 200 - 67);
+	for (i = 0; i != 200; ++i)
+	{
+		sprintf(topic, "/t/%d", i);
+		strcpy(payload, i % 5 ? "v" : "value that needs more space");
+		mt_fok(rt_check(&rt, topic, i % 3 ? payload : NULL));
+	}
+
+	psmqd_rt_destroy(&rt);
+	mt_fail(rt.index == NULL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_rt_walk(void)
+{
+	struct psmqd_rt      rt;
+	struct psmqd_rt_msg  *m;
+	int                  n;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_fok(psmqd_rt_init(&rt, 1024));
+	mt_fail(psmqd_rt_next(&rt, NULL) == NULL);
+	mt_fok(rt_set(&rt, "/a", "1"));
+	mt_fok(rt_set(&rt, "/b", "22"));
+	mt_fok(rt_set(&rt, "/c", "333"));
+
+	n = 0;
+	for (m = psmqd_rt_next(&rt, NULL); m; m = psmqd_rt_next(&rt, m), ++n)
+	{
+		mt_fail(m->hash == psmqd_tl_hash(PSMQD_RT_TOPIC(m)));
+		mt_fail(m->paylen == (unsigned)n + 2);
+		mt_fail(PSMQD_RT_TOPIC(m)[1] == 'a' + n);
+	}
+
+	mt_fail(n == 3);
+	psmqd_rt_destroy(&rt);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_rt_invalid_args(void)
+{
+	struct psmqd_rt  rt;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_ferr(psmqd_rt_init(NULL, 1024), EINVAL);
+	mt_ferr(psmqd_rt_init(&rt, 0), EINVAL);
+	mt_fok(psmqd_rt_init(&rt, 1024));
+	mt_ferr(psmqd_rt_set(NULL, "/a", 0, "1", 1), EINVAL);
+	mt_ferr(psmqd_rt_set(&rt, NULL, 0, "1", 1), EINVAL);
+	mt_ferr(psmqd_rt_set(&rt, "/a", 0, NULL, 1), EINVAL);
+	mt_fok(psmqd_rt_set(&rt, "/a", 0, NULL, 0));
+	mt_fail(psmqd_rt_find(NULL, "/a", 0) == NULL);
+	mt_fail(psmqd_rt_find(&rt, NULL, 0) == NULL);
+	mt_fail(psmqd_rt_next(NULL, NULL) == NULL);
+	mt_ferr(psmqd_rt_destroy(NULL), EINVAL);
+	mt_fok(psmqd_rt_destroy(&rt));
+}
+
+
+/* ==========================================================================
+             __               __
+            / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
+           / __// _ \ / ___// __/  / __ `// ___// __ \ / / / // __ \
+          / /_ /  __/(__  )/ /_   / /_/ // /   / /_/ // /_/ // /_/ /
+          \__/ \___//____/ \__/   \__, //_/    \____/ \__,_// .___/
+                                 /____/                    /_/
+   ========================================================================== */
+
+
+void psmqd_rt_test_group(void)
+{
+	mt_run(psmqd_rt_set_and_find);
+	mt_run(psmqd_rt_replace);
+	mt_run(psmqd_rt_clear);
+	mt_run(psmqd_rt_full);
+	mt_run(psmqd_rt_many);
+	mt_run(psmqd_rt_walk);
+	mt_run(psmqd_rt_invalid_args);
+}
@@ -0,0 +1,417 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "sub-tree.h"
+
+#include <stdlib.h>
+#include <embedlog.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "mtest.h"
+#include "psmq-common.h"
+#include "topic-list.h"
+#include "topic-match.h"
+
+mt_defs_ext();
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+#define MAX_FD 16
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Adapters of subscription tree functions for psmqt_sub_call() and
+    psmqt_check_match() from topic-match.c
+   ========================================================================== */
+
+
+static int st_add(void *st, const struct psmqd_tl *sub, unsigned short fd)
+{
+	return psmqd_st_add(st, sub, fd);
+}
+
+static int st_delete(void *st, const struct psmqd_tl *sub, unsigned short fd)
+{
+	return psmqd_st_delete(st, sub, fd);
+}
+
+static int st_match(void *st, const char *topic, unsigned long *matched)
+{
+	return psmqd_st_match(st, topic, matched);
+}
+
+
+/* ==========================================================================
+    Create subscription tree from 'topics', topics[i] is subscribed by
+    client with fd 'i'.
+   ========================================================================== */
+
+
+static struct psmqd_st *create_tree
+(
+	const char       *topics[]  /* topic to create tree with */
+)
+{
+	struct psmqd_st  *st;       /* newly created tree */
+	int               fd;       /* fd of client subscribing */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (st = NULL, fd = 0; topics[fd] != NULL; ++fd)
+	{
+		if (psmqt_sub_call(st_add, &st, topics[fd], fd) != 0)
+		{
+			el_print(ELE, "psmqd_st_add() failed");
+			psmqd_st_destroy(st);
+			return NULL;
+		}
+	}
+
+	return st;
+}
+
+
+/* ==========================================================================
+                           __               __
+                          / /_ ___   _____ / /_ _____
+                         / __// _ \ / ___// __// ___/
+                        / /_ /  __/(__  )/ /_ (__  )
+                        \__/ \___//____/ \__//____/
+
+   ========================================================================== */
+
+
+static void psmqd_st_match_exact(void)
+{
+	const char       *topics[] = { "/a", "/a/b", "/a/b/c", "/b", NULL };
+	const int         e0[] = { 0, -1 };
+	const int         e1[] = { 1, -1 };
+	const int         e2[] = { 2, -1 };
+	const int         e3[] = { 3, -1 };
+	const int         none[] = { -1 };
+	struct psmqd_st  *st;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_assert((st = create_tree(topics)) != NULL);
+	mt_fok(psmqt_check_match(st_match, st, "/a", e0));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b", e1));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b/c", e2));
+	mt_fok(psmqt_check_match(st_match, st, "/b", e3));
+	mt_fok(psmqt_check_match(st_match, st, "/c", none));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b/c/d", none));
+	mt_fok(psmqt_check_match(st_match, st, "/ab", none));
+	mt_fok(psmqt_check_match(st_match, st, "/", none));
+	psmqd_st_destroy(st);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_st_match_plus(void)
+{
+	const char       *topics[] = { "/+", "/a/+", "/+/b", "/+/+/c", NULL };
+	const int         e0[] = { 0, -1 };
+	const int         e1[] = { 1, -1 };
+	const int         e12[] = { 1, 2, -1 };
+	const int         e2[] = { 2, -1 };
+	const int         e3[] = { 3, -1 };
+	const int         none[] = { -1 };
+	struct psmqd_st  *st;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_assert((st = create_tree(topics)) != NULL);
+	mt_fok(psmqt_check_match(st_match, st, "/a", e0));
+	mt_fok(psmqt_check_match(st_match, st, "/zzz", e0));
+	mt_fok(psmqt_check_match(st_match, st, "/a/a", e1));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b", e12));
+	mt_fok(psmqt_check_match(st_match, st, "/c/b", e2));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b/c", e3));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b/d", none));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b/c/d", none));
+	psmqd_st_destroy(st);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_st_match_star(void)
+{
+	const char       *topics[] = { "/*", "/a/*", "/a/b/*", "/b/*/c", NULL };
+	const int         e0[] = { 0, -1 };
+	const int         e01[] = { 0, 1, -1 };
+	const int         e012[] = { 0, 1, 2, -1 };
+	const int         e03[] = { 0, 3, -1 };
+	const int         none[] = { -1 };
+	struct psmqd_st  *st;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_assert((st = create_tree(topics)) != NULL);
+	mt_fok(psmqt_check_match(st_match, st, "/", none));
+	mt_fok(psmqt_check_match(st_match, st, "/a", e0));
+	mt_fok(psmqt_check_match(st_match, st, "/b", e0));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b", e01));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b/c", e012));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b/c/d/e", e012));
+	mt_fok(psmqt_check_match(st_match, st, "/b/x", e03));
+	mt_fok(psmqt_check_match(st_match, st, "/b/x/y", e03));
+	psmqd_st_destroy(st);
+}
+
+
+/* ==========================================================================
+    Client subscribed to multiple matching topics must be matched only once
+   ========================================================================== */
+
+
+static void psmqd_st_match_same_client(void)
+{
+	struct psmqd_st  *st;
+	const int         e0[] = { 0, -1 };
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	st = NULL;
+	mt_fok(psmqt_sub_call(st_add, &st, "/a/b", 0));
+	mt_fok(psmqt_sub_call(st_add, &st, "/a/+", 0));
+	mt_fok(psmqt_sub_call(st_add, &st, "/a/*", 0));
+	mt_fok(psmqt_sub_call(st_add, &st, "/a/b", 0));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b", e0));
+	psmqd_st_destroy(st);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_st_delete_topics(void)
+{
+	const char       *topics[] = { "/a", "/a/b", "/a/+", "/a/*", NULL };
+	const int         e0[] = { 0, -1 };
+	const int         e12[] = { 1, 2, -1 };
+	const int         e2[] = { 2, -1 };
+	const int         none[] = { -1 };
+	struct psmqd_st  *st;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_assert((st = create_tree(topics)) != NULL);
+	mt_fok(psmqt_sub_call(st_delete, &st, "/a/*", 3));
+	mt_fok(psmqt_check_match(st_match, st, "/a", e0));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b", e12));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b/c", none));
+	mt_fok(psmqt_sub_call(st_delete, &st, "/a/b", 1));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b", e2));
+	mt_fok(psmqt_sub_call(st_delete, &st, "/a/+", 2));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b", none));
+	mt_fok(psmqt_check_match(st_match, st, "/a", e0));
+	mt_fok(psmqt_sub_call(st_delete, &st, "/a", 0));
+	mt_fail(st == NULL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_st_delete_duplicate(void)
+{
+	struct psmqd_st  *st;
+	const int         e0[] = { 0, -1 };
+	const int         none[] = { -1 };
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	st = NULL;
+	mt_fok(psmqt_sub_call(st_add, &st, "/a/b", 0));
+	mt_fok(psmqt_sub_call(st_add, &st, "/a/b", 0));
+	mt_fok(psmqt_sub_call(st_delete, &st, "/a/b", 0));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b", e0));
+	mt_fok(psmqt_sub_call(st_delete, &st, "/a/b", 0));
+	mt_fok(psmqt_check_match(st_match, st, "/a/b", none));
+	mt_fail(st == NULL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_st_delete_nonexisting(void)
+{
+	const char       *topics[] = { "/a", "/a/b", "/a/+", "/a/*", NULL };
+	const int         e0[] = { 0, -1 };
+	struct psmqd_st  *st;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_assert((st = create_tree(topics)) != NULL);
+	mt_ferr(psmqt_sub_call(st_delete, &st, "/a", 1), ENOENT);
+	mt_ferr(psmqt_sub_call(st_delete, &st, "/b", 0), ENOENT);
+	mt_ferr(psmqt_sub_call(st_delete, &st, "/a/c", 2), ENOENT);
+	mt_ferr(psmqt_sub_call(st_delete, &st, "/a/b/*", 3), ENOENT);
+	mt_fok(psmqt_check_match(st_match, st, "/a", e0));
+	psmqd_st_destroy(st);
+}
+
+
+/* ==========================================================================
+    Checks tree against reference matcher with every combination of
+    published and subscribed topic.
+   ========================================================================== */
+
+
+static void psmqd_st_match_reference(void)
+{
+	const char       *topics[] = { "/a", "/a/b", "/a/+", "/a/*", "/+/b",
+		"/+/+/c", "/*", "/a/b/c", "/b/*/x", "/a+", "/+/*", "/x/y/z/+",
+		"/a/+/c/*", NULL };
+	const char       *pubs[] = { "/", "/a", "/b", "/a/b", "/a/c", "/b/b",
+		"/a/b/c", "/a/x/c", "/a/b/c/d", "/b/q/x", "/a+", "/x/y/z/w",
+		"/x/y/z", "/a//b", "/a/b/", "//a", "/a/q/c/d/e", NULL };
+	struct psmqd_st  *st;
+	int               i;
+	int               j;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_assert((st = create_tree(topics)) != NULL);
+
+	for (i = 0; pubs[i] != NULL; ++i)
+	{
+		int  expected[MAX_FD + 1];
+		int  n;
+		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+		for (n = 0, j = 0; topics[j] != NULL; ++j)
+			if (psmqt_topic_matches(pubs[i], topics[j]))
+				expected[n++] = j;
+
+		expected[n] = -1;
+		mt_fok(psmqt_check_match(st_match, st, pubs[i], expected));
+	}
+
+	psmqd_st_destroy(st);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_st_match_empty_tree(void)
+{
+	unsigned long  matched[psmq_bm_words(MAX_FD)];
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_fail(psmqd_st_match(NULL, "/a", matched) == 0);
+}
+
+
+/* ==========================================================================
+    Counters of fds list are unsigned short, list must refuse fd over
+    that, instead of writing past the end of its array
+   ========================================================================== */
+
+
+static void psmqd_st_fds_full(void)
+{
+	struct psmqd_st_fds  fds;
+	unsigned int         i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	memset(&fds, 0x00, sizeof(fds));
+	for (i = 0; i != USHRT_MAX; ++i)
+		if (psmqd_st_fds_add(&fds, (unsigned short)i) != 0)
+			break;
+
+	mt_fail(i == USHRT_MAX);
+	mt_fail(fds.n == USHRT_MAX);
+	mt_ferr(psmqd_st_fds_add(&fds, 1), ENOSPC);
+	mt_fail(fds.n == USHRT_MAX);
+
+	mt_fok(psmqd_st_fds_delete(&fds, 7));
+	mt_fok(psmqd_st_fds_add(&fds, 7));
+	free(fds.fd);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_st_invalid_args(void)
+{
+	struct psmqd_st  *st;
+	unsigned long     matched[psmq_bm_words(MAX_FD)];
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	st = NULL;
+	mt_ferr(psmqt_sub_call(st_add, NULL, "/a", 0), EINVAL);
+	mt_ferr(psmqd_st_add(&st, NULL, 0), EINVAL);
+	mt_ferr(psmqt_sub_call(st_delete, NULL, "/a", 0), EINVAL);
+	mt_ferr(psmqt_sub_call(st_delete, &st, "/a", 0), ENOENT);
+	mt_ferr(psmqd_st_match(st, NULL, matched), EINVAL);
+	mt_ferr(psmqd_st_match(st, "/a", NULL), EINVAL);
+	mt_ferr(psmqd_st_destroy(NULL), EINVAL);
+
+	mt_fok(psmqt_sub_call(st_add, &st, "/a", 0));
+	mt_ferr(psmqd_st_delete(&st, NULL, 0), EINVAL);
+	psmqd_st_destroy(st);
+}
+
+
+/* ==========================================================================
+             __               __
+            / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
+           / __// _ \ / ___// __/  / __ `// ___// __ \ / / / // __ \
+          / /_ /  __/(__  )/ /_   / /_/ // /   / /_/ // /_/ // /_/ /
+          \__/ \___//____/ \__/   \__, //_/    \____/ \__,_// .___/
+                                 /____/                    /_/
+   ========================================================================== */
+
+
+void psmqd_st_test_group(void)
+{
+	mt_run(psmqd_st_match_exact);
+	mt_run(psmqd_st_match_plus);
+	mt_run(psmqd_st_match_star);
+	mt_run(psmqd_st_match_same_client);
+	mt_run(psmqd_st_match_reference);
+	mt_run(psmqd_st_match_empty_tree);
+	mt_run(psmqd_st_delete_topics);
+	mt_run(psmqd_st_delete_duplicate);
+	mt_run(psmqd_st_delete_nonexisting);
+	mt_run(psmqd_st_fds_full);
+	mt_run(psmqd_st_invalid_args);
+}
@@ -11,14 +11,21 @@
    ========================================================================== */
 
 
+#ifdef HAVE_CONFIG_H
+#   include "psmq-config.h"
+#endif
+
 #include "topic-list.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <embedlog.h>
 #include <string.h>
 #include <errno.h>
 
 #include "mtest.h"
+#include "psmq.h"
+#include "topic-match.h"
 
 mt_defs_ext();
 
@@ -421,6 +428,382 @@ static void psmqd_tl_destroy_null_list(void)
 }
 
 
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_tl_find_topic(void)
+{
+	const char       *topics[] = { "/a", "/a/b", "/a/+", "/a/*", NULL };
+	struct psmqd_tl  *tl;
+	struct psmqd_tl  *node;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_assert((tl = create_list(topics)) != NULL);
+	mt_assert((node = psmqd_tl_find(tl, "/a/+")) != NULL);
+	mt_fok(strcmp(node->topic, "/a/+"));
+	mt_assert((node = psmqd_tl_find(tl, "/a/*")) != NULL);
+	mt_fok(strcmp(node->topic, "/a/*"));
+	mt_assert((node = psmqd_tl_find(tl, "/a")) != NULL);
+	mt_fok(strcmp(node->topic, "/a"));
+	mt_fail(psmqd_tl_find(tl, "/a/c") == NULL);
+	mt_fail(errno == ENOENT);
+	mt_fail(psmqd_tl_find(tl, "/a/b/") == NULL);
+	mt_fail(psmqd_tl_find(NULL, "/a") == NULL);
+	mt_fail(errno == ENOENT);
+	mt_fail(psmqd_tl_find(tl, NULL) == NULL);
+	mt_fail(errno == EINVAL);
+	psmqd_tl_destroy(tl);
+}
+
+
+/* ==========================================================================
+    Topic can be added more than once, caller must get exactly node he
+    has added, and be able to remove just that one
+   ========================================================================== */
+
+
+static void psmqd_tl_duplicate_topic(void)
+{
+	struct psmqd_tl  *tl;
+	struct psmqd_tl  *first;
+	struct psmqd_tl  *second;
+	struct psmqd_tl  *third;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	tl = NULL;
+
+	mt_assert((first = psmqd_tl_add_node(&tl, "/a")) != NULL);
+	mt_assert((second = psmqd_tl_add_node(&tl, "/a")) != NULL);
+	mt_assert((third = psmqd_tl_add_node(&tl, "/a")) != NULL);
+	mt_fail(first != second);
+	mt_fail(second != third);
+	first->flags = 1;
+	second->flags = 2;
+	third->flags = 3;
+
+	mt_fok(psmqd_tl_delete_node(&tl, second));
+	mt_fail(psmqd_tl_find(tl, "/a") == first);
+	mt_fail(first->flags == 1);
+	mt_fail(third->flags == 3);
+	mt_ferr(psmqd_tl_delete_node(&tl, second), ENOENT);
+	mt_ferr(psmqd_tl_delete_node(&tl, NULL), EINVAL);
+
+	mt_fok(psmqd_tl_delete_node(&tl, first));
+	mt_fail(tl == third);
+	mt_fok(psmqd_tl_delete_node(&tl, third));
+	mt_fail(tl == NULL);
+}
+
+
+/* ==========================================================================
+    Checks if topic is properly compiled when it's added to the list
+   ========================================================================== */
+
+
+static void psmqd_tl_compile_topic(void)
+{
+	struct psmqd_tl  *tl;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	tl = NULL;
+	mt_fok(psmqd_tl_add(&tl, "/ab/c/+/de/*"));
+	mt_fail(tl->nlevels == 5);
+	mt_fail(tl->nliteral == 2);
+	mt_fail(tl->star == 4);
+	mt_fail(tl->has_wildcard == 1);
+	mt_fail(tl->levels[0].off == 1 && tl->levels[0].len == 2);
+	mt_fail(tl->levels[1].off == 4 && tl->levels[1].len == 1);
+	mt_fail(tl->levels[2].off == 6 && tl->levels[2].len == 1);
+	mt_fail(tl->levels[3].off == 8 && tl->levels[3].len == 2);
+	mt_fail(tl->levels[4].off == 11 && tl->levels[4].len == 1);
+	psmqd_tl_destroy(tl);
+
+	tl = NULL;
+	mt_fok(psmqd_tl_add(&tl, "/a/b+/*c"));
+	mt_fail(tl->nlevels == 3);
+	mt_fail(tl->nliteral == 3);
+	mt_fail(tl->star == -1);
+	mt_fail(tl->has_wildcard == 0);
+	mt_fail(tl->hash == psmqd_tl_hash("/a/b+/*c"));
+	psmqd_tl_destroy(tl);
+
+	tl = NULL;
+	mt_fok(psmqd_tl_add(&tl, "/a/b/+"));
+	mt_fail(tl->nliteral == 2);
+	mt_fail(tl->star == -1);
+	mt_fail(tl->has_wildcard == 1);
+	mt_fail(tl->hash == psmqd_tl_hash("/a/b"));
+	psmqd_tl_destroy(tl);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_tl_hash_topic(void)
+{
+	mt_fail(psmqd_tl_hash("/a/b") == psmqd_tl_hash("/a//b"));
+	mt_fail(psmqd_tl_hash("/a/b") == psmqd_tl_hash("//a/b/"));
+	mt_fail(psmqd_tl_hash("/a/b") != psmqd_tl_hash("/ab"));
+	mt_fail(psmqd_tl_hash("/a/b") != psmqd_tl_hash("/a/b/c"));
+	mt_fail(psmqd_tl_hash("/a/b") != psmqd_tl_hash("/a/c"));
+}
+
+
+/* ==========================================================================
+    Checks compiled matcher against reference matcher with every
+    combination of published and subscribed topic.
+   ========================================================================== */
+
+
+static void psmqd_tl_matches_reference(void)
+{
+	const char       *topics[] = { "/a", "/a/b", "/a/+", "/a/*", "/+/b",
+		"/+/+/c", "/*", "/a/b/c", "/b/*/x", "/a+", "/+/*", "/x/y/z/+",
+		"/a/+/c/*", "/+", "/*/+", NULL };
+	const char       *pubs[] = { "/", "/a", "/b", "/a/b", "/a/c", "/b/b",
+		"/a/b/c", "/a/x/c", "/a/b/c/d", "/b/q/x", "/a+", "/x/y/z/w",
+		"/x/y/z", "/a//b", "/a/b/", "//a", "/a/q/c/d/e", "/ab", "", NULL };
+	struct psmqd_tl  *tl;
+	struct psmqd_tl  *node;
+	int               i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	mt_assert((tl = create_list(topics)) != NULL);
+
+	for (i = 0; pubs[i] != NULL; ++i)
+	{
+		unsigned long  hash;
+		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+		hash = psmqd_tl_hash(pubs[i]);
+		for (node = tl; node != NULL; node = node->next)
+			mt_fail(psmqd_tl_matches(node, pubs[i], hash) ==
+					psmqt_topic_matches(pubs[i], node->topic));
+	}
+
+	psmqd_tl_destroy(tl);
+}
+
+
+/* ==========================================================================
+    Fills pool up to PSMQ_MAX_SUBS, all nodes must be packed in arena of
+    pool, and stay valid after arena grows and after nodes are moved down
+    when one of them is deleted
+   ========================================================================== */
+
+
+static void psmqd_tl_pool_full(void)
+{
+	struct psmqd_tl_pool  pool;
+	struct psmqd_tl      *tl;
+	struct psmqd_tl      *node;
+	char                  topic[32];
+	size_t                used;
+	int                   i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	memset(&pool, 0x00, sizeof(pool));
+	tl = NULL;
+
+	for (i = 0; i != PSMQ_MAX_SUBS; ++i)
+	{
+		sprintf(topic, "/t/%d", i);
+		mt_fail(psmqd_tl_pool_add(&pool, &tl, topic) != NULL);
+	}
+
+	mt_fail(pool.nused == PSMQ_MAX_SUBS);
+	errno = 0;
+	mt_fail(psmqd_tl_pool_add(&pool, &tl, "/t/x") == NULL);
+	mt_fail(errno == ENOSPC);
+	mt_fail(psmqd_tl_find(tl, "/t/x") == NULL);
+
+	for (i = 0, node = tl; node != NULL; node = node->next, ++i)
+	{
+		mt_fail((unsigned char *)node >= pool.arena);
+		mt_fail((unsigned char *)node < pool.arena + pool.used);
+	}
+	mt_fail(i == PSMQ_MAX_SUBS);
+
+	/* nodes after deleted one are moved down, list
+	 * must still be whole and compiled topics intact */
+	used = pool.used;
+	mt_fok(psmqd_tl_pool_delete(&pool, &tl, "/t/1"));
+	mt_fail(pool.nused == PSMQ_MAX_SUBS - 1);
+	mt_fail(pool.used < used);
+	mt_fail(psmqd_tl_find(tl, "/t/1") == NULL);
+
+	for (i = 0; i != PSMQ_MAX_SUBS; ++i)
+	{
+		if (i == 1)
+			continue;
+
+		sprintf(topic, "/t/%d", i);
+		mt_assert((node = psmqd_tl_find(tl, topic)) != NULL);
+		mt_fail(node->nlevels == 2);
+		mt_fail(node->topic[node->levels[1].off] == topic[3]);
+		mt_fail(psmqd_tl_matches(node, topic, psmqd_tl_hash(topic)));
+	}
+
+	/* room made by delete is used by next add */
+	mt_fail((node = psmqd_tl_pool_add(&pool, &tl, "/t/x/y")) != NULL);
+	mt_fail(node->nlevels == 3);
+	mt_fail(psmqd_tl_find(tl, "/t/x/y") == node);
+	mt_fail(pool.nused == PSMQ_MAX_SUBS);
+
+	mt_fok(psmqd_tl_pool_destroy(&pool));
+	mt_fail(pool.arena == NULL);
+	mt_fail(pool.used == 0);
+	mt_fail(pool.nused == 0);
+}
+
+
+/* ==========================================================================
+    Deleting last node of pool frees its arena
+   ========================================================================== */
+
+
+static void psmqd_tl_pool_empty(void)
+{
+	struct psmqd_tl_pool  pool;
+	struct psmqd_tl      *tl;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	memset(&pool, 0x00, sizeof(pool));
+	tl = NULL;
+
+	mt_fail(psmqd_tl_pool_add(&pool, &tl, "/a") == tl);
+	mt_fail(psmqd_tl_pool_add(&pool, &tl, "/b") != NULL);
+	mt_fail(pool.arena != NULL);
+	mt_fok(psmqd_tl_pool_delete(&pool, &tl, "/a"));
+	mt_fail(strcmp(tl->topic, "/b") == 0);
+	mt_fok(psmqd_tl_pool_delete(&pool, &tl, "/b"));
+	mt_fail(tl == NULL);
+	mt_fail(pool.arena == NULL);
+	mt_fail(pool.size == 0);
+	mt_fail(pool.used == 0);
+
+	/* and is taken again on next add */
+	mt_fail(psmqd_tl_pool_add(&pool, &tl, "/c") == tl);
+	mt_fail(pool.nused == 1);
+	mt_fok(psmqd_tl_pool_destroy(&pool));
+}
+
+
+/* ==========================================================================
+    Longest topic that client can send must fit into pool node
+   ========================================================================== */
+
+
+static void psmqd_tl_pool_long_topic(void)
+{
+	struct psmqd_tl_pool  pool;
+	struct psmqd_tl      *tl;
+	char                  topic[PSMQ_MSG_MAX * 2];
+	int                   i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	memset(&pool, 0x00, sizeof(pool));
+	tl = NULL;
+
+	/* as many levels as possible, "/a/a/a..." */
+	for (i = 0; i != PSMQ_MSG_MAX - 1; ++i)
+		topic[i] = i % 2 ? 'a' : '/';
+	topic[i] = '\0';
+
+	mt_fail(psmqd_tl_pool_add(&pool, &tl, topic) == tl);
+	mt_fail(tl->nlevels == (PSMQ_MSG_MAX - 1) / 2);
+	mt_fok(strcmp(tl->topic, topic));
+
+	/* and that is way longer than anything client can send */
+	for (; i != (int)sizeof(topic) - 1; ++i)
+		topic[i] = i % 2 ? 'a' : '/';
+	topic[i] = '\0';
+	errno = 0;
+	mt_fail(psmqd_tl_pool_add(&pool, &tl, topic) == NULL);
+	mt_fail(errno == ENAMETOOLONG);
+	mt_fail(pool.nused == 1);
+	psmqd_tl_pool_destroy(&pool);
+}
+
+
+/* ==========================================================================
+    Topic can be added more than once, caller must get exactly node he
+    has added, and be able to remove just that one
+   ========================================================================== */
+
+
+static void psmqd_tl_pool_duplicate(void)
+{
+	struct psmqd_tl_pool  pool;
+	struct psmqd_tl      *tl;
+	struct psmqd_tl      *node;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	memset(&pool, 0x00, sizeof(pool));
+	tl = NULL;
+
+	/* nodes may move on next add, so flags are set right away */
+	mt_assert((node = psmqd_tl_pool_add(&pool, &tl, "/a")) != NULL);
+	node->flags = 1;
+	mt_assert((node = psmqd_tl_pool_add(&pool, &tl, "/a")) != NULL);
+	node->flags = 2;
+	mt_assert((node = psmqd_tl_pool_add(&pool, &tl, "/a")) != NULL);
+	node->flags = 3;
+
+	/* new nodes go just after head, so list is 1, 3, 2 */
+	mt_assert(tl->next != NULL && tl->next->next != NULL);
+	mt_fail(tl->flags == 1);
+	mt_fail(tl->next->flags == 3);
+	mt_fail(tl->next->next->flags == 2);
+
+	mt_fok(psmqd_tl_pool_delete_node(&pool, &tl, tl->next->next));
+	mt_fail(pool.nused == 2);
+	mt_fail(psmqd_tl_find(tl, "/a") == tl);
+	mt_fail(tl->flags == 1);
+	mt_fail(tl->next->flags == 3);
+	mt_fail(tl->next->next == NULL);
+
+	mt_fok(psmqd_tl_pool_delete_node(&pool, &tl, tl));
+	mt_fail(tl->flags == 3);
+	mt_fail(tl->next == NULL);
+	mt_fok(psmqd_tl_pool_delete_node(&pool, &tl, tl));
+	mt_fail(tl == NULL);
+	mt_fok(psmqd_tl_pool_destroy(&pool));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_tl_pool_invalid_args(void)
+{
+	struct psmqd_tl_pool  pool;
+	struct psmqd_tl      *tl;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	memset(&pool, 0x00, sizeof(pool));
+	tl = NULL;
+	errno = 0;
+	mt_fail(psmqd_tl_pool_add(NULL, &tl, "/a") == NULL);
+	mt_fail(errno == EINVAL);
+	errno = 0;
+	mt_fail(psmqd_tl_pool_add(&pool, NULL, "/a") == NULL);
+	mt_fail(errno == EINVAL);
+	errno = 0;
+	mt_fail(psmqd_tl_pool_add(&pool, &tl, NULL) == NULL);
+	mt_fail(errno == EINVAL);
+	mt_ferr(psmqd_tl_pool_delete(NULL, &tl, "/a"), EINVAL);
+	mt_ferr(psmqd_tl_pool_delete_node(&pool, &tl, NULL), EINVAL);
+	mt_ferr(psmqd_tl_pool_delete(&pool, &tl, "/a"), ENOENT);
+	mt_ferr(psmqd_tl_pool_destroy(NULL), EINVAL);
+	mt_fok(psmqd_tl_pool_destroy(&pool));
+}
+
+
 /* ==========================================================================
              __               __
             / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
@@ -450,4 +833,14 @@ void psmqd_tl_test_group(void)
 	mt_run(psmqd_tl_delete_null_list);
 	mt_run(psmqd_tl_delete_null_null_list);
 	mt_run(psmqd_tl_destroy_null_list);
+	mt_run(psmqd_tl_find_topic);
+	mt_run(psmqd_tl_duplicate_topic);
+	mt_run(psmqd_tl_compile_topic);
+	mt_run(psmqd_tl_hash_topic);
+	mt_run(psmqd_tl_matches_reference);
+	mt_run(psmqd_tl_pool_full);
+	mt_run(psmqd_tl_pool_empty);
+	mt_run(psmqd_tl_pool_long_topic);
+	mt_run(psmqd_tl_pool_duplicate);
+	mt_run(psmqd_tl_pool_invalid_args);
 }
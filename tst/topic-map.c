@@ -0,0 +1,269 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "topic-map.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mtest.h"
+#include "psmq-common.h"
+#include "topic-list.h"
+#include "topic-match.h"
+
+mt_defs_ext();
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+#define MAX_FD 100 /* so fds span more than one bitmap word */
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Adapters of topic map functions for psmqt_sub_call() and
+    psmqt_check_match() from topic-match.c
+   ========================================================================== */
+
+
+static int tm_add(void *tm, const struct psmqd_tl *sub, unsigned short fd)
+{
+	return psmqd_tm_add(tm, sub, fd);
+}
+
+static int tm_delete(void *tm, const struct psmqd_tl *sub, unsigned short fd)
+{
+	return psmqd_tm_delete(tm, sub, fd);
+}
+
+static int tm_match(void *tm, const char *topic, unsigned long *matched)
+{
+	return psmqd_tm_match(tm, topic, psmqd_tl_hash(topic), matched);
+}
+
+
+/* ==========================================================================
+                           __               __
+                          / /_ ___   _____ / /_ _____
+                         / __// _ \ / ___// __// ___/
+                        / /_ /  __/(__  )/ /_ (__  )
+                        \__/ \___//____/ \__//____/
+
+   ========================================================================== */
+
+
+static void psmqd_tm_match_exact(void)
+{
+	struct psmqd_tm  tm;
+	const int        e0[] = { 0, -1 };
+	const int        e12[] = { 1, 2, -1 };
+	const int        e3[] = { 3, -1 };
+	const int        none[] = { -1 };
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	memset(&tm, 0x00, sizeof(tm));
+	mt_fok(psmqt_sub_call(tm_add, &tm, "/a", 0));
+	mt_fok(psmqt_sub_call(tm_add, &tm, "/a/b", 1));
+	mt_fok(psmqt_sub_call(tm_add, &tm, "/a/b", 2));
+	mt_fok(psmqt_sub_call(tm_add, &tm, "/a/b/c", 3));
+	mt_fok(psmqt_check_match(tm_match, &tm, "/a", e0));
+	mt_fok(psmqt_check_match(tm_match, &tm, "/a/b", e12));
+	mt_fok(psmqt_check_match(tm_match, &tm, "/a//b", e12));
+	mt_fok(psmqt_check_match(tm_match, &tm, "//a/b/", e12));
+	mt_fok(psmqt_check_match(tm_match, &tm, "/a/b/c", e3));
+	mt_fok(psmqt_check_match(tm_match, &tm, "/a/bc", none));
+	mt_fok(psmqt_check_match(tm_match, &tm, "/ab", none));
+	mt_fok(psmqt_check_match(tm_match, &tm, "/b", none));
+	mt_fok(psmqt_check_match(tm_match, &tm, "/", none));
+	psmqd_tm_destroy(&tm);
+	mt_fail(tm.entries == NULL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_tm_delete_topics(void)
+{
+	struct psmqd_tm  tm;
+	const int        e0[] = { 0, -1 };
+	const int        e1[] = { 1, -1 };
+	const int        none[] = { -1 };
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	memset(&tm, 0x00, sizeof(tm));
+	mt_fok(psmqt_sub_call(tm_add, &tm, "/a", 0));
+	mt_fok(psmqt_sub_call(tm_add, &tm, "/a", 1));
+	mt_fok(psmqt_sub_call(tm_add, &tm, "/a", 1));
+	mt_fok(psmqt_sub_call(tm_add, &tm, "/b", 0));
+	mt_fok(psmqt_sub_call(tm_delete, &tm, "/a", 0));
+	mt_fok(psmqt_check_match(tm_match, &tm, "/a", e1));
+	mt_fok(psmqt_sub_call(tm_delete, &tm, "/a", 1));
+	mt_fok(psmqt_check_match(tm_match, &tm, "/a", e1));
+	mt_fok(psmqt_sub_call(tm_delete, &tm, "/a", 1));
+	mt_fok(psmqt_check_match(tm_match, &tm, "/a", none));
+	mt_fok(psmqt_check_match(tm_match, &tm, "/b", e0));
+	mt_fail(tm.n == 1);
+	mt_fok(psmqt_sub_call(tm_delete, &tm, "/b", 0));
+	mt_fail(tm.n == 0);
+	mt_fail(tm.entries == NULL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_tm_delete_nonexisting(void)
+{
+	struct psmqd_tm  tm;
+	const int        e0[] = { 0, -1 };
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	memset(&tm, 0x00, sizeof(tm));
+	mt_ferr(psmqt_sub_call(tm_delete, &tm, "/a", 0), ENOENT);
+	mt_fok(psmqt_sub_call(tm_add, &tm, "/a", 0));
+	mt_ferr(psmqt_sub_call(tm_delete, &tm, "/a", 1), ENOENT);
+	mt_ferr(psmqt_sub_call(tm_delete, &tm, "/b", 0), ENOENT);
+	mt_ferr(psmqt_sub_call(tm_delete, &tm, "/a/b", 0), ENOENT);
+	mt_fok(psmqt_check_match(tm_match, &tm, "/a", e0));
+	psmqd_tm_destroy(&tm);
+}
+
+
+/* ==========================================================================
+    Adds many topics, so map has to grow multiple times and there are
+    plenty of collisions, then removes every other topic and checks if
+    remaining topics can still be found.
+   ========================================================================== */
+
+
+static void psmqd_tm_many_topics(void)
+{
+	struct psmqd_tm  tm;
+	char             topic[32];
+	int              expected[2];
+	const int        none[] = { -1 };
+	int              i;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	memset(&tm, 0x00, sizeof(tm));
+	expected[1] = -1;
+
+	for (i = 0; i != 1000; ++i)
+	{
+		sprintf(topic, "/t/%d", i);
+		mt_fok(psmqt_sub_call(tm_add, &tm, topic, i % MAX_FD));
+	}
+
+	mt_fail(tm.n == 1000);
+	mt_fail(tm.n * 2 <= tm.size);
+
+	for (i = 0; i != 1000; i += 2)
+	{
+		sprintf(topic, "/t/%d", i);
+		mt_fok(psmqt_sub_call(tm_delete, &tm, topic, i % MAX_FD));
+	}
+
+	mt_fail(tm.n == 500);
+
+	for (i = 0; i != 1000; ++i)
+	{
+		sprintf(topic, "/t/%d", i);
+		expected[0] = i % MAX_FD;
+		mt_fok(psmqt_check_match(tm_match, &tm, topic,
+					i % 2 ? expected : none));
+	}
+
+	psmqd_tm_destroy(&tm);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_tm_add_wildcard(void)
+{
+	struct psmqd_tm  tm;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	memset(&tm, 0x00, sizeof(tm));
+	mt_ferr(psmqt_sub_call(tm_add, &tm, "/a/+", 0), EINVAL);
+	mt_ferr(psmqt_sub_call(tm_add, &tm, "/a/*", 0), EINVAL);
+	mt_fail(tm.n == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+
+
+static void psmqd_tm_invalid_args(void)
+{
+	struct psmqd_tm  tm;
+	unsigned long    matched[psmq_bm_words(MAX_FD)];
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	memset(&tm, 0x00, sizeof(tm));
+	mt_ferr(psmqt_sub_call(tm_add, NULL, "/a", 0), EINVAL);
+	mt_ferr(psmqd_tm_add(&tm, NULL, 0), EINVAL);
+	mt_ferr(psmqt_sub_call(tm_delete, NULL, "/a", 0), EINVAL);
+	mt_ferr(psmqd_tm_delete(&tm, NULL, 0), EINVAL);
+	mt_ferr(psmqd_tm_match(NULL, "/a", 0, matched), EINVAL);
+	mt_ferr(psmqd_tm_match(&tm, NULL, 0, matched), EINVAL);
+	mt_ferr(psmqd_tm_match(&tm, "/a", 0, NULL), EINVAL);
+	mt_ferr(psmqd_tm_destroy(NULL), EINVAL);
+	mt_fail(psmqd_tm_match(&tm, "/a", psmqd_tl_hash("/a"), matched) == 0);
+}
+
+
+/* ==========================================================================
+             __               __
+            / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
+           / __// _ \ / ___// __/  / __ `// ___// __ \ / / / // __ \
+          / /_ /  __/(__  )/ /_   / /_/ // /   / /_/ // /_/ // /_/ /
+          \__/ \___//____/ \__/   \__, //_/    \____/ \__,_// .___/
+                                 /____/                    /_/
+   ========================================================================== */
+
+
+void psmqd_tm_test_group(void)
+{
+	mt_run(psmqd_tm_match_exact);
+	mt_run(psmqd_tm_delete_topics);
+	mt_run(psmqd_tm_delete_nonexisting);
+	mt_run(psmqd_tm_many_topics);
+	mt_run(psmqd_tm_add_wildcard);
+	mt_run(psmqd_tm_invalid_args);
+}
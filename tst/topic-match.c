@@ -0,0 +1,201 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "topic-match.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "psmq-common.h"
+#include "topic-list.h"
+
+
+/* ==========================================================================
+    Checks if published topic matches subscribed topic. Broker does not use
+    it to route messages (see sub-tree.c), it is kept here as the reference
+    of how topics should match, and subscription tree is checked against it.
+
+    Function walks both topics with pointers, in single pass, without
+    copying nor modifying them. Multiple '/' in a row are treated as one
+    separator, just like strtok() would do it, so "/a//b" will match "/a/b".
+
+    Return 0 when there is NO match, and 1 when they matches.
+   ========================================================================== */
+
+
+int psmqt_topic_matches
+(
+	const char  *pub_topic,  /* topic message was publish with */
+	const char  *sub_topic   /* client's subscribe topic (may contain * or + */
+)
+{
+	const char  *p;          /* current position in pub topic */
+	const char  *s;          /* current position in sub topic */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	p = pub_topic;
+	s = sub_topic;
+
+	for (;;)
+	{
+		/* skip separators, so both pointers are at the
+		 * beginning of the next level */
+		while (*p == '/')
+			++p;
+		while (*s == '/')
+			++s;
+
+		/* if both sub topic and pub topic were fully
+		 * walked, topics are equal. If only one of them
+		 * has been walked fully, these topics don't match */
+		if (*p == '\0' || *s == '\0')
+			return *p == *s;
+
+		if (s[0] == '*' && (s[1] == '/' || s[1] == '\0'))
+		{
+			/* path is equal up until now, and
+			 * current level is '*' so we can stop
+			 * parsing now and treat topics as
+			 * matching.
+			 *
+			 * Examples of matching topics ('@' is '*'):
+			 *
+			 *      pub: /a/b/c/d
+			 *      sub: /a/b/@
+			 *
+			 *      pub: /a/b/c/d
+			 *      sub: /@
+			 */
+
+			return 1;
+		}
+
+		if (s[0] == '+' && (s[1] == '/' || s[1] == '\0'))
+		{
+			/* path is equal up intil now, and
+			 * current level is '+' so we treat
+			 * whole pub level as valid, skip it
+			 * and continue with the next one.
+			 *
+			 * Examples of matching topics:
+			 *
+			 *      pub: /a/b/c/d
+			 *      sub: /+/b/c/d
+			 *
+			 *      pub: /a/b/c/d
+			 *      sub: /a/b/c/+
+			 */
+
+			++s;
+			while (*p != '/' && *p != '\0')
+				++p;
+
+			continue;
+		}
+
+		/* normal level, compare it char by char */
+		while (*p == *s && *s != '/' && *s != '\0')
+		{
+			++p;
+			++s;
+		}
+
+		/* levels are equal only when both of
+		 * them end in the same place */
+		if ((*p != '/' && *p != '\0') || (*s != '/' && *s != '\0'))
+			return 0;
+	}
+}
+
+
+/* ==========================================================================
+    Compiles 'topic' and calls 'fn' with it on routing structure 'rs', to
+    add or delete subscription of client 'fd'. Routing structures work on
+    compiled topics from topic list, so temporary list with single topic
+    is created for that. errno from 'fn' is preserved.
+
+    Returns whatever 'fn' returned, or -1 when topic could not be compiled.
+   ========================================================================== */
+
+
+int psmqt_sub_call
+(
+	psmqt_sub_fn      fn,     /* add or delete function of rs */
+	void             *rs,     /* routing structure to work on */
+	const char       *topic,  /* topic to add or delete */
+	unsigned short    fd      /* client (un)subscribing to topic */
+)
+{
+	struct psmqd_tl  *tl;     /* compiled topic */
+	int               ret;    /* return code from fn() */
+	int               err;    /* errno from fn() */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	tl = NULL;
+	if (psmqd_tl_add(&tl, topic) != 0)
+		return -1;
+
+	ret = fn(rs, tl, fd);
+	err = errno;
+	psmqd_tl_destroy(tl);
+	errno = err;
+	return ret;
+}
+
+
+/* ==========================================================================
+    Publishes 'topic' on routing structure 'rs' with 'fn', and checks if
+    only fds from 'expected' list (terminated with -1) are matched. fds
+    must be smaller than PSMQT_MATCH_MAX_FD.
+
+    Returns 0 when only expected fds matched, and -1 otherwise
+   ========================================================================== */
+
+
+int psmqt_check_match
+(
+	psmqt_match_fn    fn,        /* match function of rs */
+	void             *rs,        /* routing structure to match topic in */
+	const char       *topic,     /* published topic */
+	const int        *expected   /* expected fds, terminated by -1 */
+)
+{
+	unsigned long     matched[psmq_bm_words(PSMQT_MATCH_MAX_FD)];
+	int               n;
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	memset(matched, 0x00, sizeof(matched));
+	n = fn(rs, topic, matched);
+
+	for (; *expected != -1; ++expected, --n)
+	{
+		if (!psmq_bm_isset(matched, *expected))
+			return -1;
+
+		psmq_bm_clr(matched, *expected);
+	}
+
+	/* all expected fds were matched, now make sure nothing
+	 * else has been matched */
+	if (n != 0)
+		return -1;
+
+	for (n = 0; n != PSMQT_MATCH_MAX_FD; ++n)
+		if (psmq_bm_isset(matched, n))
+			return -1;
+
+	return 0;
+}
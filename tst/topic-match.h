@@ -0,0 +1,28 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef PSMQT_TOPIC_MATCH_H
+#define PSMQT_TOPIC_MATCH_H 1
+
+struct psmqd_tl;
+
+/* highest fd + 1 psmqt_check_match() looks at */
+#define PSMQT_MATCH_MAX_FD 128
+
+/* adds or deletes compiled 'sub' of client 'fd' in routing structure 'rs' */
+typedef int (*psmqt_sub_fn)(void *rs, const struct psmqd_tl *sub,
+        unsigned short fd);
+
+/* marks clients subscribed to 'topic' in 'matched', returns their number */
+typedef int (*psmqt_match_fn)(void *rs, const char *topic,
+        unsigned long *matched);
+
+int psmqt_topic_matches(const char *pub_topic, const char *sub_topic);
+int psmqt_sub_call(psmqt_sub_fn fn, void *rs, const char *topic,
+        unsigned short fd);
+int psmqt_check_match(psmqt_match_fn fn, void *rs, const char *topic,
+        const int *expected);
+
+#endif /* PSMQT_TOPIC_MATCH_H */
@@ -29,9 +29,12 @@
 
    ========================================================================== */
 
+#include <string.h>
 #include <sys/time.h>
 #include <time.h>
 
+#include "psmq-common.h"
+
 /* ==========================================================================
                ____                     __   _
               / __/__  __ ____   _____ / /_ (_)____   ____   _____
@@ -79,3 +82,208 @@ void psmq_ms_to_tp
 		tp->tv_sec += 1;
 	}
 }
+
+
+/* ==========================================================================
+    Returns current time of monotonic clock in microseconds. Value wraps
+    around, so only differences between two values are meaningful.
+   ========================================================================== */
+
+
+unsigned long psmq_mono_us(void)
+{
+	struct timespec  tp;  /* current monotonic time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (unsigned long)tp.tv_sec * 1000000ul + tp.tv_nsec / 1000;
+}
+
+
+/* ==========================================================================
+    Same as psmq_mono_us() but in milliseconds.
+   ========================================================================== */
+
+
+unsigned long psmq_mono_ms(void)
+{
+	struct timespec  tp;  /* current monotonic time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (unsigned long)tp.tv_sec * 1000ul + tp.tv_nsec / 1000000;
+}
+
+
+/* ==========================================================================
+    Returns timestamp for struct psmq_trace, that is psmq_mono_us() cut to
+    32 bits. 0 marks timestamp that was not taken, so it's never returned.
+   ========================================================================== */
+
+
+unsigned int psmq_trace_now(void)
+{
+	unsigned int  now;  /* current time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	now = (unsigned int)psmq_mono_us();
+	return now ? now : 1;
+}
+
+
+#if PSMQ_HAVE_SHM
+
+/* ==========================================================================
+    Creates name of shared memory slab for broker 'brokername' and stores
+    it in 'name' buffer of 'len' size.
+
+    Returns 0 on success or -1 when name does not fit into 'name'.
+   ========================================================================== */
+
+
+int psmq_shm_name
+(
+	char        *name,        /* slab name will be stored here */
+	size_t       len,         /* size of name buffer */
+	const char  *brokername   /* name of the broker's control queue */
+)
+{
+	if (strlen(brokername) + sizeof(PSMQ_SHM_SUFFIX) > len)
+		return -1;
+
+	strcpy(name, brokername);
+	strcat(name, PSMQ_SHM_SUFFIX);
+	return 0;
+}
+
+#endif /* PSMQ_HAVE_SHM */
+
+
+/* ==========================================================================
+    Validates 'desc' against slab 'h'. Descriptor must point to the start
+    of a block and payload must fit into that block. Descriptors come
+    from other processes, so they can't be trusted blindly.
+
+    Returns index of block 'desc' points to, or -1 when desc is invalid.
+   ========================================================================== */
+
+
+int psmq_shm_block
+(
+	struct psmq_shm_hdr         *h,     /* slab */
+	const struct psmq_shm_desc  *desc   /* descriptor to validate */
+)
+{
+	size_t                       off;   /* offset of first block */
+	size_t                       rel;   /* offset relative to first block */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (h == NULL || desc->slab != 0 || desc->len > h->blksize)
+		return -1;
+
+	off = psmq_shm_data_off(h->nblocks);
+	if (desc->offset < off)
+		return -1;
+
+	rel = desc->offset - off;
+	if (rel % h->blksize || rel / h->blksize >= h->nblocks)
+		return -1;
+
+	return rel / h->blksize;
+}
+
+
+/* ==========================================================================
+    Atomically adds 'n' (which can be negative) to reference counter of
+    'block' in slab 'h'. Slab is shared between processes, so plain
+    increment won't do. Does nothing when block is invalid (-1), which is
+    the only kind of block there is without shared memory support.
+
+    Returns new value of reference counter.
+   ========================================================================== */
+
+
+unsigned int psmq_shm_ref
+(
+	struct psmq_shm_hdr  *h,      /* slab */
+	int                   block,  /* index of block */
+	int                   n       /* value to add to reference counter */
+)
+{
+#if PSMQ_HAVE_SHM
+	if (block < 0)
+		return 0;
+
+	return __atomic_add_fetch(&psmq_shm_refs(h)[block], n, __ATOMIC_ACQ_REL);
+#else
+	(void)h;
+	(void)block;
+	(void)n;
+	return 0;
+#endif
+}
+
+
+#if !HAVE_BUILTIN_BITOPS
+
+/* ==========================================================================
+    Returns index of lowest set bit in 'w', 'w' must not be 0. Fallback
+    for compilers without __builtin_ctzl(). Bit is found by halving
+    search, lower half of remaining bits is checked and shifted out when
+    it's all zeros, so it's log2 of word width steps no matter the size
+    of unsigned long.
+   ========================================================================== */
+
+
+int psmq_ctzl
+(
+	unsigned long  w  /* word to search, not 0 */
+)
+{
+	int           n;     /* number of trailing zeros */
+	unsigned int  half;  /* number of bits checked in this step */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	n = 0;
+	for (half = PSMQ_BM_BITS / 2; half; half /= 2)
+	{
+		if ((w & ((1UL << half) - 1)) == 0)
+		{
+			/* no bit set in lower half, look in upper one */
+			n += half;
+			w >>= half;
+		}
+	}
+
+	return n;
+}
+
+
+/* ==========================================================================
+    Returns number of bits set in 'w'. Fallback for compilers without
+    __builtin_popcountl(). Every iteration clears lowest set bit, so
+    loop runs only as many times as there are bits set.
+   ========================================================================== */
+
+
+int psmq_popcountl
+(
+	unsigned long  w  /* word to count bits in */
+)
+{
+	int  n;  /* number of bits set */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (n = 0; w; w &= w - 1)
+		++n;
+
+	return n;
+}
+
+#endif /* !HAVE_BUILTIN_BITOPS */